@@ -2,11 +2,14 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include "../lib/version.h"
 #include "../dbapi2/dbapi2.h"
 #include "../core/error.h"
 #include "../core/hooks.h"
 #include "../core/schedule.h"
+#include "../core/metrics.h"
 #include "../control/control.h"
 #include "../irc/irc.h"
 #include "../lua/lua.h"
@@ -16,6 +19,11 @@
 #define CLEANUP_INACTIVE_DAYS 30 /* disable channels where nothing happened for this many days */
 #define CLEANUP_DELETE_DAYS 5 /* delete data for channels that have been disabled for this many days */
 
+#define FLUSH_INTERVAL 10 /* hold writes back this long so repeated ones can be merged */
+#define FLUSH_MAXPENDING 20000 /* ... unless this many keys are waiting */
+#define PENDING_HASHSIZE 4096
+#define PENDING_MAXCOLUMNS 64
+
 #define A4STATS_DB_TOLOWER(x) "translate(lower(" x "), '[]\\~', '{}|^')"
 #define A4STATS_DB_EQ_NOCASE(x, y) A4STATS_DB_TOLOWER(x) " = " A4STATS_DB_TOLOWER(y)
 
@@ -23,6 +31,8 @@ MODULE_VERSION("");
 
 DBAPIConn *a4statsdb;
 
+static metric *pendingmetric, *coalescedmetric, *flushmetric, *writemetric;
+
 static int a4stats_connectdb(void) {
   if(!a4statsdb) {
     a4statsdb = dbapi2open("pqsql", "a4stats");
@@ -162,6 +172,7 @@ typedef struct user_update_info {
   unsigned long channelid;
   char *account;
   unsigned long accountid;
+  uint64_t start;
 } user_update_info;
 
 static void a4stats_update_user_cb(const struct DBAPIResult *result, void *uarg) {
@@ -176,6 +187,8 @@ static void a4stats_update_user_cb(const struct DBAPIResult *result, void *uarg)
       if (result == NULL || (result->affected == 0 && uui->stage == 4))
         Error("a4stats", ERR_WARNING, "Unable to update user.");
 
+      metricobserve(writemetric, metricclock() - uui->start);
+
       free(uui->update);
       free(uui->account);
       free(uui);
@@ -190,12 +203,415 @@ a4_uuc_return:
     result->clear(result);
 }
 
+typedef struct relation_update_info {
+  int stage;
+  unsigned long channelid;
+  char *first;
+  unsigned long firstid;
+  char *second;
+  unsigned long secondid;
+  unsigned long score;
+  time_t seen;
+  uint64_t start;
+} relation_update_info;
+
+static void a4stats_update_relation_cb(const struct DBAPIResult *result, void *uarg) {
+  relation_update_info *rui = uarg;
+
+  rui->stage++;
+
+  if (rui->stage == 1) {
+    a4statsdb->query(a4statsdb, a4stats_update_relation_cb, rui, "UPDATE ? SET score = score + ?, seen = ? "
+      "WHERE channelid = ? AND first = ? AND firstid = ? AND second = ? AND secondid = ?",
+      "TUtUsUsU", "relations", rui->score, rui->seen, rui->channelid, rui->first, rui->firstid, rui->second, rui->secondid);
+    goto a4_urc_return;
+  } else if (rui->stage == 2 && result && result->affected == 0) {
+    a4statsdb->query(a4statsdb, a4stats_update_relation_cb, rui, "INSERT INTO ? (channelid, first, firstid, second, secondid, seen, score) VALUES (?, ?, ?, ?, ?, ?, ?)",
+      "TUsUsUtU", "relations", rui->channelid, rui->first, rui->firstid, rui->second, rui->secondid, rui->seen, rui->score);
+    goto a4_urc_return;
+  }
+
+  if (!result || result->affected == 0)
+    Error("a4stats", ERR_WARNING, "Unable to update relation.");
+
+  metricobserve(writemetric, metricclock() - rui->start);
+
+  free(rui->first);
+  free(rui->second);
+  free(rui);
+
+a4_urc_return:
+  if (result)
+    result->clear(result);
+}
+
+/*
+ * Lines, relations and user updates arrive once per channel message.  They
+ * are held here keyed on the row they touch for up to FLUSH_INTERVAL
+ * seconds, so a busy channel costs a statement per user per interval rather
+ * than one per line.  User updates are lists of "column = expression":
+ * "x = x + n" is summed and "x = <literal>" keeps the last value, anything
+ * else can't be merged so it's sent as before, after whatever was waiting
+ * for that user.
+ */
+#define PENDING_LINE 0
+#define PENDING_RELATION 1
+#define PENDING_USER 2
+
+typedef struct pending_column {
+  char name[32];
+  int add;
+  long delta;
+  char *expr;
+} pending_column;
+
+typedef struct pending_write {
+  struct pending_write *next;
+  unsigned int hash;
+  int type;
+  unsigned long channelid;
+  char *name; /* channel, account or first user */
+  unsigned long nameid;
+  char *second;
+  unsigned long secondid;
+  unsigned long count;
+  time_t seen;
+  unsigned long hours[24];
+  int columns;
+  pending_column cols[];
+} pending_write;
+
+static pending_write *pending[PENDING_HASHSIZE];
+static unsigned long pendingcount;
+static void *flushsched;
+
+static void a4stats_flushtimer(void *arg);
+
+static unsigned int a4stats_pending_hash(int type, unsigned long channelid, const char *name, unsigned long nameid, const char *second, unsigned long secondid) {
+  unsigned int h = type * 31 + channelid * 17 + nameid * 7 + secondid;
+  const char *p;
+
+  for (p = name; *p; p++)
+    h = h * 33 + (unsigned char)*p;
+
+  if (second)
+    for (p = second; *p; p++)
+      h = h * 33 + (unsigned char)*p;
+
+  return h;
+}
+
+/* finds (and unlinks, if take is set) or creates the entry for a row */
+static pending_write *a4stats_pending_find(int type, unsigned long channelid, const char *name, unsigned long nameid, const char *second, unsigned long secondid, int create, int take) {
+  unsigned int h = a4stats_pending_hash(type, channelid, name, nameid, second, secondid);
+  pending_write **pnext, *pw;
+
+  for (pnext = &pending[h % PENDING_HASHSIZE]; *pnext; pnext = &((*pnext)->next)) {
+    pw = *pnext;
+
+    if (pw->hash != h || pw->type != type || pw->channelid != channelid || pw->nameid != nameid || pw->secondid != secondid ||
+        strcmp(pw->name, name) || (second && strcmp(pw->second, second)))
+      continue;
+
+    if (take) {
+      *pnext = pw->next;
+      pendingcount--;
+      metricset(pendingmetric, pendingcount);
+    } else {
+      metricinc(coalescedmetric);
+    }
+
+    return pw;
+  }
+
+  if (!create)
+    return NULL;
+
+  pw = calloc(1, sizeof(*pw) + (type == PENDING_USER ? PENDING_MAXCOLUMNS * sizeof(pending_column) : 0));
+  if (!pw)
+    return NULL;
+
+  pw->name = strdup(name);
+  pw->second = second ? strdup(second) : NULL;
+  if (!pw->name || (second && !pw->second)) {
+    free(pw->name);
+    free(pw->second);
+    free(pw);
+    return NULL;
+  }
+
+  pw->hash = h;
+  pw->type = type;
+  pw->channelid = channelid;
+  pw->nameid = nameid;
+  pw->secondid = secondid;
+
+  pw->next = pending[h % PENDING_HASHSIZE];
+  pending[h % PENDING_HASHSIZE] = pw;
+
+  pendingcount++;
+  metricset(pendingmetric, pendingcount);
+
+  if (!flushsched)
+    flushsched = scheduleoneshot(time(NULL) + FLUSH_INTERVAL, a4stats_flushtimer, NULL);
+
+  return pw;
+}
+
+static void a4stats_pending_free(pending_write *pw) {
+  int i;
+
+  for (i = 0; i < pw->columns; i++)
+    free(pw->cols[i].expr);
+
+  free(pw->name);
+  free(pw->second);
+  free(pw);
+}
+
+static void a4stats_write_user(unsigned long channelid, const char *account, unsigned long accountid, char *update) {
+  user_update_info *uui;
+
+  uui = malloc(sizeof(*uui));
+  if (!uui) {
+    free(update);
+    return;
+  }
+
+  uui->stage = 0;
+  uui->update = update;
+  uui->channelid = channelid;
+  uui->account = strdup(account);
+  uui->accountid = accountid;
+  uui->start = metricclock();
+
+  a4stats_update_user_cb(NULL, uui);
+}
+
+#define A4STATS_USER_WHERE " WHERE channelid = ? AND (accountid != 0 AND accountid = ? OR accountid = 0 AND account = ?)"
+
+/* sends what's waiting for one row and frees it */
+static void a4stats_pending_write(pending_write *pw) {
+  char query[1024], part[64], *update;
+  relation_update_info *rui;
+  size_t len;
+  int i, first = 1;
+
+  if (pw->type == PENDING_LINE) {
+    strcpy(query, "UPDATE ? SET ");
+    for (i = 0; i < 24; i++) {
+      if (!pw->hours[i])
+        continue;
+
+      snprintf(part, sizeof(part), "%sh%d = h%d + %lu", first ? "" : ", ", i, i, pw->hours[i]);
+      strcat(query, part);
+      first = 0;
+    }
+    strcat(query, " WHERE " A4STATS_DB_EQ_NOCASE("name", "?"));
+
+    a4statsdb->squery(a4statsdb, query, "Ts", "channels", pw->name);
+  } else if (pw->type == PENDING_RELATION) {
+    rui = malloc(sizeof(*rui));
+    if (rui) {
+      rui->stage = 0;
+      rui->channelid = pw->channelid;
+      rui->first = pw->name;
+      rui->firstid = pw->nameid;
+      rui->second = pw->second;
+      rui->secondid = pw->secondid;
+      rui->score = pw->count;
+      rui->seen = pw->seen;
+      rui->start = metricclock();
+      pw->name = pw->second = NULL;
+
+      a4stats_update_relation_cb(NULL, rui);
+    }
+  } else if (pw->columns) {
+    len = sizeof("UPDATE ? SET ") + sizeof(A4STATS_USER_WHERE);
+    for (i = 0; i < pw->columns; i++)
+      len += strlen(pw->cols[i].name) * 2 + (pw->cols[i].expr ? strlen(pw->cols[i].expr) : 0) + 32;
+
+    update = malloc(len);
+    if (update) {
+      strcpy(update, "UPDATE ? SET ");
+      for (i = 0; i < pw->columns; i++) {
+        if (i)
+          strcat(update, ", ");
+
+        if (pw->cols[i].add)
+          sprintf(update + strlen(update), "%s = %s + %ld", pw->cols[i].name, pw->cols[i].name, pw->cols[i].delta);
+        else
+          sprintf(update + strlen(update), "%s = %s", pw->cols[i].name, pw->cols[i].expr);
+      }
+      strcat(update, A4STATS_USER_WHERE);
+
+      a4stats_write_user(pw->channelid, pw->name, pw->nameid, update);
+    }
+  }
+
+  a4stats_pending_free(pw);
+}
+
+static void a4stats_flush(void) {
+  pending_write *pw, *npw;
+  uint64_t start = metricclock();
+  int i;
+
+  if (flushsched) {
+    deleteschedule(flushsched, a4stats_flushtimer, NULL);
+    flushsched = NULL;
+  }
+
+  for (i = 0; i < PENDING_HASHSIZE; i++) {
+    for (pw = pending[i]; pw; pw = npw) {
+      npw = pw->next;
+      a4stats_pending_write(pw);
+    }
+    pending[i] = NULL;
+  }
+
+  pendingcount = 0;
+  metricset(pendingmetric, 0);
+  metricobserve(flushmetric, metricclock() - start);
+}
+
+static void a4stats_flushtimer(void *arg) {
+  flushsched = NULL;
+  a4stats_flush();
+}
+
+static void a4stats_pending_queued(void) {
+  if (pendingcount >= FLUSH_MAXPENDING)
+    a4stats_flush();
+}
+
+/*
+ * Splits "column = expression", returns 1 for "column = column + n", 2 for
+ * "column = <number, string or NULL>" and 0 for anything we can't merge.
+ */
+static int a4stats_parse_clause(const char *clause, pending_column *col) {
+  const char *p = clause, *rhs;
+  char *end;
+  size_t len;
+
+  while (*p == ' ')
+    p++;
+
+  for (len = 0; isalnum((unsigned char)p[len]) || p[len] == '_'; len++)
+    ;
+
+  if (!len || len >= sizeof(col->name))
+    return 0;
+
+  memcpy(col->name, p, len);
+  col->name[len] = '\0';
+
+  for (p += len; *p == ' '; p++)
+    ;
+  if (*p++ != '=')
+    return 0;
+  while (*p == ' ')
+    p++;
+
+  rhs = p;
+
+  if (!strncmp(p, col->name, len) && !isalnum((unsigned char)p[len]) && p[len] != '_') {
+    for (p += len; *p == ' '; p++)
+      ;
+    if (*p++ != '+')
+      return 0;
+
+    col->delta = strtol(p, &end, 10);
+    if (end == p)
+      return 0;
+
+    for (p = end; *p == ' '; p++)
+      ;
+
+    return *p ? 0 : 1;
+  }
+
+  if (*p == '\'') {
+    for (p++; *p; p++) {
+      if (*p == '\\' && p[1]) {
+        p++;
+      } else if (*p == '\'') {
+        if (p[1] != '\'')
+          break;
+        p++;
+      }
+    }
+
+    if (*p++ != '\'')
+      return 0;
+  } else if (!strncasecmp(p, "NULL", 4)) {
+    p += 4;
+  } else {
+    strtod(p, &end);
+    if (end == p)
+      return 0;
+    p = end;
+  }
+
+  while (*p == ' ')
+    p++;
+
+  if (*p)
+    return 0;
+
+  col->expr = strdup(rhs);
+  return col->expr ? 2 : 0;
+}
+
+/* folds one parsed clause into what's waiting, 0 if they don't mix */
+static int a4stats_merge_column(pending_write *pw, pending_column *col, int kind) {
+  pending_column *pc;
+  int i;
+
+  for (i = 0; i < pw->columns; i++)
+    if (!strcmp(pw->cols[i].name, col->name))
+      break;
+
+  if (i == pw->columns) {
+    if (pw->columns >= PENDING_MAXCOLUMNS)
+      return 0;
+
+    pc = &pw->cols[pw->columns++];
+    strcpy(pc->name, col->name);
+    pc->add = (kind == 1);
+    pc->delta = col->delta;
+    pc->expr = col->expr;
+    col->expr = NULL;
+
+    return 1;
+  }
+
+  pc = &pw->cols[i];
+
+  if (kind == 1) {
+    /* a counter added to after being set, leave it to the database */
+    if (!pc->add)
+      return 0;
+
+    pc->delta += col->delta;
+  } else {
+    free(pc->expr);
+    pc->add = 0;
+    pc->expr = col->expr;
+    col->expr = NULL;
+  }
+
+  return 1;
+}
+
 static int a4stats_lua_update_user(lua_State *ps) {
   const char *account;
   unsigned long channelid, accountid;
   char query[4096];
-  int first = 1;
-  user_update_info *uui;
+  int first = 1, columns = 0, mergeable = 1, i;
+  pending_column cols[PENDING_MAXCOLUMNS];
+  int kinds[PENDING_MAXCOLUMNS];
+  pending_write *pw;
 
   if (!lua_isnumber(ps, 1) || !lua_isstring(ps, 2) || !lua_isnumber(ps, 3))
     LUA_RETURN(ps, LUA_FAIL);
@@ -219,66 +635,65 @@ static int a4stats_lua_update_user(lua_State *ps) {
 
     strcat(query, value);
 
+    if (mergeable) {
+      if (columns < PENDING_MAXCOLUMNS) {
+        cols[columns].expr = NULL;
+        kinds[columns] = a4stats_parse_clause(value, &cols[columns]);
+        if (kinds[columns])
+          columns++;
+        else
+          mergeable = 0;
+      } else {
+        mergeable = 0;
+      }
+    }
+
     lua_pop(ps, 1);
   }
 
   lua_pop(ps, 1);
 
-  strcat(query, " WHERE channelid = ? AND (accountid != 0 AND accountid = ? OR accountid = 0 AND account = ?)");
-
-  uui = malloc(sizeof(*uui));
-  uui->stage = 0;
-  uui->update = strdup(query);
-  uui->channelid = channelid;
-  uui->account = strdup(account);
-  uui->accountid = accountid;
-
-  a4stats_update_user_cb(NULL, uui);
+  if (mergeable && columns) {
+    pw = a4stats_pending_find(PENDING_USER, channelid, account, accountid, NULL, 0, 1, 0);
+    for (i = 0; pw && i < columns; i++) {
+      if (a4stats_merge_column(pw, &cols[i], kinds[i]))
+        continue;
+
+      /* send what's there and start again from this clause */
+      pw = a4stats_pending_find(PENDING_USER, channelid, account, accountid, NULL, 0, 0, 1);
+      a4stats_pending_write(pw);
+      pw = a4stats_pending_find(PENDING_USER, channelid, account, accountid, NULL, 0, 1, 0);
+      i--;
+    }
 
-  LUA_RETURN(ps, LUA_OK);
-}
+    for (i = 0; i < columns; i++)
+      free(cols[i].expr);
 
-typedef struct relation_update_info {
-  int stage;
-  unsigned long channelid;
-  char *first;
-  unsigned long firstid;
-  char *second;
-  unsigned long secondid;
-} relation_update_info;
+    if (!pw)
+      LUA_RETURN(ps, LUA_FAIL);
 
-static void a4stats_update_relation_cb(const struct DBAPIResult *result, void *uarg) {
-  relation_update_info *rui = uarg;
+    a4stats_pending_queued();
+    LUA_RETURN(ps, LUA_OK);
+  }
 
-  rui->stage++;
+  for (i = 0; i < columns; i++)
+    free(cols[i].expr);
 
-  if (rui->stage == 1) {
-    a4statsdb->query(a4statsdb, a4stats_update_relation_cb, rui, "UPDATE ? SET score = score + 1, seen = ? "
-      "WHERE channelid = ? AND first = ? AND firstid = ? AND second = ? AND secondid = ?",
-      "TtUsUsU", "relations", time(NULL), rui->channelid, rui->first, rui->firstid, rui->second, rui->secondid);
-    goto a4_urc_return;
-  } else if (rui->stage == 2 && result && result->affected == 0) {
-    a4statsdb->query(a4statsdb, a4stats_update_relation_cb, rui, "INSERT INTO ? (channelid, first, firstid, second, secondid, seen) VALUES (?, ?, ?, ?, ?, ?)",
-      "TUsUsUt", "relations", rui->channelid, rui->first, rui->firstid, rui->second, rui->secondid, time(NULL));
-    goto a4_urc_return;
-  }
+  pw = a4stats_pending_find(PENDING_USER, channelid, account, accountid, NULL, 0, 0, 1);
+  if (pw)
+    a4stats_pending_write(pw);
 
-  if (!result || result->affected == 0)
-    Error("a4stats", ERR_WARNING, "Unable to update relation.");
+  strcat(query, A4STATS_USER_WHERE);
 
-  free(rui->first);
-  free(rui->second);
-  free(rui);
+  a4stats_write_user(channelid, account, accountid, strdup(query));
 
-a4_urc_return:
-  if (result)
-    result->clear(result);
+  LUA_RETURN(ps, LUA_OK);
 }
 
 static int a4stats_lua_update_relation(lua_State *ps) {
   const char *user1, *user2;
   unsigned long channelid, user1id, user2id;
-  relation_update_info *rui;
+  pending_write *pw;
 
   if (!lua_isnumber(ps, 1) || !lua_isstring(ps, 2) || !lua_isnumber(ps, 3) || !lua_isstring(ps, 4) || !lua_isnumber(ps, 5))
     LUA_RETURN(ps, LUA_FAIL);
@@ -289,31 +704,26 @@ static int a4stats_lua_update_relation(lua_State *ps) {
   user2 = lua_tostring(ps, 4);
   user2id = lua_tonumber(ps, 5);
 
-  rui = malloc(sizeof(*rui));
-  rui->stage = 0;
-  rui->channelid = channelid;
+  if (user1id < user2id || (user1id == user2id && strcmp(user1, user2) <= 0))
+    pw = a4stats_pending_find(PENDING_RELATION, channelid, user1, user1id, user2, user2id, 1, 0);
+  else
+    pw = a4stats_pending_find(PENDING_RELATION, channelid, user2, user2id, user1, user1id, 1, 0);
 
-  if (user1id < user2id || (user1id == user2id && strcmp(user1, user2) <= 0)) {
-    rui->first = strdup(user1);
-    rui->firstid = user1id;
-    rui->second = strdup(user2);
-    rui->secondid = user2id;
-  } else {
-    rui->first = strdup(user2);
-    rui->firstid = user2id;
-    rui->second = strdup(user1);
-    rui->secondid = user1id;
-  }
+  if (!pw)
+    LUA_RETURN(ps, LUA_FAIL);
+
+  pw->count++;
+  pw->seen = time(NULL);
 
-  a4stats_update_relation_cb(NULL, rui);
+  a4stats_pending_queued();
 
   LUA_RETURN(ps, LUA_OK);
 }
 
 static int a4stats_lua_add_line(lua_State *ps) {
-  char query[256];
   const char *channel;
   int hour;
+  pending_write *pw;
 
   if (!lua_isstring(ps, 1) || !lua_isnumber(ps, 2))
     LUA_RETURN(ps, LUA_FAIL);
@@ -321,9 +731,16 @@ static int a4stats_lua_add_line(lua_State *ps) {
   channel = lua_tostring(ps, 1);
   hour = lua_tonumber(ps, 2);
 
-  snprintf(query, sizeof(query), "UPDATE ? SET h%d = h%d + 1 WHERE " A4STATS_DB_EQ_NOCASE("name", "?"), hour, hour);
+  if (hour < 0 || hour > 23)
+    LUA_RETURN(ps, LUA_FAIL);
 
-  a4statsdb->squery(a4statsdb, query, "Ts", "channels", channel);
+  pw = a4stats_pending_find(PENDING_LINE, 0, channel, 0, NULL, 0, 1, 0);
+  if (!pw)
+    LUA_RETURN(ps, LUA_FAIL);
+
+  pw->hours[hour]++;
+
+  a4stats_pending_queued();
 
   LUA_RETURN(ps, LUA_OK);
 }
@@ -586,6 +1003,11 @@ void _init(void) {
 
   a4stats_connectdb();
 
+  pendingmetric = registermetric("a4stats_pending", METRIC_GAUGE);
+  coalescedmetric = registermetric("a4stats_coalesced", METRIC_COUNTER);
+  flushmetric = registermetric("a4stats_flush_us", METRIC_HISTOGRAM);
+  writemetric = registermetric("a4stats_write_us", METRIC_HISTOGRAM);
+
   registerhook(HOOK_LUA_LOADSCRIPT, a4stats_hook_loadscript);
   registerhook(HOOK_LUA_UNLOADSCRIPT, a4stats_hook_unloadscript);
   schedulerecurring(time(NULL), 0, CLEANUP_INTERVAL, a4stats_cleanupdb, NULL);
@@ -601,8 +1023,15 @@ void _fini(void) {
   lua_list *l;
 
   deleteschedule(NULL, a4stats_cleanupdb, NULL);
+
+  a4stats_flush();
   a4stats_closedb();
 
+  deregistermetric(pendingmetric);
+  deregistermetric(coalescedmetric);
+  deregistermetric(flushmetric);
+  deregistermetric(writemetric);
+
   for (l = lua_head; l;l = l->next) {
     a4stats_hook_unloadscript(HOOK_LUA_UNLOADSCRIPT, l->l);
 
@@ -12,25 +12,27 @@ static void *authdumpsched;
 static void doauthdump(void *arg) {
   authname *a;
   nick *np;
-  int i;
+  unsigned int i;
   FILE *fp = fopen("authdump/authdump.txt.1", "w");
 
   if(!fp)
     return;
 
-  for(i=0;i<AUTHNAMEHASHSIZE;i++) {
-    for(a=authnametable[i];a;a=a->next) {
-      np = a->nicks;
-      if(!np)
-        continue;
+  for(i=0;i<authnametablesize;i++) {
+    a = authnametable[i];
+    if(!AUTHNAMESLOTUSED(a))
+      continue;
 
-      /* grossly inefficient */
-      fprintf(fp, "%s %lu", np->authname, np->auth->userid);
-      for(;np;np=np->nextbyauthname)
-        fprintf(fp, " %s", np->nick);
+    np = a->nicks;
+    if(!np)
+      continue;
 
-      fprintf(fp, "\n");
-    }
+    /* grossly inefficient */
+    fprintf(fp, "%s %lu", np->authname, np->auth->userid);
+    for(;np;np=np->nextbyauthname)
+      fprintf(fp, " %s", np->nick);
+
+    fprintf(fp, "\n");
   }
 
   fclose(fp);
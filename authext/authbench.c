@@ -0,0 +1,110 @@
+/* authbench.c: timings for the authname tables */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "authext.h"
+#include "../control/control.h"
+#include "../lib/version.h"
+
+MODULE_VERSION("");
+
+/* Well clear of any real account ID, and '~' never appears in real account names */
+#define AUTHBENCHBASEID 4000000000UL
+#define AUTHBENCHDEFAULTCOUNT 5000000
+#define AUTHBENCHNAMELEN (ACCOUNTLEN+1)
+
+int authbench(void *sender, int cargc, char **cargv);
+
+void _init(void) {
+  registercontrolhelpcmd("authbench", NO_DEVELOPER, 1, &authbench, "Usage: authbench [count]\nTimes authname inserts and lookups over count temporary accounts (default 5000000).");
+}
+
+void _fini(void) {
+  deregistercontrolcmd("authbench", &authbench);
+}
+
+static double elapsed(struct timeval *start) {
+  struct timeval end;
+
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void report(nick *np, char *what, unsigned long count, unsigned long hits, double secs) {
+  controlreply(np, "%-12s %8lu ops, %8lu hits, %7.3fs, %6.1fns/op", what, count, hits, secs, count ? secs * 1000000000.0 / count : 0.0);
+}
+
+int authbench(void *sender, int cargc, char **cargv) {
+  nick *np = sender;
+  unsigned long i, count = AUTHBENCHDEFAULTCOUNT, hits;
+  struct timeval start;
+  authname *anp;
+  char *names;
+
+  if (cargc > 0)
+    count = strtoul(cargv[0], NULL, 10);
+
+  if (count == 0 || count > 50000000) {
+    controlreply(np, "Count must be between 1 and 50000000.");
+    return CMD_ERROR;
+  }
+
+  names = malloc(count * AUTHBENCHNAMELEN);
+  if (!names) {
+    controlreply(np, "Unable to allocate name buffer.");
+    return CMD_ERROR;
+  }
+
+  for (i=0;i<count;i++)
+    snprintf(names + i * AUTHBENCHNAMELEN, AUTHBENCHNAMELEN, "~b%lu", i);
+
+  gettimeofday(&start, NULL);
+  for (i=0;i<count;i++)
+    findorcreateauthname(AUTHBENCHBASEID + i, names + i * AUTHBENCHNAMELEN);
+  report(np, "insert:", count, count, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  for (i=0,hits=0;i<count;i++)
+    if (findauthname(AUTHBENCHBASEID + i))
+      hits++;
+  report(np, "byid:", count, hits, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  for (i=0,hits=0;i<count;i++)
+    if (findauthnamebyname(names + i * AUTHBENCHNAMELEN))
+      hits++;
+  report(np, "byname:", count, hits, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  for (i=0,hits=0;i<count;i++)
+    if (findauthname(AUTHBENCHBASEID + count + i))
+      hits++;
+  report(np, "byid miss:", count, hits, elapsed(&start));
+
+  /* mangle the names so they all miss */
+  for (i=0;i<count;i++)
+    names[i * AUTHBENCHNAMELEN + 1] = 'x';
+
+  gettimeofday(&start, NULL);
+  for (i=0,hits=0;i<count;i++)
+    if (findauthnamebyname(names + i * AUTHBENCHNAMELEN))
+      hits++;
+  report(np, "byname miss:", count, hits, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  for (i=0,hits=0;i<count;i++) {
+    anp = findauthname(AUTHBENCHBASEID + i);
+    if (anp && anp->name[0] == '~') {
+      releaseauthname(anp);
+      hits++;
+    }
+  }
+  report(np, "release:", count, hits, elapsed(&start));
+
+  free(names);
+
+  controlreply(np, "Done.");
+  return CMD_OK;
+}
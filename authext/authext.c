@@ -17,13 +17,22 @@ MODULE_VERSION("")
 /* checking to see that u_int64_t == unsigned long long for strtoull */
 CCASSERT(sizeof(unsigned long long) == sizeof(u_int64_t))
 
-#define authnamehash(x)   ((x)%AUTHNAMEHASHSIZE)
-#define authnamehashbyname(x) (irc_crc32i(x)%AUTHNAMEHASHSIZE)
+/* Both tables are linear probed, power of two sized and kept at most 3/4 full
+ * (counting tombstones).  Growing always doubles until we're back under 1/2. */
+#define AUTHNAMEINITIALSIZE 65536
 
-authname *authnametable[AUTHNAMEHASHSIZE];
+#define authnamehash(x)       ((unsigned int)(((unsigned long long)(x) * 0x9E3779B97F4A7C15ULL) >> 32))
+#define authnamehashbyname(x) (irc_strhashi(x))
+
+authname **authnametable;
+unsigned int authnametablesize;
+
+/* Marks a deleted slot; userid 0 is never a valid account so id lookups can't match it */
+authname authnametombstone;
 
 /* internal access only */
-static authname *authnametablebyname[AUTHNAMEHASHSIZE];
+static authname **authnametablebyname;
+static unsigned long authnamecount, idtombstones, nametombstones;
 
 static struct {
   sstring *name;
@@ -31,10 +40,14 @@ static struct {
 } authnameexts[MAXAUTHNAMEEXTS];
 
 static void authextstats(int hooknum, void *arg);
+static void authnameresize(unsigned int newsize);
 
 void _init(void) {
-  memset(authnametable,0,sizeof(authnametable));
-  memset(authnametablebyname,0,sizeof(authnametablebyname));
+  authnametable=NULL;
+  authnametablebyname=NULL;
+  authnamecount=idtombstones=nametombstones=0;
+  authnameresize(AUTHNAMEINITIALSIZE);
+
   registerhook(HOOK_CORE_STATSREQUEST, &authextstats);
 }
 
@@ -48,6 +61,7 @@ authname *newauthname(void) {
 }
 
 void freeauthname (authname *anp) {
+  nsfree(POOL_AUTHEXT, anp->extraexts);
   nsfree(POOL_AUTHEXT, anp);
 }
 
@@ -84,28 +98,110 @@ int findauthnameext(const char *name) {
 }
 
 void releaseauthnameext(int index) {
-  int i;
-  authname *anp;
+  unsigned int i;
 
   freesstring(authnameexts[index].name);
   authnameexts[index].name=NULL;
 
-  for (i=0;i<AUTHNAMEHASHSIZE;i++) {
-    for (anp=authnametable[i];anp;anp=anp->next) {
-      anp->exts[index]=NULL;
+  for (i=0;i<authnametablesize;i++)
+    if (AUTHNAMESLOTUSED(authnametable[i]))
+      setauthnameext(authnametable[i], index, NULL);
+
+  /* the contents of authnametablebyname should be identical */
+}
+
+void setauthnameext(authname *anp, int index, void *value) {
+  if (index < AUTHNAMEINLINEEXTS) {
+    anp->exts[index]=value;
+    return;
+  }
+
+  if (!anp->extraexts) {
+    if (!value)
+      return;
+
+    anp->extraexts=nscalloc(POOL_AUTHEXT, MAXAUTHNAMEEXTS - AUTHNAMEINLINEEXTS, sizeof(void *));
+    if (!anp->extraexts) {
+      Error("nick",ERR_ERROR,"Unable to allocate ext storage for authname %lu",anp->userid);
+      return;
     }
   }
 
-  /* the contents of authnametablebyname should be identical */
+  anp->extraexts[index - AUTHNAMEINLINEEXTS]=value;
+}
+
+static void insertbyid(authname **table, unsigned int size, authname *anp) {
+  unsigned int i, mask=size-1;
+
+  for (i=authnamehash(anp->userid)&mask;AUTHNAMESLOTUSED(table[i]);i=(i+1)&mask)
+    ;
+
+  table[i]=anp;
+}
+
+static void insertbyname(authname **table, unsigned int size, authname *anp) {
+  unsigned int i, mask=size-1;
+
+  for (i=anp->namehash&mask;AUTHNAMESLOTUSED(table[i]);i=(i+1)&mask)
+    ;
+
+  table[i]=anp;
+}
+
+static void authnameresize(unsigned int newsize) {
+  authname **newtable, **newtablebyname;
+  unsigned int i;
+
+  newtable=nscalloc(POOL_AUTHEXT, newsize, sizeof(authname *));
+  newtablebyname=nscalloc(POOL_AUTHEXT, newsize, sizeof(authname *));
+
+  if (!newtable || !newtablebyname)
+    Error("nick",ERR_STOP,"Unable to allocate authname tables of size %u",newsize);
+
+  /* every entry is in both tables, so the id table is enough to rebuild from */
+  for (i=0;i<authnametablesize;i++) {
+    if (AUTHNAMESLOTUSED(authnametable[i])) {
+      insertbyid(newtable, newsize, authnametable[i]);
+      insertbyname(newtablebyname, newsize, authnametable[i]);
+    }
+  }
+
+  nsfree(POOL_AUTHEXT, authnametable);
+  nsfree(POOL_AUTHEXT, authnametablebyname);
+
+  authnametable=newtable;
+  authnametablebyname=newtablebyname;
+  authnametablesize=newsize;
+  idtombstones=nametombstones=0;
+}
+
+static void authnamegrow(unsigned long extra) {
+  unsigned long needed=authnamecount+extra;
+  unsigned long tombstones=(idtombstones>nametombstones)?idtombstones:nametombstones;
+  unsigned int newsize;
+
+  if ((needed+tombstones)*4 <= (unsigned long)authnametablesize*3)
+    return;
+
+  /* if it's just tombstones this rebuilds at the same size */
+  for (newsize=authnametablesize;needed*2 > newsize;newsize<<=1)
+    ;
+
+  authnameresize(newsize);
+}
+
+void authnamereserve(unsigned long count) {
+  authnamegrow(count);
 }
 
 authname *findauthname(unsigned long userid) {
+  unsigned int i, mask=authnametablesize-1;
   authname *anp;
 
   if(!userid)
     return NULL;
 
-  for (anp=authnametable[authnamehash(userid)];anp;anp=(authname *)anp->next)
+  for (i=authnamehash(userid)&mask;(anp=authnametable[i]);i=(i+1)&mask)
     if (userid==anp->userid)
       return anp;
 
@@ -113,94 +209,114 @@ authname *findauthname(unsigned long userid) {
 }
 
 authname *findauthnamebyname(const char *name) {
+  unsigned int i, hash, mask=authnametablesize-1;
   authname *anp;
 
   if(!name)
     return NULL;
 
-  for (anp=authnametablebyname[authnamehashbyname(name)];anp;anp=(authname *)anp->nextbyname)
-    if (!ircd_strcmp(anp->name, name))
+  hash=authnamehashbyname(name);
+  for (i=hash&mask;(anp=authnametablebyname[i]);i=(i+1)&mask)
+    if (anp->namehash==hash && anp!=&authnametombstone && !ircd_strcmp(anp->name, name))
       return anp;
 
   return NULL;
 }
 
 authname *findorcreateauthname(unsigned long userid, const char *name) {
+  unsigned int i, mask;
   authname *anp;
-  unsigned int thehash=authnamehash(userid), secondhash = authnamehashbyname(name);
 
   if(!userid || !name)
     return NULL;
 
-  for (anp=authnametable[thehash];anp;anp=(authname *)anp->next)
-    if (userid==anp->userid)
-      return anp;
+  if ((anp=findauthname(userid)))
+    return anp;
+
+  authnamegrow(1);
 
   anp=newauthname();
   anp->userid=userid;
   strlcpy(anp->name, name, sizeof(anp->name));
+  anp->namehash=authnamehashbyname(name);
   anp->usercount=0;
   anp->marker=0;
   anp->flags=0;
   anp->nicks=NULL;
-  memset(anp->exts, 0, MAXAUTHNAMEEXTS * sizeof(void *));
-  anp->next=(struct authname *)authnametable[thehash];
-  authnametable[thehash]=anp;
+  memset(anp->exts, 0, AUTHNAMEINLINEEXTS * sizeof(void *));
+  anp->extraexts=NULL;
+
+  /* inserting over a tombstone uses it up */
+  mask=authnametablesize-1;
+  for (i=authnamehash(userid)&mask;AUTHNAMESLOTUSED(authnametable[i]);i=(i+1)&mask)
+    ;
+  if (authnametable[i])
+    idtombstones--;
+  authnametable[i]=anp;
+
+  for (i=anp->namehash&mask;AUTHNAMESLOTUSED(authnametablebyname[i]);i=(i+1)&mask)
+    ;
+  if (authnametablebyname[i])
+    nametombstones--;
+  authnametablebyname[i]=anp;
 
-  anp->namebucket=secondhash;
-  anp->nextbyname=(struct authname *)authnametablebyname[secondhash];
-  authnametablebyname[secondhash]=anp;
+  authnamecount++;
 
   return anp;
 }
 
+/* Clears slot i, only leaving a tombstone if something might have probed past it */
+static void clearslot(authname **table, unsigned int i, unsigned long *tombstones) {
+  if (!table[(i+1)&(authnametablesize-1)]) {
+    table[i]=NULL;
+  } else {
+    table[i]=&authnametombstone;
+    (*tombstones)++;
+  }
+}
+
 void releaseauthname(authname *anp) {
-  authname **manp;
-  int i, found;
+  unsigned int i, mask=authnametablesize-1;
+  int j;
+
   if (anp->usercount==0) {
     anp->nicks = NULL;
 
-    for(i=0;i<MAXAUTHNAMEEXTS;i++)
-      if(authnameexts[i].persistent && anp->exts[i]!=NULL)
+    for(j=0;j<MAXAUTHNAMEEXTS;j++)
+      if(authnameexts[j].persistent && getauthnameext(anp, j)!=NULL)
         return;
 
     triggerhook(HOOK_AUTH_LOSTAUTHNAME, (void *)anp);
-    found = 0;
-    for(manp=&(authnametable[authnamehash(anp->userid)]);*manp;manp=(authname **)&((*manp)->next)) {
-      if ((*manp)==anp) {
-        (*manp)=(authname *)anp->next;
-        found = 1;
-        break;
-      }
-    }
-    if(!found) {
+
+    for (i=authnamehash(anp->userid)&mask;authnametable[i] && authnametable[i]!=anp;i=(i+1)&mask)
+      ;
+    if (!authnametable[i]) {
       Error("nick",ERR_ERROR,"Unable to remove authname %lu from hashtable",anp->userid);
       return;
     }
+    clearslot(authnametable, i, &idtombstones);
 
-    for(manp=&(authnametablebyname[anp->namebucket]);*manp;manp=(authname **)&((*manp)->nextbyname)) {
-      if ((*manp)==anp) {
-        (*manp)=(authname *)anp->nextbyname;
-        freeauthname(anp);
-        return;
-      }
-    }
+    for (i=anp->namehash&mask;authnametablebyname[i] && authnametablebyname[i]!=anp;i=(i+1)&mask)
+      ;
+    if (!authnametablebyname[i])
+      Error("nick",ERR_STOP,"Unable to remove authname %lu from byname hashtable, TABLES ARE INCONSISTENT -- DYING",anp->userid);
+    clearslot(authnametablebyname, i, &nametombstones);
 
-    Error("nick",ERR_STOP,"Unable to remove authname %lu from byname hashtable, TABLES ARE INCONSISTENT -- DYING",anp->userid);
+    authnamecount--;
+    freeauthname(anp);
   }
 }
 
 unsigned int nextauthnamemarker(void) {
-  int i;
-  authname *anp;
+  unsigned int i;
   static unsigned int authnamemarker=0;
 
   authnamemarker++;
   if (!authnamemarker) {
     /* If we wrapped to zero, zap the marker on all records */
-    for (i=0;i<AUTHNAMEHASHSIZE;i++)
-      for (anp=authnametable[i];anp;anp=anp->next)
-        anp->marker=0;
+    for (i=0;i<authnametablesize;i++)
+      if (AUTHNAMESLOTUSED(authnametable[i]))
+        authnametable[i]->marker=0;
     authnamemarker++;
   }
 
@@ -215,48 +331,42 @@ authname *getauthbyname(const char *name) {
   return a;
 }
 
-static char *genstats(authname **hashtable, authname *(nextfn)(authname *)) {
-  int i,curchain,maxchain=0,total=0,buckets=0;
+static char *genstats(authname **hashtable, unsigned long tombstones, int byname) {
+  unsigned int i, home, probe, maxprobe=0, mask=authnametablesize-1;
+  unsigned long total=0, totalprobe=0;
   authname *ap;
-  static char buf[100];
-
-  for (i=0;i<AUTHNAMEHASHSIZE;i++) {
-    if (hashtable[i]!=NULL) {
-      buckets++;
-      curchain=0;
-      for (ap=hashtable[i];ap;ap=nextfn(ap)) {
-        total++;
-        curchain++;
-      }
-      if (curchain>maxchain) {
-        maxchain=curchain;
-      }
-    }
-  }
+  static char buf[150];
 
-  snprintf(buf, sizeof(buf), "%6d authexts (HASH: %6d/%6d, chain %3d)",total,buckets,AUTHNAMEHASHSIZE,maxchain);
-  return buf;
-}
+  for (i=0;i<authnametablesize;i++) {
+    ap=hashtable[i];
+    if (!AUTHNAMESLOTUSED(ap))
+      continue;
 
-static authname *nextbynext(authname *in) {
-  return in->next;
-}
+    home=byname?(ap->namehash&mask):(authnamehash(ap->userid)&mask);
+    probe=(i-home)&mask;
 
-static authname *nextbyname(authname *in) {
-  return in->nextbyname;
+    total++;
+    totalprobe+=probe;
+    if (probe>maxprobe)
+      maxprobe=probe;
+  }
+
+  snprintf(buf, sizeof(buf), "%7lu authexts (SLOTS: %7u, load %.2f, %lu tombstones, probe avg %.2f max %u)",
+           total, authnametablesize, (double)total/authnametablesize, tombstones,
+           total?(double)totalprobe/total:0.0, maxprobe);
+  return buf;
 }
 
 static void authextstats(int hooknum, void *arg) {
   long level=(long)arg;
-  char buf[100];
+  char buf[200];
 
   if (level>5) {
     /* Full stats */
-    snprintf(buf,sizeof(buf),"Authext : by id:   %s", genstats(authnametable, nextbynext));
+    snprintf(buf,sizeof(buf),"Authext : by id:   %s", genstats(authnametable, idtombstones, 0));
     triggerhook(HOOK_CORE_STATSREPLY,buf);
 
-    snprintf(buf,sizeof(buf),"Authext : by name: %s", genstats(authnametablebyname, nextbyname));
+    snprintf(buf,sizeof(buf),"Authext : by name: %s", genstats(authnametablebyname, nametombstones, 1));
     triggerhook(HOOK_CORE_STATSREPLY,buf);
   }
 }
-
@@ -5,9 +5,13 @@
 #include "../lib/flags.h"
 
 #include <sys/types.h>
+#include <stddef.h>
 
 #define MAXAUTHNAMEEXTS 5
 
+/* The first few exts live in the struct, the rest are allocated on demand */
+#define AUTHNAMEINLINEEXTS 2
+
 struct nick;
 
 typedef struct authname {
@@ -15,17 +19,22 @@ typedef struct authname {
   int usercount;
   unsigned int marker;
   struct nick *nicks;
-  struct authname *next, *nextbyname;
-  unsigned int namebucket;
   u_int64_t flags;
+  unsigned int namehash;
   char name[ACCOUNTLEN+1];
-  /* These are extensions only used by other modules */
-  void *exts[MAXAUTHNAMEEXTS];
+  /* These are extensions only used by other modules, use getauthnameext()/setauthnameext() */
+  void *exts[AUTHNAMEINLINEEXTS];
+  void **extraexts;
 } authname;
 
-#define AUTHNAMEHASHSIZE  60000
+/* Open addressed table of all authnames, indexed by userid.
+ * Walk it with: for (i=0;i<authnametablesize;i++) if (AUTHNAMESLOTUSED(authnametable[i])) ...
+ * Removing entries while walking is safe, adding them is not. */
+extern authname **authnametable;
+extern unsigned int authnametablesize;
 
-extern authname *authnametable[AUTHNAMEHASHSIZE];
+extern authname authnametombstone;
+#define AUTHNAMESLOTUSED(x) ((x) && (x)!=&authnametombstone)
 
 /* Allocators */
 authname *newauthname(void);
@@ -35,6 +44,14 @@ void freeauthname (authname *hp);
 int registerauthnameext(const char *name, int persistant);
 int findauthnameext(const char *name);
 void releaseauthnameext(int index);
+void setauthnameext(authname *anp, int index, void *value);
+
+static inline void *getauthnameext(authname *anp, int index) {
+  if (index < AUTHNAMEINLINEEXTS)
+    return anp->exts[index];
+
+  return anp->extraexts ? anp->extraexts[index - AUTHNAMEINLINEEXTS] : NULL;
+}
 
 /* Actual user commands */
 authname *findauthname(unsigned long userid);
@@ -42,6 +59,9 @@ authname *findauthnamebyname(const char *name);
 authname *findorcreateauthname(unsigned long userid, const char *name);
 void releaseauthname(authname *anp);
 
+/* Grow the tables ahead of a bulk load of count new entries */
+void authnamereserve(unsigned long count);
+
 /* Marker */
 unsigned int nextauthnamemarker(void);
 
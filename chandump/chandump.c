@@ -21,12 +21,12 @@ void dodump(void *arg) {
 
   fprintf(fp, "M T %lld\n", (unsigned long long)time(NULL));
 
-  for(i=0;i<CHANNELHASHSIZE;i++)
+  for(i=0;i<chantablesize;i++)
     for(c=chantable[i];c;c=c->next)
       if(c->channel && !IsSecret(c->channel))
         fprintf(fp, "C %s %d%s%s\n", c->name->content, c->channel->users->totalusers, (c->channel->topic&&c->channel->topic->content)?" ":"", (c->channel->topic&&c->channel->topic->content)?c->channel->topic->content:"");
 
-  for(i=0;i<NICKHASHSIZE;i++)
+  for(i=0;i<nicktablesize;i++)
     for(n=nicktable[i];n;n=n->next)
       fprintf(fp, "N %s %s %s %s %s\n", n->nick, n->ident, strchr(visibleuserhost(n, buf), '@') + 1, (IsAccount(n) && n->authname) ? n->authname : "0", n->realname->name->content);
 
@@ -205,7 +205,7 @@ int cfcmd_debughistogram(void *source, int cargc, char **cargv) {
   for (i = 0; i < 10001; i++)
     histogram[i] = 0;
 
-  for (i=0; i<CHANNELHASHSIZE; i++) {
+  for (i=0; i<chantablesize; i++) {
     for (cip=chantable[i]; cip; cip=cip->next) {
       if ((cf = cip->exts[cfext]) != NULL) {
         for (a=0;a<cf->regops.cursi;a++) {
@@ -612,7 +612,7 @@ void cf_free(void) {
   chanindex *cip;
 
   /* free old stuff */
-  for (i=0; i<CHANNELHASHSIZE; i++) {
+  for (i=0; i<chantablesize; i++) {
     for (cip=chantable[i]; cip; cip=cip->next) {
       if ((cf = cip->exts[cfext]) != NULL) {
         for (a=0;a<cf->regops.cursi;a++) {
@@ -675,7 +675,7 @@ void cfsched_dosample(void *arg) {
 
   gettimeofday(&start, NULL);
 
-  for (i=0; i<CHANNELHASHSIZE; i++) {
+  for (i=0; i<chantablesize; i++) {
     for (cip=chantable[i]; cip; cip=cip->next) {
       cp = cip->channel;
 
@@ -757,7 +757,7 @@ void cfsched_doexpire(void *arg) {
   gettimeofday(&start, NULL);
   currenttime=getnettime();
 
-  for (i=0; i<CHANNELHASHSIZE; i++) {
+  for (i=0; i<chantablesize; i++) {
     for (cip=chantable[i]; cip; cip=cip->next) {
       cf = (chanfix*)cip->exts[cfext];
 
@@ -782,7 +782,7 @@ void cfsched_doexpire(void *arg) {
   }
 
   /* stolen from channel/channelindex.c */
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=ncip) {
       /* CAREFUL: deleting items from chains you're walking is bad */
       ncip=cip->next;
@@ -853,7 +853,7 @@ void cfhook_statsreport(int hook, void *arg) {
   if ((long)arg > 2) {
     memory = rc = mc = 0;
 
-    for (i=0; i<CHANNELHASHSIZE; i++) {
+    for (i=0; i<chantablesize; i++) {
       for (cip=chantable[i]; cip; cip=cip->next) {
         if ((cf = cip->exts[cfext]) != NULL) {
           for (a=0;a<cf->regops.cursi;a++) {
@@ -1182,7 +1182,7 @@ int cf_storechanfix(void) {
   if (cfdata == NULL)
     return 0;
 
-  for (i=0; i<CHANNELHASHSIZE; i++) {
+  for (i=0; i<chantablesize; i++) {
     for (cip=chantable[i]; cip; cip=cip->next) {
       if ((cf = cip->exts[cfext]) != NULL) {
         for (a=0;a<cf->regops.cursi;a++) {
@@ -12,20 +12,25 @@
 
 MODULE_VERSION("")
 
-#define channelhash(x)  (irc_crc32i(x)%CHANNELHASHSIZE)
+#define channelhash(x)  (hashtable_bucket(&chanhashtable, irc_strhashi(x)))
 
-chanindex *chantable[CHANNELHASHSIZE];
+hashtable chanhashtable;
 sstring *extnames[MAXCHANNELEXTS];
 
 unsigned int channelmarker;
 
+static unsigned int chanindexitemhash(const void *item) {
+  return irc_strhashi(((const chanindex *)item)->name->content);
+}
+
 void _init() {
-  memset(chantable,0,sizeof(chantable));
+  hashtable_init(&chanhashtable, CHANNELHASHINITSIZE, offsetof(chanindex, next), chanindexitemhash);
   memset(extnames,0,sizeof(extnames));
   channelmarker=0;
 }
 
 void _fini() {
+  hashtable_free(&chanhashtable);
   nsfreeall(POOL_CHANINDEX);
 }
 
@@ -52,10 +57,10 @@ chanindex *findchanindex(const char *name) {
 
 chanindex *findorcreatechanindex(const char *name) {
   chanindex *cip;
-  int hash=channelhash(name);
+  unsigned int hash=irc_strhashi(name);
   int i;
 
-  for (cip=chantable[hash];cip;cip=cip->next) {
+  for (cip=chantable[hashtable_bucket(&chanhashtable,hash)];cip;cip=cip->next) {
     if (!ircd_strcmp(cip->name->content,name)) {
       return cip;
     }
@@ -66,8 +71,7 @@ chanindex *findorcreatechanindex(const char *name) {
   cip->name=getsstring(name,CHANNELLEN);
   cip->channel=NULL;
   cip->marker=0;
-  cip->next=chantable[hash];
-  chantable[hash]=cip;
+  hashtable_add(&chanhashtable,cip,hash);
   
   for(i=0;i<MAXCHANNELEXTS;i++) {
     cip->exts[i]=NULL;
@@ -78,8 +82,6 @@ chanindex *findorcreatechanindex(const char *name) {
 
 void releasechanindex(chanindex *cip) {
   int i;
-  chanindex **cih;
-  int hash;
   
   /* If any module is still using the channel, do nothing */
   /* Same if the channel is still present on the network */
@@ -95,15 +97,10 @@ void releasechanindex(chanindex *cip) {
   }
   
   /* Now remove the index record from the index. */
-  hash=channelhash(cip->name->content);
-  
-  for(cih=&(chantable[hash]);*cih;cih=&((*cih)->next)) {
-    if (*cih==cip) {
-      (*cih)=cip->next;
-      freesstring(cip->name);
-      freechanindex(cip);
-      return;
-    }
+  if (hashtable_remove(&chanhashtable,cip,irc_strhashi(cip->name->content))) {
+    freesstring(cip->name);
+    freechanindex(cip);
+    return;
   }
   
   Error("channel",ERR_ERROR,"Tried to release chanindex record for %s not found in hash",cip->name->content);
@@ -141,13 +138,13 @@ int findchanext(const char *name) {
 }
 
 void releasechanext(int index) {
-  int i;
+  unsigned int i;
   chanindex *cip,*ncip;
   
   freesstring(extnames[index]);
   extnames[index]=NULL;
   
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=ncip) {
       /* CAREFUL: deleting items from chains you're walking is bad */
       ncip=cip->next;
@@ -160,13 +157,13 @@ void releasechanext(int index) {
 }
 
 unsigned int nextchanmarker() {
-  int i;
+  unsigned int i;
   chanindex *cip;
   
   channelmarker++;
   if (!channelmarker) {
     /* If we wrapped to zero, zap the marker on all records */
-    for (i=0;i<CHANNELHASHSIZE;i++)
+    for (i=0;i<chantablesize;i++)
       for (cip=chantable[i];cip;cip=cip->next)
 	cip->marker=0;
     channelmarker++;
@@ -2,8 +2,10 @@
 #define __CHANINDEX_H
 
 #include "../lib/sstring.h"
+#include "../lib/hashtable.h"
 
-#define  CHANNELHASHSIZE      60000
+/* Initial size, the table grows as needed */
+#define  CHANNELHASHINITSIZE  65536
 #define  MAXCHANNELEXTS       7
 
 struct channel;
@@ -16,7 +18,11 @@ typedef struct chanindex {
   void             *exts[MAXCHANNELEXTS];
 } chanindex;
 
-extern chanindex *chantable[CHANNELHASHSIZE];
+/* Walk with: for (i=0;i<chantablesize;i++) for (cip=chantable[i];cip;cip=cip->next) */
+extern hashtable chanhashtable;
+
+#define chantable      ((chanindex **)chanhashtable.buckets)
+#define chantablesize  (chanhashtable.size)
 
 chanindex *getchanindex();
 void freechanindex(chanindex *cip);
@@ -16,8 +16,6 @@
 
 MODULE_VERSION("");
 
-#define channelhash(x)  (irc_crc32i(x)%CHANNELHASHSIZE)
-
 unsigned long nouser;
 
 const flag cmodeflags[] = {
@@ -41,6 +39,7 @@ const flag cmodeflags[] = {
 
 void channelstats(int hooknum, void *arg);
 void sendchanburst(int hooknum, void *arg);
+static void massdelnicks(int hooknum, void *arg);
 
 void _init() {
   /* Set up the nouser marker according to our own numeric */
@@ -56,6 +55,7 @@ void _init() {
   /* Set up our hooks */
   registerhook(HOOK_NICK_NEWNICK,&addordelnick);
   registerhook(HOOK_NICK_LOSTNICK,&addordelnick);
+  registerhook(HOOK_SERVER_MASSLOSTNICKS,&massdelnicks);
   registerhook(HOOK_CORE_STATSREQUEST,&channelstats);
   registerhook(HOOK_IRC_SENDBURSTBURSTS,&sendchanburst);
   registerhook(HOOK_NICK_WHOISCHANNELS,&handlewhoischannels);
@@ -89,12 +89,13 @@ void _fini() {
   
   deregisterhook(HOOK_NICK_NEWNICK,&addordelnick);
   deregisterhook(HOOK_NICK_LOSTNICK,&addordelnick);
+  deregisterhook(HOOK_SERVER_MASSLOSTNICKS,&massdelnicks);
   deregisterhook(HOOK_CORE_STATSREQUEST,&channelstats);
   deregisterhook(HOOK_IRC_SENDBURSTBURSTS,&sendchanburst);
   deregisterhook(HOOK_NICK_WHOISCHANNELS,&handlewhoischannels);
  
   /* Free all the channels */
-  for(i=0;i<CHANNELHASHSIZE;i++) {
+  for(i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=ncip) {
       ncip=cip->next;
       if ((cp=cip->channel))
@@ -103,7 +104,7 @@ void _fini() {
   }
   
   /* We also need to remove the channels array from each user */
-  for (i=0;i<NICKHASHSIZE;i++) {
+  for (i=0;i<nicktablesize;i++) {
     for (np=nicktable[i];np;np=np->next) {
       array_free(np->channels);
       free(np->channels);
@@ -259,33 +260,25 @@ channel *findchannel(char *name) {
 
 void channelstats(int hooknum, void *arg) {
   long level=(long)arg;
-  int i,curchain,maxchain=0,total=0,buckets=0,realchans=0;
+  unsigned int i;
+  int realchans=0;
   int users=0,slots=0;
   chanindex *cip;
-  char buf[100];
+  char buf[300];
   
-  for (i=0;i<CHANNELHASHSIZE;i++) {
-    if (chantable[i]!=NULL) {
-      buckets++;
-      curchain=0;
-      for (cip=chantable[i];cip;cip=cip->next) {
-        total++;
-        curchain++;
-        if (cip->channel!=NULL) {
-          realchans++;
-          users+=cip->channel->users->totalusers;
-          slots+=cip->channel->users->hashsize;
-        }
-      } 
-      if (curchain>maxchain) {
-        maxchain=curchain;
+  for (i=0;i<chantablesize;i++) {
+    for (cip=chantable[i];cip;cip=cip->next) {
+      if (cip->channel!=NULL) {
+        realchans++;
+        users+=cip->channel->users->totalusers;
+        slots+=cip->channel->users->hashsize;
       }
     }
   }
 
   if (level>5) {
     /* Full stats */
-    sprintf(buf,"Channel : %6d channels (HASH: %6d/%6d, chain %3d)",total,buckets,CHANNELHASHSIZE,maxchain);
+    snprintf(buf,sizeof(buf),"Channel : %s",hashtable_stats(&chanhashtable));
     triggerhook(HOOK_CORE_STATSREPLY,buf);
     
     sprintf(buf,"Channel :%7d channel users, %7d slots allocated, efficiency %.1f%%",users,slots,(float)(100*users)/slots);
@@ -328,6 +321,70 @@ void addordelnick(int hooknum, void *arg) {
   }
 }
 
+/*
+ * A server has split: rather than looking each nick up in each of its
+ * channels, visit every affected channel once and sweep out everyone from
+ * that server.  The nicks' channel arrays are emptied afterwards so the
+ * per-nick LOSTNICK that follows has nothing left to do.
+ */
+
+static void massdelnicks(int hooknum, void *arg) {
+  masslostnicks *ml=(masslostnicks *)arg;
+  unsigned int marker=nextchanmarker();
+  array chans;
+  channel **ch, *cp;
+  unsigned long *lp;
+  void *args[2];
+  nick *np;
+  int i, j, slot;
+
+  array_init(&chans,sizeof(channel *));
+  array_setlim1(&chans,500);
+  array_setlim2(&chans,500);
+
+  for (i=0;i<ml->count;i++) {
+    ch=(channel **)(ml->nicks[i]->channels->content);
+    for (j=0;j<ml->nicks[i]->channels->cursi;j++) {
+      if (ch[j]->index->marker!=marker) {
+        ch[j]->index->marker=marker;
+        slot=array_getfreeslot(&chans);
+        ((channel **)chans.content)[slot]=ch[j];
+      }
+    }
+  }
+
+  ch=(channel **)chans.content;
+  for (i=0;i<chans.cursi;i++) {
+    cp=ch[i];
+    args[0]=(void *)cp;
+    for (j=0;j<cp->users->hashsize;j++) {
+      lp=&cp->users->content[j];
+      if (*lp==nouser || homeserver(*lp&CU_NUMERICMASK)!=ml->servernum)
+        continue;
+
+      if ((np=getnickbynumeric(*lp&CU_NUMERICMASK))) {
+        args[1]=(void *)np;
+        triggerhook(HOOK_CHANNEL_LOSTNICK,args);
+      }
+      *lp=nouser;
+      cp->users->totalusers--;
+    }
+  }
+
+  for (i=0;i<ml->count;i++)
+    ml->nicks[i]->channels->cursi=0;
+
+  /* Only now is it safe to free empty channels, nothing refers to them */
+  for (i=0;i<chans.cursi;i++) {
+    if (ch[i]->users->totalusers==0) {
+      triggerhook(HOOK_CHANNEL_LOSTCHANNEL,ch[i]);
+      delchannel(ch[i]);
+    }
+  }
+
+  array_free(&chans);
+}
+
 /*
  * Spam our local burst on connect..
  */
@@ -347,7 +404,7 @@ void sendchanburst(int hooknum, void *arg) {
   long modeorder[] = { 0, CUMODE_OP, CUMODE_VOICE, CUMODE_OP|CUMODE_VOICE };
   long curmode;
   
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       cp=cip->channel;
       if (cp==NULL) {
@@ -59,7 +59,7 @@ void popprofiles() {
   nick *np;
   
   /* Create the chanprofile records and count clones for each profile */
-  for (i=0;i<NICKHASHSIZE;i++) {
+  for (i=0;i<nicktablesize;i++) {
     for (np=nicktable[i];np;np=np->next) {
       cpp=getcprec(np);
       cpp->clones++;
@@ -75,7 +75,7 @@ void popprofiles() {
   }
   
   /* Populate the nick arrays */
-  for (i=0;i<NICKHASHSIZE;i++) {
+  for (i=0;i<nicktablesize;i++) {
     for (np=nicktable[i];np;np=np->next) {
       cpp=getcprec(np);
       cpp->nicks[cpp->clones++]=np;
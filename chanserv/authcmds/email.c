@@ -23,7 +23,7 @@
 #include <string.h>
 
 int csa_doemail(void *source, int cargc, char **cargv) {
-  reguser *rup, *ruh;
+  reguser *rup;
   nick *sender=source;
   maildomain *mdp, *smdp;
   char *local;
@@ -98,12 +98,7 @@ int csa_doemail(void *source, int cargc, char **cargv) {
 
   mdp=findmaildomainbydomain(local);
   if(mdp) {
-    for (ruh=mdp->users; ruh; ruh=ruh->nextbydomain) {
-      if (ruh->localpart)
-        if (!strcasecmp(dupemail, ruh->localpart->content)) {
-          found++;
-        }
-    }
+    found=countregusersbyemail(cargv[1]);
 
     if((found >= mdp->actlimit) && (mdp->actlimit > 0)) {
       free(dupemail);
@@ -116,26 +111,17 @@ int csa_doemail(void *source, int cargc, char **cargv) {
 
   csdb_createmail(rup, QMAIL_NEWEMAIL);
   csdb_accounthistory_insert(sender, NULL, NULL, rup->email?rup->email->content:NULL, cargv[1]);
-  delreguserfrommaildomain(rup,rup->domain);
 
   if(rup->lastemail)
     freesstring(rup->lastemail);
-  rup->lastemail=rup->email;
-  rup->email=getsstring(cargv[1],EMAILLEN);
+  rup->lastemail=rup->email?getsstring(rup->email->content,100):NULL;
+  setreguseremail(rup, cargv[1]);
   rup->lastemailchange=t;
-  rup->domain=findorcreatemaildomain(rup->email->content);
   if(!UHasStaffPriv(rup)) {
     rup->lockuntil=t+7*24*3600;
   } else {
     rup->lockuntil=0;
   }
-  addregusertomaildomain(rup, rup->domain);
-
-  if(local) {
-    rup->localpart=getsstring(dupemail,EMAILLEN);
-  } else {
-    rup->localpart=NULL;
-  }
   free(dupemail);
 
   chanservstdmessage(sender, QM_EMAILCHANGED, cargv[1]);
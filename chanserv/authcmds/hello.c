@@ -27,7 +27,6 @@ int csa_dohello(void *source, int cargc, char **cargv) {
   char userhost[USERLEN+HOSTLEN+2];
   maildomain *mdp, *smdp;
   char *local;
-  reguser *ruh;
   int found=0;
   char *dupemail;
   activeuser *aup;
@@ -99,12 +98,7 @@ int csa_dohello(void *source, int cargc, char **cargv) {
 
   mdp=findmaildomainbydomain(local);
   if(mdp) {
-    for (ruh=mdp->users; ruh; ruh=ruh->nextbydomain) {
-      if (ruh->localpart)
-        if (!strcasecmp(dupemail, ruh->localpart->content)) {
-          found++;
-        }
-    }
+    found=countregusersbyemail(cargv[0]);
 
     if((found >= mdp->actlimit) && (mdp->actlimit > 0)) {
       free(dupemail);
@@ -120,7 +114,7 @@ int csa_dohello(void *source, int cargc, char **cargv) {
   rup=csa_createaccount(sender->nick,"", cargv[0]);
   csa_createrandompw(rup->password, PASSLEN);
   sprintf(userhost,"%s@%s",sender->ident,sender->host->name->content);
-  rup->lastuserhost=getsstring(userhost,USERLEN+HOSTLEN+1);
+  setreguserlastuserhost(rup, userhost);
 
   chanservstdmessage(sender, QM_NEWACCOUNT, rup->username,rup->email->content);
   cs_log(sender,"HELLO OK created auth %s (%s)",rup->username,rup->email->content); 
@@ -22,40 +22,35 @@
 int csa_doreqpw(void *source, int cargc, char **cargv) {
   reguser *rup;
   nick *sender=source;
-  int i, matched = 0;
+  int matched = 0;
 
   if (cargc<1) {
     chanservstdmessage(sender, QM_NOTENOUGHPARAMS, "requestpassword");
     return CMD_ERROR;
   }
 
-  for (i=0;i<REGUSERHASHSIZE;i++) {
-    for (rup=regusernicktable[i];rup;rup=rup->nextbyname) {
-      if(!rup->email || strcasecmp(cargv[0],rup->email->content))
-        continue;
-
-      if(UHasStaffPriv(rup)) {
-        cs_log(sender,"REQUESTPASSWORD FAIL privileged email %s",cargv[0]);
-        continue;
-      }
-
-      matched = 1;
+  for (rup=findreguserbyemail(cargv[0]);rup;rup=nextreguserbyemail(rup)) {
+    if(UHasStaffPriv(rup)) {
+      cs_log(sender,"REQUESTPASSWORD FAIL privileged email %s",cargv[0]);
+      continue;
+    }
 
-      if(csa_checkthrottled(sender, rup, "REQUESTPASSWORD"))
-        continue;
+    matched = 1;
 
-      rup->lastemailchange=time(NULL);
-      csdb_updateuser(rup);
+    if(csa_checkthrottled(sender, rup, "REQUESTPASSWORD"))
+      continue;
 
-      if(rup->lastauth) {
-        csdb_createmail(rup, QMAIL_REQPW);
-      } else {
-        csdb_createmail(rup, QMAIL_NEWACCOUNT); /* user hasn't authed yet and needs to do the captcha */
-      }
+    rup->lastemailchange=time(NULL);
+    csdb_updateuser(rup);
 
-      cs_log(sender,"REQUESTPASSWORD OK username %s email %s", rup->username,rup->email->content);
-      chanservstdmessage(sender, QM_MAILQUEUED);
+    if(rup->lastauth) {
+      csdb_createmail(rup, QMAIL_REQPW);
+    } else {
+      csdb_createmail(rup, QMAIL_NEWACCOUNT); /* user hasn't authed yet and needs to do the captcha */
     }
+
+    cs_log(sender,"REQUESTPASSWORD OK username %s email %s", rup->username,rup->email->content);
+    chanservstdmessage(sender, QM_MAILQUEUED);
   }
 
   if(!matched) {
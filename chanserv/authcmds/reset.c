@@ -51,9 +51,8 @@ int csa_doreset(void *source, int cargc, char **cargv) {
 
   if(rup->lastemail) {
     csdb_accounthistory_insert(sender, rup->password, newpassword, rup->email?rup->email->content:NULL, rup->lastemail->content);
-    if(rup->email)
-      freesstring(rup->email);
-    rup->email=rup->lastemail;
+    setreguseremail(rup, rup->lastemail->content);
+    freesstring(rup->lastemail);
     rup->lastemail=NULL;
   } else {
     csdb_accounthistory_insert(sender, rup->password, newpassword, NULL, NULL);
@@ -20,8 +20,6 @@
 int csa_dosetmail(void *source, int cargc, char **cargv) {
   nick *sender=source;
   reguser *rup, *vrup = getreguserfromnick(sender);
-  char *dupemail;
-  char *local;
   char *reason;
 
   if (cargc<3) {
@@ -52,25 +50,13 @@ int csa_dosetmail(void *source, int cargc, char **cargv) {
   }
 
   csdb_accounthistory_insert(sender, NULL, NULL, rup->email?rup->email->content:NULL, cargv[1]);
-  delreguserfrommaildomain(rup,rup->domain);
-  freesstring(rup->email);
-  rup->email=getsstring(cargv[1],EMAILLEN);
+  setreguseremail(rup, cargv[1]);
   rup->lastemailchange=time(NULL);
   if(rup->lastemail) {
     freesstring(rup->lastemail);
     rup->lastemail=NULL;
   }
   rup->lockuntil=0;
-  rup->domain=findorcreatemaildomain(rup->email->content);
-  addregusertomaildomain(rup, rup->domain);
-  dupemail = strdup(rup->email->content);
-  if((local=strchr(dupemail, '@'))) {
-    *(local++)='\0';
-    rup->localpart=getsstring(dupemail,EMAILLEN);
-  } else {
-    rup->localpart=NULL;
-  }
-  free(dupemail);
 
   chanservstdmessage(sender, QM_EMAILCHANGED, cargv[1]);
   cs_log(sender,"SETEMAIL OK username %s <%s> (reason: %s)",rup->username,rup->email->content, reason);
@@ -177,14 +177,12 @@ reguser *csa_createaccount(char *username, char *password, char *email) {
   rup->suspendtime=0;
   rup->lockuntil=0;
   strncpy(rup->password,password,PASSLEN); rup->password[PASSLEN]='\0';
-  rup->email=getsstring(email,EMAILLEN);
+  rup->email=rup->localpart=NULL;
+  rup->domain=NULL;
+  setreguseremail(rup, email);
   rup->lastemail=NULL;
-
-  rup->localpart=getsstring(dupemail,EMAILLEN);
   free(dupemail);
 
-  rup->domain=findorcreatemaildomain(email);
-  addregusertomaildomain(rup, rup->domain);
   rup->info=NULL;
   rup->lastuserhost=NULL;
   rup->suspendreason=NULL;
@@ -264,9 +262,7 @@ int csa_completeauth2(reguser *rup, char *nickname, char *ident, char *hostname,
     rup->lastauth++;
 
   sprintf(userhost,"%s@%s",ident,hostname);
-  if (rup->lastuserhost)
-    freesstring(rup->lastuserhost);
-  rup->lastuserhost=getsstring(userhost,USERLEN+HOSTLEN+1);
+  setreguserlastuserhost(rup, userhost);
 
   csdb_updateuser(rup);
 
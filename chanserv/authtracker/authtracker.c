@@ -41,7 +41,7 @@ void at_dbloaded(int hooknum, void *arg) {
   if (hooknum)
     deregisterhook(HOOK_CHANSERV_RUNNING, at_dbloaded);
   
-  for (i=0;i<NICKHASHSIZE;i++) {
+  for (i=0;i<nicktablesize;i++) {
     for (np=nicktable[i];np;np=np->next) {
       at_newnick(0, np);
     }
@@ -44,7 +44,7 @@ int csc_dosuspendchanlist(void *source, int cargc, char **cargv) {
 
   /* @TIMELEN */
   chanservstdmessage(sender, QM_SUSPENDCHANLISTHEADER);
-  for (i=0; i<CHANNELHASHSIZE; i++) {
+  for (i=0; i<chantablesize; i++) {
     for (cip=chantable[i]; cip; cip=cip->next) {
       if (!(rcp=(regchan*)cip->exts[chanservext]))
         continue;
@@ -98,7 +98,7 @@ void chanserv_finalinit() {
   nick *np, *nnp;
 
   /* Scan for users */
-  for (i=0;i<NICKHASHSIZE;i++)
+  for (i=0;i<nicktablesize;i++)
     for (np=nicktable[i];np;np=nnp) {
       nnp=np->next;
       cs_checknick(np);
@@ -199,7 +199,7 @@ static void cs_hourlyfunc(void *arg) {
   regchan *rcp;
   time_t t = time(NULL);
 
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=ncip) {
       ncip=cip->next;
       if (!(rcp=cip->exts[chanservext]))
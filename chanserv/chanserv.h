@@ -608,6 +608,8 @@ typedef struct reguser {
   time_t             lastpasschange;
 
   struct reguser     *nextbydomain;
+  struct reguser     *nextbyemail;
+  struct reguser     *nextbylasthost;
   struct reguser     *nextbyname;
   struct reguser     *nextbyID;
 } reguser;
@@ -707,7 +709,7 @@ typedef struct maillock {
 #endif
 
 #define getactiveuserfromnick(x)  ((activeuser*)(x)->exts[chanservnext])
-#define getreguserfromnick(x)     ((x)->auth?(reguser *)(x)->auth->exts[chanservaext]:NULL)
+#define getreguserfromnick(x)     ((x)->auth?(reguser *)getauthnameext((x)->auth,chanservaext):NULL)
    
 /* Global variables for chanserv module */
 extern unsigned int lastuserID;
@@ -797,6 +799,12 @@ void removemaildomainfromhash(maildomain *mdp);
 void addregusertomaildomain(reguser *rup, maildomain *mdp);
 void delreguserfrommaildomain(reguser *rup, maildomain *mdp);
 reguser *findreguserbyemail(const char *email);
+reguser *nextreguserbyemail(reguser *rup);
+int countregusersbyemail(const char *email);
+reguser *findreguserbylasthost(const char *host);
+reguser *nextreguserbylasthost(reguser *rup);
+void setreguseremail(reguser *rup, const char *email);
+void setreguserlastuserhost(reguser *rup, const char *userhost);
 
 /* chanservdb.c */
 int chanservdbinit();
@@ -824,6 +832,29 @@ char *csdb_gethelpstr(char *command, int language);
 void csdb_createmail(reguser *rup, int type);
 void csdb_dohelp(nick *np, Command *cmd);
 void csdb_flushchannelcounters(void *arg);
+void csdb_loadphase(const char *name);
+void loadalltables();
+void loadmailtables();
+#ifndef CS_NODB
+void loadsomeusers(DBConn *, void *);
+void loadsomechannels(DBConn *, void *);
+void loadchanusersinit(DBConn *, void *);
+void loadsomechanusers(DBConn *, void *);
+void loadsomechanbans(DBConn *, void *);
+#endif
+
+/* chanservdb_snapshot.c */
+#define CSDB_CHANGE_USER      1
+#define CSDB_CHANGE_CHANNEL   2
+#define CSDB_CHANGE_CHANUSER  3
+#define CSDB_CHANGE_BAN       4
+
+extern regchan **allchans;
+
+int csdb_snapshotinit(void);
+void csdb_snapshotfini(void);
+void csdb_snapshotstats(long level);
+void csdb_logchange(unsigned int table, unsigned int id1, unsigned int id2);
 
 #define q9asyncquery(handler, tag, format, ...) dbasyncqueryi(q9dbid, handler, tag, format , ##__VA_ARGS__)
 #define q9a_asyncquery(handler, tag, format, ...) dbasyncqueryi(q9adbid, handler, tag, format , ##__VA_ARGS__)
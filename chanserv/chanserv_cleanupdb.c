@@ -127,7 +127,7 @@ static void cleanupdb_real(DBConn *dbconn, void *arg) {
 
   cleanuplog("Phase 2 complete, starting phase 3 (chanindex scan)...");
     
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=ncip) {
       ncip=cip->next;
       if (!(rcp=cip->exts[chanservext]))
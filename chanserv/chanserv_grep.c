@@ -1,49 +1,134 @@
 
+#define _GNU_SOURCE
+
 #include "chanserv.h"
 #include "../core/events.h"
+#include "../core/config.h"
+#include "../core/error.h"
+#include "../core/nslog.h"
 #include "../lib/irc_string.h"
-#include <pcre.h>
 #include <sys/poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
 #include <string.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include "../lib/version.h"
+#include "chanserv_grep.h"
 
 MODULE_VERSION(QVERSION)
 
-#define CSG_BUFSIZE    1024
+/*
+ * Each search is handed to a forked worker which reads the logs with a
+ * large buffer and the (JIT compiled if available) pattern, and writes the
+ * matching lines back down a pipe.  The pipe is read from the event loop,
+ * so the main process never blocks on the disk and several opers can
+ * search at once.
+ *
+ * Where the pattern contains a fixed string of at least CSG_MINLITERAL
+ * characters the worker looks for that with memmem() first, and only runs
+ * the pattern on lines which contain it.  With chanserv.grepindex set,
+ * workers also keep a trigram bitmap of each rotated logfile in
+ * data/chanservgrep so files which can't contain the string (e.g. an
+ * account name that wasn't seen that day) are skipped without being read.
+ */
+
+#define CSG_REPLYBUFSIZE     2048
 #define CSG_MAXSTARTPOINT    30
+#define CSG_MAXSEARCHES      4
+#define CSG_MAXMATCHES       500
+#define CSG_MINLITERAL       3
+
+#define CSG_INDEXDIR         "data/chanservgrep"
+#define CSG_INDEXMAGIC       0x49475343U  /* "CSGI" */
+#define CSG_INDEXMAXAGE      (60 * 86400)
+
+/* Worker -> parent line types */
+#define CSG_RMATCH           'M'
+#define CSG_RTRUNCATED       'T'
+#define CSG_REND             'E'
+
+#ifndef PCRE_STUDY_JIT_COMPILE
+#define PCRE_STUDY_JIT_COMPILE 0
+#endif
 
-pcre           *csg_curpat;        /* Compiled pattern from pcre */
-int             csg_curfile;       /* Which logfile is being searched */
-unsigned long   csg_curnum;        /* What numeric is doing a search */
-int             csg_matches;       /* How many lines have been returned so far */
-int             csg_maxmatches=0;  /* How many matches are allowed */
-int		csg_direction;     /* Log direction (0 = forward, 1 = reverse) */
-int		csg_bytesread;
+#ifndef PCRE_CONFIG_JIT
+#define pcre_free_study pcre_free
+#endif
 
-char            csg_readbuf[CSG_BUFSIZE];  /* Buffer */
-int             csg_bytesleft;     /* How much valid data there is in the buffer */
+typedef struct csgsearch {
+  pid_t pid;
+  int fd;
+  unsigned long numeric;
+  int gotend;
+  int bytesleft;
+  char readbuf[CSG_REPLYBUFSIZE];
+} csgsearch;
+
+typedef struct csgindexheader {
+  uint32_t magic;
+  uint32_t bits;
+  uint64_t size;
+  int64_t mtime;
+} csgindexheader;
+
+static csgsearch csg_searches[CSG_MAXSEARCHES];
+static int csg_useindex;
 
 void csg_handleevents(int fd, short revents);
 int csg_dogrep(void *source, int cargc, char **cargv);
 int csg_dorgrep(void *source, int cargc, char **cargv);
-int csg_execgrep(nick *sender, char *pattern);
-
-#if !defined(pread)
-extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
-#endif
+int csg_execgrep(nick *sender, char *pattern, int startfile, int direction);
 
 void _init() {
+  sstring *s;
+  int i;
+
+  for (i=0;i<CSG_MAXSEARCHES;i++)
+    csg_searches[i].fd=-1;
+
+  s=getcopyconfigitem("chanserv","grepindex","0",5);
+  csg_useindex=atoi(s->content);
+  freesstring(s);
+
+  if (csg_useindex && mkdir(CSG_INDEXDIR, 0700) < 0 && errno != EEXIST) {
+    Error("chanserv_grep",ERR_WARNING,"Unable to create %s, not indexing logs.",CSG_INDEXDIR);
+    csg_useindex=0;
+  }
+
   chanservaddcommand("grep",   QCMD_OPER, 1, csg_dogrep,   "Searches the logs.","Usage: GREP <regex>\nSearches the logs.  The current logfile will be specified first, followed by\nall older logfiles found.  This will shuffle the order of results slightly.  Where:\nregex  - regular expression to search for.\nNote: For a case insensitive search, prepend (?i) to the regex.");
   chanservaddcommand("rgrep",  QCMD_OPER, 2, csg_dorgrep,  "Searches the logs in reverse order.","Usage: RGREP <days> <regex>\nSearches the logs.  The oldest specified log will be specified first meaning\nthat all events returned will be in strict chronological order. Where:\ndays  - number of days of history to search\nregex - regex to search for\nNote: For a case insensitive search, prepend (?i) to the regex.");
 }
 
+static void csg_endsearch(csgsearch *sp) {
+  deregisterhandler(sp->fd, 1);
+  sp->fd=-1;
+
+  if (sp->pid>0) {
+    if (!sp->gotend)
+      kill(sp->pid, SIGTERM);
+    waitpid(sp->pid, NULL, 0);
+  }
+  sp->pid=0;
+}
+
 void _fini() {
+  int i;
+
+  for (i=0;i<CSG_MAXSEARCHES;i++)
+    if (csg_searches[i].fd!=-1)
+      csg_endsearch(&csg_searches[i]);
+
   chanservremovecommand("grep", csg_dogrep);
   chanservremovecommand("rgrep", csg_dorgrep);
 }
@@ -60,13 +145,10 @@ int csg_dogrep(void *source, int cargc, char **cargv) {
     return CMD_ERROR;
   }
 
-  csg_curfile=0;
-  csg_direction=0;
-
   chanservwallmessage("%s (%s) used GREP %s", sender->nick, rup->username, cargv[0]);
   cs_log(sender, "GREP %s", cargv[0]);
 
-  return csg_execgrep(sender, cargv[0]);
+  return csg_execgrep(sender, cargv[0], 0, 0);
 }
 
 int csg_dorgrep(void *source, int cargc, char **cargv) {
@@ -100,140 +182,519 @@ int csg_dorgrep(void *source, int cargc, char **cargv) {
   chanservwallmessage("%s (%s) used RGREP %s %s", sender->nick, rup->username, cargv[0], cargv[1]);
   cs_log(sender, "RGREP %s %s", cargv[0], cargv[1]);
 
-  csg_curfile=startpoint;
-  csg_direction=1;
-  return csg_execgrep(sender, cargv[1]);
+  return csg_execgrep(sender, cargv[1], startpoint, 1);
+}
+
+static void csg_filename(char *buf, size_t len, int n) {
+  if (n)
+    snprintf(buf, len, "chanservlog.%d", n);
+  else
+    snprintf(buf, len, "chanservlog");
+}
+
+/* Escapes which match one thing (or nothing) and take no operand */
+#define CSG_SIMPLEESCAPES    "dDwWsSbBhHvVRXAzZGKntrefa"
+
+/* Length of the {m}, {m,} or {m,n} at p, 0 if it isn't a quantifier */
+static int csg_quantifierlen(const char *p) {
+  const char *q=p+1;
+
+  if (!isdigit((unsigned char)*q))
+    return 0;
+
+  while (isdigit((unsigned char)*q))
+    q++;
+
+  if (*q==',')
+    for (q++;isdigit((unsigned char)*q);q++)
+      ;
+
+  return *q=='}' ? q-p+1 : 0;
+}
+
+/*
+ * Picks out the longest run of characters any match must contain.  Gives
+ * up on anything with alternation, optional groups, inline options other
+ * than a leading (?i), \Q...\E quoting or escapes with operands (\x41,
+ * \101, \1, \p{L} and so on) -- it's only an optimisation, and getting it
+ * wrong makes GREP silently miss lines.
+ */
+void csg_findliteral(csgquery *qp, const char *pattern) {
+  char run[256];
+  int runlen=0;
+  const char *p=pattern, *e;
+
+  qp->literallen=0;
+  qp->caseless=0;
+
+  if (!strncmp(p, "(?i)", 4)) {
+    qp->caseless=1;
+    p+=4;
+  }
+
+  if (strchr(p, '|') || strstr(p, "(?") || strstr(p, "(*") || strstr(p, ")?") || strstr(p, ")*") || strstr(p, "){") || strstr(p, "\\Q"))
+    return;
+
+  for (;;) {
+    int c=(unsigned char)*p, lit=-1, skip=1;
+
+    if (c=='\\' && p[1]) {
+      /* \d, \w, \b and friends aren't literals, escaped punctuation is */
+      if (!isalnum((unsigned char)p[1]))
+        lit=(unsigned char)p[1];
+      else if (!strchr(CSG_SIMPLEESCAPES, p[1]))
+        goto giveup;
+      skip=2;
+    } else if (c=='{') {
+      /* Counts on something which wasn't a literal, e.g. [a-z]{2,3} */
+      if (!(skip=csg_quantifierlen(p)))
+        goto giveup;
+    } else if (c && !strchr(".^$[]()*+?}", c)) {
+      lit=c;
+    }
+
+    /* A following ?, * or {0 makes this character optional */
+    if (lit!=-1 && (p[skip]=='?' || p[skip]=='*' || p[skip]=='{'))
+      lit=-1;
+
+    if (lit!=-1 && runlen < sizeof(run)-1) {
+      run[runlen++]=qp->caseless ? tolower(lit) : lit;
+      if (p[skip]!='+') {
+        p+=skip;
+        continue;
+      }
+    }
+
+    if (runlen > qp->literallen) {
+      memcpy(qp->literal, run, runlen);
+      qp->literallen=runlen;
+    }
+    runlen=0;
+
+    if (!c)
+      break;
+
+    /* Skip character classes entirely, including any [:alpha:] in them */
+    if (c=='[') {
+      p++;
+      if (*p=='^')
+        p++;
+      if (*p==']')
+        p++;
+      while (*p && *p!=']') {
+        if (*p=='[' && p[1]==':' && (e=strstr(p+2, ":]")))
+          p=e+2;
+        else
+          p+=(*p=='\\' && p[1]) ? 2 : 1;
+      }
+      if (*p)
+        p++;
+      continue;
+    }
+
+    p+=skip;
+  }
+
+  if (qp->literallen >= CSG_MINLITERAL)
+    return;
+
+giveup:
+  qp->literallen=0;
+}
+
+static inline unsigned int csg_trigram(unsigned char a, unsigned char b, unsigned char c) {
+  return (((uint32_t)a << 16 | (uint32_t)b << 8 | c) * 2654435761U) >> (32 - CSG_INDEXBITS);
+}
+
+static void csg_indexpath(char *buf, size_t len, struct stat *st) {
+  snprintf(buf, len, "%s/%llu-%llu.idx", CSG_INDEXDIR, (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+}
+
+int csg_bitmapexcludes(csgquery *qp, unsigned char *bitmap) {
+  int i;
+
+  for (i=0;i+2<qp->literallen;i++) {
+    unsigned int t=csg_trigram(tolower((unsigned char)qp->literal[i]), tolower((unsigned char)qp->literal[i+1]), tolower((unsigned char)qp->literal[i+2]));
+    if (!(bitmap[t >> 3] & (1 << (t & 7))))
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Returns 1 if the index says the file can't contain the literal, 0 if it might or there's no index */
+static int csg_indexexcludes(csgquery *qp, struct stat *st) {
+  unsigned char *bitmap;
+  csgindexheader hdr;
+  char path[PATH_MAX];
+  int fd, excluded=0;
+
+  csg_indexpath(path, sizeof(path), st);
+  if ((fd=open(path, O_RDONLY))<0)
+    return 0;
+
+  if (read(fd, &hdr, sizeof(hdr))!=sizeof(hdr) || hdr.magic!=CSG_INDEXMAGIC || hdr.bits!=CSG_INDEXBITS ||
+      hdr.size!=(uint64_t)st->st_size || hdr.mtime!=(int64_t)st->st_mtime || !(bitmap=malloc(CSG_INDEXSIZE))) {
+    close(fd);
+    return 0;
+  }
+
+  if (read(fd, bitmap, CSG_INDEXSIZE)==CSG_INDEXSIZE)
+    excluded=csg_bitmapexcludes(qp, bitmap);
+
+  free(bitmap);
+  close(fd);
+
+  return excluded;
+}
+
+void csg_indexadd(unsigned char *bitmap, unsigned char *last, const char *buf, int len) {
+  int i;
+
+  for (i=0;i<len;i++) {
+    unsigned int t;
+
+    last[0]=last[1];
+    last[1]=last[2];
+    last[2]=tolower((unsigned char)buf[i]);
+    t=csg_trigram(last[0], last[1], last[2]);
+    bitmap[t >> 3] |= 1 << (t & 7);
+  }
+}
+
+/* Also clears out indexes for files which have long since been rotated away */
+static void csg_indexsave(unsigned char *bitmap, struct stat *st) {
+  csgindexheader hdr;
+  char path[PATH_MAX], tmppath[PATH_MAX];
+  struct dirent *de;
+  struct stat ist;
+  time_t now=time(NULL);
+  DIR *dir;
+  int fd;
+
+  csg_indexpath(path, sizeof(path), st);
+  if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= sizeof(tmppath))
+    return;
+
+  hdr.magic=CSG_INDEXMAGIC;
+  hdr.bits=CSG_INDEXBITS;
+  hdr.size=st->st_size;
+  hdr.mtime=st->st_mtime;
+
+  if ((fd=open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0600))<0)
+    return;
+
+  if (write(fd, &hdr, sizeof(hdr))!=sizeof(hdr) || write(fd, bitmap, CSG_INDEXSIZE)!=CSG_INDEXSIZE) {
+    close(fd);
+    unlink(tmppath);
+    return;
+  }
+
+  close(fd);
+  rename(tmppath, path);
+
+  if (!(dir=opendir(CSG_INDEXDIR)))
+    return;
+
+  while ((de=readdir(dir))) {
+    if (de->d_name[0]=='.')
+      continue;
+
+    if (snprintf(path, sizeof(path), "%s/%s", CSG_INDEXDIR, de->d_name) >= sizeof(path))
+      continue;
+
+    if (!stat(path, &ist) && now - ist.st_mtime > CSG_INDEXMAXAGE)
+      unlink(path);
+  }
+
+  closedir(dir);
+}
+
+static int csg_reply(int fd, char type, const char *line, int len) {
+  char buf[CSG_REPLYBUFSIZE];
+
+  if (len > CSG_REPLYBUFSIZE-3)
+    len=CSG_REPLYBUFSIZE-3;
+
+  buf[0]=type;
+  memcpy(buf+1, line, len);
+  buf[len+1]='\n';
+  len+=2;
+
+  return write(fd, buf, len)==len;
+}
+
+/* Runs the pattern over the complete lines in buf, returns 0 once we should stop */
+static int csg_scanlines(csgquery *qp, int wfd, char *buf, int len, int *matches) {
+  char *pos=buf, *end=buf+len, *linestart, *lineend;
+
+  while (pos < end) {
+    if (qp->literallen && !qp->caseless) {
+      char *hit=memmem(pos, end-pos, qp->literal, qp->literallen);
+
+      if (!hit)
+        return 1;
+
+      for (linestart=hit;linestart>pos && linestart[-1]!='\n';linestart--)
+        ;
+    } else {
+      linestart=pos;
+    }
+
+    if (!(lineend=memchr(linestart, '\n', end-linestart)))
+      lineend=end;
+    pos=lineend+1;
+
+    if (lineend>linestart && lineend[-1]=='\r')
+      lineend--;
+
+    if (lineend==linestart || pcre_exec(qp->pat, qp->extra, linestart, lineend-linestart, 0, 0, NULL, 0) < 0)
+      continue;
+
+    if (!csg_reply(wfd, CSG_RMATCH, linestart, lineend-linestart))
+      return 0;
+
+    if (++(*matches) >= CSG_MAXMATCHES) {
+      csg_reply(wfd, CSG_RTRUNCATED, "", 0);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Returns 0 once we should stop */
+int csg_scanfile(csgquery *qp, int wfd, int fd, int n, char *buf, int *matches) {
+  unsigned char *bitmap=NULL, last[3]={ 0, 0, 0 };
+  struct stat st;
+  int res, left=0, i, ret=1;
+
+  if (fstat(fd, &st))
+    return 1;
+
+  /* The live log is still growing, only rotated ones are indexed */
+  if (csg_useindex && n>0) {
+    if (qp->literallen && csg_indexexcludes(qp, &st))
+      return 1;
+    bitmap=calloc(1, CSG_INDEXSIZE);
+  }
+
+  for (;;) {
+    res=read(fd, buf+left, CSG_BUFSIZE-left);
+    if (res<0 && errno==EINTR)
+      continue;
+
+    if (res<=0) {
+      /* Whatever is left is an unterminated last line */
+      if (left && !(ret=csg_scanlines(qp, wfd, buf, left, matches)))
+        break;
+      if (bitmap && res==0)
+        csg_indexsave(bitmap, &st);
+      break;
+    }
+
+    if (bitmap)
+      csg_indexadd(bitmap, last, buf+left, res);
+
+    left+=res;
+
+    for (i=left;i>0 && buf[i-1]!='\n';i--)
+      ;
+
+    /* No newline in a full buffer, treat it as one line */
+    if (!i && left==CSG_BUFSIZE)
+      i=left;
+
+    if (!(ret=csg_scanlines(qp, wfd, buf, i, matches)))
+      break;
+
+    left-=i;
+    memmove(buf, buf+i, left);
+  }
+
+  free(bitmap);
+  return ret;
 }
 
-int csg_execgrep(nick *sender, char *pattern) {
+static void csg_worker(csgquery *qp, int wfd) {
+  char filename[50];
+  char *buf;
+  int fd, matches=0;
+
+  /* Don't let a crash in here run the parent's core handlers */
+  signal(SIGSEGV, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  if (!(buf=malloc(CSG_BUFSIZE)))
+    _exit(1);
+
+  for (;;) {
+    csg_filename(filename, sizeof(filename), qp->curfile);
+    if ((fd=open(filename, O_RDONLY))<0)
+      break;
+
+    if (!csg_scanfile(qp, wfd, fd, qp->curfile, buf, &matches)) {
+      close(fd);
+      _exit(0);
+    }
+    close(fd);
+
+    if (qp->direction==0)
+      qp->curfile++;
+    else if (--qp->curfile<0)
+      break;
+  }
+
+  csg_reply(wfd, CSG_REND, "", 0);
+  _exit(0);
+}
+
+int csg_execgrep(nick *sender, char *pattern, int startfile, int direction) {
   const char *errptr;
   int erroffset;
-  int fd;
+  csgsearch *sp=NULL;
+  csgquery q;
   char filename[50];
+  int i, fds[2];
+  pid_t pid;
 
-  if (csg_maxmatches>0) {
+  for (i=0;i<CSG_MAXSEARCHES;i++) {
+    if (csg_searches[i].fd==-1) {
+      sp=&csg_searches[i];
+      break;
+    }
+  }
+
+  if (!sp) {
     chanservsendmessage(sender, "Sorry, the grepper is currently busy - try later.");
     return CMD_ERROR;
   }
 
-  if (!(csg_curpat=pcre_compile(pattern, 0, &errptr, &erroffset, NULL))) {
+  if (startfile==0) {
+    /* Make sure the current file has everything we've logged so far */
+    nslogflushall(1);
+  }
+
+  csg_filename(filename, sizeof(filename), startfile);
+  if (access(filename, R_OK)) {
+    chanservsendmessage(sender, "Unable to open logfile.");
+    return CMD_ERROR;
+  }
+
+  if (!(q.pat=pcre_compile(pattern, 0, &errptr, &erroffset, NULL))) {
     chanservsendmessage(sender, "Error in pattern at character %d: %s",erroffset,errptr);
     return CMD_ERROR;
   }
 
-  if (csg_direction==0 || csg_curfile==0) {
-    if ((fd=open("chanservlog",O_RDONLY))<0) {
-      chanservsendmessage(sender, "Unable to open logfile.");
-      free(csg_curpat);    
-      return CMD_ERROR;
-    }
-  } else {
-    sprintf(filename,"chanservlog.%d",csg_curfile);
-    if ((fd=open(filename,O_RDONLY))<0) {
-      chanservsendmessage(sender, "Unable to open logfile.");
-      free(csg_curpat);    
-      return CMD_ERROR;
-    }
+  q.extra=pcre_study(q.pat, PCRE_STUDY_JIT_COMPILE, &errptr);
+  q.curfile=startfile;
+  q.direction=direction;
+  csg_findliteral(&q, pattern);
+
+  if (pipe(fds)) {
+    Error("chanserv_grep",ERR_WARNING,"Unable to create pipe for grep (%d).",errno);
+    chanservsendmessage(sender, "Sorry, unable to start grep - try later.");
+    goto out;
   }
 
-  /* Initialise stuff for the match */
-  csg_maxmatches=500;
-  csg_matches=0;
-  csg_curnum=sender->numeric;
-  csg_bytesleft=0;
-  csg_bytesread=0;
+  if ((pid=fork())<0) {
+    Error("chanserv_grep",ERR_WARNING,"Unable to fork grep worker (%d).",errno);
+    chanservsendmessage(sender, "Sorry, unable to start grep - try later.");
+    close(fds[0]);
+    close(fds[1]);
+    goto out;
+  }
 
-  registerhandler(fd, POLLIN, csg_handleevents);
+  if (!pid) {
+    close(fds[0]);
+    csg_worker(&q, fds[1]);
+  }
+
+  close(fds[1]);
+
+  sp->pid=pid;
+  sp->fd=fds[0];
+  sp->numeric=sender->numeric;
+  sp->gotend=0;
+  sp->bytesleft=0;
+
+  registerhandler(sp->fd, POLLIN, csg_handleevents);
   chanservsendmessage(sender, "Started grep for %s...",pattern);
 
-  return CMD_OK;
+out:
+  if (q.extra)
+    pcre_free_study(q.extra);
+  pcre_free(q.pat);
+
+  return sp->fd==-1 ? CMD_ERROR : CMD_OK;
+}
+
+static void csg_handleline(csgsearch *sp, nick *np, char *line) {
+  switch(*line) {
+    case CSG_RMATCH:
+      chanservsendmessage(np, "%s", line+1);
+      break;
+
+    case CSG_RTRUNCATED:
+      chanservstdmessage(np, QM_TRUNCATED, CSG_MAXMATCHES);
+      chanservstdmessage(np, QM_ENDOFLIST);
+      sp->gotend=1;
+      break;
+
+    case CSG_REND:
+      chanservstdmessage(np, QM_ENDOFLIST);
+      sp->gotend=1;
+      break;
+  }
 }
 
 void csg_handleevents(int fd, short revents) {
-  int res;
-  nick *np=getnickbynumeric(csg_curnum);
-  char *chp, *linestart;
-  char filename[50];
-  off_t pos;
+  csgsearch *sp=NULL;
+  char *linestart, *lineend;
+  nick *np;
+  int i, res;
+
+  for (i=0;i<CSG_MAXSEARCHES;i++) {
+    if (csg_searches[i].fd==fd) {
+      sp=&csg_searches[i];
+      break;
+    }
+  }
 
-  /* If the target user has vanished, drop everything */
-  if (!np) {
+  if (!sp) {
     deregisterhandler(fd, 1);
-    free(csg_curpat);
-    csg_maxmatches=0;
     return;
   }
 
-retry:
-  res=read(fd, csg_readbuf+csg_bytesleft, CSG_BUFSIZE-csg_bytesleft);
-  
+  /* If the target user has vanished, drop everything */
+  if (!(np=getnickbynumeric(sp->numeric))) {
+    csg_endsearch(sp);
+    return;
+  }
+
+  res=read(fd, sp->readbuf+sp->bytesleft, CSG_REPLYBUFSIZE-sp->bytesleft);
+  if (res<0 && (errno==EINTR || errno==EAGAIN))
+    return;
+
   if (res<=0) {
-/*    chanservsendmessage(np, "Closing file: res=%d, errno=%d(%s), bytes read=%d",res,errno,sys_errlist[errno],csg_bytesread); */
-    /* End of file (or error) */
-    deregisterhandler(fd, 1);
-    if (csg_direction==0) {
-      sprintf(filename,"chanservlog.%d",++csg_curfile);
-    } else {
-      csg_curfile--;
-      if (csg_curfile<0) {
-        chanservstdmessage(np, QM_ENDOFLIST);
-        free(csg_curpat);
-        csg_maxmatches=0;
-        return;
-      } else if (csg_curfile==0) {
-        sprintf(filename,"chanservlog");
-      } else {
-        sprintf(filename,"chanservlog.%d",csg_curfile);
-      }
-    }
-    if ((fd=open(filename,O_RDONLY))>=0) {
-      /* Found the next file */
-      registerhandler(fd, POLLIN, csg_handleevents);
-    } else {
+    /* Worker went away without saying it had finished */
+    if (!sp->gotend) {
+      sp->gotend=1;
       chanservstdmessage(np, QM_ENDOFLIST);
-      free(csg_curpat);
-      csg_maxmatches=0;
     }
-
+    csg_endsearch(sp);
     return;
   }
 
-  csg_bytesread+=res;
-
-  linestart=chp=csg_readbuf;
-  csg_bytesleft+=res;
-  
-  while (csg_bytesleft) {
-    csg_bytesleft--;
-    if (*chp=='\r' || *chp=='\n' || *chp=='\0') {
-      if (linestart==chp) {
-	linestart=(++chp);
-      } else {
-	*chp++='\0';
-	if (!pcre_exec(csg_curpat, NULL, linestart, strlen(linestart), 0, 0, NULL, 0)) {
-	  chanservsendmessage(np, "%s", linestart);
-	  if (++csg_matches >= csg_maxmatches) {
-	    chanservstdmessage(np, QM_TRUNCATED, csg_maxmatches);
-	    chanservstdmessage(np, QM_ENDOFLIST);
-	    free(csg_curpat);
-	    deregisterhandler(fd, 1);
-	    csg_maxmatches=0;
-	  } 
-	}
-	linestart=chp;
-      }
-    } else {
-      chp++;
-    }
+  sp->bytesleft+=res;
+  linestart=sp->readbuf;
+
+  while ((lineend=memchr(linestart, '\n', sp->bytesleft-(linestart-sp->readbuf)))) {
+    *lineend='\0';
+    csg_handleline(sp, np, linestart);
+    linestart=lineend+1;
   }
-  
-  csg_bytesleft=(chp-linestart);
-  memmove(csg_readbuf, linestart, csg_bytesleft);
-  
-  /* BSD hack */
-  pos=lseek(fd, 0, SEEK_CUR);
-  if (!pread(fd, csg_readbuf+csg_bytesleft, 1, pos)) {
-    /* EOF */
-    goto retry;
-  }    
+
+  sp->bytesleft-=(linestart-sp->readbuf);
+  memmove(sp->readbuf, linestart, sp->bytesleft);
 }
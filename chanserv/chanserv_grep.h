@@ -0,0 +1,26 @@
+#ifndef __CHANSERV_GREP_H
+#define __CHANSERV_GREP_H
+
+#include <pcre.h>
+
+#define CSG_BUFSIZE          65536
+#define CSG_INDEXBITS        20
+#define CSG_INDEXSIZE        ((1 << CSG_INDEXBITS) / 8)
+
+typedef struct csgquery {
+  pcre *pat;
+  pcre_extra *extra;
+  char literal[256];
+  int literallen;
+  int caseless;
+  int curfile;
+  int direction;              /* 0 = forward, 1 = reverse */
+} csgquery;
+
+/* Exposed for chanserv_greptest */
+void csg_findliteral(csgquery *qp, const char *pattern);
+int csg_bitmapexcludes(csgquery *qp, unsigned char *bitmap);
+void csg_indexadd(unsigned char *bitmap, unsigned char *last, const char *buf, int len);
+int csg_scanfile(csgquery *qp, int wfd, int fd, int n, char *buf, int *matches);
+
+#endif
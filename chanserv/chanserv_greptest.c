@@ -0,0 +1,133 @@
+/*
+ * chanserv_greptest: checks the GREP literal prefilter and trigram index
+ * against a plain pattern scan.
+ *
+ * Runs once when loaded: each test pattern is run over a canned log with
+ * and without the prefilter and index, and any pattern where the two
+ * disagree is logged as an error.  Unload it again afterwards, it does
+ * nothing else.
+ */
+
+#include "chanserv.h"
+#include "chanserv_grep.h"
+#include "../core/error.h"
+#include "../core/schedule.h"
+#include "../lib/version.h"
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+MODULE_VERSION(QVERSION)
+
+/*
+ * Patterns the literal extractor has got wrong before, and lines which
+ * match them without containing what it used to pick out.
+ */
+static const char *csgt_log=
+  "abbcd\n"
+  "abcabc\n"
+  "fooAbar\n"
+  "FOOABAR\n"
+  "abcZ\n"
+  "xxyz\n"
+  "wxy\n"
+  "123\n"
+  "\001bcd\n";
+
+static const char *csgt_patterns[]={
+  "ab{2,3}cd",
+  "[a-c]{3,10}$",
+  "foo\\x41bar",
+  "foo\\101bar",
+  "foo\\o{101}bar",
+  "(?i)foo\\x41bar",
+  "abc\\p{Latin}",
+  "(x)\\1yz",
+  "w\\Qxyz\\E?",
+  "^[[:digit:]xyz]+$",
+  "(*UCP)abc",
+  "\\cAbcd",
+  "(?i)fooabar",
+  "ab+cd",
+  NULL
+};
+
+static void csgt_run(void *arg);
+
+void _init(void) {
+  scheduleoneshot(time(NULL), &csgt_run, NULL);
+}
+
+void _fini(void) {
+  deleteschedule(NULL, &csgt_run, NULL);
+}
+
+/* Scans the test log as a worker would, returns the length of what it would have sent */
+static int csgt_scan(csgquery *qp, int fd, char *buf, char *out, int outlen) {
+  FILE *fp;
+  int matches=0, len;
+
+  if (!(fp=tmpfile()))
+    return -1;
+
+  lseek(fd, 0, SEEK_SET);
+  csg_scanfile(qp, fileno(fp), fd, 0, buf, &matches);
+  lseek(fileno(fp), 0, SEEK_SET);
+  len=read(fileno(fp), out, outlen);
+  fclose(fp);
+
+  return len;
+}
+
+static void csgt_run(void *arg) {
+  unsigned char *bitmap, last[3]={ 0, 0, 0 };
+  char *buf, filtered[1024], unfiltered[1024];
+  const char *errptr;
+  int i, erroffset, flen, ulen, excluded, tested=0, failed=0;
+  csgquery q;
+  FILE *fp;
+
+  buf=malloc(CSG_BUFSIZE);
+  bitmap=calloc(1, CSG_INDEXSIZE);
+  fp=tmpfile();
+
+  if (!buf || !bitmap || !fp || write(fileno(fp), csgt_log, strlen(csgt_log))!=strlen(csgt_log)) {
+    Error("chanserv_greptest",ERR_ERROR,"Unable to set up the test log.");
+    goto out;
+  }
+
+  csg_indexadd(bitmap, last, csgt_log, strlen(csgt_log));
+
+  for (i=0;csgt_patterns[i];i++) {
+    /* e.g. \o{} or \p{} on an older or non-unicode libpcre */
+    if (!(q.pat=pcre_compile(csgt_patterns[i], 0, &errptr, &erroffset, NULL))) {
+      Error("chanserv_greptest",ERR_INFO,"Skipping %s, libpcre doesn't support it.",csgt_patterns[i]);
+      continue;
+    }
+
+    q.extra=NULL;
+    csg_findliteral(&q, csgt_patterns[i]);
+
+    excluded=q.literallen && csg_bitmapexcludes(&q, bitmap);
+    flen=excluded ? 0 : csgt_scan(&q, fileno(fp), buf, filtered, sizeof(filtered));
+    q.literallen=0;
+    ulen=csgt_scan(&q, fileno(fp), buf, unfiltered, sizeof(unfiltered));
+
+    pcre_free(q.pat);
+
+    tested++;
+    if (flen!=ulen || memcmp(filtered, unfiltered, ulen>0 ? ulen : 0)) {
+      Error("chanserv_greptest",ERR_ERROR,"Prefilter%s misses lines matching %s.",excluded ? " index" : "",csgt_patterns[i]);
+      failed++;
+    }
+  }
+
+  Error("chanserv_greptest",failed ? ERR_ERROR : ERR_INFO,"%d/%d patterns passed.",tested-failed,tested);
+
+out:
+  if (fp)
+    fclose(fp);
+  free(bitmap);
+  free(buf);
+}
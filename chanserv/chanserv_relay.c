@@ -377,8 +377,7 @@ int csa_dosettempemail(void *source, int cargc, char **cargv) {
     return CMD_ERROR;
   }
 
-  freesstring(rup->email);
-  rup->email=getsstring(email,EMAILLEN);
+  setreguseremail(rup, email);
   cs_log(sender,"SETTEMPEMAIL OK username %s email %s",rup->username, rup->email->content);
 
   csdb_updateuser(rup);
@@ -435,8 +434,7 @@ int csa_dosetemail(void *source, int cargc, char **cargv) {
     return CMD_ERROR;
   }
 
-  freesstring(rup->email);
-  rup->email=getsstring(email,EMAILLEN);
+  setreguseremail(rup, email);
   cs_log(sender,"SETEMAIL OK username %s email %s",rup->username, rup->email->content);
 
   csdb_updateuser(rup);
@@ -19,12 +19,15 @@
 void csdb_updateauthinfo(reguser *rup) {
   char eschost[2*HOSTLEN+1];
 
+  csdb_logchange(CSDB_CHANGE_USER, rup->ID, 0);
+
   dbescapestring(eschost,rup->lastuserhost->content,rup->lastuserhost->length);
   dbquery("UPDATE chanserv.users SET lastauth=%lu,lastuserhost='%s' WHERE ID=%u",
 		  rup->lastauth,eschost,rup->ID);
 }
 
 void csdb_updatelastjoin(regchanuser *rcup) {
+  csdb_logchange(CSDB_CHANGE_CHANUSER, rcup->user->ID, rcup->chan->ID);
   dbquery("UPDATE chanserv.chanusers SET usetime=%lu WHERE userID=%u and channelID=%u",
 	  rcup->usetime, rcup->user->ID, rcup->chan->ID);
 }
@@ -32,6 +35,8 @@ void csdb_updatelastjoin(regchanuser *rcup) {
 void csdb_updatetopic(regchan *rcp) {
   char esctopic[TOPICLEN*2+5];
 
+  csdb_logchange(CSDB_CHANGE_CHANNEL, rcp->ID, 0);
+
   if (rcp->topic) {
     dbescapestring(esctopic,rcp->topic->content,rcp->topic->length);
   } else {
@@ -48,6 +53,8 @@ void csdb_updatechannel(regchan *rcp) {
   char esccomment[510];
   char escname[1000];
 
+  csdb_logchange(CSDB_CHANGE_CHANNEL, rcp->ID, 0);
+
   dbescapestring(escname, rcp->index->name->content, rcp->index->name->length);
 
   if (rcp->welcome) 
@@ -116,6 +123,8 @@ void csdb_flushchannelcounters(void *arg) {
 }
 
 void csdb_updatechannelcounters(regchan *rcp) {
+  csdb_logchange(CSDB_CHANGE_CHANNEL, rcp->ID, 0);
+
   if(channelcounter_count == CHANNELCOUNTER_MAX)
     csdb_flushchannelcounters(NULL);
 
@@ -132,6 +141,7 @@ void csdb_updatechannelcounters(regchan *rcp) {
 }
 
 void csdb_updatechanneltimestamp(regchan *rcp) {
+  csdb_logchange(CSDB_CHANGE_CHANNEL, rcp->ID, 0);
   dbquery("UPDATE chanserv.channels SET "
 		  "lasttimestamp=%jd WHERE ID=%u",
 		  (intmax_t)rcp->ltimestamp, rcp->ID);
@@ -145,6 +155,8 @@ void csdb_createchannel(regchan *rcp) {
   char esccomment[510];
   char escname[510];
 
+  csdb_logchange(CSDB_CHANGE_CHANNEL, rcp->ID, 0);
+
   dbescapestring(escname, rcp->index->name->content, rcp->index->name->length);
 
   if (rcp->welcome) 
@@ -191,12 +203,14 @@ void csdb_createchannel(regchan *rcp) {
 }
 
 void csdb_deletechannel(regchan *rcp) {
+  csdb_logchange(CSDB_CHANGE_CHANNEL, rcp->ID, 0);
   dbquery("DELETE FROM chanserv.channels WHERE ID=%u",rcp->ID);
   dbquery("DELETE FROM chanserv.chanusers WHERE channelID=%u",rcp->ID);
   dbquery("DELETE FROM chanserv.bans WHERE channelID=%u",rcp->ID);
 }
 
 void csdb_deleteuser(reguser *rup) {
+  csdb_logchange(CSDB_CHANGE_USER, rup->ID, 0);
   dbquery("DELETE FROM chanserv.users WHERE ID=%u",rup->ID);
   dbquery("DELETE FROM chanserv.chanusers WHERE userID=%u",rup->ID);
 }
@@ -210,6 +224,8 @@ void csdb_updateuser(reguser *rup) {
   char escinfo[210];
   char esclastemail[210];
 
+  csdb_logchange(CSDB_CHANGE_USER, rup->ID, 0);
+
   dbescapestring(escpassword, rup->password, strlen(rup->password));
    
   if (rup->email)
@@ -262,6 +278,8 @@ void csdb_createuser(reguser *rup) {
   char escinfo[210];
   char esclastemail[210];
 
+  csdb_logchange(CSDB_CHANGE_USER, rup->ID, 0);
+
   dbescapestring(escusername, rup->username, strlen(rup->username));
   dbescapestring(escpassword, rup->password, strlen(rup->password));
   
@@ -309,6 +327,8 @@ void csdb_createuser(reguser *rup) {
 void csdb_updatechanuser(regchanuser *rcup) {
   char escinfo[210];
 
+  csdb_logchange(CSDB_CHANGE_CHANUSER, rcup->user->ID, rcup->chan->ID);
+
   if (rcup->info) 
     dbescapestring(escinfo, rcup->info->content, rcup->info->length);
   else
@@ -322,6 +342,8 @@ void csdb_updatechanuser(regchanuser *rcup) {
 void csdb_createchanuser(regchanuser *rcup) {
   char escinfo[210];
 
+  csdb_logchange(CSDB_CHANGE_CHANUSER, rcup->user->ID, rcup->chan->ID);
+
   if (rcup->info) 
     dbescapestring(escinfo, rcup->info->content, rcup->info->length);
   else
@@ -333,6 +355,7 @@ void csdb_createchanuser(regchanuser *rcup) {
 }
 
 void csdb_deletechanuser(regchanuser *rcup) {
+  csdb_logchange(CSDB_CHANGE_CHANUSER, rcup->user->ID, rcup->chan->ID);
   dbquery("DELETE FROM chanserv.chanusers WHERE channelid=%u AND userID=%u",
 		  rcup->chan->ID, rcup->user->ID);
 }
@@ -342,6 +365,8 @@ void csdb_createban(regchan *rcp, regban *rbp) {
   char banstr[100];
   char escban[200];
 
+  csdb_logchange(CSDB_CHANGE_BAN, rbp->ID, 0);
+
   strcpy(banstr,bantostring(rbp->cbp));
   dbescapestring(escban,banstr,strlen(banstr));
   
@@ -360,6 +385,8 @@ void csdb_updateban(regchan *rcp, regban *rbp) {
   char banstr[100];
   char escban[200];
 
+  csdb_logchange(CSDB_CHANGE_BAN, rbp->ID, 0);
+
   strcpy(banstr,bantostring(rbp->cbp));
   dbescapestring(escban,banstr,strlen(banstr));
   
@@ -373,6 +400,7 @@ void csdb_updateban(regchan *rcp, regban *rbp) {
 }
 
 void csdb_deleteban(regban *rbp) {
+  csdb_logchange(CSDB_CHANGE_BAN, rbp->ID, 0);
   dbquery("DELETE FROM chanserv.bans WHERE banID=%u", rbp->ID);
 }
 
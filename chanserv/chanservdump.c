@@ -26,7 +26,7 @@ int dumplastjoindata(const char *filename) {
     return 1;
   }
     
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if (!(rcp=cip->exts[chanservext]))
 	continue;
@@ -74,7 +74,7 @@ int readlastjoindata(const char *filename) {
   /* Set up the allchans and allusers arrays */
   allchans=(regchan **)malloc((lastchannelID+1)*sizeof(regchan *));
   memset(allchans,0,(lastchannelID+1)*sizeof(regchan *));
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if ((rcp=cip->exts[chanservext]))
 	allchans[rcp->ID]=cip->exts[chanservext];
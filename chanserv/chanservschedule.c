@@ -17,7 +17,7 @@ void chanservdgline(void* arg) {
     return;
     
   for (nl=anp->nicks;nl;nl=nl->nextbyauthname) {
-    for (i=0, ucount=0; i<NICKHASHSIZE; i++)
+    for (i=0, ucount=0; i<nicktablesize; i++)
       for (np=nicktable[i];np;np=np->next)
         if (np->ipnode==nl->ipnode && !ircd_strcmp(np->ident, nl->ident))
           ucount++;
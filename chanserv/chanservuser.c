@@ -56,7 +56,7 @@ void chanservreguser(void *arg) {
   freesstring(csaccount);
 
   /* Now join channels */
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if (cip->channel && (rcp=cip->exts[chanservext]) && !CIsSuspended(rcp)) {
         /* This will do timestamp faffing even if it won't actually join */
@@ -517,7 +517,7 @@ void chanservwallmessage(char *message, ... ) {
   va_end(va);
   
   /* Scan for users */
-  for (i=0;i<NICKHASHSIZE;i++) {
+  for (i=0;i<nicktablesize;i++) {
     for (np=nicktable[i];np;np=np->next) {
       if (!IsOper(np)) /* optimisation, if VIEWWALLMESSAGE changes change this */
         continue;
@@ -607,7 +607,7 @@ void cs_checknick(nick *np) {
   assert(getactiveuserfromnick(np));
 
   if (IsAccount(np) && np->auth) {
-    if (np->auth->exts[chanservaext]) {
+    if (getauthnameext(np->auth, chanservaext)) {
       rup=getreguserfromnick(np);
 
       /* safe? */
@@ -651,7 +651,8 @@ void cs_checknick(nick *np) {
       rup->domain=NULL;
       rup->info=NULL;
       sprintf(userhost,"%s@%s",np->ident,np->host->name->content);
-      rup->lastuserhost=getsstring(userhost,USERLEN+HOSTLEN+1);
+      rup->lastuserhost=NULL;
+      setreguserlastuserhost(rup, userhost);
       rup->suspendreason=NULL;
       rup->comment=NULL;
       rup->knownon=NULL;
@@ -1176,12 +1177,9 @@ void cs_removeuser(reguser *rup) {
     cs_removechannelifempty(NULL, rcp);
   }
 
-  if(rup->domain)
-    delreguserfrommaildomain(rup,rup->domain);
-  freesstring(rup->localpart);
-  freesstring(rup->email);
+  setreguseremail(rup, NULL);
+  setreguserlastuserhost(rup, NULL);
   freesstring(rup->lastemail);
-  freesstring(rup->lastuserhost);
   freesstring(rup->suspendreason);
   freesstring(rup->comment);
   freesstring(rup->info);
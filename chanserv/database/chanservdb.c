@@ -12,6 +12,7 @@
 #include "../../lib/strlfunc.h"
 #include "../../dbapi/dbapi.h"
 #include "../../lib/version.h"
+#include "../../core/metrics.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -41,6 +42,7 @@ void loadmessages_part2(DBConn *, void *);
 void loadcommandsummary_real(DBConn *, void *);
 
 /* User loading functions */
+void loadusercount(DBConn *, void *);
 void loadsomeusers(DBConn *, void *);
 void loadusersdone(DBConn *, void *);
 
@@ -68,6 +70,16 @@ void loadmaillocksdone(DBConn *, void *);
 /* Free sstrings in the structures */
 void csdb_freestuff();
 
+#define MAXLOADPHASES 10
+
+/* How long each part of the last load took */
+static struct {
+  const char *name;
+  double secs;
+} loadphases[MAXLOADPHASES];
+static int loadphasecount;
+static uint64_t loadstart, loadmark;
+
 static void setuptables() {
   /* Set up the tables */
   /* User table */
@@ -230,6 +242,14 @@ static void setuptables() {
                  "createdby    INT               NOT NULL,"
                  "created      INT               NOT NULL,"
                  "PRIMARY KEY (ID))");
+
+   /* Keys written since the last snapshot, see chanservdb_snapshot.c */
+   dbcreatequery("CREATE TABLE chanserv.changelog ("
+                 "seq          BIGINT            NOT NULL,"
+                 "tablename    INT               NOT NULL,"
+                 "id1          INT               NOT NULL,"
+                 "id2          INT               NOT NULL,"
+                 "PRIMARY KEY (seq))");
 }
 
 void _init() {
@@ -249,12 +269,11 @@ void _init() {
 
     lastuserID=lastchannelID=lastdomainID=0;
 
-    dbloadtable("chanserv.users",NULL,loadsomeusers,loadusersdone);
-    dbloadtable("chanserv.channels",NULL,loadsomechannels,loadchannelsdone);
-    dbloadtable("chanserv.chanusers",loadchanusersinit,loadsomechanusers,loadchanusersdone);
-    dbloadtable("chanserv.bans",NULL,loadsomechanbans,loadchanbansdone);
-    dbloadtable("chanserv.maildomain",NULL, loadsomemaildomains,loadmaildomainsdone);
-    dbloadtable("chanserv.maillocks",NULL, loadsomemaillocks,loadmaillocksdone);
+    loadphasecount=0;
+    loadstart=loadmark=metricclock();
+
+    if (!csdb_snapshotinit())
+      loadalltables();
     
     loadmessages(); 
   }
@@ -262,6 +281,8 @@ void _init() {
 
 void _fini() {
   deregisterhook(HOOK_CORE_STATSREQUEST, csdb_handlestats);
+
+  csdb_snapshotfini();
   
   csdb_freestuff();
 
@@ -276,9 +297,55 @@ void _fini() {
 }
 
 void csdb_handlestats(int hooknum, void *arg) {
-/*   long level=(long)arg; */
+  long level=(long)arg;
+  char buf[200];
+  int i;
+
+  if (level>5) {
+    for (i=0;i<loadphasecount;i++) {
+      snprintf(buf,sizeof(buf),"ChanServ: load phase %-28s %8.2fs",loadphases[i].name,loadphases[i].secs);
+      triggerhook(HOOK_CORE_STATSREPLY,buf);
+    }
+  }
+
+  csdb_snapshotstats(level);
+}
+
+/*
+ * csdb_loadphase():
+ *  Notes the time taken since the previous phase of the startup load.
+ */
+
+void csdb_loadphase(const char *name) {
+  uint64_t now=metricclock();
+  double secs=(now-loadmark)/1000000.0;
+
+  loadmark=now;
+
+  if (loadphasecount<MAXLOADPHASES) {
+    loadphases[loadphasecount].name=name;
+    loadphases[loadphasecount].secs=secs;
+    loadphasecount++;
+  }
+
+  Error("chanserv",ERR_INFO,"Load phase %s took %.2fs",name,secs);
+}
+
+/* The full load, used when there's no usable snapshot */
+void loadalltables() {
+  dbasyncquery(loadusercount, NULL, "SELECT COUNT(*) FROM chanserv.users");
+  dbloadtable("chanserv.users",NULL,loadsomeusers,loadusersdone);
+  dbloadtable("chanserv.channels",NULL,loadsomechannels,loadchannelsdone);
+  dbloadtable("chanserv.chanusers",loadchanusersinit,loadsomechanusers,loadchanusersdone);
+  dbloadtable("chanserv.bans",NULL,loadsomechanbans,loadchanbansdone);
 
-  /* Keeping options open here */
+  loadmailtables();
+}
+
+/* Always comes last, the DBLOADED hook fires once these are in */
+void loadmailtables() {
+  dbloadtable("chanserv.maildomain",NULL, loadsomemaildomains,loadmaildomainsdone);
+  dbloadtable("chanserv.maillocks",NULL, loadsomemaillocks,loadmaillocksdone);
 }
 
 void chanservdbclose() {
@@ -287,6 +354,27 @@ void chanservdbclose() {
 
 }
 
+/*
+ * loadusercount():
+ *  Sizes the authname tables up front so loading users doesn't keep rehashing them
+ */
+
+void loadusercount(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+
+  pgres=dbgetresult(dbconn);
+
+  if (!dbquerysuccessful(pgres)) {
+    Error("chanserv",ERR_ERROR,"Error counting user DB");
+    return;
+  }
+
+  if (dbfetchrow(pgres))
+    authnamereserve(strtoul(dbgetvalue(pgres,0),NULL,10));
+
+  dbclear(pgres);
+}
+
 /*
  * loadsomeusers():
  *  Loads some users in from the SQL DB
@@ -295,8 +383,6 @@ void chanservdbclose() {
 void loadsomeusers(DBConn *dbconn, void *arg) {
   DBResult *pgres;
   reguser *rup;
-  char *local;
-  char mailbuf[1024];
 
   pgres=dbgetresult(dbconn);
 
@@ -325,24 +411,11 @@ void loadsomeusers(DBConn *dbconn, void *arg) {
     rup->suspendtime=strtoul(dbgetvalue(pgres,9),NULL,10);
     rup->lockuntil=strtoul(dbgetvalue(pgres,10),NULL,10);
     strncpy(rup->password,dbgetvalue(pgres,11),PASSLEN); rup->password[PASSLEN]='\0';
-    rup->email=getsstring(dbgetvalue(pgres,12),100);
-    if (rup->email) {
-      rup->domain=findorcreatemaildomain(rup->email->content);
-      addregusertomaildomain(rup, rup->domain);
-
-      strlcpy(mailbuf, rup->email->content, sizeof(mailbuf));
-      if((local=strchr(mailbuf, '@'))) {
-        *(local++)='\0';
-        rup->localpart=getsstring(mailbuf,EMAILLEN);
-      } else {
-        rup->localpart=NULL;
-      }
-    } else {
-      rup->domain=NULL;
-      rup->localpart=NULL;
-    }
+    rup->email=rup->localpart=rup->lastuserhost=NULL;
+    rup->domain=NULL;
+    setreguseremail(rup, dbgetvalue(pgres,12));
     rup->lastemail=getsstring(dbgetvalue(pgres,13),100);
-    rup->lastuserhost=getsstring(dbgetvalue(pgres,14),75);
+    setreguserlastuserhost(rup, dbgetvalue(pgres,14));
     rup->suspendreason=getsstring(dbgetvalue(pgres,15),250);
     rup->comment=getsstring(dbgetvalue(pgres,16),250);
     rup->info=getsstring(dbgetvalue(pgres,17),100);
@@ -362,6 +435,7 @@ void loadsomeusers(DBConn *dbconn, void *arg) {
 }
 
 void loadusersdone(DBConn *conn, void *arg) {
+  csdb_loadphase("users");
   Error("chanserv",ERR_INFO,"Load users done (highest ID was %d)",lastuserID);
 }
 
@@ -449,6 +523,7 @@ void loadsomechannels(DBConn *dbconn, void *arg) {
 }
 
 void loadchannelsdone(DBConn *dbconn, void *arg) {
+  csdb_loadphase("channels");
   Error("chanserv",ERR_INFO,"Channel load done (highest ID was %d)",lastchannelID);
 }
 
@@ -459,7 +534,7 @@ void loadchanusersinit(DBConn *dbconn, void *arg) {
 
   allchans=(regchan **)malloc((lastchannelID+1)*sizeof(regchan *));
   memset(allchans,0,(lastchannelID+1)*sizeof(regchan *));
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if (cip->exts[chanservext]) {
         rcp=(regchan *)cip->exts[chanservext];
@@ -495,7 +570,7 @@ void loadsomechanusers(DBConn *dbconn, void *arg) {
     uid=strtol(dbgetvalue(pgres,0),NULL,10);
     cid=strtol(dbgetvalue(pgres,1),NULL,10);
 
-    if (!(anp=findauthname(uid)) || !(rup=anp->exts[chanservaext])) {
+    if (!(anp=findauthname(uid)) || !(rup=getauthnameext(anp, chanservaext))) {
       Error("chanserv",ERR_WARNING,"Skipping channeluser for unknown user %d",uid);
       continue;
     }
@@ -525,6 +600,7 @@ void loadsomechanusers(DBConn *dbconn, void *arg) {
 }
 
 void loadchanusersdone(DBConn *dbconn, void *arg) {
+  csdb_loadphase("chanusers");
   Error("chanserv",ERR_INFO,"Channel user load done.");
 }
 
@@ -579,6 +655,8 @@ void loadsomechanbans(DBConn *dbconn, void *arg) {
 
 void loadchanbansdone(DBConn *dbconn, void *arg) {
   free(allchans);
+  allchans=NULL;
+  csdb_loadphase("bans");
   
   Error("chanserv",ERR_INFO,"Channel ban load done, highest ID was %d",lastbanID);
 }
@@ -737,7 +815,7 @@ void csdb_freestuff() {
     }
   }
 
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=ncip) {
       ncip=cip->next;
       if ((rcp=cip->exts[chanservext])) {
@@ -844,6 +922,9 @@ void loadsomemaillocks(DBConn *dbconn,void *arg) {
 void loadmaillocksdone(DBConn *dbconn, void *arg) {
   Error("chanserv",ERR_INFO,"Load Mail Locks done (highest ID was %d)",lastmaillockID);
 
+  csdb_loadphase("mail tables");
+  Error("chanserv",ERR_INFO,"Database load took %.2fs in total.",(metricclock()-loadstart)/1000000.0);
+
   chanservdb_ready=1;
   triggerhook(HOOK_CHANSERV_DBLOADED, NULL);
 }
@@ -10,18 +10,25 @@
 
 #include "../chanserv.h"
 #include "../../lib/irc_string.h"
+#include "../../lib/strlfunc.h"
 
 reguser *regusernicktable[REGUSERHASHSIZE];
+reguser *reguseremailtable[REGUSERHASHSIZE];
+reguser *reguserlasthosttable[REGUSERHASHSIZE];
 
 maildomain *maildomainnametable[MAILDOMAINHASHSIZE];
 maildomain *maildomainIDtable[MAILDOMAINHASHSIZE];
 
 #define regusernickhash(x)  ((irc_crc32i(x))%REGUSERHASHSIZE)
+#define reguseremailhash(x) ((irc_crc32i(x))%REGUSERHASHSIZE)
+#define reguserhosthash(x)  ((irc_crc32i(x))%REGUSERHASHSIZE)
 #define maildomainnamehash(x)   ((irc_crc32i(x))%MAILDOMAINHASHSIZE)
 #define maildomainIDhash(x)     ((x)%MAILDOMAINHASHSIZE)
 
 void chanservhashinit() {
   memset(regusernicktable,0,REGUSERHASHSIZE*sizeof(reguser *));
+  memset(reguseremailtable,0,REGUSERHASHSIZE*sizeof(reguser *));
+  memset(reguserlasthosttable,0,REGUSERHASHSIZE*sizeof(reguser *));
   memset(maildomainnametable,0,MAILDOMAINHASHSIZE*sizeof(maildomain *));
   memset(maildomainIDtable,0,MAILDOMAINHASHSIZE*sizeof(maildomain *));
 }
@@ -36,7 +43,7 @@ void addregusertohash(reguser *rup) {
   regusernicktable[hash]=rup;
 
   anp=findorcreateauthname(rup->ID, rup->username);
-  anp->exts[chanservaext]=rup;
+  setauthnameext(anp, chanservaext, rup);
 }
 
 reguser *findreguserbynick(const char *nick) {
@@ -59,29 +66,150 @@ reguser *findreguserbyID(unsigned int ID) {
 
   anp=findauthname(ID);
   if (anp)
-    return (reguser *)anp->exts[chanservaext];
+    return (reguser *)getauthnameext(anp, chanservaext);
   else
     return NULL;
 }
     
 /*
- * findreguserbyemail()
+ * The email and last host hashes hold every user with the field set, so
+ * both must only be changed through setreguseremail() and
+ * setreguserlastuserhost().  Emails compare case insensitively, hosts
+ * (the part of lastuserhost after the @) with IRC case rules.
  */
+static const char *lastuserhosthost(const char *userhost) {
+  const char *host=strchr(userhost, '@');
+
+  return host ? host+1 : userhost;
+}
+
 reguser *findreguserbyemail(const char *email) {
-  int i;
   reguser *rup;
 
-  for (i=0;i<REGUSERHASHSIZE;i++) {
-    for (rup=regusernicktable[i];rup;rup=rup->nextbyname) {
-      if (rup->email && !strcasecmp(email,rup->email->content)) {
-        return rup;
-      }
-    }
-  } 
+  for (rup=reguseremailtable[reguseremailhash(email)];rup;rup=rup->nextbyemail)
+    if (!strcasecmp(email,rup->email->content))
+      return rup;
+
   /* Not found */
   return NULL;
 }
 
+/* Next user after rup with the same email */
+reguser *nextreguserbyemail(reguser *rup) {
+  reguser *nrup;
+
+  for (nrup=rup->nextbyemail;nrup;nrup=nrup->nextbyemail)
+    if (!strcasecmp(rup->email->content,nrup->email->content))
+      return nrup;
+
+  return NULL;
+}
+
+int countregusersbyemail(const char *email) {
+  reguser *rup;
+  int count=0;
+
+  for (rup=findreguserbyemail(email);rup;rup=nextreguserbyemail(rup))
+    count++;
+
+  return count;
+}
+
+reguser *findreguserbylasthost(const char *host) {
+  reguser *rup;
+
+  for (rup=reguserlasthosttable[reguserhosthash(host)];rup;rup=rup->nextbylasthost)
+    if (!ircd_strcmp(host,lastuserhosthost(rup->lastuserhost->content)))
+      return rup;
+
+  return NULL;
+}
+
+/* Next user after rup who last authed from the same host */
+reguser *nextreguserbylasthost(reguser *rup) {
+  const char *host=lastuserhosthost(rup->lastuserhost->content);
+  reguser *nrup;
+
+  for (nrup=rup->nextbylasthost;nrup;nrup=nrup->nextbylasthost)
+    if (!ircd_strcmp(host,lastuserhosthost(nrup->lastuserhost->content)))
+      return nrup;
+
+  return NULL;
+}
+
+static void unlinkreguser(reguser **ruh, reguser *rup, int byemail) {
+  for (;*ruh;ruh=byemail ? &((*ruh)->nextbyemail) : &((*ruh)->nextbylasthost)) {
+    if (*ruh==rup) {
+      *ruh=byemail ? rup->nextbyemail : rup->nextbylasthost;
+      return;
+    }
+  }
+
+  Error("chanserv",ERR_ERROR,"Unable to remove reguser %s from %s hash",
+        rup->username, byemail ? "email" : "last host");
+}
+
+/*
+ * setreguseremail():
+ *  Changes a user's email (NULL for none), keeping its maildomain, local
+ *  part and the email hash in step.  rup->email, ->domain and ->localpart
+ *  must be valid (or NULL) beforehand.
+ */
+void setreguseremail(reguser *rup, const char *email) {
+  char mailbuf[1024];
+  char *local;
+
+  if (rup->email) {
+    unlinkreguser(&reguseremailtable[reguseremailhash(rup->email->content)], rup, 1);
+    freesstring(rup->email);
+    rup->email=NULL;
+  }
+
+  if (rup->domain)
+    delreguserfrommaildomain(rup, rup->domain);
+
+  freesstring(rup->localpart);
+  rup->localpart=NULL;
+  rup->domain=NULL;
+
+  if (!email || !(rup->email=getsstring(email,100)))
+    return;
+
+  rup->nextbyemail=reguseremailtable[reguseremailhash(rup->email->content)];
+  reguseremailtable[reguseremailhash(rup->email->content)]=rup;
+
+  rup->domain=findorcreatemaildomain(rup->email->content);
+  addregusertomaildomain(rup, rup->domain);
+
+  strlcpy(mailbuf, rup->email->content, sizeof(mailbuf));
+  if((local=strchr(mailbuf, '@'))) {
+    *local='\0';
+    rup->localpart=getsstring(mailbuf,EMAILLEN);
+  }
+}
+
+/*
+ * setreguserlastuserhost():
+ *  Changes a user's last user@host (NULL for none) and moves it in the
+ *  last host hash.
+ */
+void setreguserlastuserhost(reguser *rup, const char *userhost) {
+  unsigned int hash;
+
+  if (rup->lastuserhost) {
+    unlinkreguser(&reguserlasthosttable[reguserhosthash(lastuserhosthost(rup->lastuserhost->content))], rup, 0);
+    freesstring(rup->lastuserhost);
+    rup->lastuserhost=NULL;
+  }
+
+  if (!userhost || !(rup->lastuserhost=getsstring(userhost,USERLEN+HOSTLEN+1)))
+    return;
+
+  hash=reguserhosthash(lastuserhosthost(rup->lastuserhost->content));
+  rup->nextbylasthost=reguserlasthosttable[hash];
+  reguserlasthosttable[hash]=rup;
+}
+
 void removereguserfromhash(reguser *rup) {
   unsigned int hash;
   reguser **ruh;
@@ -108,7 +236,7 @@ void removereguserfromhash(reguser *rup) {
   anp=findauthname(rup->ID);
   
   if (anp) {
-    anp->exts[chanservaext]=NULL;
+    setauthnameext(anp, chanservaext, NULL);
     releaseauthname(anp);
   } else {
     Error("chanserv",ERR_ERROR,"Unable to remove reguser %s from ID hash",rup->username);
@@ -0,0 +1,1153 @@
+/*
+ * chanservdb_snapshot.c:
+ *  Binary snapshot of the users, channels, chanusers and bans, so a restart
+ *  doesn't have to pull millions of rows through the SQL cursor.
+ *
+ *  Every write to those four tables first logs the key it touches in
+ *  chanserv.changelog, using sequence numbers we hand out ourselves.  A
+ *  snapshot records the last sequence number it includes (the watermark);
+ *  at startup we load the file and refetch only the rows logged after it.
+ *  This relies on newserv being the only thing writing to those tables.
+ *
+ *  The row at the watermark of the last snapshot written is always kept, so
+ *  a snapshot is only loaded if the log still goes back to its watermark.
+ *  Running with snapshots off clears the log, so a snapshot left over from
+ *  before that is refused rather than loaded without the changes since.
+ *
+ *  Snapshots are written by a forked child from its copy of the tables, so
+ *  the main loop carries on while the file is written and synced.
+ *
+ *  The file is native endian and only meant to be read back by the same
+ *  build.  If anything about it looks wrong we just do the full load.
+ */
+
+#include "../chanserv.h"
+#include "../../core/config.h"
+#include "../../core/error.h"
+#include "../../core/schedule.h"
+#include "../../core/events.h"
+#include "../../core/metrics.h"
+#include "../../lib/sstring.h"
+#include "../../lib/strlfunc.h"
+#include "../../dbapi/dbapi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/poll.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CSSNAP_MAGIC      0x50414e53U  /* "SNAP" */
+#define CSSNAP_VERSION    1
+#define CSSNAP_NULLSTR    0xFFFF
+#define CSSNAP_BATCH      250          /* keys per refetch query, keeps us well inside the query buffer */
+
+struct cssnapheader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t watermark;
+  uint64_t written;
+  uint32_t users, channels, chanusers, bans;
+  uint32_t lastuserID, lastchannelID, lastbanID, spare;
+  uint64_t length;                     /* bytes following the header */
+  uint64_t checksum;                   /* FNV-1a over those bytes */
+};
+
+/* Each record is followed by its strings and padded to 8 bytes.  A string
+ * is a 16-bit length (CSSNAP_NULLSTR for NULL) then the bytes and a NUL. */
+
+struct cssnapuser {
+  uint32_t ID, flags, suspendby;
+  int16_t  languageid;
+  uint16_t spare;
+  int64_t  created, lastauth, lastemailchange, suspendexp, suspendtime, lockuntil, lastpasschange;
+  char     username[NICKLEN+1];
+  char     password[PASSLEN+1];
+  /* email, lastemail, lastuserhost, suspendreason, comment, info */
+};
+
+struct cssnapchan {
+  uint32_t ID, flags, forcemodes, denymodes;
+  uint32_t founder, addedby, suspendby;
+  uint32_t totaljoins, tripjoins, maxusers, tripusers;
+  uint16_t limit;
+  int16_t  autolimit, banstyle, chantype;
+  int64_t  ltimestamp, created, lastactive, statsreset, banduration, suspendtime;
+  /* name, welcome, topic, key, suspendreason, comment */
+};
+
+struct cssnapchanuser {
+  uint32_t userID, channelID, flags, spare;
+  int64_t  changetime, usetime;
+  /* info */
+};
+
+struct cssnapban {
+  uint32_t ID, channelID, setby, spare;
+  int64_t  expiry;
+  /* hostmask, reason */
+};
+
+typedef struct csdbkey {
+  unsigned int table, id1, id2;        /* table 0 marks an empty slot */
+} csdbkey;
+
+typedef struct csdbkeyset {
+  csdbkey *keys;
+  unsigned int count, size;
+} csdbkeyset;
+
+/* What the writer sends back to the parent when it's done */
+struct cssnapresult {
+  int ok, err;
+  uint32_t users, channels, chanusers, bans;
+  uint64_t elapsed;
+};
+
+typedef struct snapwriter {
+  FILE *fp;
+  uint64_t length, checksum;
+  int failed;
+} snapwriter;
+
+typedef struct snapreader {
+  const char *base, *pos, *end;
+  int failed;
+} snapreader;
+
+static sstring *snapshotfile;
+static int snapshotinterval;
+
+static uint64_t firstchangeseq;        /* oldest sequence number still in the log at startup */
+static uint64_t lastchangeseq;         /* last sequence number handed out */
+static uint64_t snapshotwatermark;     /* watermark of the snapshot on disk */
+static uint64_t pendingwatermark;      /* watermark of the one being written */
+static pid_t snapshotpid;              /* writer, if there is one */
+static int snapshotfd=-1;
+static int changelogactive;
+static csdbkeyset loggedkeys;          /* keys logged since the last snapshot */
+
+/* Load in progress */
+static void *snapmap;
+static size_t snapmaplen;
+static struct cssnapheader snaphdr;
+static snapreader snapreader_links;
+static csdbkeyset changedkeys;
+
+static void csdb_snapshotbegin(DBConn *dbconn, void *arg);
+static void csdb_snapshotreplay(DBConn *dbconn, void *arg);
+static void csdb_snapshotlinks(DBConn *dbconn, void *arg);
+static void csdb_snapshotdone(DBConn *dbconn, void *arg);
+static void csdb_snapshottimer(void *arg);
+static void csdb_snapshotwritten(int fd, short revents);
+static void csdb_stopwriter(void);
+static void csdb_detachsnapshot(void);
+
+static unsigned int keyhash(unsigned int table, unsigned int id1, unsigned int id2) {
+  uint32_t h=id1*0x9e3779b1U;
+
+  h^=id2*0x85ebca6bU + table;
+  h^=h>>15;
+  h*=0xc2b2ae35U;
+  h^=h>>13;
+
+  return h;
+}
+
+static csdbkey *keyslot(csdbkeyset *ks, unsigned int table, unsigned int id1, unsigned int id2) {
+  unsigned int i=keyhash(table, id1, id2) & (ks->size-1);
+  csdbkey *kp;
+
+  for (;;) {
+    kp=&ks->keys[i];
+    if (!kp->table || (kp->table==table && kp->id1==id1 && kp->id2==id2))
+      return kp;
+    i=(i+1) & (ks->size-1);
+  }
+}
+
+/* Returns 1 if the key wasn't there before */
+static int keysetadd(csdbkeyset *ks, unsigned int table, unsigned int id1, unsigned int id2) {
+  csdbkey *kp, *oldkeys;
+  unsigned int i, oldsize;
+
+  if ((ks->count+1)*2 > ks->size) {
+    oldkeys=ks->keys;
+    oldsize=ks->size;
+
+    ks->size=oldsize ? oldsize*2 : 1024;
+    if (!(ks->keys=calloc(ks->size, sizeof(csdbkey))))
+      Error("chanserv",ERR_STOP,"calloc() failed in chanservdb_snapshot.c");
+
+    for (i=0;i<oldsize;i++)
+      if (oldkeys[i].table)
+        *keyslot(ks, oldkeys[i].table, oldkeys[i].id1, oldkeys[i].id2)=oldkeys[i];
+
+    free(oldkeys);
+  }
+
+  kp=keyslot(ks, table, id1, id2);
+  if (kp->table)
+    return 0;
+
+  kp->table=table;
+  kp->id1=id1;
+  kp->id2=id2;
+  ks->count++;
+
+  return 1;
+}
+
+static int keysethas(csdbkeyset *ks, unsigned int table, unsigned int id1, unsigned int id2) {
+  if (!ks->count)
+    return 0;
+
+  return keyslot(ks, table, id1, id2)->table!=0;
+}
+
+static void keysetfree(csdbkeyset *ks) {
+  free(ks->keys);
+  ks->keys=NULL;
+  ks->count=ks->size=0;
+}
+
+static uint64_t snapchecksum(uint64_t sum, const void *buf, size_t len) {
+  const unsigned char *p=buf;
+
+  while (len--) {
+    sum^=*p++;
+    sum*=0x100000001b3ULL;
+  }
+
+  return sum;
+}
+
+int csdb_snapshotinit(void) {
+  sstring *interval;
+
+  snapshotfile=getcopyconfigitem("chanserv","snapshotfile","",100);
+  interval=getcopyconfigitem("chanserv","snapshotinterval","3600",10);
+  snapshotinterval=atoi(interval->content);
+  freesstring(interval);
+
+  if (!snapshotfile || !*snapshotfile->content) {
+    freesstring(snapshotfile);
+    snapshotfile=NULL;
+
+    /* Nothing gets logged from here on, make sure no old snapshot is trusted later */
+    dbquery("DELETE FROM chanserv.changelog");
+    return 0;
+  }
+
+  if (snapshotinterval>0)
+    schedulerecurring(time(NULL)+snapshotinterval, 0, snapshotinterval, csdb_snapshottimer, NULL);
+
+  dbasyncquery(csdb_snapshotbegin, NULL, "SELECT MIN(seq), MAX(seq) FROM chanserv.changelog");
+
+  return 1;
+}
+
+void csdb_snapshotfini(void) {
+  if (!snapshotfile)
+    return;
+
+  deleteallschedules(csdb_snapshottimer);
+
+  /* The final snapshot below supersedes whatever is being written */
+  if (snapshotpid)
+    csdb_stopwriter();
+
+  if (chanservdb_ready && changelogactive)
+    csdb_detachsnapshot();
+
+  if (snapmap) {
+    munmap(snapmap, snapmaplen);
+    snapmap=NULL;
+  }
+
+  keysetfree(&changedkeys);
+  keysetfree(&loggedkeys);
+  changelogactive=0;
+
+  freesstring(snapshotfile);
+  snapshotfile=NULL;
+}
+
+/*
+ * csdb_logchange():
+ *  Records that a row is about to change.  Once per key between snapshots
+ *  is enough, as the refetch always gets the current row.  This has to be
+ *  queued before the write itself so the log is never behind the table.
+ */
+
+void csdb_logchange(unsigned int table, unsigned int id1, unsigned int id2) {
+  if (!changelogactive || !keysetadd(&loggedkeys, table, id1, id2))
+    return;
+
+  dbquery("INSERT INTO chanserv.changelog (seq, tablename, id1, id2) VALUES (%llu,%u,%u,%u)",
+          (unsigned long long)++lastchangeseq, table, id1, id2);
+}
+
+void csdb_snapshotstats(long level) {
+  char buf[200];
+
+  if (!snapshotfile || level<=5)
+    return;
+
+  snprintf(buf,sizeof(buf),"ChanServ: snapshot watermark %llu, change log at %llu, %u keys logged since%s.",
+           (unsigned long long)snapshotwatermark, (unsigned long long)lastchangeseq, loggedkeys.count,
+           snapshotpid ? ", writing a snapshot" : "");
+  triggerhook(HOOK_CORE_STATSREPLY,buf);
+}
+
+/*
+ * Writing
+ */
+
+static void sw_write(snapwriter *sw, const void *buf, size_t len) {
+  if (sw->failed)
+    return;
+
+  if (fwrite(buf, 1, len, sw->fp)!=len) {
+    sw->failed=1;
+    return;
+  }
+
+  sw->checksum=snapchecksum(sw->checksum, buf, len);
+  sw->length+=len;
+}
+
+static void sw_string(snapwriter *sw, const char *str, size_t len) {
+  uint16_t slen;
+
+  if (!str) {
+    slen=CSSNAP_NULLSTR;
+    sw_write(sw, &slen, sizeof(slen));
+    return;
+  }
+
+  if (len>=CSSNAP_NULLSTR)
+    len=CSSNAP_NULLSTR-1;
+
+  slen=len;
+  sw_write(sw, &slen, sizeof(slen));
+  sw_write(sw, str, len);
+  sw_write(sw, "", 1);
+}
+
+static void sw_sstring(snapwriter *sw, sstring *ss) {
+  if (ss)
+    sw_string(sw, ss->content, ss->length);
+  else
+    sw_string(sw, NULL, 0);
+}
+
+static void sw_align(snapwriter *sw) {
+  static const char zero[8];
+
+  if (sw->length & 7)
+    sw_write(sw, zero, 8 - (sw->length & 7));
+}
+
+static void snapshottmpname(char *buf, size_t len, pid_t pid) {
+  snprintf(buf, len, "%s.%d.tmp", snapshotfile->content, (int)pid);
+}
+
+/*
+ * Runs in the child, so it mustn't touch anything the parent would notice
+ * (logs included); what happened goes back in res.
+ */
+static void csdb_writesnapshot(struct cssnapresult *res) {
+  char tmpname[200];
+  struct cssnapheader hdr;
+  struct cssnapuser su;
+  struct cssnapchan sc;
+  struct cssnapchanuser scu;
+  struct cssnapban sb;
+  snapwriter sw;
+  reguser *rup;
+  regchan *rcp;
+  regchanuser *rcup;
+  regban *rbp;
+  chanindex *cip;
+  uint64_t starttime=metricclock();
+  char *banstr;
+  int i;
+
+  memset(res, 0, sizeof(*res));
+  snapshottmpname(tmpname, sizeof(tmpname), getpid());
+
+  memset(&sw, 0, sizeof(sw));
+  if (!(sw.fp=fopen(tmpname, "w"))) {
+    res->err=errno;
+    return;
+  }
+  setvbuf(sw.fp, NULL, _IOFBF, 1024*1024);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic=CSSNAP_MAGIC;
+  hdr.version=CSSNAP_VERSION;
+  hdr.watermark=pendingwatermark;
+  hdr.written=time(NULL);
+  hdr.lastuserID=lastuserID;
+  hdr.lastchannelID=lastchannelID;
+  hdr.lastbanID=lastbanID;
+
+  /* Header goes in for real once we know the counts and checksum */
+  if (fwrite(&hdr, sizeof(hdr), 1, sw.fp)!=1)
+    sw.failed=1;
+  sw.checksum=0xcbf29ce484222325ULL;
+
+  for (i=0;i<REGUSERHASHSIZE;i++) {
+    for (rup=regusernicktable[i];rup;rup=rup->nextbyname) {
+      memset(&su, 0, sizeof(su));
+      su.ID=rup->ID;
+      su.flags=rup->flags;
+      su.suspendby=rup->suspendby;
+      su.languageid=rup->languageid;
+      su.created=rup->created;
+      su.lastauth=rup->lastauth;
+      su.lastemailchange=rup->lastemailchange;
+      su.suspendexp=rup->suspendexp;
+      su.suspendtime=rup->suspendtime;
+      su.lockuntil=rup->lockuntil;
+      su.lastpasschange=rup->lastpasschange;
+      strlcpy(su.username, rup->username, sizeof(su.username));
+      strlcpy(su.password, rup->password, sizeof(su.password));
+
+      sw_write(&sw, &su, sizeof(su));
+      sw_sstring(&sw, rup->email);
+      sw_sstring(&sw, rup->lastemail);
+      sw_sstring(&sw, rup->lastuserhost);
+      sw_sstring(&sw, rup->suspendreason);
+      sw_sstring(&sw, rup->comment);
+      sw_sstring(&sw, rup->info);
+      sw_align(&sw);
+      hdr.users++;
+    }
+  }
+
+  for (i=0;i<chantablesize;i++) {
+    for (cip=chantable[i];cip;cip=cip->next) {
+      if (!(rcp=cip->exts[chanservext]))
+        continue;
+
+      memset(&sc, 0, sizeof(sc));
+      sc.ID=rcp->ID;
+      sc.flags=rcp->flags;
+      sc.forcemodes=rcp->forcemodes;
+      sc.denymodes=rcp->denymodes;
+      sc.founder=rcp->founder;
+      sc.addedby=rcp->addedby;
+      sc.suspendby=rcp->suspendby;
+      sc.totaljoins=rcp->totaljoins;
+      sc.tripjoins=rcp->tripjoins;
+      sc.maxusers=rcp->maxusers;
+      sc.tripusers=rcp->tripusers;
+      sc.limit=rcp->limit;
+      sc.autolimit=rcp->autolimit;
+      sc.banstyle=rcp->banstyle;
+      sc.chantype=rcp->chantype;
+      sc.ltimestamp=rcp->ltimestamp;
+      sc.created=rcp->created;
+      sc.lastactive=rcp->lastactive;
+      sc.statsreset=rcp->statsreset;
+      sc.banduration=rcp->banduration;
+      sc.suspendtime=rcp->suspendtime;
+
+      sw_write(&sw, &sc, sizeof(sc));
+      sw_sstring(&sw, cip->name);
+      sw_sstring(&sw, rcp->welcome);
+      sw_sstring(&sw, rcp->topic);
+      sw_sstring(&sw, rcp->key);
+      sw_sstring(&sw, rcp->suspendreason);
+      sw_sstring(&sw, rcp->comment);
+      sw_align(&sw);
+      hdr.channels++;
+    }
+  }
+
+  for (i=0;i<REGUSERHASHSIZE;i++) {
+    for (rup=regusernicktable[i];rup;rup=rup->nextbyname) {
+      for (rcup=rup->knownon;rcup;rcup=rcup->nextbyuser) {
+        memset(&scu, 0, sizeof(scu));
+        scu.userID=rup->ID;
+        scu.channelID=rcup->chan->ID;
+        scu.flags=rcup->flags;
+        scu.changetime=rcup->changetime;
+        scu.usetime=rcup->usetime;
+
+        sw_write(&sw, &scu, sizeof(scu));
+        sw_sstring(&sw, rcup->info);
+        sw_align(&sw);
+        hdr.chanusers++;
+      }
+    }
+  }
+
+  for (i=0;i<chantablesize;i++) {
+    for (cip=chantable[i];cip;cip=cip->next) {
+      if (!(rcp=cip->exts[chanservext]))
+        continue;
+
+      for (rbp=rcp->bans;rbp;rbp=rbp->next) {
+        memset(&sb, 0, sizeof(sb));
+        sb.ID=rbp->ID;
+        sb.channelID=rcp->ID;
+        sb.setby=rbp->setby;
+        sb.expiry=rbp->expiry;
+
+        banstr=bantostring(rbp->cbp);
+        sw_write(&sw, &sb, sizeof(sb));
+        sw_string(&sw, banstr, strlen(banstr));
+        sw_sstring(&sw, rbp->reason);
+        sw_align(&sw);
+        hdr.bans++;
+      }
+    }
+  }
+
+  hdr.length=sw.length;
+  hdr.checksum=sw.checksum;
+
+  if (!sw.failed && (fseek(sw.fp, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, sw.fp)!=1))
+    sw.failed=1;
+
+  if (!sw.failed && (fflush(sw.fp) || fsync(fileno(sw.fp))))
+    sw.failed=1;
+
+  if (sw.failed && !res->err)
+    res->err=errno;
+
+  if (fclose(sw.fp) || sw.failed || rename(tmpname, snapshotfile->content)) {
+    if (!res->err)
+      res->err=errno;
+    unlink(tmpname);
+    return;
+  }
+
+  res->ok=1;
+  res->users=hdr.users;
+  res->channels=hdr.channels;
+  res->chanusers=hdr.chanusers;
+  res->bans=hdr.bans;
+  res->elapsed=metricclock()-starttime;
+}
+
+static void csdb_snapshotwriter(int fd) {
+  struct cssnapresult res;
+
+  /* Don't let a crash in here run the parent's core handlers */
+  signal(SIGSEGV, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  csdb_writesnapshot(&res);
+
+  if (fd>=0 && write(fd, &res, sizeof(res))!=sizeof(res))
+    res.ok=0;
+
+  _exit(res.ok ? 0 : 1);
+}
+
+static void csdb_startsnapshot(void) {
+  int fds[2];
+  pid_t pid;
+
+  if (snapshotpid) {
+    Error("chanserv",ERR_WARNING,"Previous snapshot still being written, skipping this one.");
+    return;
+  }
+
+  if (pipe(fds)) {
+    Error("chanserv",ERR_ERROR,"Unable to create pipe for snapshot writer (%d).",errno);
+    return;
+  }
+
+  pendingwatermark=lastchangeseq;
+
+  if ((pid=fork())<0) {
+    Error("chanserv",ERR_ERROR,"Unable to fork snapshot writer (%d).",errno);
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+
+  if (!pid) {
+    close(fds[0]);
+    csdb_snapshotwriter(fds[1]);
+  }
+
+  close(fds[1]);
+  snapshotpid=pid;
+  snapshotfd=fds[0];
+  registerhandler(snapshotfd, POLLIN, csdb_snapshotwritten);
+
+  /* Everything logged so far is in the child's copy, anything from here on
+   * has to be logged again for the next one */
+  keysetfree(&loggedkeys);
+}
+
+static void csdb_snapshotwritten(int fd, short revents) {
+  struct cssnapresult res;
+  ssize_t len;
+
+  len=read(fd, &res, sizeof(res));
+  if (len<0 && (errno==EINTR || errno==EAGAIN))
+    return;
+
+  if (len!=sizeof(res))
+    memset(&res, 0, sizeof(res));
+
+  deregisterhandler(fd, 1);
+  waitpid(snapshotpid, NULL, 0);
+  snapshotpid=0;
+  snapshotfd=-1;
+
+  if (!res.ok) {
+    Error("chanserv",ERR_ERROR,"Error writing snapshot to %s: %s.",snapshotfile->content,
+          res.err ? strerror(res.err) : "writer exited early");
+    return;
+  }
+
+  /* Keep the log back to the previous snapshot in case this one didn't
+   * make it to disk after all.  The row at the old watermark stays so
+   * MAX(seq) never drops below a watermark we have written. */
+  if (snapshotwatermark)
+    dbquery("DELETE FROM chanserv.changelog WHERE seq < %llu", (unsigned long long)snapshotwatermark);
+
+  snapshotwatermark=pendingwatermark;
+
+  Error("chanserv",ERR_INFO,"Wrote snapshot (%u users, %u channels, %u chanusers, %u bans) in %.2fs, watermark %llu.",
+        res.users, res.channels, res.chanusers, res.bans, res.elapsed/1000000.0,
+        (unsigned long long)snapshotwatermark);
+}
+
+static void csdb_stopwriter(void) {
+  char tmpname[200];
+
+  kill(snapshotpid, SIGTERM);
+  waitpid(snapshotpid, NULL, 0);
+  deregisterhandler(snapshotfd, 1);
+
+  snapshottmpname(tmpname, sizeof(tmpname), snapshotpid);
+  unlink(tmpname);
+
+  snapshotpid=0;
+  snapshotfd=-1;
+}
+
+/*
+ * On the way out nobody is left to hear how it went, so the writer is
+ * detached (and reparented to init) and the log is tidied up next time.
+ */
+static void csdb_detachsnapshot(void) {
+  pid_t pid;
+
+  pendingwatermark=lastchangeseq;
+
+  if ((pid=fork())<0) {
+    Error("chanserv",ERR_ERROR,"Unable to fork snapshot writer (%d).",errno);
+    return;
+  }
+
+  if (!pid) {
+    if (!fork())
+      csdb_snapshotwriter(-1);
+    _exit(0);
+  }
+
+  waitpid(pid, NULL, 0);
+}
+
+static void csdb_snapshottimer(void *arg) {
+  if (chanservdb_ready && changelogactive)
+    csdb_startsnapshot();
+}
+
+/*
+ * Reading
+ */
+
+static const void *sr_get(snapreader *sr, size_t len) {
+  const char *p=sr->pos;
+
+  if (sr->failed || (size_t)(sr->end - sr->pos) < len) {
+    sr->failed=1;
+    return NULL;
+  }
+
+  sr->pos+=len;
+  return p;
+}
+
+static void sr_record(snapreader *sr, void *dst, size_t len) {
+  const void *p=sr_get(sr, len);
+
+  if (p)
+    memcpy(dst, p, len);
+  else
+    memset(dst, 0, len);
+}
+
+static const char *sr_string(snapreader *sr) {
+  const char *str;
+  uint16_t len;
+
+  sr_record(sr, &len, sizeof(len));
+  if (sr->failed || len==CSSNAP_NULLSTR)
+    return NULL;
+
+  if (!(str=sr_get(sr, len+1)) || str[len]) {
+    sr->failed=1;
+    return NULL;
+  }
+
+  return str;
+}
+
+static void sr_align(snapreader *sr) {
+  size_t off=(sr->pos - sr->base) & 7;
+
+  if (off)
+    sr_get(sr, 8-off);
+}
+
+static void snapshotunmap(void) {
+  if (snapmap)
+    munmap(snapmap, snapmaplen);
+  snapmap=NULL;
+  snapmaplen=0;
+}
+
+/* Maps the snapshot and checks it can be used, returns 0 if not */
+static int snapshotmap(void) {
+  const char *why=NULL;
+  struct stat st;
+  int fd;
+
+  if ((fd=open(snapshotfile->content, O_RDONLY))<0) {
+    Error("chanserv",ERR_INFO,"No snapshot in %s, loading from database.",snapshotfile->content);
+    return 0;
+  }
+
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct cssnapheader)) {
+    why="file too short";
+  } else if ((snapmap=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))==MAP_FAILED) {
+    snapmap=NULL;
+    why="unable to map file";
+  }
+  close(fd);
+
+  if (!why) {
+    snapmaplen=st.st_size;
+    memcpy(&snaphdr, snapmap, sizeof(snaphdr));
+
+    if (snaphdr.magic!=CSSNAP_MAGIC || snaphdr.version!=CSSNAP_VERSION)
+      why="wrong format or version";
+    else if (snaphdr.length!=snapmaplen-sizeof(snaphdr))
+      why="length mismatch";
+    else if (snaphdr.watermark>lastchangeseq)
+      why="newer than the change log";
+    else if (snaphdr.watermark<firstchangeseq)
+      why="change log no longer goes back that far";
+    else if (snapchecksum(0xcbf29ce484222325ULL, (char *)snapmap+sizeof(snaphdr), snaphdr.length)!=snaphdr.checksum)
+      why="checksum mismatch";
+  }
+
+  if (why) {
+    Error("chanserv",ERR_WARNING,"Ignoring snapshot %s (%s), loading from database.",snapshotfile->content,why);
+    snapshotunmap();
+    return 0;
+  }
+
+  return 1;
+}
+
+static void csdb_snapshotbegin(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+
+  pgres=dbgetresult(dbconn);
+
+  if (!dbquerysuccessful(pgres)) {
+    Error("chanserv",ERR_ERROR,"Error reading change log, snapshots disabled.");
+    freesstring(snapshotfile);
+    snapshotfile=NULL;
+    loadalltables();
+    return;
+  }
+
+  firstchangeseq=lastchangeseq=0;
+  if (dbfetchrow(pgres)) {
+    firstchangeseq=strtoull(dbgetvalue(pgres,0),NULL,10);
+    lastchangeseq=strtoull(dbgetvalue(pgres,1),NULL,10);
+  }
+  dbclear(pgres);
+
+  changelogactive=1;
+
+  /*
+   * An empty log was cleared while snapshots were off (or never used), so
+   * nothing on disk can be trusted.  Start it off with a marker so every
+   * snapshot from now on has a row at its watermark.
+   */
+  if (!lastchangeseq) {
+    lastchangeseq=1;
+    dbquery("INSERT INTO chanserv.changelog (seq, tablename, id1, id2) VALUES (1,0,0,0)");
+
+    if (!access(snapshotfile->content, F_OK))
+      Error("chanserv",ERR_WARNING,"Ignoring snapshot %s (change log is empty), loading from database.",snapshotfile->content);
+    loadalltables();
+    return;
+  }
+
+  if (!snapshotmap()) {
+    loadalltables();
+    return;
+  }
+
+  snapshotwatermark=snaphdr.watermark;
+  csdb_loadphase("snapshot check");
+
+  dbasyncquery(csdb_snapshotreplay, NULL, "SELECT tablename, id1, id2 FROM chanserv.changelog WHERE seq > %llu",
+               (unsigned long long)snaphdr.watermark);
+}
+
+static void snapshotloadusers(snapreader *sr) {
+  struct cssnapuser su;
+  reguser *rup;
+  const char *str[6];
+  unsigned int i, j, skipped=0;
+
+  for (i=0;i<snaphdr.users && !sr->failed;i++) {
+    sr_record(sr, &su, sizeof(su));
+    for (j=0;j<6;j++)
+      str[j]=sr_string(sr);
+    sr_align(sr);
+
+    if (sr->failed)
+      break;
+
+    if (keysethas(&changedkeys, CSDB_CHANGE_USER, su.ID, 0)) {
+      skipped++;
+      continue;
+    }
+
+    rup=getreguser();
+    rup->status=0;
+    rup->ID=su.ID;
+    strlcpy(rup->username, su.username, sizeof(rup->username));
+    rup->created=su.created;
+    rup->lastauth=su.lastauth;
+    rup->lastemailchange=su.lastemailchange;
+    rup->flags=su.flags;
+    rup->languageid=su.languageid;
+    rup->suspendby=su.suspendby;
+    rup->suspendexp=su.suspendexp;
+    rup->suspendtime=su.suspendtime;
+    rup->lockuntil=su.lockuntil;
+    strlcpy(rup->password, su.password, sizeof(rup->password));
+    rup->email=rup->localpart=rup->lastuserhost=NULL;
+    rup->domain=NULL;
+    setreguseremail(rup, str[0]);
+    rup->lastemail=getsstring(str[1],100);
+    setreguserlastuserhost(rup, str[2]);
+    rup->suspendreason=getsstring(str[3],250);
+    rup->comment=getsstring(str[4],250);
+    rup->info=getsstring(str[5],100);
+    rup->lastpasschange=su.lastpasschange;
+    rup->knownon=NULL;
+    rup->checkshd=NULL;
+    rup->stealcount=0;
+    rup->fakeuser=NULL;
+    addregusertohash(rup);
+
+    if (rup->ID > lastuserID)
+      lastuserID=rup->ID;
+  }
+
+  Error("chanserv",ERR_INFO,"Loaded %u users from snapshot (%u changed since).",i-skipped,skipped);
+}
+
+static void snapshotloadchannels(snapreader *sr) {
+  struct cssnapchan sc;
+  const char *str[6];
+  chanindex *cip;
+  regchan *rcp;
+  unsigned int i, j, skipped=0;
+  time_t now=time(NULL);
+
+  for (i=0;i<snaphdr.channels && !sr->failed;i++) {
+    sr_record(sr, &sc, sizeof(sc));
+    for (j=0;j<6;j++)
+      str[j]=sr_string(sr);
+    sr_align(sr);
+
+    if (!str[0])
+      sr->failed=1;
+
+    if (sr->failed)
+      break;
+
+    if (keysethas(&changedkeys, CSDB_CHANGE_CHANNEL, sc.ID, 0)) {
+      skipped++;
+      continue;
+    }
+
+    cip=findorcreatechanindex(str[0]);
+    if (cip->exts[chanservext]) {
+      Error("chanserv",ERR_WARNING,"%s in snapshot twice - this WILL cause problems later.",cip->name->content);
+      continue;
+    }
+    rcp=getregchan();
+    cip->exts[chanservext]=rcp;
+
+    rcp->ID=sc.ID;
+    rcp->index=cip;
+    rcp->flags=sc.flags;
+    rcp->status=0;
+    rcp->lastbancheck=0;
+    rcp->lastcountersync=now;
+    rcp->lastpart=0;
+    rcp->bans=NULL;
+    rcp->forcemodes=sc.forcemodes;
+    rcp->denymodes=sc.denymodes;
+    rcp->limit=sc.limit;
+    rcp->autolimit=sc.autolimit;
+    rcp->banstyle=sc.banstyle;
+    rcp->created=sc.created;
+    rcp->lastactive=sc.lastactive;
+    rcp->statsreset=sc.statsreset;
+    rcp->banduration=sc.banduration;
+    rcp->founder=sc.founder;
+    rcp->addedby=sc.addedby;
+    rcp->suspendby=sc.suspendby;
+    rcp->suspendtime=sc.suspendtime;
+    rcp->chantype=sc.chantype;
+    rcp->totaljoins=sc.totaljoins;
+    rcp->tripjoins=sc.tripjoins;
+    rcp->maxusers=sc.maxusers;
+    rcp->tripusers=sc.tripusers;
+    rcp->welcome=getsstring(str[1],500);
+    rcp->topic=getsstring(str[2],TOPICLEN);
+    rcp->key=getsstring(str[3],KEYLEN);
+    rcp->suspendreason=getsstring(str[4],250);
+    rcp->comment=getsstring(str[5],250);
+    rcp->checksched=NULL;
+    rcp->ltimestamp=sc.ltimestamp;
+    memset(rcp->regusers,0,REGCHANUSERHASHSIZE*sizeof(reguser *));
+
+    if (rcp->ID > lastchannelID)
+      lastchannelID=rcp->ID;
+
+    if (CIsAutoLimit(rcp))
+      rcp->limit=0;
+
+    for (j=0;j<CHANOPHISTORY;j++) {
+      rcp->chanopnicks[j][0]='\0';
+      rcp->chanopaccts[j]=0;
+    }
+    rcp->chanoppos=0;
+  }
+
+  Error("chanserv",ERR_INFO,"Loaded %u channels from snapshot (%u changed since).",i-skipped,skipped);
+}
+
+/* Deleted users and channels are simply missing by now, so their links go quietly */
+static void snapshotloadlinks(snapreader *sr) {
+  struct cssnapchanuser scu;
+  struct cssnapban sb;
+  regchanuser *rcup;
+  regban *rbp;
+  regchan *rcp;
+  reguser *rup;
+  authname *anp;
+  const char *str, *mask;
+  unsigned int i, loaded=0;
+
+  for (i=0;i<snaphdr.chanusers && !sr->failed;i++) {
+    sr_record(sr, &scu, sizeof(scu));
+    str=sr_string(sr);
+    sr_align(sr);
+
+    if (sr->failed || keysethas(&changedkeys, CSDB_CHANGE_CHANUSER, scu.userID, scu.channelID))
+      continue;
+
+    if (!(anp=findauthname(scu.userID)) || !(rup=getauthnameext(anp, chanservaext)))
+      continue;
+
+    if (scu.channelID>lastchannelID || !(rcp=allchans[scu.channelID]))
+      continue;
+
+    rcup=getregchanuser();
+    rcup->user=rup;
+    rcup->chan=rcp;
+    rcup->flags=scu.flags;
+    rcup->changetime=scu.changetime;
+    rcup->usetime=scu.usetime;
+    rcup->info=getsstring(str,100);
+    addregusertochannel(rcup);
+    loaded++;
+  }
+
+  Error("chanserv",ERR_INFO,"Loaded %u chanusers from snapshot.",loaded);
+
+  for (i=0,loaded=0;i<snaphdr.bans && !sr->failed;i++) {
+    sr_record(sr, &sb, sizeof(sb));
+    mask=sr_string(sr);
+    str=sr_string(sr);
+    sr_align(sr);
+
+    if (sr->failed || !mask || keysethas(&changedkeys, CSDB_CHANGE_BAN, sb.ID, 0))
+      continue;
+
+    if (sb.channelID>lastchannelID || !(rcp=allchans[sb.channelID]))
+      continue;
+
+    rbp=getregban();
+    rbp->setby=sb.setby;
+    rbp->ID=sb.ID;
+    rbp->expiry=sb.expiry;
+    rbp->reason=getsstring(str,200);
+    rbp->cbp=makeban(mask);
+    rbp->next=rcp->bans;
+    rcp->bans=rbp;
+    loaded++;
+
+    if (rbp->ID>lastbanID)
+      lastbanID=rbp->ID;
+  }
+
+  Error("chanserv",ERR_INFO,"Loaded %u bans from snapshot.",loaded);
+}
+
+/* Queues SELECTs for every changed key from one table, a batch at a time */
+static void snapshotrefetch(unsigned int table, const char *tablename, const char *keycolumn, DBQueryHandler handler) {
+  char list[CSSNAP_BATCH*24];
+  unsigned int i, n=0;
+  size_t len=0;
+  csdbkey *kp;
+
+  for (i=0;i<changedkeys.size;i++) {
+    kp=&changedkeys.keys[i];
+    if (kp->table!=table)
+      continue;
+
+    if (table==CSDB_CHANGE_CHANUSER)
+      len+=snprintf(list+len, sizeof(list)-len, "%s(%u,%u)", n ? "," : "", kp->id1, kp->id2);
+    else
+      len+=snprintf(list+len, sizeof(list)-len, "%s%u", n ? "," : "", kp->id1);
+
+    if (++n==CSSNAP_BATCH) {
+      dbasyncquery(handler, NULL, "SELECT * FROM chanserv.%s WHERE %s IN (%s)", tablename, keycolumn, list);
+      n=len=0;
+    }
+  }
+
+  if (n)
+    dbasyncquery(handler, NULL, "SELECT * FROM chanserv.%s WHERE %s IN (%s)", tablename, keycolumn, list);
+}
+
+static void csdb_snapshotreplay(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+  snapreader sr;
+  unsigned int table;
+
+  pgres=dbgetresult(dbconn);
+
+  if (!dbquerysuccessful(pgres)) {
+    Error("chanserv",ERR_ERROR,"Error reading change log, loading from database.");
+    snapshotunmap();
+    loadalltables();
+    return;
+  }
+
+  while(dbfetchrow(pgres)) {
+    table=strtoul(dbgetvalue(pgres,0),NULL,10);
+    if (table)
+      keysetadd(&changedkeys, table, strtoul(dbgetvalue(pgres,1),NULL,10), strtoul(dbgetvalue(pgres,2),NULL,10));
+  }
+  dbclear(pgres);
+
+  Error("chanserv",ERR_INFO,"Snapshot watermark %llu, %u rows changed since.",
+        (unsigned long long)snaphdr.watermark, changedkeys.count);
+  csdb_loadphase("change log");
+
+  /* From here on we're committed, the refetches fill in whatever we skip */
+  authnamereserve(snaphdr.users + changedkeys.count);
+
+  sr.base=(const char *)snapmap+sizeof(snaphdr);
+  sr.pos=sr.base;
+  sr.end=sr.base+snaphdr.length;
+  sr.failed=0;
+
+  snapshotloadusers(&sr);
+  if (snaphdr.lastuserID>lastuserID)
+    lastuserID=snaphdr.lastuserID;
+  csdb_loadphase("snapshot users");
+
+  snapshotloadchannels(&sr);
+  if (snaphdr.lastchannelID>lastchannelID)
+    lastchannelID=snaphdr.lastchannelID;
+  csdb_loadphase("snapshot channels");
+
+  snapreader_links=sr;
+
+  snapshotrefetch(CSDB_CHANGE_USER, "users", "ID", loadsomeusers);
+  snapshotrefetch(CSDB_CHANGE_CHANNEL, "channels", "ID", loadsomechannels);
+
+  /* The links need every user and channel in place, so they wait until
+   * the refetches above have been processed */
+  dbasyncquery(csdb_snapshotlinks, NULL, "SELECT 1");
+}
+
+static void csdb_snapshotlinks(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+
+  pgres=dbgetresult(dbconn);
+  if (dbquerysuccessful(pgres))
+    dbclear(pgres);
+
+  csdb_loadphase("changed users and channels");
+
+  loadchanusersinit(NULL, NULL);
+  snapshotloadlinks(&snapreader_links);
+
+  if (snapreader_links.failed)
+    Error("chanserv",ERR_ERROR,"Snapshot %s is truncated, some records were not loaded.",snapshotfile->content);
+
+  if (snaphdr.lastbanID>lastbanID)
+    lastbanID=snaphdr.lastbanID;
+
+  snapshotunmap();
+  csdb_loadphase("snapshot chanusers and bans");
+
+  snapshotrefetch(CSDB_CHANGE_CHANUSER, "chanusers", "(userID,channelID)", loadsomechanusers);
+  snapshotrefetch(CSDB_CHANGE_BAN, "bans", "banID", loadsomechanbans);
+
+  dbasyncquery(csdb_snapshotdone, NULL, "SELECT 1");
+}
+
+static void csdb_snapshotdone(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+
+  pgres=dbgetresult(dbconn);
+  if (dbquerysuccessful(pgres))
+    dbclear(pgres);
+
+  free(allchans);
+  allchans=NULL;
+  keysetfree(&changedkeys);
+
+  csdb_loadphase("changed chanusers and bans");
+
+  Error("chanserv",ERR_INFO,"Snapshot load done (highest IDs: user %u, channel %u, ban %u)",lastuserID,lastchannelID,lastbanID);
+
+  loadmailtables();
+}
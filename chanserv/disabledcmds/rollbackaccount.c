@@ -68,8 +68,7 @@ void csdb_dorollbackaccount_real(DBConn *dbconn, void *arg) {
     }
     else if (strlen(newemail) > 0) {
       /* WARNING: lastemail untouched */
-      freesstring(rup->email);
-      rup->email=getsstring(oldemail, EMAILLEN);
+      setreguseremail(rup, oldemail);
       rup->lastemailchange=changetime;
       chanservsendmessage(np, "Restoring old email (%s -> %s)", newemail, oldemail);
     }
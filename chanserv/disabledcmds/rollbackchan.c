@@ -70,7 +70,7 @@ void csc_dorollbackchan_real(DBConn *dbconn, void *arg) {
     channelID=strtoul(dbgetvalue(pgres, 1), NULL, 10);
 
     if (!rcp) {
-      for (j=0; j<CHANNELHASHSIZE && !rcp; j++) {
+      for (j=0; j<chantablesize && !rcp; j++) {
         for (cip=chantable[j]; cip && !rcp; cip=cip->next) {
           if (!cip->exts[chanservext])
             continue;
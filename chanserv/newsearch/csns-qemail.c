@@ -27,7 +27,7 @@ struct searchNode *qemail_parse(searchCtx *ctx, int argc, char **argv) {
 
 void *qemail_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
   authname *ap = (authname *)theinput;
-  reguser *rup = ap->exts[chanservaext];
+  reguser *rup = getauthnameext(ap, chanservaext);
   if(!rup || !rup->email)
     return "";
 
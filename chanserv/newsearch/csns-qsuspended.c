@@ -27,7 +27,7 @@ struct searchNode *qsuspended_parse(searchCtx *ctx, int argc, char **argv) {
 
 void *qsuspended_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
   authname *ap = (authname *)theinput;
-  reguser *rup = ap->exts[chanservaext];
+  reguser *rup = getauthnameext(ap, chanservaext);
   if(!rup || !UHasSuspension(rup))
     return NULL;
 
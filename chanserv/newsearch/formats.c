@@ -100,7 +100,7 @@ void printauth(searchCtx *ctx, nick *sender, authname *anp) {
   int space = 0;
 */
 
-  if (!(rup=anp->exts[chanservaext]))
+  if (!(rup=getauthnameext(anp, chanservaext)))
     return;
 
 /*
@@ -3,6 +3,7 @@
 #include "chanserv_newsearch.h"
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 
 static char *concatargs(int cargc, char **cargv) {
   static char bigbuf[1024];
@@ -92,6 +93,30 @@ void showheader(void *source, void *header) {
   chanservstdmessage(source, iheader);
 }
 
+/* An address without wildcards can come straight out of the email hash */
+static int cs_spewexactemail(nick *sender, char *email) {
+  reguser *rup;
+  char timebuf[TIMELEN];
+  int count=0;
+
+  chanservstdmessage(sender, QM_SPEWHEADER);
+  for(rup=findreguserbyemail(email);rup;rup=nextreguserbyemail(rup)) {
+    if(count++ >= 2000) {
+      chanservsendmessage(sender, "--- More than %d matches, skipping the rest", 2000);
+      count--;
+      break;
+    }
+
+    if(rup->lastauth)
+      q9strftime(timebuf, sizeof(timebuf), rup->lastauth);
+    chanservsendmessage(sender, "%-15s %-10s %-30s %-15s %s", rup->username, UHasSuspension(rup)?"yes":"no", rup->email->content,
+                        rup->lastauth?timebuf:"(never)", rup->lastuserhost?rup->lastuserhost->content:"(no last host)");
+  }
+  chanservsendmessage(sender, "--- End of list: %d matches", count);
+
+  return CMD_OK;
+}
+
 int cs_dospewemail(void *source, int cargc, char **cargv) {
   searchASTExpr tree;
 
@@ -102,6 +127,9 @@ int cs_dospewemail(void *source, int cargc, char **cargv) {
 
   cs_log(source, "SPEWEMAIL %s", cargv[0]);
 
+  if(!strpbrk(cargv[0], "*?\\"))
+    return cs_spewexactemail(source, cargv[0]);
+
   tree = NSASTNode(match_parse, NSASTNode(qemail_parse), NSASTLiteral(cargv[0]));
   return ast_usersearch(&tree, chanservmessagewrapper, source, chanservwallwrapper, printauth, showheader, (void *)QM_SPEWHEADER, 2000, NULL);
 }
@@ -0,0 +1,51 @@
+/* Automatically generated by refactor.pl.
+ *
+ *
+ * CMDNAME: spewhost
+ * CMDLEVEL: QCMD_OPER
+ * CMDARGS: 1
+ * CMDDESC: Lists users who last authed from a given host.
+ * CMDFUNC: csu_dospewhost
+ * CMDPROTO: int csu_dospewhost(void *source, int cargc, char **cargv);
+ * CMDHELP: Usage: spewhost <host>
+ * CMDHELP: Displays all users whose last auth came from exactly the specified host.
+ */
+
+#include "../chanserv.h"
+#include "../../lib/irc_string.h"
+#include <stdio.h>
+#include <string.h>
+
+int csu_dospewhost(void *source, int cargc, char **cargv) {
+  nick *sender=source;
+  reguser *rup=getreguserfromnick(sender);
+  reguser *dbrup;
+  unsigned int count=0;
+  char timebuf[TIMELEN];
+
+  if (!rup)
+    return CMD_ERROR;
+
+  if (cargc < 1) {
+    chanservstdmessage(sender, QM_NOTENOUGHPARAMS, "spewhost");
+    return CMD_ERROR;
+  }
+
+  cs_log(sender, "SPEWHOST %s", cargv[0]);
+
+  chanservstdmessage(sender, QM_SPEWHEADER);
+  for (dbrup=findreguserbylasthost(cargv[0]); dbrup; dbrup=nextreguserbylasthost(dbrup)) {
+    if (dbrup->lastauth)
+      q9strftime(timebuf, sizeof(timebuf), dbrup->lastauth);
+    chanservsendmessage(sender, "%-15s %-10s %-30s %-15s %s", dbrup->username, UHasSuspension(dbrup)?"yes":"no", dbrup->email?dbrup->email->content:"(no email)",
+                        dbrup->lastauth?timebuf:"(never)", dbrup->lastuserhost->content);
+    count++;
+    if (count >= 2000) {
+      chanservstdmessage(sender, QM_TOOMANYRESULTS, 2000, "users");
+      return CMD_ERROR;
+    }
+  }
+  chanservstdmessage(sender, QM_RESULTCOUNT, count, "user", (count==1)?"":"s");
+
+  return CMD_OK;
+}
@@ -108,7 +108,7 @@ int dochansearch(void *source, int cargc, char **cargv) {
 
   controlreply(sender,"The following channels match your criteria:");
   
-  for(i=0;i<CHANNELHASHSIZE;i++) {
+  for(i=0;i<chantablesize;i++) {
     for(cip=chantable[i];cip;cip=cip->next) {
       for(j=0;j<numterms;j++) {
         res=(terms[j].searchfunc)((void *)cip,terms[j].params,terms[j].args);
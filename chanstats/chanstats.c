@@ -133,7 +133,7 @@ void doupdate(void *arg) {
    * Loop over all chans doing update
    */
   
-  for(i=0;i<CHANNELHASHSIZE;i++) {
+  for(i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if ((cip->channel!=NULL) || (cip->exts[csext]!=NULL)) {
         updatechanstats(cip,now);
@@ -197,7 +197,7 @@ void rotatechanstats() {
   chanindex *cip,*ncip;
   chanstats *csp;
 
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=ncip) {
       ncip=cip->next;
       
@@ -262,7 +262,7 @@ void savechanstats() {
   fprintf(fp,"\n");
   
   /* body: channel, chanstats_lastsample, samplestoday, sizetoday, <last sizes, last samples> */
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if ((chp=cip->exts[csext])==NULL) { 
         continue;
@@ -492,7 +492,7 @@ int douserhistogram(void *source, int cargc, char **cargv) {
     serverdata[i]=0;
   } 
   
-  for (i=0;i<NICKHASHSIZE;i++) {
+  for (i=0;i<nicktablesize;i++) {
     for (np=nicktable[i];np;np=np->next) {
       if (np->channels->cursi <= 20) {
         histdata[np->channels->cursi]++;
@@ -632,7 +632,7 @@ void dohist_now(int *data, float *bounds, int cats, nick *np) {
   for (i=0;i<cats;i++) 
     data[i]=0;
   
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if (cip->channel==NULL) {
         continue;
@@ -656,7 +656,7 @@ void dohist_today(int *data, float *bounds, int cats) {
   for (i=0;i<cats;i++) 
     data[i]=0;
   
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if ((csp=cip->exts[csext])==NULL) {
         continue;
@@ -680,7 +680,7 @@ void dohist_days(int *data, float *bounds, int cats, int days) {
   for (i=0;i<cats;i++) 
     data[i]=0;
   
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if ((csp=cip->exts[csext])==NULL) {
         continue;
@@ -706,7 +706,7 @@ void dohist_namelen(int *data, float *bounds, int cats) {
   for (i=0;i<cats;i++)
     data[i]=0;
     
-  for(i=0;i<CHANNELHASHSIZE;i++) {
+  for(i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       for (j=0;j<cats;j++) {
         if (cip->name->length>=bounds[j]) {
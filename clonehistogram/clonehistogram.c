@@ -41,7 +41,7 @@ int ch_chanhistogram(void *source, int cargc, char **cargv) {
 
   memset(count, 0, sizeof(count));
 
-  for (j=0;j<NICKHASHSIZE;j++) {
+  for (j=0;j<nicktablesize;j++) {
     for(np2=nicktable[j];np2;np2=np2->next) {
       total++;
       n = np2->channels->cursi;
@@ -75,7 +75,7 @@ int ch_clonehistogram(void *source, int cargc, char **cargv) {
 
   memset(count, 0, sizeof(count));
 
-  for (j=0;j<HOSTHASHSIZE;j++)
+  for (j=0;j<hosttablesize;j++)
     for(hp=hosttable[j];hp;hp=hp->next)
       if (match2strings(pattern, hp->name->content)) {
         total++;
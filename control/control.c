@@ -480,7 +480,7 @@ void noperserv_whois_account_handler(int hooknum, void *arg) {
     int i = 0;
     nick *sp;
 
-    for(;i<NICKHASHSIZE;i++)
+    for(;i<nicktablesize;i++)
       for(sp=nicktable[i];sp;sp=sp->next)
         if(IsAccount(sp) && !ircd_strcmp(sp->authname, authname)) {
           found = 1;
@@ -509,7 +509,8 @@ void noperserv_whois_account_handler(int hooknum, void *arg) {
 
 int controllistusers(void *sender, int cargc, char **cargv) {
   nick *np = (nick *)sender;
-  int i, count = 0;
+  unsigned int i;
+  int count = 0;
   authname *anp;
   no_autheduser *au;
 
@@ -517,21 +518,23 @@ int controllistusers(void *sender, int cargc, char **cargv) {
 
   registerhook(HOOK_CONTROL_WHOISREPLY, &handlewhois);
 
-  for (i=0;i<AUTHNAMEHASHSIZE;i++) {
-    for (anp=authnametable[i];anp;anp=anp->next) {
-      au = noperserv_get_autheduser(anp);
-      if(!au)
-        continue;
+  for (i=0;i<authnametablesize;i++) {
+    anp = authnametable[i];
+    if (!AUTHNAMESLOTUSED(anp))
+      continue;
 
-      if (count > 0)
-        controlreply(np, "---");
+    au = noperserv_get_autheduser(anp);
+    if(!au)
+      continue;
 
-      controlreply(np, "Account   : %s", au->authname->name);
-      noperserv_whois_account_handler(HOOK_CONTROL_WHOISREQUEST_AUTHEDUSER, (void *)au);
-      controlreply(np, "Flags     : %s", printflags(NOGetAuthLevel(au), no_userflags));
+    if (count > 0)
+      controlreply(np, "---");
 
-      count++;
-    }
+    controlreply(np, "Account   : %s", au->authname->name);
+    noperserv_whois_account_handler(HOOK_CONTROL_WHOISREQUEST_AUTHEDUSER, (void *)au);
+    controlreply(np, "Flags     : %s", printflags(NOGetAuthLevel(au), no_userflags));
+
+    count++;
   }
 
   deregisterhook(HOOK_CONTROL_WHOISREPLY, &handlewhois);
@@ -843,7 +846,7 @@ void controlwall(flag_t permissionlevel, flag_t noticelevel, char *format, ...)
   char buf[512];
   va_list va;
   char *flags = printflags(noticelevel, no_noticeflags) + 1;
-  int i;
+  unsigned int i;
   authname *anp;
   no_autheduser *au;
   nick *np;
@@ -854,16 +857,18 @@ void controlwall(flag_t permissionlevel, flag_t noticelevel, char *format, ...)
 
   Error("noperserv", ERR_INFO, "$%s$ %s", flags, buf);
 
-  for (i=0;i<AUTHNAMEHASHSIZE;i++) {
-    for (anp=authnametable[i];anp;anp=anp->next) {
-      au = noperserv_get_autheduser(anp);
-      if(!au)
-        continue;
-      if((NOGetNoticeLevel(au) & noticelevel) && !(NOGetAuthLevel(au) & __NO_RELAY)) {
-        for(np=anp->nicks;np;np=np->nextbyauthname)
-          if(noperserv_policy_command_permitted(permissionlevel, np))
-            controlreply(np, "$%s$ %s", flags, buf);
-      }
+  for (i=0;i<authnametablesize;i++) {
+    anp = authnametable[i];
+    if (!AUTHNAMESLOTUSED(anp))
+      continue;
+
+    au = noperserv_get_autheduser(anp);
+    if(!au)
+      continue;
+    if((NOGetNoticeLevel(au) & noticelevel) && !(NOGetAuthLevel(au) & __NO_RELAY)) {
+      for(np=anp->nicks;np;np=np->nextbyauthname)
+        if(noperserv_policy_command_permitted(permissionlevel, np))
+          controlreply(np, "$%s$ %s", flags, buf);
     }
   }
 }
@@ -957,7 +962,7 @@ void controlnoticeopers(flag_t permissionlevel, flag_t noticelevel, char *format
   vsnprintf(broadcast, sizeof(broadcast), format, va);
   va_end(va);
 
-  for(i=0;i<NICKHASHSIZE;i++)
+  for(i=0;i<nicktablesize;i++)
     for(np=nicktable[i];np;np=np->next)
       if (IsOper(np))
         controlnotice(np, "%s", broadcast);
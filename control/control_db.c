@@ -84,20 +84,18 @@ void noperserv_create_tables(void) {
 }
 
 void noperserv_cleanup_db(void) {
-  int i;
-  authname *anp, *next;
+  unsigned int i;
+  authname *anp;
   no_autheduser *au;
 
-  for (i=0;i<AUTHNAMEHASHSIZE;i++) {
-    for (anp=authnametable[i];anp;) {
-      next = anp->next;
-
-      au = anp->exts[noperserv_ext];
-      if(au)
-        noperserv_free_user(au);
+  for (i=0;i<authnametablesize;i++) {
+    anp = authnametable[i];
+    if(!AUTHNAMESLOTUSED(anp))
+      continue;
 
-      anp = next;
-    }
+    au = getauthnameext(anp, noperserv_ext);
+    if(au)
+      noperserv_free_user(au);
   }
 
   nodb->close(nodb);
@@ -121,7 +119,7 @@ no_autheduser *noperserv_new_autheduser(unsigned long userid, char *name) {
   loadedusers++;
   au->newuser = 1;
 
-  anp->exts[noperserv_ext] = au;
+  setauthnameext(anp, noperserv_ext, au);
 
   return au;
 }
@@ -144,7 +142,7 @@ void noperserv_update_autheduser(no_autheduser *au) {
 
 void noperserv_free_user(no_autheduser *au) {
   authname *anp = au->authname;
-  anp->exts[noperserv_ext] = NULL;
+  setauthnameext(anp, noperserv_ext, NULL);
   releaseauthname(anp);
   free(au);
 
@@ -155,7 +153,7 @@ no_autheduser *noperserv_get_autheduser(authname *anp) {
   if (!anp)
     return NULL;
 
-  return anp->exts[noperserv_ext];
+  return getauthnameext(anp, noperserv_ext);
 }
 
 unsigned long noperserv_get_autheduser_count(void) {
@@ -6,8 +6,9 @@
 #include <stdlib.h>
 #include "error.h"
 #include "hooks.h"
+#include "nslog.h"
 
-FILE *logfile;
+static nslog *mainlog;
 
 static corehandler *coreh, *coret;
 
@@ -36,33 +37,24 @@ char *sevtostring(int severity) {
   }
 }
 
-void reopen_logfile(int hooknum, void *arg) {
-  if (logfile)
-    fclose(logfile);
-  
-  logfile=fopen("logs/newserv.log","a");
-}
-
 void init_logfile() {
-  logfile=fopen("logs/newserv.log","a");
-  if (!logfile) {
+  mainlog=nslogopen("logs/newserv.log",0666);
+  if (!mainlog || mainlog->fd<0) {
     fprintf(stderr,"Failed to open logfile...\n");
   }
-  registerhook(HOOK_CORE_SIGUSR1, reopen_logfile);
 }
 
 void fini_logfile() {
-  deregisterhook(HOOK_CORE_SIGUSR1, reopen_logfile);
-  if (logfile)
-    fclose(logfile);
+  nslogclose(mainlog);
+  mainlog=NULL;
 }
 
 void Error(char *source, int severity, char *reason, ... ) {
   char buf[512];
   va_list va;
-  struct tm *tm;
   time_t now;
-  char timebuf[100];
+  static time_t lasttime;
+  static char timebuf[100];
   struct error_event evt;
     
   va_start(va,reason);
@@ -76,19 +68,23 @@ void Error(char *source, int severity, char *reason, ... ) {
   
   if (severity>ERR_DEBUG) {
     now=time(NULL);
-    tm=gmtime(&now);
-    strftime(timebuf,100,"%Y-%m-%d %H:%M:%S",tm);
+    if (now!=lasttime) {
+      strftime(timebuf,100,"%Y-%m-%d %H:%M:%S",gmtime(&now));
+      lasttime=now;
+    }
     fprintf(stderr,"[%s] %s(%s): %s\n",timebuf,sevtostring(severity),source,buf);
     fflush(stderr);
 
-    if (logfile)  {
-      fprintf(logfile,"[%s] %s(%s): %s\n",timebuf,sevtostring(severity),source,buf);
-      fflush(logfile);
-    }
+    nslogprintf(mainlog,"[%s] %s(%s): %s\n",timebuf,sevtostring(severity),source,buf);
+
+    /* Don't hold back anything someone might be about to go looking for */
+    if (severity>=ERR_ERROR)
+      nslogflush(mainlog);
   }
   
   if (severity>=ERR_STOP) {
     fprintf(stderr,"Terminal error occured, exiting...\n");
+    nslogflushall(1);
     triggerhook(HOOK_CORE_STOPERROR, NULL);
     exit(0);
   }
@@ -3,6 +3,7 @@
 #include "hooks.h"
 #include <assert.h>
 #include "../core/error.h"
+#include "../core/metrics.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,11 +25,13 @@ typedef struct HookHead {
 static HookHead hooks[HOOKMAX];
 static int dirtyhooks[HOOKMAX];
 static int dirtyhookcount;
+static metric *hookmetrics[HOOKMAX];
 
 unsigned int hookqueuelength = 0;
 
 static void collectgarbage(HookHead *h);
 static void markdirty(int hook);
+static void hookprofiled(int hooknum, uint64_t elapsed);
 
 void inithooks() {
 }
@@ -94,10 +97,18 @@ int deregisterhook(int hooknum, HookCallback callback) {
 void triggerhook(int hooknum, void *arg) {
   int i;
   Hook *hp;
+  uint64_t start=0, hookstart=0;
 
   if (hooknum>HOOKMAX)
     return;
-    
+
+  /* Only time outermost hooks, nested ones are included in those */
+  if (!hookqueuelength && hooklatencymetric)
+    start=metricclock();
+
+  if (hookprofile)
+    hookstart=metricclock();
+
   hookqueuelength++;
   for(hp=hooks[hooknum].head;hp;hp=hp->next) {
     if(hp->callback)
@@ -105,6 +116,12 @@ void triggerhook(int hooknum, void *arg) {
   }
   hookqueuelength--;
 
+  if (start)
+    metricobserve(hooklatencymetric, metricclock()-start);
+
+  if (hookstart)
+    hookprofiled(hooknum, metricclock()-hookstart);
+
   if (!hookqueuelength && hooknum!=HOOK_CORE_ENDOFHOOKSQUEUE) {
     triggerhook(HOOK_CORE_ENDOFHOOKSQUEUE, 0);
 
@@ -115,6 +132,22 @@ void triggerhook(int hooknum, void *arg) {
   }
 }
 
+/* Per hook times include any hooks triggered from inside it */
+static void hookprofiled(int hooknum, uint64_t elapsed) {
+  char name[METRICNAMELEN];
+
+  if (!hookmetrics[hooknum]) {
+    snprintf(name, sizeof(name), "core_hook_%d_us", hooknum);
+    if (!(hookmetrics[hooknum]=registermetric(name, METRIC_HISTOGRAM))) {
+      Error("core", ERR_WARNING, "Unable to register %s, hook profiling disabled.", name);
+      hookprofile=0;
+      return;
+    }
+  }
+
+  metricobserve(hookmetrics[hooknum], elapsed);
+}
+
 static void markdirty(int hook) {
   if(hooks[hook].dirty)
     return;
@@ -7,6 +7,8 @@
 #include "config.h"
 #include "error.h"
 #include "nsmalloc.h"
+#include "metrics.h"
+#include "nslog.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -43,6 +45,7 @@ int main(int argc, char **argv) {
   inithandlers();
   initschedule();
 
+  initnslog();
   init_logfile();
   
   if (argc>1) {
@@ -65,6 +68,9 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  initmetrics();
+  initnslogmetrics();
+
   /* Loading the modules will bring in the bulk of the code */
   initmodules();
   signal(SIGPIPE, SIG_IGN);
@@ -77,6 +83,7 @@ int main(int argc, char **argv) {
   for(;;) {
     handleevents(10);  
     doscheduledevents(time(NULL));
+    nslogflushall(0);
 
     if (newserv_shutdown_pending) {
       newserv_shutdown();
@@ -87,8 +94,11 @@ int main(int argc, char **argv) {
   }  
 
   freeconfig();
+  fininslogmetrics();
+  finimetrics();
 
   fini_logfile();
+  fininslog();
   finischedule();
   finihandlers();
 
@@ -149,6 +159,7 @@ void sighuphandler(int sig) {
 }
 
 void sigsegvhandler(int sig) {
+  nslogflushall(1);
   handlecore();
 
   oldsegv(sig);
@@ -0,0 +1,153 @@
+/* metrics.c */
+
+#define _GNU_SOURCE
+
+#include "metrics.h"
+#include "config.h"
+#include "error.h"
+#include "../lib/sstring.h"
+#include "../lib/strlfunc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define METRICSMAPSIZE (sizeof(struct metricshdr) + MAXMETRICS * sizeof(metric))
+
+struct metricshdr *metricshdr;
+metric *metrics;
+
+metric *hooklatencymetric;
+int hookprofile;
+
+static void *metricsmap;
+
+void initmetrics(void) {
+  sstring *filename;
+  int fd=-1;
+
+  filename=getcopyconfigitem("core","metricsfile","data/metrics",100);
+
+  if (filename && *filename->content) {
+    if ((fd=open(filename->content, O_RDWR|O_CREAT|O_TRUNC, 0644))<0 || ftruncate(fd, METRICSMAPSIZE)) {
+      Error("core",ERR_WARNING,"Unable to create metrics file %s, metrics will not be exported.",filename->content);
+      if (fd>=0)
+        close(fd);
+      fd=-1;
+    }
+  }
+  freesstring(filename);
+
+  filename=getcopyconfigitem("core","hookprofile","0",10);
+  hookprofile=atoi(filename->content);
+  freesstring(filename);
+
+  if (fd>=0) {
+    metricsmap=mmap(NULL, METRICSMAPSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  } else {
+    metricsmap=mmap(NULL, METRICSMAPSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  }
+
+  if (metricsmap==MAP_FAILED)
+    Error("core",ERR_STOP,"Unable to map metrics table.");
+
+  memset(metricsmap, 0, METRICSMAPSIZE);
+
+  metricshdr=(struct metricshdr *)metricsmap;
+  metrics=(metric *)(metricshdr+1);
+
+  metricshdr->version=METRICS_VERSION;
+  metricshdr->maxmetrics=MAXMETRICS;
+  metricshdr->slotsize=sizeof(metric);
+  metricshdr->starttime=time(NULL);
+  metricshdr->pid=getpid();
+
+  /* Publish the magic last so a reader never sees a half initialised header */
+  __atomic_store_n(&metricshdr->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+
+  hooklatencymetric=registermetric("core_hook_latency_us", METRIC_HISTOGRAM);
+}
+
+void finimetrics(void) {
+  if (!metricsmap)
+    return;
+
+  hooklatencymetric=NULL;
+  hookprofile=0;
+  munmap(metricsmap, METRICSMAPSIZE);
+  metricsmap=NULL;
+  metricshdr=NULL;
+  metrics=NULL;
+}
+
+static void bumpgeneration(void) {
+  __atomic_store_n(&metricshdr->generation, metricshdr->generation+1, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+metric *findmetric(const char *name) {
+  unsigned int i;
+
+  if (!metrics)
+    return NULL;
+
+  for (i=0;i<MAXMETRICS;i++)
+    if (metrics[i].type!=METRIC_FREE && !strcmp(metrics[i].name, name))
+      return &metrics[i];
+
+  return NULL;
+}
+
+metric *registermetric(const char *name, int type) {
+  metric *mp=NULL;
+  unsigned int i;
+
+  if (!metrics || type==METRIC_FREE)
+    return NULL;
+
+  if (findmetric(name)) {
+    Error("core",ERR_WARNING,"Metric %s registered twice.",name);
+    return NULL;
+  }
+
+  for (i=0;i<MAXMETRICS;i++) {
+    if (metrics[i].type==METRIC_FREE) {
+      mp=&metrics[i];
+      break;
+    }
+  }
+
+  if (!mp) {
+    Error("core",ERR_WARNING,"Metrics table full, not registering %s.",name);
+    return NULL;
+  }
+
+  bumpgeneration();
+  memset(mp, 0, sizeof(metric));
+  strlcpy(mp->name, name, sizeof(mp->name));
+  mp->type=type;
+  bumpgeneration();
+
+  return mp;
+}
+
+void deregistermetric(metric *mp) {
+  if (!mp || !metrics)
+    return;
+
+  bumpgeneration();
+  memset(mp, 0, sizeof(metric));
+  bumpgeneration();
+}
+
+uint64_t metricclock(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
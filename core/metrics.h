@@ -0,0 +1,105 @@
+/* metrics.h */
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdint.h>
+
+/*
+ * Counters, gauges and histograms live in a fixed table of slots which is
+ * mapped MAP_SHARED from a file (core.metricsfile), so a local scraper can
+ * read them at any time without talking to us.
+ *
+ * Only the main thread writes.  Values are aligned 64-bit words updated
+ * with single stores, so readers never see a torn value.  Registering or
+ * removing a metric bumps the header generation to odd before touching
+ * the slot and back to even afterwards; readers retry if it was odd or
+ * changed while they read names.
+ */
+
+#define METRICS_MAGIC       0x4e534d54U  /* "NSMT" */
+#define METRICS_VERSION     1
+
+#define MAXMETRICS          256
+#define METRICNAMELEN       56
+#define METRICHISTBUCKETS   22           /* bucket n counts values in [2^(n-1), 2^n), last one is open */
+
+#define METRIC_FREE         0
+#define METRIC_COUNTER      1
+#define METRIC_GAUGE        2
+#define METRIC_HISTOGRAM    3
+
+struct metricshdr {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t maxmetrics;
+  uint32_t slotsize;
+  uint64_t generation;
+  uint64_t starttime;
+  uint64_t pid;
+  uint64_t spare[3];
+};
+
+typedef struct metric {
+  char name[METRICNAMELEN];
+  uint32_t type;
+  uint32_t spare;
+  uint64_t value;                       /* counter/gauge value, histogram observation count */
+  uint64_t sum;                         /* histogram sum of observations */
+  uint64_t buckets[METRICHISTBUCKETS];
+} metric;
+
+extern struct metricshdr *metricshdr;
+extern metric *metrics;
+
+/* Core metrics, registered by initmetrics() */
+extern metric *hooklatencymetric;
+
+/* core.hookprofile: also time every hook number into its own core_hook_<n>_us */
+extern int hookprofile;
+
+void initmetrics(void);
+void finimetrics(void);
+
+metric *registermetric(const char *name, int type);
+void deregistermetric(metric *mp);
+metric *findmetric(const char *name);
+
+/* Monotonic clock in microseconds, for timing things into histograms */
+uint64_t metricclock(void);
+
+#define metricstore(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/* All of these accept NULL so callers needn't care if the table was full */
+static inline void metricadd(metric *mp, uint64_t n) {
+  if (mp)
+    metricstore(mp->value, mp->value + n);
+}
+
+static inline void metricinc(metric *mp) {
+  metricadd(mp, 1);
+}
+
+static inline void metricset(metric *mp, uint64_t v) {
+  if (mp)
+    metricstore(mp->value, v);
+}
+
+static inline void metricobserve(metric *mp, uint64_t v) {
+  unsigned int bucket=0;
+  uint64_t x=v;
+
+  if (!mp)
+    return;
+
+  while (x && bucket < METRICHISTBUCKETS-1) {
+    x>>=1;
+    bucket++;
+  }
+
+  metricstore(mp->buckets[bucket], mp->buckets[bucket] + 1);
+  metricstore(mp->sum, mp->sum + v);
+  metricstore(mp->value, mp->value + 1);
+}
+
+#endif
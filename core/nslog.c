@@ -0,0 +1,250 @@
+/* nslog.c */
+
+#define _GNU_SOURCE
+
+#include "nslog.h"
+#include "hooks.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+static nslog *logs;
+static size_t queuedbytes;
+static metric *queuedmetric, *writtenmetric, *droppedmetric, *flushesmetric;
+
+static void nslogstats(int hooknum, void *arg);
+static void nslogusr1(int hooknum, void *arg);
+
+void initnslog(void) {
+  registerhook(HOOK_CORE_SIGUSR1, &nslogusr1);
+  registerhook(HOOK_CORE_STATSREQUEST, &nslogstats);
+}
+
+void fininslog(void) {
+  deregisterhook(HOOK_CORE_STATSREQUEST, &nslogstats);
+  deregisterhook(HOOK_CORE_SIGUSR1, &nslogusr1);
+
+  while (logs)
+    nslogclose(logs);
+}
+
+/* The metrics table doesn't exist yet when the first logs are opened */
+void initnslogmetrics(void) {
+  queuedmetric=registermetric("log_queued_bytes", METRIC_GAUGE);
+  writtenmetric=registermetric("log_written_bytes", METRIC_COUNTER);
+  droppedmetric=registermetric("log_dropped_bytes", METRIC_COUNTER);
+  flushesmetric=registermetric("log_flushes", METRIC_COUNTER);
+}
+
+void fininslogmetrics(void) {
+  deregistermetric(queuedmetric);
+  deregistermetric(writtenmetric);
+  deregistermetric(droppedmetric);
+  deregistermetric(flushesmetric);
+  queuedmetric=writtenmetric=droppedmetric=flushesmetric=NULL;
+}
+
+static int nslogopenfd(nslog *lp) {
+  return open(lp->filename, O_WRONLY|O_CREAT|O_APPEND, lp->mode);
+}
+
+/* Always returns a log, if the file can't be opened lines are just counted as dropped */
+nslog *nslogopen(const char *filename, int mode) {
+  nslog *lp;
+
+  if (!(lp=malloc(sizeof(nslog))))
+    return NULL;
+
+  lp->filename=strdup(filename);
+  lp->buf=malloc(NSLOG_BUFSIZE);
+  if (!lp->filename || !lp->buf) {
+    free(lp->filename);
+    free(lp->buf);
+    free(lp);
+    return NULL;
+  }
+
+  lp->mode=mode;
+  lp->len=0;
+  lp->firstqueued=0;
+  lp->written=lp->dropped=lp->flushes=0;
+  lp->fd=nslogopenfd(lp);
+
+  lp->next=logs;
+  logs=lp;
+
+  return lp;
+}
+
+void nslogclose(nslog *lp) {
+  nslog **lh;
+
+  if (!lp)
+    return;
+
+  nslogflush(lp);
+
+  for (lh=&logs;*lh;lh=&((*lh)->next)) {
+    if (*lh==lp) {
+      *lh=lp->next;
+      break;
+    }
+  }
+
+  if (lp->len) {
+    lp->dropped+=lp->len;
+    metricadd(droppedmetric, lp->len);
+    queuedbytes-=lp->len;
+    metricset(queuedmetric, queuedbytes);
+  }
+
+  if (lp->fd>=0)
+    close(lp->fd);
+
+  free(lp->filename);
+  free(lp->buf);
+  free(lp);
+}
+
+void nslogflush(nslog *lp) {
+  size_t done=0;
+  ssize_t res;
+
+  if (!lp || !lp->len || lp->fd<0)
+    return;
+
+  while (done < lp->len) {
+    res=write(lp->fd, lp->buf + done, lp->len - done);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      break;
+    done+=res;
+  }
+
+  lp->flushes++;
+  metricinc(flushesmetric);
+
+  if (!done)
+    return;
+
+  lp->written+=done;
+  metricadd(writtenmetric, done);
+  queuedbytes-=done;
+  metricset(queuedmetric, queuedbytes);
+
+  /* Keep anything the kernel wouldn't take for the next attempt */
+  lp->len-=done;
+  if (lp->len) {
+    memmove(lp->buf, lp->buf + done, lp->len);
+    lp->firstqueued=metricclock();
+  }
+}
+
+void nslogwrite(nslog *lp, const char *line, size_t len) {
+  if (!lp)
+    return;
+
+  if (lp->fd<0 || len > NSLOG_BUFSIZE) {
+    lp->dropped+=len;
+    metricadd(droppedmetric, len);
+    return;
+  }
+
+  if (lp->len + len > NSLOG_BUFSIZE) {
+    nslogflush(lp);
+    if (lp->len + len > NSLOG_BUFSIZE) {
+      lp->dropped+=len;
+      metricadd(droppedmetric, len);
+      return;
+    }
+  }
+
+  if (!lp->len)
+    lp->firstqueued=metricclock();
+
+  memcpy(lp->buf + lp->len, line, len);
+  lp->len+=len;
+  queuedbytes+=len;
+  metricset(queuedmetric, queuedbytes);
+
+  if (lp->len >= NSLOG_FLUSHSIZE)
+    nslogflush(lp);
+}
+
+void nslogprintf(nslog *lp, const char *format, ...) {
+  char buf[1024];
+  va_list va;
+  int len;
+
+  va_start(va, format);
+  len=vsnprintf(buf, sizeof(buf), format, va);
+  va_end(va);
+
+  if (len < 0)
+    return;
+
+  if (len >= sizeof(buf))
+    len=sizeof(buf)-1;
+
+  nslogwrite(lp, buf, len);
+}
+
+/* Called every pass of the main loop, only logs whose oldest line is due get written unless forced */
+void nslogflushall(int force) {
+  uint64_t now=0;
+  nslog *lp;
+
+  for (lp=logs;lp;lp=lp->next) {
+    if (!lp->len)
+      continue;
+
+    if (!force) {
+      if (!now)
+        now=metricclock();
+      if (now - lp->firstqueued < NSLOG_COMMITDELAY)
+        continue;
+    }
+
+    nslogflush(lp);
+  }
+}
+
+void nslogreopenall(void) {
+  nslog *lp;
+
+  for (lp=logs;lp;lp=lp->next) {
+    nslogflush(lp);
+
+    if (lp->fd>=0)
+      close(lp->fd);
+
+    lp->fd=nslogopenfd(lp);
+  }
+}
+
+static void nslogusr1(int hooknum, void *arg) {
+  nslogreopenall();
+}
+
+static void nslogstats(int hooknum, void *arg) {
+  long level=(long)arg;
+  char buf[512];
+  nslog *lp;
+
+  if (level>10) {
+    for (lp=logs;lp;lp=lp->next) {
+      snprintf(buf,sizeof(buf),"Logs    : %s: %lu queued, %llu written, %llu dropped, %llu flushes%s",
+        lp->filename,(unsigned long)lp->len,lp->written,lp->dropped,lp->flushes,lp->fd<0?" (not open)":"");
+      triggerhook(HOOK_CORE_STATSREPLY,(void *)buf);
+    }
+  }
+}
@@ -0,0 +1,48 @@
+/* nslog.h */
+
+#ifndef __NSLOG_H
+#define __NSLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Buffered append-only logfiles.
+ *
+ * Lines are queued per log and written in one go once the oldest has been
+ * waiting NSLOG_COMMITDELAY, the buffer passes NSLOG_FLUSHSIZE, or something
+ * bad happens (ERR_STOP, SIGSEGV).  The main loop calls nslogflushall() once
+ * per pass, so a busy log costs one write() per pass rather than one per
+ * line.  On SIGUSR1 whatever is queued goes to the old file before it is
+ * reopened.  If the buffer is full and the write fails the line is dropped
+ * and counted rather than blocking the service.
+ */
+
+#define NSLOG_BUFSIZE       262144
+#define NSLOG_FLUSHSIZE     65536
+#define NSLOG_COMMITDELAY   200000  /* microseconds */
+
+typedef struct nslog {
+  char *filename;
+  int fd, mode;
+  char *buf;
+  size_t len;
+  uint64_t firstqueued;
+  unsigned long long written, dropped, flushes;
+  struct nslog *next;
+} nslog;
+
+void initnslog(void);
+void fininslog(void);
+void initnslogmetrics(void);
+void fininslogmetrics(void);
+
+nslog *nslogopen(const char *filename, int mode);
+void nslogclose(nslog *lp);
+void nslogwrite(nslog *lp, const char *line, size_t len);
+void nslogprintf(nslog *lp, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+void nslogflush(nslog *lp);
+void nslogflushall(int force);
+void nslogreopenall(void);
+
+#endif
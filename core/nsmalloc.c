@@ -16,7 +16,132 @@
 
 struct nsmpool nsmpools[MAXPOOL];
 
-void *nsmalloc(unsigned int poolid, size_t size) {
+struct nsmsite nsmsites[NSM_MAXSITES];
+unsigned int nsmsamplerate;
+unsigned long nsmsamplecount;
+
+struct nsmsample {
+  void *ptr;
+  struct nsmsite *site;
+  size_t size;
+};
+
+static struct nsmsample nsmsamples[NSM_MAXSAMPLES];
+static unsigned int nsmsamplecountdown;
+
+#define nsmsamplehash(x) ((unsigned int)(((uintptr_t)(x) * 0x9E3779B97F4A7C15ULL) >> 40) & (NSM_MAXSAMPLES-1))
+#define nsmsitehash(x) ((unsigned int)(((uintptr_t)(x) * 0x9E3779B97F4A7C15ULL) >> 40) & (NSM_MAXSITES-1))
+
+static inline void nsmaccount(struct nsmpool *pool, size_t size) {
+  unsigned int class=nssizeclass(size);
+
+  pool->size+=size;
+  pool->count++;
+  pool->sumsq+=(unsigned long long)size * size;
+  pool->classcount[class]++;
+  pool->classsize[class]+=size;
+
+  if (pool->size > pool->peaksize)
+    pool->peaksize=pool->size;
+}
+
+static inline void nsmunaccount(struct nsmpool *pool, size_t size) {
+  unsigned int class=nssizeclass(size);
+
+  pool->size-=size;
+  pool->count--;
+  pool->sumsq-=(unsigned long long)size * size;
+  pool->classcount[class]--;
+  pool->classsize[class]-=size;
+}
+
+static struct nsmsite *nsmfindsite(unsigned int poolid, void *caller) {
+  unsigned int i, n;
+  struct nsmsite *sp;
+
+  for (i=nsmsitehash(caller),n=0;n<NSM_MAXSITES;i=(i+1)&(NSM_MAXSITES-1),n++) {
+    sp=&nsmsites[i];
+    if (!sp->caller) {
+      sp->caller=caller;
+      sp->poolid=poolid;
+      return sp;
+    }
+    if (sp->caller==caller && sp->poolid==poolid)
+      return sp;
+  }
+
+  return NULL;
+}
+
+static void nsmsample(unsigned int poolid, void *ptr, size_t size, void *caller) {
+  struct nsmsite *sp;
+  unsigned int i;
+
+  /* Keep the sample table at most 3/4 full */
+  if (nsmsamplecount >= NSM_MAXSAMPLES/4*3)
+    return;
+
+  if (!(sp=nsmfindsite(poolid, caller)))
+    return;
+
+  for (i=nsmsamplehash(ptr);nsmsamples[i].ptr;i=(i+1)&(NSM_MAXSAMPLES-1))
+    ;
+
+  nsmsamples[i].ptr=ptr;
+  nsmsamples[i].site=sp;
+  nsmsamples[i].size=size;
+  nsmsamplecount++;
+
+  sp->allocs++;
+  sp->count++;
+  sp->size+=size;
+}
+
+static struct nsmsample *nsmfindsample(void *ptr) {
+  unsigned int i;
+
+  for (i=nsmsamplehash(ptr);nsmsamples[i].ptr;i=(i+1)&(NSM_MAXSAMPLES-1))
+    if (nsmsamples[i].ptr==ptr)
+      return &nsmsamples[i];
+
+  return NULL;
+}
+
+static void nsmunsample(struct nsmsample *smp) {
+  unsigned int i, j, k;
+
+  smp->site->count--;
+  smp->site->size-=smp->size;
+  nsmsamplecount--;
+
+  /* Backward shift deletion: pull later entries of the probe run into the hole */
+  i=j=smp-nsmsamples;
+  for (;;) {
+    j=(j+1)&(NSM_MAXSAMPLES-1);
+    if (!nsmsamples[j].ptr)
+      break;
+
+    k=nsmsamplehash(nsmsamples[j].ptr);
+    if ((i<=j) ? (i<k && k<=j) : (i<k || k<=j))
+      continue;
+
+    nsmsamples[i]=nsmsamples[j];
+    i=j;
+  }
+
+  nsmsamples[i].ptr=NULL;
+}
+
+void nssetsamplerate(unsigned int rate) {
+  nsmsamplerate=rate;
+  nsmsamplecountdown=rate;
+
+  /* Forget sites with nothing left to report */
+  if (!nsmsamplecount)
+    memset(nsmsites, 0, sizeof(nsmsites));
+}
+
+static void *nsmalloc_r(unsigned int poolid, size_t size, void *caller) {
   struct nsminfo *nsmp;
   
   if (poolid >= MAXPOOL)
@@ -31,8 +156,8 @@ void *nsmalloc(unsigned int poolid, size_t size) {
   VALGRIND_CREATE_MEMPOOL(nsmp, 0, 0);
 
   nsmp->size=size;
-  nsmpools[poolid].size+=size;
-  nsmpools[poolid].count++;
+  nsmaccount(&nsmpools[poolid], size);
+  nsmpools[poolid].allocs++;
 
   if (nsmpools[poolid].blocks) {
     nsmpools[poolid].blocks->prev = nsmp;
@@ -46,14 +171,23 @@ void *nsmalloc(unsigned int poolid, size_t size) {
   nsmp->redzone = REDZONE_MAGIC;
   VALGRIND_MAKE_MEM_NOACCESS(&nsmp->redzone, sizeof(nsmp->redzone));
 
+  if (nsmsamplerate && --nsmsamplecountdown == 0) {
+    nsmsamplecountdown=nsmsamplerate;
+    nsmsample(poolid, nsmp->data, size, caller);
+  }
+
   return (void *)nsmp->data;
 }
 
+void *nsmalloc(unsigned int poolid, size_t size) {
+  return nsmalloc_r(poolid, size, __builtin_return_address(0));
+}
+
 void *nscalloc(unsigned int poolid, size_t nmemb, size_t size) {
   size_t total = nmemb * size;
   void *m;
 
-  m = nsmalloc(poolid, total);
+  m = nsmalloc_r(poolid, total, __builtin_return_address(0));
   if(!m)
     return NULL;
 
@@ -77,14 +211,20 @@ void nsfree(unsigned int poolid, void *ptr) {
   if (nsmp->prev) {
     nsmp->prev->next = nsmp->next;
   } else
-    nsmpools[poolid].blocks = NULL;
+    nsmpools[poolid].blocks = nsmp->next;
 
   if (nsmp->next) {
     nsmp->next->prev = nsmp->prev;
   }
 
-  nsmpools[poolid].size-=nsmp->size;
-  nsmpools[poolid].count--;
+  nsmunaccount(&nsmpools[poolid], nsmp->size);
+  nsmpools[poolid].frees++;
+
+  if (nsmsamplecount) {
+    struct nsmsample *smp=nsmfindsample(ptr);
+    if (smp)
+      nsmunsample(smp);
+  }
 
   VALGRIND_MEMPOOL_FREE(nsmp, nsmp->data);
 
@@ -96,9 +236,10 @@ void nsfree(unsigned int poolid, void *ptr) {
 
 void *nsrealloc(unsigned int poolid, void *ptr, size_t size) {
   struct nsminfo *nsmp, *nsmpn;
+  struct nsmsample *smp;
 
   if (ptr == NULL)
-    return nsmalloc(poolid, size);
+    return nsmalloc_r(poolid, size, __builtin_return_address(0));
 
   if (size == 0) {
     nsfree(poolid, ptr);
@@ -116,13 +257,26 @@ void *nsrealloc(unsigned int poolid, void *ptr, size_t size) {
   if (size == nsmp->size)
     return (void *)nsmp->data;
 
+  smp=nsmsamplecount?nsmfindsample(ptr):NULL;
+
   nsmpn=(struct nsminfo *)realloc(nsmp, sizeof(struct nsminfo)+size);
   if (!nsmpn)
     return NULL;
 
   VALGRIND_MOVE_MEMPOOL(nsmp, nsmpn);
 
-  nsmpools[poolid].size+=size-nsmpn->size;
+  nsmunaccount(&nsmpools[poolid], nsmpn->size);
+  nsmaccount(&nsmpools[poolid], size);
+
+  /* The sample stays with its original caller, rehash it under the new address */
+  if (smp) {
+    struct nsmsite *sp=smp->site;
+
+    nsmunsample(smp);
+    sp->allocs--;
+    nsmsample(poolid, nsmpn->data, size, sp->caller);
+  }
+
   nsmpn->size=size;
 
   if (nsmpn->prev) {
@@ -147,15 +301,26 @@ void nsfreeall(unsigned int poolid) {
  
   for (nsmp=nsmpools[poolid].blocks;nsmp;nsmp=nnsmp) {
     nnsmp=nsmp->next;
+
+    if (nsmsamplecount) {
+      struct nsmsample *smp=nsmfindsample(nsmp->data);
+      if (smp)
+        nsmunsample(smp);
+    }
+
     VALGRIND_MEMPOOL_FREE(nsmp, nsmp->data);
 
     VALGRIND_DESTROY_MEMPOOL(nsmp);
     free(nsmp);
   }
   
+  nsmpools[poolid].frees+=nsmpools[poolid].count;
   nsmpools[poolid].blocks=NULL;
   nsmpools[poolid].size=0;
   nsmpools[poolid].count=0;
+  nsmpools[poolid].sumsq=0;
+  memset(nsmpools[poolid].classcount, 0, sizeof(nsmpools[poolid].classcount));
+  memset(nsmpools[poolid].classsize, 0, sizeof(nsmpools[poolid].classsize));
 }
 
 void nscheckfreeall(unsigned int poolid) {
@@ -170,6 +335,9 @@ void nscheckfreeall(unsigned int poolid) {
 
 void nsinit(void) {
   memset(nsmpools, 0, sizeof(nsmpools));
+  memset(nsmsites, 0, sizeof(nsmsites));
+  memset(nsmsamples, 0, sizeof(nsmsamples));
+  nsmsamplecount=0;
 }
 
 void nsexit(void) {
@@ -23,6 +23,7 @@ void nsexit(void);
 void *nsrealloc(unsigned int poolid, void *ptr, size_t size);
 void nscheckfreeall(unsigned int poolid);
 void *nscalloc(unsigned int poolid, size_t nmemb, size_t size);
+void nssetsamplerate(unsigned int rate);
 
 #define MAXPOOL		100
 #define REDZONE_MAGIC   0x243653E957851F68ULL
@@ -35,14 +36,51 @@ struct nsminfo {
   char data[];
 };
 
+/* Size class n holds blocks of [2^(n-1), 2^n) bytes, class 0 is empty blocks */
+#define NSM_SIZECLASSES 32
+
+static inline unsigned int nssizeclass(size_t size) {
+  unsigned int class=0;
+
+  while (size && class < NSM_SIZECLASSES-1) {
+    size>>=1;
+    class++;
+  }
+
+  return class;
+}
+
 struct nsmpool {
   unsigned long count;
   size_t size;
   struct nsminfo *blocks;
+
+  /* Running counters, kept current by every call so stats never walk blocks */
+  size_t peaksize;
+  unsigned long allocs, frees;
+  unsigned long long sumsq;
+  unsigned long classcount[NSM_SIZECLASSES];
+  size_t classsize[NSM_SIZECLASSES];
 };
 
 extern struct nsmpool nsmpools[MAXPOOL];
 
+/* Call site attribution: one allocation in nsmsamplerate is recorded
+ * against its caller until it is freed. 0 turns sampling off. */
+#define NSM_MAXSITES    512
+#define NSM_MAXSAMPLES  65536
+struct nsmsite {
+  void *caller;
+  unsigned int poolid;
+  unsigned long allocs;
+  unsigned long count;
+  size_t size;
+};
+
+extern struct nsmsite nsmsites[NSM_MAXSITES];
+extern unsigned int nsmsamplerate;
+extern unsigned long nsmsamplecount;
+
 #endif
 
 /* Pools here in the order they were created */
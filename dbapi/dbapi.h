@@ -38,7 +38,7 @@ typedef PQResult DBResult;
 #define dbasyncqueryf(id, handler, tag, flags, format, ...) pqasyncqueryf(id, handler, tag, flags, format , ##__VA_ARGS__)
 #define dbquerysuccessful(x) pqquerysuccessful(x)
 #define dbgetresult(conn) pqgetresult(conn)
-#define dbnumfields(x) PQnfields(x->result)
+#define dbnumfields(x) pqnumfields(x)
 #define dbnumaffected(c, x) strtoul(PQcmdTuples(x->result), NULL, 10)
 
 #define dbfetchrow(result) pqfetchrow(result)
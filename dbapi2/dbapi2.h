@@ -112,6 +112,31 @@ typedef struct DBAPIResult {
   DBAPIResultClear clear;
 } DBAPIResult;
 
+/*
+ * Batched writes, see dbapi2batch.c.  Values are passed as strings, one per
+ * column; queueing a key that's already waiting adds to its ADD columns and
+ * replaces its SET columns.
+ */
+#define DBAPI2_BATCH_KEY        0
+#define DBAPI2_BATCH_ADD        1
+#define DBAPI2_BATCH_SET        2
+
+#define DBAPI2_BATCH_MAXCOLUMNS 32
+
+typedef struct DBAPIBatch DBAPIBatch;
+
+typedef struct DBAPIBatchStats {
+  unsigned long queued, rows, coalesced, flushes, statements, inflight, failed;
+  unsigned long long lastflush; /* microseconds for the last statement to come back */
+} DBAPIBatchStats;
+
+DBAPIBatch *dbapi2batchnew(const DBAPIConn *, const char *table, int columns, const char **names, const int *kinds, int interval, const char *metricname);
+int dbapi2batchqueue(DBAPIBatch *, const char **values);
+void dbapi2batchflush(DBAPIBatch *);
+void dbapi2batchfree(DBAPIBatch *);
+const DBAPIBatchStats *dbapi2batchstats(DBAPIBatch *);
+int dbapi2batchcolumns(DBAPIBatch *);
+
 int registerdbprovider(const char *, DBAPIProvider *);
 void deregisterdbprovider(int);
 DBAPIConn *dbapi2open(const char *, const char *);
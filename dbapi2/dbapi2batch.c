@@ -0,0 +1,456 @@
+/*
+ * Batched writes.
+ *
+ * Rows are held client side keyed on their key columns until the flush
+ * window closes (or too many are waiting), so a key updated on every
+ * channel line costs one row per window instead of one statement per line.
+ * Each flush is a handful of multi-row upserts:
+ *
+ *   INSERT INTO table AS t (k, a, s) VALUES (...), (...)
+ *     ON CONFLICT (k) DO UPDATE SET a = t.a + EXCLUDED.a, s = EXCLUDED.s
+ *
+ * which both pqsql and sqlite (3.24+) understand; the key columns need a
+ * unique index.  Statements are kept under what the providers will take.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../core/error.h"
+#include "../core/schedule.h"
+#include "../core/metrics.h"
+#include "../lib/stringbuf.h"
+#include "dbapi2.h"
+
+#define BATCHHASHSIZE   1024
+#define BATCHMAXROWS    10000
+#define BATCHQUERYLEN   7680 /* the providers truncate at 8192 */
+#define BATCHVALUELEN   1024
+
+typedef struct DBAPIBatchRow {
+  struct DBAPIBatchRow *hnext, *next;
+  unsigned int hash;
+  long long *sums;
+  char *values[];
+} DBAPIBatchRow;
+
+struct DBAPIBatch {
+  struct DBAPIBatch *next;
+  const DBAPIConn *db;
+  char *table;
+  int columns;
+  char **names;
+  int *kinds;
+  int interval;
+  void *sched;
+
+  DBAPIBatchRow *hash[BATCHHASHSIZE];
+  DBAPIBatchRow *head, *tail;
+
+  DBAPIBatchStats stats;
+  metric *queuedmetric, *flushmetric, *rowsmetric;
+};
+
+typedef struct DBAPIBatchFlush {
+  DBAPIBatch *b;
+  uint64_t start;
+} DBAPIBatchFlush;
+
+static DBAPIBatch *batches;
+
+static void batchtimer(void *arg);
+
+static unsigned int batchhash(DBAPIBatch *b, const char **values) {
+  unsigned int h = 5381;
+  const char *p;
+  int i;
+
+  for(i=0;i<b->columns;i++) {
+    if(b->kinds[i] != DBAPI2_BATCH_KEY)
+      continue;
+
+    for(p=values[i];*p;p++)
+      h = h * 33 + (unsigned char)*p;
+    h = h * 33;
+  }
+
+  return h;
+}
+
+static int batchexists(DBAPIBatch *b) {
+  DBAPIBatch *bp;
+
+  for(bp=batches;bp;bp=bp->next)
+    if(bp == b)
+      return 1;
+
+  return 0;
+}
+
+/* table and column names are pasted into the SQL as they are */
+static int batchidentifier(const char *name) {
+  if(!*name)
+    return 0;
+
+  for(;*name;name++)
+    if(!((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z') || (*name >= '0' && *name <= '9') || *name == '_'))
+      return 0;
+
+  return 1;
+}
+
+DBAPIBatch *dbapi2batchnew(const DBAPIConn *db, const char *table, int columns, const char **names, const int *kinds, int interval, const char *metricname) {
+  DBAPIBatch *b;
+  char buf[METRICNAMELEN];
+  int i, keys = 0;
+
+  if(!batchidentifier(table))
+    return NULL;
+
+  for(i=0;i<columns;i++) {
+    if(!batchidentifier(names[i]))
+      return NULL;
+    if(kinds[i] == DBAPI2_BATCH_KEY)
+      keys++;
+  }
+
+  if(!keys || columns > DBAPI2_BATCH_MAXCOLUMNS)
+    return NULL;
+
+  b = calloc(1, sizeof(DBAPIBatch));
+  if(!b)
+    return NULL;
+
+  b->db = db;
+  b->table = strdup(db->tablename(db, table));
+  b->columns = columns;
+  b->names = calloc(columns, sizeof(char *));
+  b->kinds = calloc(columns, sizeof(int));
+  b->interval = interval > 0 ? interval : 1;
+
+  if(!b->table || !b->names || !b->kinds) {
+    dbapi2batchfree(b);
+    return NULL;
+  }
+
+  for(i=0;i<columns;i++) {
+    b->kinds[i] = kinds[i];
+    b->names[i] = strdup(names[i]);
+    if(!b->names[i]) {
+      dbapi2batchfree(b);
+      return NULL;
+    }
+  }
+
+  if(metricname) {
+    snprintf(buf, sizeof(buf), "%s_queued", metricname);
+    b->queuedmetric = registermetric(buf, METRIC_GAUGE);
+    snprintf(buf, sizeof(buf), "%s_flush_us", metricname);
+    b->flushmetric = registermetric(buf, METRIC_HISTOGRAM);
+    snprintf(buf, sizeof(buf), "%s_rows", metricname);
+    b->rowsmetric = registermetric(buf, METRIC_COUNTER);
+  }
+
+  b->next = batches;
+  batches = b;
+
+  return b;
+}
+
+static void freerow(DBAPIBatch *b, DBAPIBatchRow *r) {
+  int i;
+
+  for(i=0;i<b->columns;i++)
+    free(r->values[i]);
+
+  free(r);
+}
+
+int dbapi2batchqueue(DBAPIBatch *b, const char **values) {
+  DBAPIBatchRow *r;
+  unsigned int h;
+  int i;
+
+  for(i=0;i<b->columns;i++)
+    if(!values[i] || strlen(values[i]) > BATCHVALUELEN)
+      return 0;
+
+  h = batchhash(b, values);
+
+  for(r=b->hash[h % BATCHHASHSIZE];r;r=r->hnext) {
+    if(r->hash != h)
+      continue;
+
+    for(i=0;i<b->columns;i++)
+      if((b->kinds[i] == DBAPI2_BATCH_KEY) && strcmp(r->values[i], values[i]))
+        break;
+
+    if(i == b->columns)
+      break;
+  }
+
+  if(r) {
+    for(i=0;i<b->columns;i++) {
+      if(b->kinds[i] == DBAPI2_BATCH_ADD) {
+        r->sums[i]+=strtoll(values[i], NULL, 10);
+      } else if(b->kinds[i] == DBAPI2_BATCH_SET && strcmp(r->values[i], values[i])) {
+        char *v = strdup(values[i]);
+        if(!v)
+          return 0;
+
+        free(r->values[i]);
+        r->values[i] = v;
+      }
+    }
+
+    b->stats.coalesced++;
+    return 1;
+  }
+
+  r = calloc(1, sizeof(DBAPIBatchRow) + sizeof(char *) * b->columns + sizeof(long long) * b->columns);
+  if(!r)
+    return 0;
+
+  r->sums = (long long *)&r->values[b->columns];
+  r->hash = h;
+
+  for(i=0;i<b->columns;i++) {
+    if(b->kinds[i] == DBAPI2_BATCH_ADD) {
+      r->sums[i] = strtoll(values[i], NULL, 10);
+    } else if(!(r->values[i] = strdup(values[i]))) {
+      freerow(b, r);
+      return 0;
+    }
+  }
+
+  r->hnext = b->hash[h % BATCHHASHSIZE];
+  b->hash[h % BATCHHASHSIZE] = r;
+
+  if(b->tail) {
+    b->tail->next = r;
+  } else {
+    b->head = r;
+  }
+  b->tail = r;
+
+  b->stats.queued++;
+  metricset(b->queuedmetric, b->stats.queued);
+
+  if(b->stats.queued >= BATCHMAXROWS) {
+    dbapi2batchflush(b);
+  } else if(!b->sched) {
+    b->sched = scheduleoneshot(time(NULL) + b->interval, batchtimer, b);
+  }
+
+  return 1;
+}
+
+static void batchflushed(const DBAPIResult *result, void *tag) {
+  DBAPIBatchFlush *f = tag;
+  DBAPIBatch *b = f->b;
+
+  if(batchexists(b)) {
+    b->stats.inflight--;
+    b->stats.lastflush = metricclock() - f->start;
+    metricobserve(b->flushmetric, b->stats.lastflush);
+
+    if(!result || !result->success) {
+      b->stats.failed++;
+      Error("dbapi2", ERR_WARNING, "Batched write to %s failed.", b->table);
+    }
+  }
+
+  if(result)
+    result->clear(result);
+
+  free(f);
+}
+
+/* column list and ON CONFLICT clause, the same for every statement */
+static int batchclauses(DBAPIBatch *b, StringBuf *head, StringBuf *tail) {
+  int i, first, ok;
+
+  ok = sbaddstr(head, "INSERT INTO ") && sbaddstr(head, b->table) && sbaddstr(head, " AS t (");
+  for(i=0;i<b->columns;i++)
+    ok = ok && (!i || sbaddstr(head, ", ")) && sbaddstr(head, b->names[i]);
+  ok = ok && sbaddstr(head, ") VALUES ");
+
+  ok = ok && sbaddstr(tail, " ON CONFLICT (");
+  for(i=0,first=1;i<b->columns;i++) {
+    if(b->kinds[i] != DBAPI2_BATCH_KEY)
+      continue;
+    ok = ok && (first || sbaddstr(tail, ", ")) && sbaddstr(tail, b->names[i]);
+    first = 0;
+  }
+  ok = ok && sbaddstr(tail, ") DO ");
+
+  for(i=0,first=1;i<b->columns;i++) {
+    if(b->kinds[i] == DBAPI2_BATCH_KEY)
+      continue;
+
+    ok = ok && sbaddstr(tail, first ? "UPDATE SET " : ", ") && sbaddstr(tail, b->names[i]) && sbaddstr(tail, " = ");
+    if(b->kinds[i] == DBAPI2_BATCH_ADD)
+      ok = ok && sbaddstr(tail, "t.") && sbaddstr(tail, b->names[i]) && sbaddstr(tail, " + ");
+    ok = ok && sbaddstr(tail, "EXCLUDED.") && sbaddstr(tail, b->names[i]);
+    first = 0;
+  }
+
+  if(first)
+    ok = ok && sbaddstr(tail, "NOTHING");
+
+  return ok && sbterminate(head) && sbterminate(tail);
+}
+
+static int batchrow(DBAPIBatch *b, DBAPIBatchRow *r, StringBuf *sb) {
+  char buf[BATCHVALUELEN * 2 + 10];
+  int i, ok;
+
+  ok = sbaddchar(sb, '(');
+  for(i=0;i<b->columns;i++) {
+    if(i)
+      ok = ok && sbaddstr(sb, ", ");
+
+    if(b->kinds[i] == DBAPI2_BATCH_ADD) {
+      snprintf(buf, sizeof(buf), "%lld", r->sums[i]);
+      ok = ok && sbaddstr(sb, buf);
+    } else {
+      ok = ok && b->db->__quotestring(b->db, buf, sizeof(buf), r->values[i], strlen(r->values[i])) && sbaddstr(sb, buf);
+    }
+  }
+
+  return ok && sbaddchar(sb, ')');
+}
+
+static void batchsend(DBAPIBatch *b, StringBuf *sb, const char *tail) {
+  DBAPIBatchFlush *f;
+
+  if(!sbaddstr(sb, (char *)tail) || !sbterminate(sb))
+    return;
+
+  f = malloc(sizeof(DBAPIBatchFlush));
+  if(!f)
+    return;
+
+  f->b = b;
+  f->start = metricclock();
+
+  b->stats.statements++;
+  b->stats.inflight++;
+  b->db->unsafequery(b->db, batchflushed, f, "%s", sb->buf);
+}
+
+void dbapi2batchflush(DBAPIBatch *b) {
+  char head[1024], tail[1024], query[BATCHQUERYLEN];
+  StringBuf hb, tb, sb;
+  DBAPIBatchRow *r, *nr;
+  int rows = 0, mark;
+
+  if(b->sched) {
+    deleteschedule(b->sched, batchtimer, b);
+    b->sched = NULL;
+  }
+
+  if(!b->head)
+    return;
+
+  sbinit(&hb, head, sizeof(head));
+  sbinit(&tb, tail, sizeof(tail));
+  if(!batchclauses(b, &hb, &tb)) {
+    Error("dbapi2", ERR_WARNING, "Too many columns to batch writes to %s.", b->table);
+    return;
+  }
+
+  /* leave room for the ON CONFLICT clause on the end */
+  sbinit(&sb, query, sizeof(query) - tb.len);
+  sbaddstr(&sb, head);
+
+  for(r=b->head;r;r=nr) {
+    nr = r->next;
+
+    mark = sb.len;
+    if(!(rows ? sbaddstr(&sb, ", ") : 1) || !batchrow(b, r, &sb)) {
+      sb.len = mark;
+
+      if(!rows) {
+        Error("dbapi2", ERR_WARNING, "Row too long for batched write to %s, dropped.", b->table);
+        freerow(b, r);
+        continue;
+      }
+
+      sb.capacity = sizeof(query);
+      batchsend(b, &sb, tail);
+
+      sbinit(&sb, query, sizeof(query) - tb.len);
+      sbaddstr(&sb, head);
+      rows = 0;
+      nr = r; /* again, in a statement of its own */
+      continue;
+    }
+
+    rows++;
+    b->stats.rows++;
+    metricinc(b->rowsmetric);
+    freerow(b, r);
+  }
+
+  if(rows) {
+    sb.capacity = sizeof(query);
+    batchsend(b, &sb, tail);
+  }
+
+  memset(b->hash, 0, sizeof(b->hash));
+  b->head = b->tail = NULL;
+  b->stats.queued = 0;
+  b->stats.flushes++;
+  metricset(b->queuedmetric, 0);
+}
+
+static void batchtimer(void *arg) {
+  DBAPIBatch *b = arg;
+
+  b->sched = NULL;
+  dbapi2batchflush(b);
+}
+
+const DBAPIBatchStats *dbapi2batchstats(DBAPIBatch *b) {
+  return &b->stats;
+}
+
+int dbapi2batchcolumns(DBAPIBatch *b) {
+  return b->columns;
+}
+
+/* anything still queued is flushed first */
+void dbapi2batchfree(DBAPIBatch *b) {
+  DBAPIBatch **bp;
+  int i;
+
+  if(b->head)
+    dbapi2batchflush(b);
+
+  if(b->sched)
+    deleteschedule(b->sched, batchtimer, b);
+
+  for(bp=&batches;*bp;bp=&(*bp)->next) {
+    if(*bp == b) {
+      *bp = b->next;
+      break;
+    }
+  }
+
+  deregistermetric(b->queuedmetric);
+  deregistermetric(b->flushmetric);
+  deregistermetric(b->rowsmetric);
+
+  if(b->names)
+    for(i=0;i<b->columns;i++)
+      free(b->names[i]);
+
+  free(b->names);
+  free(b->kinds);
+  free(b->table);
+  free(b);
+}
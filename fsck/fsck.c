@@ -33,17 +33,17 @@ int dofsck(void *source, int cargc, char **cargv) {
 
   nickmarker=nextnickmarker();
 
-  for(i=0;i<HOSTHASHSIZE;i++)
+  for(i=0;i<hosttablesize;i++)
     for(hp=hosttable[i];hp;hp=hp->next)
       hp->marker=0;
   
-  for(i=0;i<REALNAMEHASHSIZE;i++)
+  for(i=0;i<realnametablesize;i++)
     for(rnp=realnametable[i];rnp;rnp=rnp->next)
       rnp->marker=0;
 
   controlreply(sender," - Scanning nick hash table");
   
-  for (i=0;i<NICKHASHSIZE;i++) {
+  for (i=0;i<nicktablesize;i++) {
     for(np=nicktable[i];np;np=np->next) {
       if (np->marker==nickmarker) {
         controlreply(sender, "ERROR: bumped into the same nick %s/%s twice in hash table.",longtonumeric(np->numeric,5),np->nick);
@@ -159,7 +159,7 @@ int dofsck(void *source, int cargc, char **cargv) {
 
   controlreply(sender," - Scanning host and realname tables");
   
-  for (i=0;i<HOSTHASHSIZE;i++) {
+  for (i=0;i<hosttablesize;i++) {
     for (hp=hosttable[i];hp;hp=hp->next) {
 
       /* Check that the user counts match up */
@@ -185,7 +185,7 @@ int dofsck(void *source, int cargc, char **cargv) {
     }
   }
 
-  for (i=0;i<REALNAMEHASHSIZE;i++) {
+  for (i=0;i<realnametablesize;i++) {
     for (rnp=realnametable[i];rnp;rnp=rnp->next) {
       if (rnp->usercount != rnp->marker) {
 	controlreply(sender,
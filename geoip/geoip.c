@@ -197,7 +197,7 @@ void _init(void) {
     return;
   }
 
-  for (int i = 0; i < NICKHASHSIZE; i++) {
+  for (int i = 0; i < nicktablesize; i++) {
     for (nick *np = nicktable[i]; np; np=np->next) {
       nick_setup(np);
     }
@@ -131,7 +131,7 @@ void glinebufcounthits(glinebuf *gbuf, int *users, int *channels) {
   array_free(&gbuf->hits);
   array_init(&gbuf->hits, sizeof(sstring *));
 
-  for (i = 0; i<CHANNELHASHSIZE; i++) {
+  for (i = 0; i<chantablesize; i++) {
     for (cip = chantable[i]; cip; cip = cip->next) {
       cp = cip->channel;
 
@@ -158,26 +158,24 @@ void glinebufcounthits(glinebuf *gbuf, int *users, int *channels) {
     }
   }
 
-  for (i = 0; i < NICKHASHSIZE; i++) {
-    for (np = nicktable[i]; np; np = np->next) {
-      hit = 0;
+  NICKCOLUMN_WALK(i, np) {
+    hit = 0;
 
-      for (gl = gbuf->glines; gl; gl = gl->next) {
-        if (gline_match_nick(gl, np)) {
-          hit = 1;
-          break;
-        }
+    for (gl = gbuf->glines; gl; gl = gl->next) {
+      if (gline_match_nick(gl, np)) {
+        hit = 1;
+        break;
       }
+    }
 
-      if (hit) {
-        snprintf(uhmask, sizeof(uhmask), "user: %s!%s@%s%s%s r(%s)", np->nick, np->ident, np->host->name->content,
-          (np->auth) ? "/" : "", (np->auth) ? np->authname : "", np->realname->name->content);
+    if (hit) {
+      snprintf(uhmask, sizeof(uhmask), "user: %s!%s@%s%s%s r(%s)", np->nick, np->ident, np->host->name->content,
+        (np->auth) ? "/" : "", (np->auth) ? np->authname : "", np->realname->name->content);
 
-        gbuf->userhits++;
+      gbuf->userhits++;
 
-        slot = array_getfreeslot(&gbuf->hits);
-        ((sstring **)gbuf->hits.content)[slot] = getsstring(uhmask, 512);
-      }
+      slot = array_getfreeslot(&gbuf->hits);
+      ((sstring **)gbuf->hits.content)[slot] = getsstring(uhmask, 512);
     }
   }
 
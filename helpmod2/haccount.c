@@ -11,6 +11,11 @@
 #include "huser.h"
 #include "hgen.h"
 
+/* Accounts by case-folded name, next is kept for ordered walks */
+static haccount *haccount_hashtable[HACCOUNT_HASHSIZE];
+
+#define haccount_hash(x) (irc_crc32i(x) % HACCOUNT_HASHSIZE)
+
 haccount *haccount_get_by_name(const char *name)
 {
     haccount *tmp;
@@ -21,8 +26,8 @@ haccount *haccount_get_by_name(const char *name)
     if (*name == '#')
         name++;
 
-    tmp = haccounts;
-    for (;tmp;tmp = tmp->next)
+    tmp = haccount_hashtable[haccount_hash(name)];
+    for (;tmp;tmp = tmp->nextbyname)
         if (!ircd_strcmp(tmp->name->content, name))
             return tmp;
 
@@ -52,6 +57,9 @@ haccount *haccount_add(const char *name, hlevel lvl)
     tmp->next = haccounts;
     haccounts = tmp;
 
+    tmp->nextbyname = haccount_hashtable[haccount_hash(name)];
+    haccount_hashtable[haccount_hash(name)] = tmp;
+
     return tmp;
 }
 
@@ -59,6 +67,14 @@ int haccount_del(haccount *hack)
 {
     huser *h_ptr = husers;
     haccount **ptr = &haccounts;
+    haccount **hptr = &haccount_hashtable[haccount_hash(hack->name->content)];
+
+    for (;*hptr;hptr = &(*hptr)->nextbyname)
+        if (*hptr == hack)
+        {
+            *hptr = hack->nextbyname;
+            break;
+        }
 
     for (;h_ptr;h_ptr = h_ptr->next)
         if (h_ptr->account == hack)
@@ -36,8 +36,11 @@ typedef struct haccount_struct
     hstat_account *stats;
 
     struct haccount_struct *next;
+    struct haccount_struct *nextbyname;
 } haccount;
 
+#define HACCOUNT_HASHSIZE 4096
+
 extern struct haccount_struct *haccounts;
 
 haccount *haccount_get_by_name(const char*);
@@ -35,6 +35,7 @@ hchannel *hchannel_add(const char *cname)
     hchan->real_channel = cp;
     hchan->flags = H_CHANFLAGS_DEFAULT;
     hchan->channel_users = NULL;
+    memset(hchan->user_hash, 0, sizeof(hchan->user_hash));
     hchan->channel_hterms = NULL;
     hchan->max_idle = 5 * HDEF_m;
     hchan->topic = NULL;
@@ -152,10 +153,12 @@ void hchannel_del_all(void)
         hchannel_del(hchannels);
 }
 
+#define hchannel_user_hash(husr) ((((unsigned long)(husr)) >> 4) & (HCHANNEL_USERHASHSIZE - 1))
+
 hchannel_user *hchannel_on_channel(hchannel *hchan, struct huser_struct *husr)
 {
-    hchannel_user *ptr = hchan->channel_users;
-    for (;ptr;ptr = ptr->next)
+    hchannel_user *ptr = hchan->user_hash[hchannel_user_hash(husr)];
+    for (;ptr;ptr = ptr->nextbyhash)
         if (ptr->husr == husr)
             return ptr;
     return NULL;
@@ -173,6 +176,9 @@ hchannel_user *hchannel_add_user(hchannel *hchan, struct huser_struct *husr)
     (*tmp)->time_joined = time(NULL);
     (*tmp)->next = NULL;
 
+    (*tmp)->nextbyhash = hchan->user_hash[hchannel_user_hash(husr)];
+    hchan->user_hash[hchannel_user_hash(husr)] = *tmp;
+
     assert(hchannel_on_channel(hchan, husr) != NULL);
 
     return *tmp;
@@ -181,8 +187,16 @@ hchannel_user *hchannel_add_user(hchannel *hchan, struct huser_struct *husr)
 hchannel_user *hchannel_del_user(hchannel *hchan, struct huser_struct *husr)
 {
     hchannel_user **tmp = &(hchan->channel_users);
+    hchannel_user **hptr = &hchan->user_hash[hchannel_user_hash(husr)];
     assert(hchannel_on_channel(hchan, husr) != NULL);
 
+    for (;*hptr;hptr = &(*hptr)->nextbyhash)
+        if ((*hptr)->husr == husr)
+        {
+            *hptr = (*hptr)->nextbyhash;
+            break;
+        }
+
     for (;*tmp;tmp = &(*tmp)->next)
         if ((*tmp)->husr == husr)
         {
@@ -57,6 +57,9 @@ enum
 
 #define HCHANNEL_WELCOME_LEN 400
 
+/* must be a power of two */
+#define HCHANNEL_USERHASHSIZE 64
+
 typedef struct hchannel_struct
 {
     channel *real_channel;
@@ -73,6 +76,8 @@ typedef struct hchannel_struct
 
     /* this is also the queue, so it's "sorted" */
     struct hchannel_user_struct *channel_users;
+    /* same entries hashed by huser, for membership tests */
+    struct hchannel_user_struct *user_hash[HCHANNEL_USERHASHSIZE];
 
     time_t last_activity;
     time_t last_staff_activity;
@@ -91,6 +96,7 @@ typedef struct hchannel_user_struct
     struct huser_struct *husr;
     time_t time_joined;
     struct hchannel_user_struct *next;
+    struct hchannel_user_struct *nextbyhash;
 } hchannel_user;
 
 extern hchannel *hchannels;
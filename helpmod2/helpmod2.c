@@ -23,6 +23,7 @@
 #include "hticket.h"
 #include "hed.h"
 #include "../lib/version.h"
+#include "../core/metrics.h"
 
 MODULE_VERSION("")
 
@@ -353,8 +354,13 @@ void helpmod_kicked(void **args)
     }
 }
 
+/* time taken per line, from receipt to mode commit */
+static metric *helpmod_linemetric;
+
 void helpmodmessagehandler(nick *sender, int messagetype, void **args)
 {
+    uint64_t start = metricclock();
+
     switch (messagetype)
     {
     case LU_PRIVMSG:
@@ -369,6 +375,9 @@ void helpmodmessagehandler(nick *sender, int messagetype, void **args)
     }
 
     hcommit_modes();
+
+    if (messagetype == LU_PRIVMSG || messagetype == LU_CHANMSG)
+        metricobserve(helpmod_linemetric, metricclock() - start);
 }
 
 void helpconnect(void) {
@@ -413,6 +422,10 @@ void _init()
     hchanbans = NULL;
 
     helpmod_startup_time = time(NULL);
+
+    huser_init();
+    helpmod_linemetric = registermetric("helpmod_line_us", METRIC_HISTOGRAM);
+
     /* add the supported commands, needs to be done like this since 3 arrays would just become a mess */
     /* first the legacy old-H commands */
 
@@ -462,6 +475,7 @@ void _fini()
     hcommand_del_all();
     hchannel_del_all();
     huser_del_all();
+    huser_fini();
     hlc_del_all();
     hban_del_all();
     hterm_del_all(NULL);
@@ -470,4 +484,7 @@ void _fini()
     helpmod_clear_all_entries();
 
     deregisterlocaluser(helpmodnick, "Module unloaded");
+
+    deregistermetric(helpmod_linemetric);
+    helpmod_linemetric = NULL;
 }
@@ -12,6 +12,22 @@
 #include "hgen.h"
 #include "hed.h"
 
+/* husers hang off their nick, so finding the sender of a line is O(1) */
+static int huser_nickext = -1;
+
+void huser_init(void)
+{
+    if ((huser_nickext = registernickext("helpmod2")) < 0)
+        Error("helpmod", ERR_WARNING, "Unable to register nick extension, user lookups will be slow");
+}
+
+void huser_fini(void)
+{
+    if (huser_nickext >= 0)
+        releasenickext(huser_nickext);
+    huser_nickext = -1;
+}
+
 huser *huser_add(nick *nck)
 {
     huser *tmp;
@@ -44,29 +60,35 @@ huser *huser_add(nick *nck)
     tmp->editor = NULL;
 
     tmp->next = husers;
+    tmp->prev = NULL;
+    if (husers)
+        husers->prev = tmp;
     husers = tmp;
 
+    if (huser_nickext >= 0)
+        nck->exts[huser_nickext] = tmp;
+
     return tmp;
 }
 
 void huser_del(huser *husr)
 {
-    huser **ptr = &husers;
     if (!husr)
         return;
 
-    for (;*ptr;ptr = &(*ptr)->next)
-        if (*ptr  == husr)
-	{
-	    huser *tmp = (*ptr)->next;
+    if (husr->prev)
+        husr->prev->next = husr->next;
+    else
+        husers = husr->next;
+    if (husr->next)
+        husr->next->prev = husr->prev;
 
-            hed_close(husr->editor);
+    if (huser_nickext >= 0 && husr->real_user->exts[huser_nickext] == husr)
+        husr->real_user->exts[huser_nickext] = NULL;
 
-	    free(*ptr);
-            *ptr = tmp;
+    hed_close(husr->editor);
 
-            return;
-        }
+    free(husr);
 }
 
 void huser_del_all(void)
@@ -84,6 +106,9 @@ huser *huser_get(nick *nck)
     if (nck == NULL)
         return NULL;
 
+    if (huser_nickext >= 0)
+        return (huser*)nck->exts[huser_nickext];
+
     for (tmp = husers;tmp;tmp = tmp->next)
         if (tmp->real_user == nck)
             return tmp;
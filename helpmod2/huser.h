@@ -38,6 +38,7 @@ typedef struct huser_struct
     struct huser_channel_struct *hchannels;
 
     struct huser_struct *next;
+    struct huser_struct *prev;
 } huser;
 
 enum
@@ -63,6 +64,9 @@ typedef struct huser_channel_struct
 
 extern huser *husers;
 
+void huser_init(void);
+void huser_fini(void);
+
 huser *huser_add(nick*);
 void huser_del(huser*);
 void huser_del_all();
@@ -11,6 +11,7 @@
 #include "../core/error.h"
 #include "../core/config.h"
 #include "../core/hooks.h"
+#include "../core/metrics.h"
 #include "../lib/base64.h"
 #include "../lib/splitline.h"
 #include "../lib/version.h"
@@ -50,6 +51,8 @@ char *args[MAX_SERVERARGS];
 int bytesleft;
 int linesreceived;
 
+static metric *linesmetric, *bytesmetric;
+
 sstring *mynumeric;
 sstring *myserver;
 long mylongnum;
@@ -87,6 +90,9 @@ void _init() {
 
   registerhook(HOOK_CORE_STATSREQUEST,&ircstats);
   registerhook(HOOK_CORE_REHASH,&ircrehash);
+
+  linesmetric=registermetric("irc_lines_in", METRIC_COUNTER);
+  bytesmetric=registermetric("irc_bytes_in", METRIC_COUNTER);
 }
 
 void _fini() {
@@ -102,6 +108,9 @@ void _fini() {
 
   deregisterhook(HOOK_CORE_STATSREQUEST,&ircstats);
   deregisterhook(HOOK_CORE_REHASH,&ircrehash);
+
+  deregistermetric(linesmetric);
+  deregistermetric(bytesmetric);
  
   deleteschedule(NULL,&sendping,NULL);
   deleteschedule(NULL,&irc_connect,NULL);
@@ -439,6 +448,7 @@ void handledata(int fd, short events) {
       return;
     }
 
+    metricadd(bytesmetric, res);
     again=((bytesleft+=res)==READBUFSIZE);
     while (!parseline())
       ; /* empty loop */
@@ -495,6 +505,7 @@ int parseline() {
   /* and nextline points at where we are going next */      
   
   linesreceived++;
+  metricinc(linesmetric);
 
   /* Split it up */
   cargc=splitline(currentline,cargv,MAX_SERVERARGS,1);
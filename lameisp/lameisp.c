@@ -30,7 +30,7 @@ void _init() {
   /* ok, first time loading we have to go through every host
      and check for excess clones, and obviously kill the excess */
      
-  for (j=0;j<HOSTHASHSIZE;j++)
+  for (j=0;j<hosttablesize;j++)
     for(hp=hosttable[j];hp;hp=hp->next)
       if (hp->clonecount > LI_CLONEMAX) /* if we have too many clones */
         for(i=0;i<li_ispscount;) /* cycle through the list of isps */
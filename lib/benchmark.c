@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../core/error.h"
+#include "../core/config.h"
+#include "sstring.h"
+#include "benchmark.h"
+
+long benchconfiglong(char *module, char *key, char *defaultvalue) {
+  sstring *s = getcopyconfigitem(module, key, defaultvalue, 20);
+  long v = strtol(s->content, NULL, 10);
+
+  freesstring(s);
+  return v;
+}
+
+double benchconfigdouble(char *module, char *key, char *defaultvalue) {
+  sstring *s = getcopyconfigitem(module, key, defaultvalue, 20);
+  double v = strtod(s->content, NULL);
+
+  freesstring(s);
+  return v;
+}
+
+/* results still go to the log if the file can't be opened */
+void benchopen(benchresults *br, char *module) {
+  char defaultfile[100];
+  sstring *results;
+
+  snprintf(defaultfile, sizeof(defaultfile), "data/%s.results", module);
+
+  br->module = module;
+  results = getcopyconfigitem(module, "results", defaultfile, 100);
+  if(!(br->fp = fopen(results->content, "w")))
+    Error(module, ERR_WARNING, "Unable to open %s, results will only be logged.", results->content);
+  freesstring(results);
+}
+
+/* extra is more key=value pairs, or "" */
+void benchresult(benchresults *br, const char *bench, unsigned long ops, uint64_t us, const char *extra) {
+  double ns = ops ? us * 1000.0 / ops : 0.0;
+
+  Error(br->module, ERR_INFO, "%-18s %10lu ops %10.3fs %10.1f ns/op%s%s", bench, ops, us / 1000000.0, ns, *extra ? " " : "", extra);
+
+  if(br->fp) {
+    fprintf(br->fp, "%s bench=%s ops=%lu us=%llu ns_per_op=%.1f%s%s\n", br->module, bench, ops, (unsigned long long)us, ns, *extra ? " " : "", extra);
+    fflush(br->fp);
+  }
+}
+
+void benchclose(benchresults *br) {
+  if(br->fp)
+    fclose(br->fp);
+  br->fp = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef __BENCHMARK_H
+#define __BENCHMARK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Shared bits for the benchmark modules: numeric config items from the
+ * module's own section, and results written both to the log and, one
+ * key=value line per benchmark, to a results file:
+ *
+ *   <module> bench=<name> ops=<n> us=<n> ns_per_op=<n> [extra...]
+ *
+ * The file is <results> in the module's config section, by default
+ * data/<module>.results, and is rewritten on each run.
+ */
+
+typedef struct benchresults {
+  char *module;
+  FILE *fp;
+} benchresults;
+
+long benchconfiglong(char *module, char *key, char *defaultvalue);
+double benchconfigdouble(char *module, char *key, char *defaultvalue);
+
+void benchopen(benchresults *br, char *module);
+void benchresult(benchresults *br, const char *bench, unsigned long ops, uint64_t us, const char *extra);
+void benchclose(benchresults *br);
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * ChaCha20-Poly1305 AEAD (RFC 8439).
+ *
+ * Portable C; Poly1305 uses 26-bit limbs so it only needs 32x32->64
+ * multiplies.  Data is encrypted/decrypted in place.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chachapoly.h"
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QR(a, b, c, d) \
+  a += b; d ^= a; d = ROTL32(d, 16); \
+  c += d; b ^= c; b = ROTL32(b, 12); \
+  a += b; d ^= a; d = ROTL32(d, 8); \
+  c += d; b ^= c; b = ROTL32(b, 7);
+
+typedef struct {
+  uint32_t r[5], h[5], pad[4];
+  size_t leftover;
+  unsigned char buffer[16];
+  int final;
+} poly1305;
+
+static uint32_t load32(const unsigned char *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store32(unsigned char *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void store64(unsigned char *p, uint64_t v) {
+  store32(p, (uint32_t)v);
+  store32(p + 4, (uint32_t)(v >> 32));
+}
+
+static void chacha20_block(const uint32_t *input, unsigned char *out) {
+  uint32_t x[16];
+  int i;
+
+  memcpy(x, input, sizeof(x));
+
+  for(i=0;i<10;i++) {
+    QR(x[0], x[4], x[8], x[12]);
+    QR(x[1], x[5], x[9], x[13]);
+    QR(x[2], x[6], x[10], x[14]);
+    QR(x[3], x[7], x[11], x[15]);
+    QR(x[0], x[5], x[10], x[15]);
+    QR(x[1], x[6], x[11], x[12]);
+    QR(x[2], x[7], x[8], x[13]);
+    QR(x[3], x[4], x[9], x[14]);
+  }
+
+  for(i=0;i<16;i++)
+    store32(out + i * 4, x[i] + input[i]);
+}
+
+static void chacha20_init(uint32_t *state, const unsigned char *key, const unsigned char *nonce, uint32_t counter) {
+  int i;
+
+  state[0] = 0x61707865;
+  state[1] = 0x3320646e;
+  state[2] = 0x79622d32;
+  state[3] = 0x6b206574;
+  for(i=0;i<8;i++)
+    state[4 + i] = load32(key + i * 4);
+  state[12] = counter;
+  for(i=0;i<3;i++)
+    state[13 + i] = load32(nonce + i * 4);
+}
+
+static void chacha20_xor(uint32_t *state, unsigned char *data, size_t len) {
+  unsigned char block[64];
+  size_t i, n;
+
+  while(len) {
+    chacha20_block(state, block);
+    state[12]++;
+
+    n = len < 64 ? len : 64;
+    for(i=0;i<n;i++)
+      data[i] ^= block[i];
+
+    data+=n;
+    len-=n;
+  }
+}
+
+static void poly1305_init(poly1305 *p, const unsigned char *key) {
+  p->r[0] = load32(key) & 0x3ffffff;
+  p->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+  p->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+  p->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+  p->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+
+  memset(p->h, 0, sizeof(p->h));
+
+  p->pad[0] = load32(key + 16);
+  p->pad[1] = load32(key + 20);
+  p->pad[2] = load32(key + 24);
+  p->pad[3] = load32(key + 28);
+
+  p->leftover = 0;
+  p->final = 0;
+}
+
+static void poly1305_blocks(poly1305 *p, const unsigned char *m, size_t bytes) {
+  const uint32_t hibit = p->final ? 0 : (1UL << 24);
+  uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+  uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+  uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+  uint64_t d0, d1, d2, d3, d4;
+  uint32_t c;
+
+  while(bytes >= 16) {
+    h0 += load32(m) & 0x3ffffff;
+    h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+    h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+    h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+    h4 += (load32(m + 12) >> 8) | hibit;
+
+    d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+    d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+    d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+    d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+    d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+    c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+    d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+    d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+    d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+    d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    m+=16;
+    bytes-=16;
+  }
+
+  p->h[0] = h0;
+  p->h[1] = h1;
+  p->h[2] = h2;
+  p->h[3] = h3;
+  p->h[4] = h4;
+}
+
+static void poly1305_update(poly1305 *p, const unsigned char *m, size_t bytes) {
+  size_t i, want;
+
+  if(p->leftover) {
+    want = 16 - p->leftover;
+    if(want > bytes)
+      want = bytes;
+    for(i=0;i<want;i++)
+      p->buffer[p->leftover + i] = m[i];
+    bytes-=want;
+    m+=want;
+    p->leftover+=want;
+    if(p->leftover < 16)
+      return;
+    poly1305_blocks(p, p->buffer, 16);
+    p->leftover = 0;
+  }
+
+  if(bytes >= 16) {
+    want = bytes & ~(size_t)15;
+    poly1305_blocks(p, m, want);
+    m+=want;
+    bytes-=want;
+  }
+
+  for(i=0;i<bytes;i++)
+    p->buffer[p->leftover + i] = m[i];
+  p->leftover+=bytes;
+}
+
+static void poly1305_pad16(poly1305 *p, size_t len) {
+  static const unsigned char zeros[16];
+
+  if(len % 16)
+    poly1305_update(p, zeros, 16 - len % 16);
+}
+
+static void poly1305_finish(poly1305 *p, unsigned char *mac) {
+  uint32_t h0, h1, h2, h3, h4, c;
+  uint32_t g0, g1, g2, g3, g4;
+  uint32_t mask;
+  uint64_t f;
+
+  if(p->leftover) {
+    size_t i = p->leftover;
+    p->buffer[i++] = 1;
+    for(;i<16;i++)
+      p->buffer[i] = 0;
+    p->final = 1;
+    poly1305_blocks(p, p->buffer, 16);
+  }
+
+  h0 = p->h[0];
+  h1 = p->h[1];
+  h2 = p->h[2];
+  h3 = p->h[3];
+  h4 = p->h[4];
+
+  c = h1 >> 26; h1 &= 0x3ffffff;
+  h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+  h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+  h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+  h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+  h1 += c;
+
+  /* compute h - p and select it if it didn't underflow */
+  g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+  g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+  g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+  g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+  g4 = h4 + c - (1UL << 26);
+
+  mask = (g4 >> 31) - 1;
+  g0 &= mask;
+  g1 &= mask;
+  g2 &= mask;
+  g3 &= mask;
+  g4 &= mask;
+  mask = ~mask;
+  h0 = (h0 & mask) | g0;
+  h1 = (h1 & mask) | g1;
+  h2 = (h2 & mask) | g2;
+  h3 = (h3 & mask) | g3;
+  h4 = (h4 & mask) | g4;
+
+  h0 = h0 | (h1 << 26);
+  h1 = (h1 >> 6) | (h2 << 20);
+  h2 = (h2 >> 12) | (h3 << 14);
+  h3 = (h3 >> 18) | (h4 << 8);
+
+  f = (uint64_t)h0 + p->pad[0]; h0 = (uint32_t)f;
+  f = (uint64_t)h1 + p->pad[1] + (f >> 32); h1 = (uint32_t)f;
+  f = (uint64_t)h2 + p->pad[2] + (f >> 32); h2 = (uint32_t)f;
+  f = (uint64_t)h3 + p->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+  store32(mac, h0);
+  store32(mac + 4, h1);
+  store32(mac + 8, h2);
+  store32(mac + 12, h3);
+
+  memset(p, 0, sizeof(*p));
+}
+
+static void chachapoly_mac(uint32_t *state, const unsigned char *ad, size_t adlen, const unsigned char *ct, size_t len, unsigned char *tag) {
+  unsigned char block[64], lengths[16];
+  poly1305 p;
+
+  /* block 0 keys the MAC, the payload starts at block 1 */
+  chacha20_block(state, block);
+  state[12]++;
+
+  poly1305_init(&p, block);
+  poly1305_update(&p, ad, adlen);
+  poly1305_pad16(&p, adlen);
+  poly1305_update(&p, ct, len);
+  poly1305_pad16(&p, len);
+  store64(lengths, adlen);
+  store64(lengths + 8, len);
+  poly1305_update(&p, lengths, 16);
+  poly1305_finish(&p, tag);
+
+  memset(block, 0, sizeof(block));
+}
+
+void chachapoly_seal(const unsigned char *key, const unsigned char *nonce, const unsigned char *ad, size_t adlen,
+  unsigned char *data, size_t len, unsigned char *tag) {
+  uint32_t state[16];
+
+  chacha20_init(state, key, nonce, 1);
+  chacha20_xor(state, data, len);
+
+  state[12] = 0;
+  chachapoly_mac(state, ad, adlen, data, len, tag);
+
+  memset(state, 0, sizeof(state));
+}
+
+/* returns 0 and decrypts data if the tag matches, otherwise 1 and leaves data alone */
+int chachapoly_open(const unsigned char *key, const unsigned char *nonce, const unsigned char *ad, size_t adlen,
+  unsigned char *data, size_t len, const unsigned char *tag) {
+  uint32_t state[16];
+  unsigned char expected[CHACHAPOLY_TAGLEN], diff = 0;
+  int i;
+
+  chacha20_init(state, key, nonce, 0);
+  chachapoly_mac(state, ad, adlen, data, len, expected);
+
+  for(i=0;i<CHACHAPOLY_TAGLEN;i++)
+    diff |= expected[i] ^ tag[i];
+
+  if(diff) {
+    memset(state, 0, sizeof(state));
+    return 1;
+  }
+
+  chacha20_xor(state, data, len);
+  memset(state, 0, sizeof(state));
+
+  return 0;
+}
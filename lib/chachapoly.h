@@ -0,0 +1,17 @@
+#ifndef __LIB_CHACHAPOLY_H
+#define __LIB_CHACHAPOLY_H
+
+#include <stddef.h>
+
+/* ChaCha20-Poly1305 AEAD as in RFC 8439 */
+
+#define CHACHAPOLY_KEYLEN   32
+#define CHACHAPOLY_NONCELEN 12
+#define CHACHAPOLY_TAGLEN   16
+
+void chachapoly_seal(const unsigned char *key, const unsigned char *nonce, const unsigned char *ad, size_t adlen,
+  unsigned char *data, size_t len, unsigned char *tag);
+int chachapoly_open(const unsigned char *key, const unsigned char *nonce, const unsigned char *ad, size_t adlen,
+  unsigned char *data, size_t len, const unsigned char *tag);
+
+#endif
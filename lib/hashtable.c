@@ -0,0 +1,125 @@
+/* hashtable.c: incrementally growing chained hash tables, see hashtable.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../core/error.h"
+
+#include "hashtable.h"
+
+#define itemnext(ht, item) (*(void **)((char *)(item) + (ht)->nextoffset))
+
+void hashtable_init(hashtable *ht, unsigned int initialsize, size_t nextoffset, HashFunc hashitem) {
+  unsigned int size;
+
+  for (size=16;size<initialsize;size<<=1)
+    ;
+
+  ht->buckets=calloc(size, sizeof(void *));
+  if (!ht->buckets)
+    Error("hashtable", ERR_STOP, "Unable to allocate %u buckets.", size);
+
+  ht->size=ht->allocated=size;
+  ht->lowmask=size-1;
+  ht->split=0;
+  ht->count=0;
+  ht->nextoffset=nextoffset;
+  ht->hashitem=hashitem;
+}
+
+void hashtable_free(hashtable *ht) {
+  free(ht->buckets);
+  ht->buckets=NULL;
+  ht->size=ht->allocated=0;
+  ht->count=0;
+}
+
+/* Moves the entries of bucket "split" that now belong in the upper half */
+static void hashtable_split(hashtable *ht) {
+  unsigned int from=ht->split, to=ht->split + ht->lowmask + 1, highmask=(ht->lowmask << 1) | 1;
+  void **pp, *item;
+
+  if (to >= ht->allocated) {
+    void **nb=realloc(ht->buckets, ht->allocated * 2 * sizeof(void *));
+
+    /* not fatal, we just stay more loaded */
+    if (!nb)
+      return;
+
+    memset(nb + ht->allocated, 0, ht->allocated * sizeof(void *));
+    ht->buckets=nb;
+    ht->allocated*=2;
+  }
+
+  ht->buckets[to]=NULL;
+  for (pp=&ht->buckets[from];(item=*pp);) {
+    if ((ht->hashitem(item) & highmask) == to) {
+      *pp=itemnext(ht, item);
+      itemnext(ht, item)=ht->buckets[to];
+      ht->buckets[to]=item;
+    } else {
+      pp=&itemnext(ht, item);
+    }
+  }
+
+  ht->size++;
+  if (++ht->split > ht->lowmask) {
+    ht->lowmask=highmask;
+    ht->split=0;
+  }
+}
+
+void hashtable_add(hashtable *ht, void *item, unsigned int hash) {
+  unsigned int b=hashtable_bucket(ht, hash);
+
+  itemnext(ht, item)=ht->buckets[b];
+  ht->buckets[b]=item;
+
+  if (++ht->count > (unsigned long)ht->size * HASHTABLE_MAXLOAD)
+    hashtable_split(ht);
+}
+
+int hashtable_remove(hashtable *ht, void *item, unsigned int hash) {
+  void **pp;
+
+  for (pp=&ht->buckets[hashtable_bucket(ht, hash)];*pp;pp=&itemnext(ht, *pp)) {
+    if (*pp==item) {
+      *pp=itemnext(ht, item);
+      ht->count--;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Load factor plus a histogram of chain lengths (last column is "or more") */
+char *hashtable_stats(hashtable *ht) {
+  static char buf[256];
+  unsigned long hist[8];
+  unsigned int i, len, maxchain=0, used=0;
+  void *item;
+  int n;
+
+  memset(hist, 0, sizeof(hist));
+
+  for (i=0;i<ht->size;i++) {
+    for (len=0,item=ht->buckets[i];item;item=itemnext(ht, item))
+      len++;
+
+    if (len)
+      used++;
+    if (len>maxchain)
+      maxchain=len;
+
+    hist[len<7?len:7]++;
+  }
+
+  n=snprintf(buf, sizeof(buf), "%lu entries, %u/%u buckets used, load %.2f, max chain %u, chains:",
+             ht->count, used, ht->size, ht->size?(double)ht->count/ht->size:0.0, maxchain);
+
+  for (i=0;i<8 && n>0 && n<(int)sizeof(buf);i++)
+    n+=snprintf(buf + n, sizeof(buf) - n, " %u%s=%lu", i, (i==7)?"+":"", hist[i]);
+
+  return buf;
+}
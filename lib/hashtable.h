@@ -0,0 +1,49 @@
+/* hashtable.h */
+
+#ifndef __HASHTABLE_H
+#define __HASHTABLE_H
+
+#include <stddef.h>
+
+/*
+ * Chained hash table that grows one bucket at a time (linear hashing):
+ * each insert that takes the table over its load factor splits a single
+ * bucket, so there's never a full rehash.  Entries are never moved to a
+ * lower bucket, so walking buckets [0,size) sees everything even if the
+ * table grows part way through (though entries may then be seen twice).
+ *
+ * Entries are caller owned structs with a "next" pointer at nextoffset.
+ * The table never shrinks; removing entries while walking is fine.
+ */
+
+typedef unsigned int (*HashFunc)(const void *item);
+
+typedef struct hashtable {
+  void **buckets;          /* walk [0,size) */
+  unsigned int size;
+  unsigned int allocated;
+  unsigned int lowmask;    /* buckets below split use lowmask*2+1 instead */
+  unsigned int split;
+  unsigned long count;
+  size_t nextoffset;
+  HashFunc hashitem;
+} hashtable;
+
+#define HASHTABLE_MAXLOAD 1
+
+void hashtable_init(hashtable *ht, unsigned int initialsize, size_t nextoffset, HashFunc hashitem);
+void hashtable_free(hashtable *ht);
+void hashtable_add(hashtable *ht, void *item, unsigned int hash);
+int hashtable_remove(hashtable *ht, void *item, unsigned int hash);
+char *hashtable_stats(hashtable *ht);
+
+static inline unsigned int hashtable_bucket(hashtable *ht, unsigned int hash) {
+  unsigned int b=hash & ht->lowmask;
+
+  if (b < ht->split)
+    b=hash & ((ht->lowmask << 1) | 1);
+
+  return b;
+}
+
+#endif
@@ -4,6 +4,8 @@
 #include "chattr.tab.c"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <errno.h>
 
 /*-
@@ -145,6 +147,81 @@ unsigned long irc_crc32i(const char *s) {
   return crc32val;
 }
 
+/* irc_strhash/irc_strhashi
+ *
+ * Word at a time string hashes for in-memory hash tables.  Unlike the crc32
+ * functions above these are NOT stable across platforms, never store them.
+ *
+ * irc_strhashi() folds case the same way as ToLower(): bytes 'A'..'^' have
+ * 0x20 added, which covers both A-Z and the rfc1459 []\^ -> {}|~ mapping.
+ * Words containing 8859-1 characters fall back to the lookup table.
+ */
+
+#define HASHONES  0x0101010101010101ULL
+#define HASHHIGHS 0x8080808080808080ULL
+
+static inline uint64_t hashfoldword(uint64_t w) {
+  uint64_t low, ge41, ge5f;
+  unsigned char *cp;
+  int i;
+
+  if (w & HASHHIGHS) {
+    cp=(unsigned char *)&w;
+    for (i=0;i<8;i++)
+      cp[i]=ToLower((char)cp[i]);
+    return w;
+  }
+
+  low=w & ~HASHHIGHS;
+  ge41=(low + HASHONES * (0x80 - 0x41)) & HASHHIGHS;
+  ge5f=(low + HASHONES * (0x80 - 0x5f)) & HASHHIGHS;
+
+  return w | ((ge41 & ~ge5f) >> 2);
+}
+
+static inline uint64_t hashmix(uint64_t h, uint64_t w) {
+  h^=w;
+  h*=0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 29);
+}
+
+static inline unsigned int hashfinal(uint64_t h, size_t len) {
+  h^=len;
+  h^=h >> 33;
+  h*=0xFF51AFD7ED558CCDULL;
+  h^=h >> 33;
+  h*=0xC4CEB9FE1A85EC53ULL;
+  h^=h >> 33;
+
+  return (unsigned int)h;
+}
+
+static unsigned int strhash(const char *s, int fold) {
+  size_t len=strlen(s), i;
+  uint64_t h=0, w;
+
+  for (i=0;i+8<=len;i+=8) {
+    memcpy(&w, s + i, 8);
+    h=hashmix(h, fold ? hashfoldword(w) : w);
+  }
+
+  if (i<len) {
+    w=0;
+    memcpy(&w, s + i, len - i);
+    h=hashmix(h, fold ? hashfoldword(w) : w);
+  }
+
+  return hashfinal(h, len);
+}
+
+unsigned int irc_strhash(const char *s) {
+  return strhash(s, 0);
+}
+
+unsigned int irc_strhashi(const char *s) {
+  return strhash(s, 1);
+}
+
 /* ircd_strcmp/ircd_strncmp
  *
  * Copyright (c) 1987
@@ -0,0 +1,14 @@
+#include "splitmix.h"
+
+uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/* uniform on [0, 1), 53 bits */
+double splitmix64_01(uint64_t *state) {
+  return (splitmix64(state) >> 11) * (1.0 / 9007199254740992.0);
+}
@@ -0,0 +1,15 @@
+#ifndef __SPLITMIX_H
+#define __SPLITMIX_H
+
+#include <stdint.h>
+
+/*
+ * splitmix64: small, fast and the same everywhere for a given seed, for
+ * benchmarks and generators that need to reproduce a run.  Not for
+ * anything that needs to be unpredictable, use prng.h for that.
+ */
+
+uint64_t splitmix64(uint64_t *state);
+double splitmix64_01(uint64_t *state);
+
+#endif
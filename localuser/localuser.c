@@ -634,6 +634,7 @@ void localusersetaccount(nick *np, char *accname, unsigned long accid, u_int64_t
     strcpy(np->authname,accname);
   }
 
+  nickcolumnsync(np);
   sendaccountmessage(np);
 
   triggerhook(HOOK_NICK_ACCOUNT, np);
@@ -645,6 +646,7 @@ void localusersetumodes(nick *np, flag_t newmodes) {
   }
 
   np->umodes = newmodes;
+  nickcolumnsync(np);
 }
 
 void localusersetaccountflags(authname *anp, u_int64_t accountflags) {
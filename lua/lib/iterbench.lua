@@ -0,0 +1,198 @@
+-- Times per-element iteration (irc_getfirstnick/irc_getnextnick and the
+-- table-per-element iterators) against the bulk irc_getnicks/irc_getchans,
+-- with and without filters.
+--
+-- Load it as a script (script=lib/iterbench) on a populated network --
+-- testmod/synthnet with keep=1 will do.  It waits for some users to show
+-- up, runs once, and writes one key=value line per benchmark to
+-- data/iterbench.results.
+--
+-- Each walk runs in a resume of its own, but on networks much bigger than
+-- synthnet's default one walk can still use up instructionbudget; give it
+-- scriptbudget=libiterbench=0 there (script names lose their slashes).
+
+local RESULTS = "data/iterbench.results"
+local REPEATS = 5
+
+local sched = Scheduler()
+local out
+
+local function result(name, ops, elapsed, matches)
+  local line = string.format("iterbench bench=%s ops=%d us=%d ns_per_op=%.1f matches=%d", name, ops, elapsed * 1000000, ops > 0 and elapsed * 1000000000 / ops or 0, matches)
+
+  if out then
+    out:write(line .. "\n")
+    out:flush()
+  end
+end
+
+-- average over REPEATS, giving the rest of the bot a go between each one
+-- (and starting each on a fresh instruction budget)
+local function bench(name, ops, fn)
+  local matches
+  local elapsed = 0
+
+  for i=1,REPEATS do
+    local start = os.clock()
+    matches = fn()
+    elapsed = elapsed + os.clock() - start
+    coroutine.yield()
+  end
+
+  result(name, ops, elapsed / REPEATS, matches)
+
+  return matches
+end
+
+local function compare(what, a, b)
+  if a ~= b then
+    result(what .. "_mismatch", 0, 0, a - b)
+  end
+end
+
+local function run()
+  local fields = { nickpusher.numeric, nickpusher.accountid }
+  local _, nicks = irc_getnicks({})
+  local a, b
+
+  out = io.open(RESULTS, "w")
+
+  a = bench("nick_element", nicks, function()
+    local count = 0
+    local numeric, accountid = irc_getfirstnick(fields)
+    while numeric do
+      if accountid then
+        count = count + 1
+      end
+      numeric, accountid = irc_getnextnick()
+    end
+    return count
+  end)
+
+  b = bench("nick_element_tables", nicks, function()
+    local count = 0
+    for t in nickhash_iter(fields) do
+      if t[2] then
+        count = count + 1
+      end
+    end
+    return count
+  end)
+  compare("nick_element_tables", a, b)
+
+  b = bench("nick_bulk", nicks, function()
+    local count = 0
+    local r, n, stride = irc_getnicks(fields)
+    for i=2,n*stride,stride do
+      if r[i] then
+        count = count + 1
+      end
+    end
+    return count
+  end)
+  compare("nick_bulk", a, b)
+
+  b = bench("nick_bulk_filter", nicks, function()
+    local _, n = irc_getnicks({}, { account = true })
+    return n
+  end)
+  compare("nick_bulk_filter", a, b)
+
+  a = bench("oper_element", nicks, function()
+    local count = 0
+    local numeric, umodes = irc_getfirstnick({ nickpusher.numeric, nickpusher.umodes })
+    while numeric do
+      if umodes:find("o", 1, true) then
+        count = count + 1
+      end
+      numeric, umodes = irc_getnextnick()
+    end
+    return count
+  end)
+
+  b = bench("oper_bulk_filter", nicks, function()
+    local _, n = irc_getnicks({ nickpusher.numeric }, { umodes = "+o" })
+    return n
+  end)
+  compare("oper_bulk_filter", a, b)
+
+  local server = irc_getfirstnick({ nickpusher.servernumeric })
+  a = bench("server_element", nicks, function()
+    local count = 0
+    local numeric, s = irc_getfirstnick({ nickpusher.numeric, nickpusher.servernumeric })
+    while numeric do
+      if s == server then
+        count = count + 1
+      end
+      numeric, s = irc_getnextnick()
+    end
+    return count
+  end)
+
+  b = bench("server_bulk_filter", nicks, function()
+    local _, n = irc_getnicks({ nickpusher.numeric }, { server = server })
+    return n
+  end)
+  compare("server_bulk_filter", a, b)
+
+  local chans, nchans, stride = irc_getchans({ chanpusher.name, chanpusher.totalusers })
+  local biggest, users = nil, 0
+  for i=1,nchans*stride,stride do
+    if chans[i + 1] > users then
+      biggest, users = chans[i], chans[i + 1]
+    end
+  end
+
+  if biggest then
+    a = bench("chanusers_element", users, function()
+      local count = 0
+      local numeric = irc_getfirstchannick(biggest, { nickpusher.numeric })
+      while numeric do
+        count = count + 1
+        numeric = irc_getnextchannick()
+      end
+      return count
+    end)
+
+    b = bench("chanusers_bulk", users, function()
+      local _, n = irc_getnicks({ nickpusher.numeric }, { channel = biggest })
+      return n
+    end)
+    compare("chanusers_bulk", a, b)
+  end
+
+  a = bench("chan_element", nchans, function()
+    local total = 0
+    local name, count = irc_getfirstchan({ chanpusher.name, chanpusher.totalusers })
+    while name do
+      total = total + count
+      name, count = irc_getnextchan()
+    end
+    return total
+  end)
+
+  b = bench("chan_bulk", nchans, function()
+    local total = 0
+    local r, n = irc_getchans({ chanpusher.totalusers })
+    for i=1,n do
+      total = total + r[i]
+    end
+    return total
+  end)
+  compare("chan_bulk", a, b)
+
+  if out then
+    out:close()
+    out = nil
+  end
+end
+
+local function waitforusers()
+  if irc_getfirstnick({ nickpusher.numeric }) then
+    coroutine_spawn(run)
+  else
+    sched:add(5, waitforusers)
+  end
+end
+
+sched:add(5, waitforusers)
@@ -84,4 +84,39 @@ function nickchannels_iter(nick)
   end
 end
 
+-- bulk versions: one C call for everything, filtered in C (see irc_getnicks),
+-- and no table per element -- the fields come back after the index:
+--   for i, numeric, account in nickhash_bulk_iter({ nickpusher.numeric, nickpusher.authname }, { umodes = "+o" }) do
+local function bulk_iter(a, count, stride)
+  local i = 0
 
+  return function()
+    if i == count then
+      return nil
+    end
+
+    local base = i * stride
+    i = i + 1
+    return i, unpack(a, base + 1, base + stride)
+  end
+end
+
+function nickhash_bulk_iter(items, filter)
+  local a, count, stride = irc_getnicks(items, filter)
+  return bulk_iter(a, count or 0, stride or 0)
+end
+
+function channelusers_bulk_iter(channel, items, filter)
+  local f = {}
+  for k, v in pairs(filter or {}) do
+    f[k] = v
+  end
+  f.channel = channel
+
+  return nickhash_bulk_iter(items, f)
+end
+
+function channelhash_bulk_iter(items, filter)
+  local a, count, stride = irc_getchans(items, filter)
+  return bulk_iter(a, count or 0, stride or 0)
+end
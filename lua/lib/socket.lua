@@ -33,6 +33,18 @@ local function socket_handler(socket, event, tag, ...)
     socket_new(newsocket, sockets[socket].handler)
   end
 
+  -- a coroutine sat in socket_wait gets the event instead of the handler
+  local waiter = sockets[socket].waiter
+  if waiter then
+    sockets[socket].waiter = nil
+    if coroutine_wake(waiter, event, ...) then
+      if event == "close" then
+        sockets[socket] = nil
+      end
+      return
+    end
+  end
+
   sockets[socket].handler(socket, event, tag, ...)
 
   if event == "close" then
@@ -129,6 +141,18 @@ function socket_write(socket, data)
   return true
 end
 
+-- from inside a coroutine: returns event, data ("read", "accept", "connect"
+-- or "close"), or nil, "timeout"
+function socket_wait(socket, timeout)
+  local token = coroutine_token()
+  if not token or not sockets[socket] then
+    return nil
+  end
+
+  sockets[socket].waiter = token
+  return coroutine_wait(token, timeout)
+end
+
 function socket_close(socket, flush)
   if whenbufferempty and sockets[socket].writebuf ~= "" then
     sockets[socket].closing = true
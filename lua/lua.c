@@ -61,6 +61,8 @@ void lua_scheduler_freeall(lua_list *l);
 void lua_registersocketcommands(lua_State *ps);
 void lua_registercryptocommands(lua_State *ps);
 void lua_registerschedulercommands(lua_State *ps);
+void lua_registercoroutinecommands(lua_State *ps);
+void lua_coroutine_freeall(lua_list *l);
 
 void lua_registerdbcommands(lua_list *l);
 void lua_destroydb(lua_list *l);
@@ -80,6 +82,8 @@ void *startsched = NULL;
 
 int loaded = 0;
 
+static unsigned long defaultbudget;
+
 struct rusage r_usages;
 struct rusage r_usagee;
 
@@ -100,6 +104,8 @@ static const luaL_Reg ourlibs[] = {
 lua_list dummy;
   
 void _init() {
+  sstring *m;
+
   lua_setupdebugsocket();
   lua_initnickpusher();
   lua_initchanpusher();
@@ -125,6 +131,9 @@ void _init() {
 
   lua_setpath();
 
+  m = getconfigitem("lua", "instructionbudget");
+  defaultbudget = m ? strtoul(m->content, NULL, 10) : LUA_DEFAULTBUDGET;
+
   loaded = 1;
 
   startsched = scheduleoneshot(time(NULL) + 1, &lua_startup, NULL);
@@ -178,6 +187,27 @@ void lua_loadscripts(void) {
   }
 }
 
+/* scriptbudget lines look like "myscript=100000000", anything else gets instructionbudget */
+static unsigned long lua_scriptbudget(const char *name) {
+  array *ls = getconfigitems("lua", "scriptbudget");
+  sstring **items;
+  char *p;
+  size_t len = strlen(name);
+  int i;
+
+  if(!ls)
+    return defaultbudget;
+
+  items = (sstring **)(ls->content);
+  for(i=0;i<ls->cursi;i++) {
+    p = items[i]->content;
+    if(!strncmp(p, name, len) && (p[len] == '='))
+      return strtoul(p + len + 1, NULL, 10);
+  }
+
+  return defaultbudget;
+}
+
 /* taken from the lua manual, modified to use nsmalloc */
 static void *lua_nsmalloc(void *ud, void *ptr, size_t osize, size_t nsize) {
   if(nsize == 0) {
@@ -224,12 +254,19 @@ lua_State *lua_loadscript(char *file) {
     return NULL;
   }
   n->calls = 0;
+  n->budget = lua_scriptbudget(buf);
+  n->budgetdepth = 0;
+  n->preempted = 0;
 
   timerclear(&n->ru_utime);
   timerclear(&n->ru_stime);
 
   n->l = l;
 
+  /* so threads we didn't create (coroutine.create) can still find us */
+  lua_pushlightuserdata(l, n);
+  lua_setfield(l, LUA_REGISTRYINDEX, LUA_LISTKEY);
+
   lua_loadlibs(l);
   lua_registerdebug(l);
   lua_registercommands(l);
@@ -238,6 +275,7 @@ lua_State *lua_loadscript(char *file) {
   lua_registersocketcommands(l);
   lua_registercryptocommands(l);
   lua_registerschedulercommands(l);
+  lua_registercoroutinecommands(l);
 
   args[0] = file;
   args[1] = l;
@@ -245,6 +283,12 @@ lua_State *lua_loadscript(char *file) {
 
 #ifdef LUA_USEJIT
   lua_require(l, "lib/jit");
+
+  /* count hooks don't fire in compiled traces, so budgeted scripts stay interpreted */
+  if(n->budget) {
+    Error("lua", ERR_WARNING, "%s has an instruction budget, running it without the JIT.", n->name->content);
+    luaJIT_setmode(l, 0, LUAJIT_MODE_ENGINE|LUAJIT_MODE_OFF);
+  }
 #endif
 
   lua_require(l, "lib/bootstrap");
@@ -263,6 +307,7 @@ lua_State *lua_loadscript(char *file) {
   n->nicks = NULL;
   n->sockets = NULL;
   n->schedulers = NULL;
+  n->coroutines = NULL;
 
   if(!lua_head) { 
     lua_head = n;
@@ -274,8 +319,10 @@ lua_State *lua_loadscript(char *file) {
 
   top = lua_gettop(l);
 
-  if(lua_pcall(l, 0, 0, 0)) {
+  /* the top-level load gets a budget like any other call */
+  if(lua_debugpcall(l, "main", 0, 0, 0)) {
     Error("lua", ERR_ERROR, "Error pcalling: %s.", file);
+    lua_coroutine_freeall(n);
     lua_close(l);
     freesstring(n->name);
 
@@ -303,6 +350,7 @@ void lua_unloadscript(lua_list *l) {
 
   lua_onunload(l->l);
   lua_deregisternicks(l);
+  lua_coroutine_freeall(l);
   lua_socket_closeall(l);
   lua_scheduler_freeall(l);
   lua_destroydb(l);
@@ -431,10 +479,25 @@ void lua_debugoutput(char *format, ...) {
 
 lua_list *lua_listfromstate(lua_State *l) {
   lua_list *i = lua_head;
+  lua_coroutine *c;
+
   for(;i;i=i->next)
     if(i->l == l)
       return i;
 
+  for(i=lua_head;i;i=i->next)
+    for(c=i->coroutines;c;c=c->next)
+      if(c->co == l)
+        return i;
+
+  /* any other thread shares its script's registry */
+  lua_getfield(l, LUA_REGISTRYINDEX, LUA_LISTKEY);
+  i = (lua_list *)lua_touserdata(l, -1);
+  lua_pop(l, 1);
+
+  if(i && lua_listexists(i))
+    return i;
+
   return &dummy;
 }
 
@@ -454,6 +517,24 @@ int lua_lineok(const char *data) {
   return 1;
 }
 
+/* keeps failing every LUA_BUDGETRETRY instructions so the script can't pcall its way out */
+static void lua_budgethook(lua_State *l, lua_Debug *ar) {
+  lua_list *ll = lua_listfromstate(l);
+
+  if(lua_gethookcount(l) != LUA_BUDGETRETRY) {
+    ll->preempted++;
+    Error("lua", ERR_WARNING, "%s exceeded its budget of %lu instructions, preempting.", ll->name->content, ll->budget);
+    lua_sethook(l, lua_budgethook, LUA_MASKCOUNT, LUA_BUDGETRETRY);
+  }
+
+  luaL_error(l, "instruction budget exceeded");
+}
+
+void lua_setbudget(lua_list *ll, lua_State *l) {
+  if(ll->budget)
+    lua_sethook(l, lua_budgethook, LUA_MASKCOUNT, ll->budget);
+}
+
 int lua_debugpcall(lua_State *l, char *message, int a, int b, int c) {
   lua_list *l2 = lua_listfromstate(l);
   int ret;
@@ -466,8 +547,15 @@ int lua_debugpcall(lua_State *l, char *message, int a, int b, int c) {
   ACCOUNTING_START(l2);
 #endif
 
+  /* nested calls share the outer call's budget */
+  if(!l2->budgetdepth++)
+    lua_setbudget(l2, l);
+
   ret = lua_pcall(l, a, b, c);
 
+  if(!--l2->budgetdepth && l2->budget)
+    lua_sethook(l, NULL, 0, 0);
+
 #ifdef LUA_PROFILE
   ACCOUNTING_STOP(l2);
 #endif
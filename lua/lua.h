@@ -24,6 +24,7 @@
 #include "lualocal.h"
 #include "luasocket.h"
 #include "luascheduler.h"
+#include "luacoroutine.h"
 
 #define luamalloc(x) nsmalloc(POOL_LUA, x)
 #define luarealloc(x, y) nsrealloc(POOL_LUA, x, y)
@@ -44,6 +45,18 @@
 #define LUA_DEBUGSOCKET_ADDRESS "127.0.0.1"
 #define LUA_DEBUGSOCKET_PORT 7733
 
+#define LUA_MAXBATCHES 16
+
+/* instructions per call, 0 for unlimited -- budgeted scripts lose the JIT, so it's opt-in there */
+#ifdef LUA_USEJIT
+#define LUA_DEFAULTBUDGET 0
+#else
+#define LUA_DEFAULTBUDGET 50000000
+#endif
+#define LUA_BUDGETRETRY 1000
+
+#define LUA_LISTKEY "newserv_lualist" /* registry key holding the script's lua_list */
+
 #ifdef LUA_USEJIT
 #include <luajit.h>
 #define LUA_AUXVERSION " + " LUAJIT_VERSION
@@ -66,10 +79,14 @@ typedef struct lua_list {
   struct {
     int attempted_load;
     void *db;
+    void *batches[LUA_MAXBATCHES];
   } db;
   lua_localnick *nicks;
   lua_socket *sockets;
   lua_scheduler *schedulers;
+  lua_coroutine *coroutines;
+  unsigned long budget, preempted;
+  int budgetdepth;
 } lua_list;
 
 #define LUA_STARTLOOP(l) { lua_list *ll; for(ll=lua_head;ll;ll=ll->next) {  l = ll->l
@@ -87,6 +104,7 @@ lua_list *lua_scriptloaded(char *name);
 lua_list *lua_listfromstate(lua_State *l);
 int lua_listexists(lua_list *l);
 int lua_lineok(const char *data);
+void lua_setbudget(lua_list *l, lua_State *ps);
 
 #define lua_toint(l, n) (int)lua_tonumber(l, n)
 #define lua_isint(l, n) lua_isnumber(l, n)
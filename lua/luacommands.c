@@ -559,7 +559,7 @@ static int lua_getnextnick(lua_State *l) {
   do {
     if(!lasthashnick) {
       hashindex++;
-      if(hashindex >= NICKHASHSIZE)
+      if(hashindex >= nicktablesize)
         return 0;
       lasthashnick = nicktable[hashindex];
     } else {
@@ -591,7 +591,7 @@ static int lua_getnextchan(lua_State *l) {
   do {
     if(!lasthashchan) {
       chanhashindex++;
-      if(chanhashindex >= CHANNELHASHSIZE)
+      if(chanhashindex >= chantablesize)
         return 0;
       lasthashchan = chantable[chanhashindex];
     } else {
@@ -888,6 +888,234 @@ static int lua_nickonchan(lua_State *l) {
   return 1;
 }
 
+/*
+ * Bulk versions of the iterators: one call returns a flat array holding
+ * the requested pusher fields for each match in turn, the number of
+ * matches and the number of fields per match, with the filtering done
+ * here rather than in lua.  Unknown fields are dropped, so step through
+ * the array by the field count rather than by #fields.
+ *
+ * irc_getnicks(fields[, { server = name or numeric, umodes = "+o-k",
+ *                         account = name or true/false, channel = name }])
+ * irc_getchans(fields[, { minusers = n, nick = numeric }])
+ */
+
+typedef struct lua_nickfilter {
+  int server;
+  flag_t umodeson, umodesoff;
+  int authed; /* -1 for don't care */
+  authname *auth;
+  channel *cp;
+} lua_nickfilter;
+
+struct lua_pusher *bulknickpusher[MAX_PUSHER];
+struct lua_pusher *bulkchanpusher[MAX_PUSHER];
+
+/* 0 if nothing can match */
+static int lua_getnickfilter(lua_State *l, int index, lua_nickfilter *f) {
+  flag_t off = ~0;
+  int ok = 1;
+
+  f->server = -1;
+  f->umodeson = 0;
+  f->umodesoff = 0;
+  f->authed = -1;
+  f->auth = NULL;
+  f->cp = NULL;
+
+  if(!lua_istable(l, index))
+    return 1;
+
+  lua_getfield(l, index, "server");
+  if(lua_type(l, -1) == LUA_TNUMBER) {
+    f->server = lua_toint(l, -1);
+    ok = (f->server >= 0) && (f->server < MAXSERVERS);
+  } else if(lua_isstring(l, -1)) {
+    f->server = findserver(lua_tostring(l, -1));
+    ok = f->server >= 0;
+  }
+  lua_pop(l, 1);
+
+  lua_getfield(l, index, "umodes");
+  if(ok && lua_isstring(l, -1)) {
+    char *modes = (char *)lua_tostring(l, -1);
+
+    ok = (setflags(&f->umodeson, ~0, modes, umodeflags, REJECT_UNKNOWN) == REJECT_NONE) &&
+         (setflags(&off, ~0, modes, umodeflags, REJECT_UNKNOWN) == REJECT_NONE);
+    f->umodesoff = ~off;
+  }
+  lua_pop(l, 1);
+
+  lua_getfield(l, index, "account");
+  if(ok && lua_isboolean(l, -1)) {
+    f->authed = lua_toboolean(l, -1);
+  } else if(ok && lua_isstring(l, -1)) {
+    f->auth = getauthbyname(lua_tostring(l, -1));
+    ok = f->auth != NULL;
+  }
+  lua_pop(l, 1);
+
+  lua_getfield(l, index, "channel");
+  if(ok && lua_isstring(l, -1)) {
+    f->cp = findchannel((char *)lua_tostring(l, -1));
+    ok = f->cp && f->cp->users;
+  }
+  lua_pop(l, 1);
+
+  return ok;
+}
+
+static int lua_nickmatches(nick *np, lua_nickfilter *f) {
+  if((f->server != -1) && (homeserver(np->numeric) != f->server))
+    return 0;
+
+  if(((np->umodes & f->umodeson) != f->umodeson) || (np->umodes & f->umodesoff))
+    return 0;
+
+  if((f->authed != -1) && (!IsAccount(np) != !f->authed))
+    return 0;
+
+  if(f->auth && (np->auth != f->auth))
+    return 0;
+
+  if(f->cp && !getnumerichandlefromchanhash(f->cp->users, np->numeric))
+    return 0;
+
+  return 1;
+}
+
+/* fields per match, after lua_setuppusher has dropped anything it didn't like */
+static int lua_pushercount(struct lua_pusher **lp) {
+  int fields = 0;
+
+  while(lp[fields])
+    fields++;
+
+  return fields;
+}
+
+/* appends one match's fields to the array at t */
+static void lua_bulkpush(lua_State *l, int t, struct lua_pusher **lp, void *p, int *count) {
+  int fields = lua_usepusher(l, lp, p), base = *count * fields;
+
+  for(;fields>0;fields--)
+    lua_rawseti(l, t, base + fields);
+
+  (*count)++;
+}
+
+static int lua_getnicks(lua_State *l) {
+  lua_nickfilter f;
+  nick *np;
+  channel *cp;
+  int t, i, fields, count = 0;
+
+  if(!lua_istable(l, 1))
+    return 0;
+
+  lua_setupnickpusher(l, 1, bulknickpusher, MAX_PUSHER);
+  fields = lua_pushercount(bulknickpusher);
+
+  if(!lua_getnickfilter(l, 2, &f)) {
+    lua_newtable(l);
+    lua_pushint(l, 0);
+    lua_pushint(l, fields);
+    return 3;
+  }
+
+  if(!lua_checkstack(l, MAX_PUSHER + 2))
+    return 0;
+
+  /* walk the smallest thing we've been given */
+  if(f.cp) {
+    cp = f.cp;
+    f.cp = NULL;
+
+    lua_createtable(l, cp->users->totalusers * fields, 0);
+    t = lua_gettop(l);
+
+    for(i=0;i<cp->users->hashsize;i++) {
+      if(cp->users->content[i] == nouser)
+        continue;
+
+      np = getnickbynumeric(cp->users->content[i]);
+      if(np && lua_nickmatches(np, &f))
+        lua_bulkpush(l, t, bulknickpusher, np, &count);
+    }
+  } else if(f.auth) {
+    lua_newtable(l);
+    t = lua_gettop(l);
+
+    for(np=f.auth->nicks;np;np=np->nextbyauthname)
+      if(lua_nickmatches(np, &f))
+        lua_bulkpush(l, t, bulknickpusher, np, &count);
+  } else {
+    lua_newtable(l);
+    t = lua_gettop(l);
+
+    for(i=0;i<nicktablesize;i++)
+      for(np=nicktable[i];np;np=np->next)
+        if(lua_nickmatches(np, &f))
+          lua_bulkpush(l, t, bulknickpusher, np, &count);
+  }
+
+  lua_pushint(l, count);
+  lua_pushint(l, fields);
+  return 3;
+}
+
+static int lua_getchans(lua_State *l) {
+  chanindex *cip;
+  channel **cps;
+  nick *np = NULL;
+  int t, i, fields, minusers = 0, count = 0;
+
+  if(!lua_istable(l, 1))
+    return 0;
+
+  lua_setupchanpusher(l, 1, bulkchanpusher, MAX_PUSHER);
+  fields = lua_pushercount(bulkchanpusher);
+
+  if(lua_istable(l, 2)) {
+    lua_getfield(l, 2, "minusers");
+    if(lua_isint(l, -1))
+      minusers = lua_toint(l, -1);
+    lua_pop(l, 1);
+
+    /* anything other than a known numeric matches nothing, as in lua_getnickfilter */
+    lua_getfield(l, 2, "nick");
+    if(!lua_isnil(l, -1) && (!lua_islong(l, -1) || !(np = getnickbynumeric(lua_tolong(l, -1))))) {
+      lua_newtable(l);
+      lua_pushint(l, 0);
+      lua_pushint(l, fields);
+      return 3;
+    }
+    lua_pop(l, 1);
+  }
+
+  if(!lua_checkstack(l, MAX_PUSHER + 2))
+    return 0;
+
+  lua_newtable(l);
+  t = lua_gettop(l);
+
+  if(np) {
+    cps = (channel **)np->channels->content;
+    for(i=0;i<np->channels->cursi;i++)
+      if(cps[i]->users->totalusers >= minusers)
+        lua_bulkpush(l, t, bulkchanpusher, cps[i]->index, &count);
+  } else {
+    for(i=0;i<chantablesize;i++)
+      for(cip=chantable[i];cip;cip=cip->next)
+        if(cip->channel && (cip->channel->users->totalusers >= minusers))
+          lua_bulkpush(l, t, bulkchanpusher, cip, &count);
+  }
+
+  lua_pushint(l, count);
+  lua_pushint(l, fields);
+  return 3;
+}
+
 static int lua_simplechanmode(lua_State *ps) {
   channel *cp;
   char *modes;
@@ -999,6 +1227,9 @@ void lua_registercommands(lua_State *l) {
 
   lua_register(l, "irc_getfirstchan", lua_getfirstchan);
   lua_register(l, "irc_getnextchan", lua_getnextchan);
+
+  lua_register(l, "irc_getnicks", lua_getnicks);
+  lua_register(l, "irc_getchans", lua_getchans);
   lua_register(l, "irc_getusermodes", lua_getusermodes);
   lua_register(l, "irc_nickonchan", lua_nickonchan);
 
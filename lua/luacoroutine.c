@@ -0,0 +1,292 @@
+/*
+ * Coroutines driven by the event loop.
+ *
+ * coroutine_spawn(fn, ...) runs fn in its own thread until it waits on
+ * something (coroutine_sleep, coroutine_wait, db_querywait, socket_wait),
+ * and whatever it was waiting on resumes it later.  A bare
+ * coroutine.yield() gives the rest of the bot a go and carries on at the
+ * schedule's next tick, i.e. after at least a second.
+ *
+ * Waiters are handed a token rather than the coroutine itself, so a
+ * wake-up for something we've stopped waiting on (timed out, say) is
+ * just ignored.
+ */
+
+#define _DEFAULT_SOURCE
+#include "../core/schedule.h"
+#include "../core/error.h"
+#include "lua.h"
+#include "luabot.h"
+
+static unsigned long nextidentifier, nexttoken;
+
+static void lua_coroutine_timeout(void *arg);
+
+static lua_coroutine *lua_coroutinefromstate(lua_State *co) {
+  lua_list *ll;
+  lua_coroutine *c;
+
+  for(ll=lua_head;ll;ll=ll->next)
+    for(c=ll->coroutines;c;c=c->next)
+      if(c->co == co)
+        return c;
+
+  return NULL;
+}
+
+lua_coroutine *lua_coroutinebytoken(unsigned long token) {
+  lua_list *ll;
+  lua_coroutine *c;
+
+  if(!token)
+    return NULL;
+
+  for(ll=lua_head;ll;ll=ll->next)
+    for(c=ll->coroutines;c;c=c->next)
+      if(c->waiting && (c->token == token))
+        return c;
+
+  return NULL;
+}
+
+static void lua_coroutine_free(lua_coroutine *c) {
+  lua_coroutine **cp;
+
+  if(c->timeout)
+    deleteschedule(c->timeout, lua_coroutine_timeout, c);
+
+  for(cp=&c->l->coroutines;*cp;cp=&(*cp)->next) {
+    if(*cp == c) {
+      *cp = c->next;
+      break;
+    }
+  }
+
+  luaL_unref(c->l->l, LUA_REGISTRYINDEX, c->ref);
+  luafree(c);
+}
+
+void lua_coroutine_freeall(lua_list *ll) {
+  while(ll->coroutines)
+    lua_coroutine_free(ll->coroutines);
+}
+
+/*
+ * nargs values are already on c->co's stack, if it hasn't yielded yet
+ * (something finished straight away) they're left for the waiting
+ * function to return itself.
+ */
+void lua_coroutine_resume(lua_coroutine *c, int nargs) {
+  lua_list *ll = c->l;
+  int ret;
+
+  c->waiting = 0;
+  c->sleeping = 0;
+  c->token = 0;
+  if(c->timeout) {
+    deleteschedule(c->timeout, lua_coroutine_timeout, c);
+    c->timeout = NULL;
+  }
+
+  if(c->running)
+    return;
+
+  lua_setbudget(ll, c->co);
+  c->running = 1;
+
+#ifdef LUA_PROFILE
+  ACCOUNTING_START(ll);
+#endif
+
+  ret = lua_resume(c->co, nargs);
+  c->running = 0;
+
+#ifdef LUA_PROFILE
+  ACCOUNTING_STOP(ll);
+#endif
+
+  if(ret == LUA_YIELD) {
+    lua_settop(c->co, 0);
+
+    /* plain coroutine.yield(): anything scheduled for "now" would run in this
+       same pass of the schedule, so the soonest we can come back is a second */
+    if(!c->waiting) {
+      c->sleeping = 1;
+      c->timeout = scheduleoneshot(time(NULL) + 1, lua_coroutine_timeout, c);
+      if(!c->timeout) {
+        Error("lua", ERR_ERROR, "Unable to schedule coroutine %lu (%s), abandoning it.", c->identifier, ll->name->content);
+        lua_coroutine_free(c);
+      }
+    }
+
+    return;
+  }
+
+  if(ret)
+    Error("lua", ERR_ERROR, "Error in coroutine %lu (%s): %s.", c->identifier, ll->name->content, lua_tostring(c->co, -1));
+
+  lua_coroutine_free(c);
+}
+
+static void lua_coroutine_timeout(void *arg) {
+  lua_coroutine *c = (lua_coroutine *)arg;
+  int nargs = 0;
+
+  c->timeout = NULL;
+
+  if(!c->sleeping) {
+    lua_pushnil(c->co);
+    lua_pushstring(c->co, "timeout");
+    nargs = 2;
+  }
+
+  lua_coroutine_resume(c, nargs);
+}
+
+/* 0 if co wasn't started with coroutine_spawn */
+unsigned long lua_coroutine_token(lua_State *co) {
+  lua_coroutine *c = lua_coroutinefromstate(co);
+  if(!c)
+    return 0;
+
+  if(!++nexttoken)
+    nexttoken++;
+
+  c->token = nexttoken;
+  return c->token;
+}
+
+/* marks co as waiting on token, the caller should return lua_yield(co, 0) on success */
+int lua_coroutine_wait(lua_State *co, unsigned long token, int timeout) {
+  lua_coroutine *c = lua_coroutinefromstate(co);
+  if(!c || !token || (c->token != token) || c->waiting)
+    return 0;
+
+  if(timeout >= 0) {
+    c->timeout = scheduleoneshot(time(NULL) + timeout, lua_coroutine_timeout, c);
+    if(!c->timeout)
+      return 0;
+  }
+
+  c->waiting = 1;
+  return 1;
+}
+
+static int lua_coroutine_spawn(lua_State *ps) {
+  lua_list *ll = lua_listfromstate(ps);
+  lua_coroutine *c;
+  unsigned long identifier;
+  int nargs = lua_gettop(ps) - 1;
+
+  if(!lua_listexists(ll) || !lua_isfunction(ps, 1))
+    return 0;
+
+  c = (lua_coroutine *)luamalloc(sizeof(lua_coroutine));
+  if(!c)
+    return 0;
+
+  c->co = lua_newthread(ps);
+  c->ref = luaL_ref(ps, LUA_REGISTRYINDEX);
+  if(!lua_checkstack(c->co, nargs + 1)) {
+    luaL_unref(ps, LUA_REGISTRYINDEX, c->ref);
+    luafree(c);
+    return 0;
+  }
+  lua_xmove(ps, c->co, nargs + 1);
+
+  c->identifier = identifier = ++nextidentifier;
+  c->token = 0;
+  c->waiting = 0;
+  c->sleeping = 0;
+  c->running = 0;
+  c->timeout = NULL;
+  c->l = ll;
+  c->next = ll->coroutines;
+  ll->coroutines = c;
+
+  lua_coroutine_resume(c, nargs);
+
+  lua_pushlong(ps, identifier);
+  return 1;
+}
+
+static int lua_coroutine_sleep(lua_State *ps) {
+  unsigned long token;
+  int seconds;
+
+  if(!lua_isint(ps, 1))
+    return 0;
+
+  seconds = lua_toint(ps, 1);
+  if(seconds < 1)
+    seconds = 1;
+
+  token = lua_coroutine_token(ps);
+  if(!lua_coroutine_wait(ps, token, seconds))
+    return 0;
+
+  lua_coroutinefromstate(ps)->sleeping = 1;
+  return lua_yield(ps, 0);
+}
+
+static int lua_coroutine_newtoken(lua_State *ps) {
+  unsigned long token = lua_coroutine_token(ps);
+  if(!token)
+    return 0;
+
+  lua_pushlong(ps, token);
+  return 1;
+}
+
+/* coroutine_wait(token[, timeout]) returns whatever was passed to coroutine_wake, or nil, "timeout" */
+static int lua_coroutine_waittoken(lua_State *ps) {
+  if(!lua_islong(ps, 1))
+    return 0;
+
+  if(!lua_coroutine_wait(ps, lua_tolong(ps, 1), lua_isint(ps, 2) ? lua_toint(ps, 2) : -1))
+    return 0;
+
+  return lua_yield(ps, 0);
+}
+
+/* true if something was waiting on token */
+static int lua_coroutine_wake(lua_State *ps) {
+  lua_coroutine *c;
+  int nargs = lua_gettop(ps) - 1;
+
+  if(!lua_islong(ps, 1))
+    return 0;
+
+  c = lua_coroutinebytoken(lua_tolong(ps, 1));
+  if(!c || (c->co == ps) || !lua_checkstack(c->co, nargs)) {
+    lua_pushboolean(ps, 0);
+    return 1;
+  }
+
+  lua_xmove(ps, c->co, nargs);
+  lua_coroutine_resume(c, nargs);
+
+  lua_pushboolean(ps, 1);
+  return 1;
+}
+
+static int lua_coroutine_count(lua_State *ps) {
+  lua_list *ll = lua_listfromstate(ps);
+  lua_coroutine *c;
+  int count = 0;
+
+  for(c=ll->coroutines;c;c=c->next)
+    count++;
+
+  lua_pushint(ps, count);
+  return 1;
+}
+
+void lua_registercoroutinecommands(lua_State *ps) {
+  lua_register(ps, "coroutine_spawn", lua_coroutine_spawn);
+  lua_register(ps, "coroutine_sleep", lua_coroutine_sleep);
+  lua_register(ps, "coroutine_token", lua_coroutine_newtoken);
+  lua_register(ps, "coroutine_wait", lua_coroutine_waittoken);
+  lua_register(ps, "coroutine_wake", lua_coroutine_wake);
+  lua_register(ps, "coroutine_count", lua_coroutine_count);
+}
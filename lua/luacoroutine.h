@@ -0,0 +1,25 @@
+#ifndef _LUA_COROUTINE_H
+#define _LUA_COROUTINE_H
+
+#include "lua.h"
+
+typedef struct lua_coroutine {
+  lua_State *co;
+  int ref;
+  unsigned long identifier;
+  unsigned long token; /* handed to whoever is going to wake us */
+  int waiting;
+  int running;
+  int sleeping;
+  void *timeout;
+  struct lua_list *l;
+
+  struct lua_coroutine *next;
+} lua_coroutine;
+
+unsigned long lua_coroutine_token(lua_State *co);
+int lua_coroutine_wait(lua_State *co, unsigned long token, int timeout);
+lua_coroutine *lua_coroutinebytoken(unsigned long token);
+void lua_coroutine_resume(lua_coroutine *c, int nargs);
+
+#endif
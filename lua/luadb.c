@@ -157,6 +157,68 @@ static int lua_dbquery(lua_State *ps) {
   LUA_RETURN(ps, LUA_OK);
 }
 
+static void lua_dbwaitcallback(const DBAPIResult *result, void *tag) {
+  unsigned long *token = (unsigned long *)tag;
+  lua_coroutine *c = lua_coroutinebytoken(*token);
+  int success = result && result->success, row, i;
+
+  luafree(token);
+
+  if(!c) { /* gave up waiting */
+    if(result)
+      result->clear(result);
+    return;
+  }
+
+  lua_pushboolean(c->co, success);
+  lua_newtable(c->co);
+
+  if(success) {
+    for(row=1;result->next(result);row++) {
+      lua_createtable(c->co, result->fields, 0);
+      for(i=0;i<result->fields;i++) {
+        lua_pushstring(c->co, result->get(result, i));
+        lua_rawseti(c->co, -2, i + 1);
+      }
+      lua_rawseti(c->co, -2, row);
+    }
+  }
+
+  if(result)
+    result->clear(result);
+
+  lua_coroutine_resume(c, 2);
+}
+
+/* db_querywait(query[, timeout]) from inside a coroutine, returns success, { { field, ... }, ... } */
+static int lua_dbquerywait(lua_State *ps) {
+  lua_list *l = lua_listfromstate(ps);
+  char *q = (char *)lua_tostring(ps, 1);
+  unsigned long *token, t;
+  DBAPIConn *luadb = lua_getdb_l(l);
+
+  if(!luadb || !q)
+    return 0;
+
+  token = (unsigned long *)luamalloc(sizeof(unsigned long));
+  if(!token)
+    return 0;
+
+  *token = t = lua_coroutine_token(ps);
+  if(!lua_coroutine_wait(ps, t, lua_isint(ps, 2) ? lua_toint(ps, 2) : -1)) {
+    luafree(token);
+    return 0;
+  }
+
+  luadb->unsafequery(luadb, lua_dbwaitcallback, token, "%s", q);
+
+  /* sqlite runs it there and then */
+  if(!lua_coroutinebytoken(t))
+    return 2;
+
+  return lua_yield(ps, 0);
+}
+
 static int lua_dbescape(lua_State *ps) {
   char ebuf[8192 * 2 + 1];
   char *s = (char *)lua_tostring(ps, 1);
@@ -179,6 +241,144 @@ static int lua_dbescape(lua_State *ps) {
   return 1;
 }
 
+/* adds a table of column names, all of one kind */
+static int lua_dbbatchcolumns(lua_State *ps, int index, int kind, const char **names, int *kinds, int *columns) {
+  int i, count;
+
+  if(lua_isnil(ps, index))
+    return 1;
+
+  if(!lua_istable(ps, index))
+    return 0;
+
+  count = lua_objlen(ps, index);
+  for(i=1;i<=count;i++) {
+    if(*columns >= DBAPI2_BATCH_MAXCOLUMNS)
+      return 0;
+
+    lua_rawgeti(ps, index, i);
+    names[*columns] = lua_tostring(ps, -1);
+    lua_pop(ps, 1); /* still referenced by the table */
+
+    if(!names[*columns])
+      return 0;
+
+    kinds[(*columns)++] = kind;
+  }
+
+  return 1;
+}
+
+/*
+ * db_batch(table, { keys }, { counters }, { values }[, interval]), returns a handle for db_batchqueue.
+ * The table and column names go into the SQL as they are, so they must be plain [A-Za-z0-9_]
+ * identifiers -- anything else gets nil.
+ */
+static int lua_dbbatch(lua_State *ps) {
+  lua_list *l = lua_listfromstate(ps);
+  const char *names[DBAPI2_BATCH_MAXCOLUMNS];
+  int kinds[DBAPI2_BATCH_MAXCOLUMNS], columns = 0, interval = 5, i;
+  char *table = (char *)lua_tostring(ps, 1);
+  char metricname[48];
+  DBAPIConn *luadb = lua_getdb_l(l);
+
+  if(!luadb || !table)
+    return 0;
+
+  if(!lua_dbbatchcolumns(ps, 2, DBAPI2_BATCH_KEY, names, kinds, &columns) ||
+     !lua_dbbatchcolumns(ps, 3, DBAPI2_BATCH_ADD, names, kinds, &columns) ||
+     !lua_dbbatchcolumns(ps, 4, DBAPI2_BATCH_SET, names, kinds, &columns))
+    return 0;
+
+  if(lua_isint(ps, 5))
+    interval = lua_toint(ps, 5);
+
+  for(i=0;i<LUA_MAXBATCHES;i++)
+    if(!l->db.batches[i])
+      break;
+
+  if(i == LUA_MAXBATCHES)
+    return 0;
+
+  snprintf(metricname, sizeof(metricname), "%s_%s", luadb->name, table);
+  l->db.batches[i] = dbapi2batchnew(luadb, table, columns, names, kinds, interval, metricname);
+  if(!l->db.batches[i])
+    return 0;
+
+  lua_pushint(ps, i + 1);
+  return 1;
+}
+
+static DBAPIBatch *lua_getbatch(lua_State *ps) {
+  lua_list *l = lua_listfromstate(ps);
+  int i;
+
+  if(!l || !lua_isint(ps, 1))
+    return NULL;
+
+  i = lua_toint(ps, 1);
+  if(i < 1 || i > LUA_MAXBATCHES)
+    return NULL;
+
+  return l->db.batches[i - 1];
+}
+
+/* db_batchqueue(handle, key..., counter..., value...), in the order the columns were given */
+static int lua_dbbatchqueue(lua_State *ps) {
+  const char *values[DBAPI2_BATCH_MAXCOLUMNS];
+  DBAPIBatch *b = lua_getbatch(ps);
+  int i, columns = lua_gettop(ps) - 1;
+
+  if(!b || columns > DBAPI2_BATCH_MAXCOLUMNS)
+    LUA_RETURN(ps, LUA_FAIL);
+
+  for(i=0;i<columns;i++)
+    values[i] = lua_tostring(ps, i + 2);
+
+  if(columns != dbapi2batchcolumns(b) || !dbapi2batchqueue(b, values))
+    LUA_RETURN(ps, LUA_FAIL);
+
+  LUA_RETURN(ps, LUA_OK);
+}
+
+static int lua_dbbatchflush(lua_State *ps) {
+  DBAPIBatch *b = lua_getbatch(ps);
+
+  if(!b)
+    LUA_RETURN(ps, LUA_FAIL);
+
+  dbapi2batchflush(b);
+  LUA_RETURN(ps, LUA_OK);
+}
+
+static int lua_dbbatchstats(lua_State *ps) {
+  DBAPIBatch *b = lua_getbatch(ps);
+  const DBAPIBatchStats *s;
+
+  if(!b)
+    return 0;
+
+  s = dbapi2batchstats(b);
+
+  lua_newtable(ps);
+  lua_pushnumber(ps, s->queued);
+  lua_setfield(ps, -2, "queued");
+  lua_pushnumber(ps, s->coalesced);
+  lua_setfield(ps, -2, "coalesced");
+  lua_pushnumber(ps, s->rows);
+  lua_setfield(ps, -2, "rows");
+  lua_pushnumber(ps, s->statements);
+  lua_setfield(ps, -2, "statements");
+  lua_pushnumber(ps, s->inflight);
+  lua_setfield(ps, -2, "inflight");
+  lua_pushnumber(ps, s->failed);
+  lua_setfield(ps, -2, "failed");
+  lua_pushnumber(ps, s->lastflush);
+  lua_setfield(ps, -2, "lastflush");
+
+  return 1;
+}
+
 void lua_registerdbcommands(lua_list *n) {
   lua_State *l = n->l;
 
@@ -186,15 +386,22 @@ void lua_registerdbcommands(lua_list *n) {
 
   lua_register(l, "db_createquery", lua_dbcreatequery);
   lua_register(l, "db_query", lua_dbquery);
+  lua_register(l, "db_querywait", lua_dbquerywait);
   lua_register(l, "db_escape", lua_dbescape);
 
   lua_register(l, "db_numfields", lua_dbnumfields);
   lua_register(l, "db_getvalue", lua_dbgetvalue);
   lua_register(l, "db_nextrow", lua_dbnextrow);
 
+  lua_register(l, "db_batch", lua_dbbatch);
+  lua_register(l, "db_batchqueue", lua_dbbatchqueue);
+  lua_register(l, "db_batchflush", lua_dbbatchflush);
+  lua_register(l, "db_batchstats", lua_dbbatchstats);
+
   /* lazy open */
   n->db.attempted_load = 0;
   n->db.db = NULL;
+  memset(n->db.batches, 0, sizeof(n->db.batches));
 
   /* TODO */
   /* parameterised queries (huge pain due to no va_args in dbapi2) */
@@ -203,9 +410,19 @@ void lua_registerdbcommands(lua_list *n) {
 }
 
 void lua_destroydb(lua_list *n) {
+  int i;
+
   if(!n->db.db)
     return;
 
+  /* gets the last of the queued rows out */
+  for(i=0;i<LUA_MAXBATCHES;i++) {
+    if(n->db.batches[i]) {
+      dbapi2batchfree(n->db.batches[i]);
+      n->db.batches[i] = NULL;
+    }
+  }
+
   DBAPIConn *db = n->db.db;
   db->close(db);
   n->db.db = NULL;
@@ -20,7 +20,8 @@ static int lua_scheduler_new(lua_State *ps) {
 
   result->count = 0;
   result->entries = NULL;
-  result->ps = ps;
+  /* the creating thread may be a coroutine that's long gone by the time this fires */
+  result->ps = lua_listexists(ll) ? ll->l : ps;
   result->next = ll->schedulers;
   ll->schedulers = result;
 
@@ -0,0 +1,272 @@
+/*
+ * metrics: serves the core metrics table as plain text over HTTP.
+ *
+ * The table itself is always available to local readers through the
+ * mapped file (see core/metrics.h), this is for scrapers that would
+ * rather speak HTTP.  Output is in the Prometheus text format.
+ */
+
+#include "../core/metrics.h"
+#include "../core/config.h"
+#include "../core/error.h"
+#include "../core/events.h"
+#include "../control/control.h"
+#include "../lib/sstring.h"
+#include "../lib/version.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+MODULE_VERSION("");
+
+#define MAXMETRICSCLIENTS 16
+
+typedef struct metricsclient {
+  int fd;
+  char *buf;
+  size_t len, sent;
+} metricsclient;
+
+static int listenfd=-1;
+static metricsclient clients[MAXMETRICSCLIENTS];
+static metric *requestsmetric;
+
+static void metrics_handlelisten(int fd, short events);
+static void metrics_handleclient(int fd, short events);
+static int metrics_list(void *sender, int cargc, char **cargv);
+
+void _init(void) {
+  struct sockaddr_in sin;
+  sstring *bindaddr, *port;
+  unsigned int opt=1;
+  int i, portnum;
+
+  for (i=0;i<MAXMETRICSCLIENTS;i++)
+    clients[i].fd=-1;
+
+  registercontrolhelpcmd("metrics", NO_DEVELOPER, 1, &metrics_list, "Usage: metrics [prefix]\nShows current metric values, optionally only those starting with prefix.");
+
+  requestsmetric=registermetric("metrics_http_requests", METRIC_COUNTER);
+
+  port=getcopyconfigitem("metrics", "port", "9102", 6);
+  bindaddr=getcopyconfigitem("metrics", "bind", "127.0.0.1", 40);
+  portnum=atoi(port->content);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family=AF_INET;
+  sin.sin_port=htons(portnum);
+
+  if (!portnum) {
+    /* HTTP disabled, the mapped file is still there */
+  } else if (inet_pton(AF_INET, bindaddr->content, &sin.sin_addr) != 1) {
+    Error("metrics", ERR_ERROR, "Invalid bind address: %s", bindaddr->content);
+  } else if ((listenfd=socket(AF_INET, SOCK_STREAM, 0))==-1) {
+    Error("metrics", ERR_ERROR, "Unable to open listening socket (%d).", errno);
+  } else if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt)) ||
+             bind(listenfd, (struct sockaddr *)&sin, sizeof(sin)) || listen(listenfd, 5) ||
+             ioctl(listenfd, FIONBIO, &opt)) {
+    Error("metrics", ERR_ERROR, "Unable to listen on %s:%d (%d).", bindaddr->content, portnum, errno);
+    close(listenfd);
+    listenfd=-1;
+  } else {
+    registerhandler(listenfd, POLLIN, &metrics_handlelisten);
+  }
+
+  freesstring(port);
+  freesstring(bindaddr);
+}
+
+static void metrics_closeclient(metricsclient *cp) {
+  deregisterhandler(cp->fd, 1);
+  free(cp->buf);
+  cp->buf=NULL;
+  cp->fd=-1;
+}
+
+void _fini(void) {
+  int i;
+
+  for (i=0;i<MAXMETRICSCLIENTS;i++)
+    if (clients[i].fd!=-1)
+      metrics_closeclient(&clients[i]);
+
+  if (listenfd!=-1)
+    deregisterhandler(listenfd, 1);
+
+  deregistermetric(requestsmetric);
+  deregistercontrolcmd("metrics", &metrics_list);
+}
+
+typedef struct textbuf {
+  char *buf;
+  size_t len, size;
+} textbuf;
+
+static void tbprintf(textbuf *tb, char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static void tbprintf(textbuf *tb, char *format, ...) {
+  va_list va;
+  int len;
+
+  for (;;) {
+    va_start(va, format);
+    len=vsnprintf(tb->buf + tb->len, tb->size - tb->len, format, va);
+    va_end(va);
+
+    if (len < 0)
+      return;
+
+    if (tb->len + len < tb->size) {
+      tb->len+=len;
+      return;
+    }
+
+    tb->size=(tb->size + len) * 2;
+    tb->buf=realloc(tb->buf, tb->size);
+    if (!tb->buf)
+      Error("metrics", ERR_STOP, "realloc() failed in metrics.c");
+  }
+}
+
+/* Renders the table, readers in other processes do the same from the file */
+static void metrics_render(textbuf *tb) {
+  static const char *typenames[] = { "", "counter", "gauge", "histogram" };
+  unsigned int i, j;
+  uint64_t cumulative;
+
+  for (i=0;i<MAXMETRICS;i++) {
+    metric *mp=&metrics[i];
+
+    if (mp->type==METRIC_FREE)
+      continue;
+
+    tbprintf(tb, "# TYPE newserv_%s %s\n", mp->name, typenames[mp->type]);
+
+    if (mp->type!=METRIC_HISTOGRAM) {
+      tbprintf(tb, "newserv_%s %llu\n", mp->name, (unsigned long long)mp->value);
+      continue;
+    }
+
+    for (j=0,cumulative=0;j<METRICHISTBUCKETS-1;j++) {
+      cumulative+=mp->buckets[j];
+      tbprintf(tb, "newserv_%s_bucket{le=\"%llu\"} %llu\n", mp->name, j ? (1ULL << j) - 1 : 0ULL, (unsigned long long)cumulative);
+    }
+    tbprintf(tb, "newserv_%s_bucket{le=\"+Inf\"} %llu\n", mp->name, (unsigned long long)mp->value);
+    tbprintf(tb, "newserv_%s_sum %llu\n", mp->name, (unsigned long long)mp->sum);
+    tbprintf(tb, "newserv_%s_count %llu\n", mp->name, (unsigned long long)mp->value);
+  }
+}
+
+static void metrics_handlelisten(int fd, short events) {
+  struct sockaddr_in sin;
+  socklen_t addrsize=sizeof(sin);
+  unsigned int opt=1;
+  int newfd, i;
+
+  if ((newfd=accept(fd, (struct sockaddr *)&sin, &addrsize))<0)
+    return;
+
+  for (i=0;i<MAXMETRICSCLIENTS;i++)
+    if (clients[i].fd==-1)
+      break;
+
+  if (i==MAXMETRICSCLIENTS || ioctl(newfd, FIONBIO, &opt)) {
+    close(newfd);
+    return;
+  }
+
+  clients[i].fd=newfd;
+  clients[i].buf=NULL;
+  clients[i].len=clients[i].sent=0;
+  registerhandler(newfd, POLLIN, &metrics_handleclient);
+}
+
+static metricsclient *metrics_findclient(int fd) {
+  int i;
+
+  for (i=0;i<MAXMETRICSCLIENTS;i++)
+    if (clients[i].fd==fd)
+      return &clients[i];
+
+  return NULL;
+}
+
+/* Whatever the request was, the first read gets the whole table back */
+static void metrics_handleclient(int fd, short events) {
+  metricsclient *cp=metrics_findclient(fd);
+  textbuf body={ NULL, 0, 0 }, reply={ NULL, 0, 0 };
+  char req[1024];
+  ssize_t res;
+
+  if (!cp) {
+    deregisterhandler(fd, 1);
+    return;
+  }
+
+  if (events & (POLLERR | POLLHUP | POLLNVAL)) {
+    metrics_closeclient(cp);
+    return;
+  }
+
+  if (!cp->buf) {
+    if (read(fd, req, sizeof(req)) <= 0) {
+      metrics_closeclient(cp);
+      return;
+    }
+
+    metricinc(requestsmetric);
+
+    metrics_render(&body);
+    tbprintf(&reply, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)body.len);
+    tbprintf(&reply, "%.*s", (int)body.len, body.buf ? body.buf : "");
+    free(body.buf);
+
+    cp->buf=reply.buf;
+    cp->len=reply.len;
+    cp->sent=0;
+
+    /* Swap over to waiting for write space */
+    deregisterhandler(fd, 0);
+    registerhandler(fd, POLLOUT, &metrics_handleclient);
+  }
+
+  res=write(fd, cp->buf + cp->sent, cp->len - cp->sent);
+  if (res < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (res <= 0 || (cp->sent+=res) == cp->len)
+    metrics_closeclient(cp);
+}
+
+static int metrics_list(void *sender, int cargc, char **cargv) {
+  unsigned int i, count=0;
+  size_t plen=cargc ? strlen(cargv[0]) : 0;
+
+  for (i=0;i<MAXMETRICS;i++) {
+    metric *mp=&metrics[i];
+
+    if (mp->type==METRIC_FREE || (plen && strncmp(mp->name, cargv[0], plen)))
+      continue;
+
+    count++;
+    if (mp->type==METRIC_HISTOGRAM) {
+      controlreply(sender, "%-40s %12llu observations, mean %.1f", mp->name, (unsigned long long)mp->value,
+        mp->value ? (double)mp->sum / mp->value : 0.0);
+    } else {
+      controlreply(sender, "%-40s %12llu", mp->name, (unsigned long long)mp->value);
+    }
+  }
+
+  controlreply(sender, "%u metrics.", count);
+
+  return CMD_OK;
+}
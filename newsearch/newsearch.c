@@ -542,38 +542,31 @@ void nicksearch_exe(struct searchNode *search, searchCtx *ctx) {
   /* The top-level node needs to return a BOOL */
   search=coerceNode(ctx, search, RETURNTYPE_BOOL);
   
-  for (i=0;i<NICKHASHSIZE;i++) {
-    for (np=nicktable[i], k = 0;ctx->targets ? (k < ctx->targets->cursi) : (np != NULL);np=np->next, k++) {
-      if (ctx->targets) {
-        np = ((nick **)ctx->targets->content)[k];
-        if (!np)
-          continue;
-      }
+  for (i=nickcolumns.count, k = 0;ctx->targets ? (k < ctx->targets->cursi) : (i-- > 0);k++) {
+    np = ctx->targets ? ((nick **)ctx->targets->content)[k] : nickcolumns.nick[i];
+    if (!np)
+      continue;
 
-      if ((search->exe)(ctx, search, np)) {
-        /* Add total channels */
-        tchans += np->channels->cursi;
-        
-        /* Check channels for uniqueness */
-        cs=(channel **)np->channels->content;
-        for (j=0;j<np->channels->cursi;j++) {
-          if (cs[j]->index->marker != cmarker) {
-            cs[j]->index->marker=cmarker;
-            uchans++;
-          }
+    if ((search->exe)(ctx, search, np)) {
+      /* Add total channels */
+      tchans += np->channels->cursi;
+      
+      /* Check channels for uniqueness */
+      cs=(channel **)np->channels->content;
+      for (j=0;j<np->channels->cursi;j++) {
+        if (cs[j]->index->marker != cmarker) {
+          cs[j]->index->marker=cmarker;
+          uchans++;
         }
-          
-	if (matches<limit)
-	  display(ctx, sender, np);
-	  
-	if (matches==limit)
-	  ctx->reply(sender, "--- More than %d matches, skipping the rest",limit);
-	matches++;
       }
+        
+      if (matches<limit)
+        display(ctx, sender, np);
+        
+      if (matches==limit)
+        ctx->reply(sender, "--- More than %d matches, skipping the rest",limit);
+      matches++;
     }
-
-    if (ctx->targets)
-      break;
   }
 
   ctx->reply(sender,"--- End of list: %d matches; users were on %u channels (%u unique, %.1f average clones)", 
@@ -715,7 +708,7 @@ void chansearch_exe(struct searchNode *search, searchCtx *ctx) {
 
   search=coerceNode(ctx, search, RETURNTYPE_BOOL);
   
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
       if ((search->exe)(ctx, search, cip)) {
 	if (matches<limit)
@@ -775,7 +768,7 @@ int do_usersearch(void *source, int cargc, char **cargv) {
 }
 
 void usersearch_exe(struct searchNode *search, searchCtx *ctx) {  
-  int i;
+  unsigned int i;
   authname *aup;
   int matches = 0;
   nick *sender = ctx->sender;
@@ -787,15 +780,17 @@ void usersearch_exe(struct searchNode *search, searchCtx *ctx) {
 
   search=coerceNode(ctx, search, RETURNTYPE_BOOL);
   
-  for (i=0;i<AUTHNAMEHASHSIZE;i++) {
-    for (aup=authnametable[i];aup;aup=aup->next) {
-      if ((search->exe)(ctx, search, aup)) {
-	if (matches<limit)
-	  display(ctx, sender, aup);
-	if (matches==limit)
-	  ctx->reply(sender, "--- More than %d matches, skipping the rest",limit);
-	matches++;
-      }
+  for (i=0;i<authnametablesize;i++) {
+    aup=authnametable[i];
+    if (!AUTHNAMESLOTUSED(aup))
+      continue;
+
+    if ((search->exe)(ctx, search, aup)) {
+      if (matches<limit)
+	display(ctx, sender, aup);
+      if (matches==limit)
+	ctx->reply(sender, "--- More than %d matches, skipping the rest",limit);
+      matches++;
     }
   }
 
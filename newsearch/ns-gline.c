@@ -241,7 +241,7 @@ static void commitglines(void *arg) {
 
 void gline_free(searchCtx *ctx, struct searchNode *thenode) {
   struct gline_localdata *localdata;
-  nick *np, *nnp;
+  nick *np;
   chanindex *cip, *ncip;
   whowas *ww;
   int i, j, hits, safe=0, delay;
@@ -262,7 +262,7 @@ void gline_free(searchCtx *ctx, struct searchNode *thenode) {
   glinebufinit(gbuf, 0);
 
   if (ctx->searchcmd == reg_chansearch) {
-    for (i=0;i<CHANNELHASHSIZE;i++) {
+    for (i=0;i<chantablesize;i++) {
       for (cip=chantable[i];cip;cip=ncip) {
         ncip = cip->next;
         if (cip != NULL && cip->channel != NULL && cip->marker == localdata->marker) {
@@ -279,13 +279,10 @@ void gline_free(searchCtx *ctx, struct searchNode *thenode) {
       }
     }
   } else if (ctx->searchcmd == reg_nicksearch) {
-    for (i=0;i<NICKHASHSIZE;i++) {
-      for (np=nicktable[i];np;np=nnp) {
-        nnp = np->next;
-        if (np->marker == localdata->marker) {
-          if(!glineuser(gbuf, np, localdata, ti))
-            safe++;
-        }
+    NICKCOLUMN_WALK(i, np) {
+      if (np->marker == localdata->marker) {
+        if(!glineuser(gbuf, np, localdata, ti))
+          safe++;
       }
     }
   } else {
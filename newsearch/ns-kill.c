@@ -96,7 +96,7 @@ void *kill_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
 
 void kill_free(searchCtx *ctx, struct searchNode *thenode) {
   struct kill_localdata *localdata;
-  nick *np, *nnp;
+  nick *np;
   chanindex *cip;
   int i, j, safe=0;
   unsigned int nickmarker;
@@ -115,7 +115,7 @@ void kill_free(searchCtx *ctx, struct searchNode *thenode) {
   /* For channel searches, mark up all the nicks in the relevant channels first */
   if (ctx->searchcmd == reg_chansearch) {
     nickmarker=nextnickmarker();
-    for (i=0;i<CHANNELHASHSIZE;i++) {
+    for (i=0;i<chantablesize;i++) {
       for (cip=chantable[i];cip;cip=cip->next) {
         /* Skip empty and non-matching channels */
         if (!cip->channel || cip->marker != localdata->marker)
@@ -136,21 +136,17 @@ void kill_free(searchCtx *ctx, struct searchNode *thenode) {
   }
 
   /* Now do the actual kills */
-  for (i=0;i<NICKHASHSIZE;i++) {
-    for (np=nicktable[i];np;np=nnp) {
-      nnp = np->next;
-
-      if (np->marker != nickmarker)
-        continue;
+  NICKCOLUMN_WALK(i, np) {
+    if (np->marker != nickmarker)
+      continue;
 
-      if (IsOper(np) || IsService(np) || IsXOper(np)) {
-        safe++;
-        continue;
-      }
-
-      nssnprintf(msgbuf, sizeof(msgbuf), localdata->reason, np);
-      killuser(NULL, np, "%s", msgbuf);
+    if (IsOper(np) || IsService(np) || IsXOper(np)) {
+      safe++;
+      continue;
     }
+
+    nssnprintf(msgbuf, sizeof(msgbuf), localdata->reason, np);
+    killuser(NULL, np, "%s", msgbuf);
   }
 
   if (safe)
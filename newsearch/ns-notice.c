@@ -96,7 +96,7 @@ void *notice_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
 
 void notice_free(searchCtx *ctx, struct searchNode *thenode) {
   struct notice_localdata *localdata;
-  nick *np, *nnp;
+  nick *np;
   chanindex *cip, *ncip;
   int i, j;
   unsigned int nickmarker;
@@ -105,7 +105,7 @@ void notice_free(searchCtx *ctx, struct searchNode *thenode) {
 
   if (ctx->searchcmd == reg_chansearch) {
     nickmarker=nextnickmarker();
-    for (i=0;i<CHANNELHASHSIZE;i++) {
+    for (i=0;i<chantablesize;i++) {
       for (cip=chantable[i];cip;cip=ncip) {
         ncip = cip->next;
         if (cip != NULL && cip->channel != NULL && cip->marker == localdata->marker) {
@@ -119,21 +119,15 @@ void notice_free(searchCtx *ctx, struct searchNode *thenode) {
         }
       }
     }
-    for (i=0;i<NICKHASHSIZE;i++) {
-      for(np=nicktable[i];np;np=nnp) {
-        nnp = np->next;
-        if (np->marker == nickmarker)
-          controlnotice(np, "%s", localdata->message);
-      }
+    NICKCOLUMN_WALK(i, np) {
+      if (np->marker == nickmarker)
+        controlnotice(np, "%s", localdata->message);
     }
   }
   else {
-    for (i=0;i<NICKHASHSIZE;i++) {
-      for (np=nicktable[i];np;np=nnp) {
-        nnp = np->next;
-        if (np->marker == localdata->marker)
-         controlnotice(np, "%s", localdata->message);
-      }
+    NICKCOLUMN_WALK(i, np) {
+      if (np->marker == localdata->marker)
+        controlnotice(np, "%s", localdata->message);
     }
   }
   /* notify opers of the action */
@@ -14,6 +14,7 @@
 #include "../lib/version.h"
 #include "../lib/ccassert.h"
 #include "../core/nsmalloc.h"
+#include "../core/metrics.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -51,30 +52,46 @@ const flag accountflags[] = {
    { 'd', AFLAG_DEVELOPER },
    { '\0', 0 } };
 
-#define nickhash(x)       ((irc_crc32i(x))%NICKHASHSIZE)
+#define nickhash(x)       (hashtable_bucket(&nickhashtable, irc_strhashi(x)))
 
-nick *nicktable[NICKHASHSIZE];
+hashtable nickhashtable;
 nick **servernicks[MAXSERVERS];
 
 sstring *nickextnames[MAXNICKEXTS];
 
 void nickstats(int hooknum, void *arg);
+static unsigned int nickitemhash(const void *item);
 
 char *NULLAUTHNAME = "";
 
+metric *newnickmetric, *lostnickmetric, *renamenickmetric;
+static metric *nickcountmetric, *splitmetric;
+
+int masslostserver=-1;
+
+static void releasenick(nick *np);
+static void deleteservernicks(long servernum);
+
 void _init() {
   unsigned int i;
   authname *anp;
 
   /* Clear up the nicks in authext */
-  for (i=0;i<AUTHNAMEHASHSIZE;i++) 
-    for (anp=authnametable[i];anp;anp=anp->next)
-      anp->nicks=NULL;  
+  for (i=0;i<authnametablesize;i++)
+    if (AUTHNAMESLOTUSED(anp=authnametable[i]))
+      anp->nicks=NULL;
 
   initnickhelpers();
-  memset(nicktable,0,sizeof(nicktable));
+  hashtable_init(&nickhashtable, NICKHASHINITSIZE, offsetof(nick, next), nickitemhash);
+  initnickcolumns();
   memset(servernicks,0,sizeof(servernicks));
 
+  newnickmetric=registermetric("nick_new", METRIC_COUNTER);
+  lostnickmetric=registermetric("nick_lost", METRIC_COUNTER);
+  renamenickmetric=registermetric("nick_renames", METRIC_COUNTER);
+  nickcountmetric=registermetric("nick_count", METRIC_GAUGE);
+  splitmetric=registermetric("nick_split_us", METRIC_HISTOGRAM);
+
   /* If we're connected to IRC, force a disconnect.  This needs to be done
    * before we register all our hooks which would otherwise get called
    * during the disconnect. */
@@ -108,7 +125,7 @@ void _fini() {
 
   fininickhelpers();
 
-  for (i=0;i<NICKHASHSIZE;i++) {
+  for (i=0;i<nicktablesize;i++) {
     for (np=nicktable[i];np;np=np->next) {
       freesstring(np->shident);
       freesstring(np->sethost);
@@ -118,6 +135,8 @@ void _fini() {
     }
   }
 
+  hashtable_free(&nickhashtable);
+  fininickcolumns();
   nsfreeall(POOL_NICK);
 
   /* Free the hooks */
@@ -135,6 +154,13 @@ void _fini() {
   deregisterserverhandler("A",&handleawaymsg);
   deregisterserverhandler("CA",&handleaddcloak);
   deregisterserverhandler("CU",&handleclearcloak);
+
+  deregistermetric(newnickmetric);
+  deregistermetric(lostnickmetric);
+  deregistermetric(renamenickmetric);
+  deregistermetric(nickcountmetric);
+  deregistermetric(splitmetric);
+  newnickmetric=lostnickmetric=renamenickmetric=nickcountmetric=splitmetric=NULL;
 }
 
 /*
@@ -145,7 +171,6 @@ void _fini() {
 
 void handleserverchange(int hooknum, void *arg) {
   long servernum;
-  int i;
   
   servernum=(long)arg;
   
@@ -156,16 +181,67 @@ void handleserverchange(int hooknum, void *arg) {
       break;
       
     case HOOK_SERVER_LOSTSERVER:
-      for (i=0;i<=serverlist[servernum].maxusernum;i++) {
-        if (servernicks[servernum][i]!=NULL) {
-          deletenick(servernicks[servernum][i]);        
-        }
-      }
+      deleteservernicks(servernum);
       nsfree(POOL_NICK,servernicks[servernum]);
       break;
   }
 }
 
+/*
+ * deleteservernicks:
+ *
+ * Removes every nick on a server that has gone away.  Modules that can
+ * tear down a whole server's worth of users more cheaply than one at a
+ * time hook HOOK_SERVER_MASSLOSTNICKS and then ignore the per-nick
+ * HOOK_NICK_LOSTNICK calls for which NickInMassLoss() is true; everyone
+ * else just sees the usual PRE_LOSTNICK/LOSTNICK pair for each nick.
+ */
+
+static void deleteservernicks(long servernum) {
+  masslostnicks ml;
+  uint64_t start=metricclock();
+  int i;
+
+  ml.servernum=servernum;
+  ml.count=0;
+
+  for (i=0;i<=serverlist[servernum].maxusernum;i++)
+    if (servernicks[servernum][i]!=NULL)
+      ml.count++;
+
+  if (!ml.count)
+    return;
+
+  ml.nicks=(nick **)nsmalloc(POOL_NICK,ml.count*sizeof(nick *));
+  if (!ml.nicks) {
+    /* Fall back to doing it one at a time */
+    for (i=0;i<=serverlist[servernum].maxusernum;i++)
+      if (servernicks[servernum][i]!=NULL)
+        deletenick(servernicks[servernum][i]);
+    return;
+  }
+
+  for (ml.count=0,i=0;i<=serverlist[servernum].maxusernum;i++)
+    if (servernicks[servernum][i]!=NULL)
+      ml.nicks[ml.count++]=servernicks[servernum][i];
+
+  /* Everyone gets to look at the nicks while they're still fully intact */
+  for (i=0;i<ml.count;i++)
+    triggerhook(HOOK_NICK_PRE_LOSTNICK, ml.nicks[i]);
+
+  masslostserver=servernum;
+  triggerhook(HOOK_SERVER_MASSLOSTNICKS, &ml);
+
+  for (i=0;i<=serverlist[servernum].maxusernum;i++)
+    if (servernicks[servernum][i]!=NULL)
+      releasenick(servernicks[servernum][i]);
+
+  masslostserver=-1;
+  nsfree(POOL_NICK,ml.nicks);
+
+  metricobserve(splitmetric, metricclock()-start);
+}
+
 /*
  * deletenick:
  *
@@ -173,13 +249,18 @@ void handleserverchange(int hooknum, void *arg) {
  */
  
 void deletenick(nick *np) {
-  nick **nh;
-
   /* Fire a pre-lostnick trigger to allow hooks to check the channels etc. of a lost nick */
   triggerhook(HOOK_NICK_PRE_LOSTNICK, np);
 
+  releasenick(np);
+}
+
+static void releasenick(nick *np) {
+  nick **nh;
+
   /* Fire the hook.  This will deal with removal from channels etc. */
   triggerhook(HOOK_NICK_LOSTNICK, np);
+  metricinc(lostnickmetric);
   
   /* Release the realname and hostname parts */
 
@@ -241,20 +322,20 @@ void deletenick(nick *np) {
   freenick(np);
 }
 
+static unsigned int nickitemhash(const void *item) {
+  return irc_strhashi(((const nick *)item)->nick);
+}
+
 void addnicktohash(nick *np) {
-  np->next=nicktable[nickhash(np->nick)];
-  nicktable[nickhash(np->nick)]=np;
+  hashtable_add(&nickhashtable, np, irc_strhashi(np->nick));
+  nickcolumnadd(np);
+  metricset(nickcountmetric, nickhashtable.count);
 }
 
 void removenickfromhash(nick *np) {
-  nick **nh;
-  
-  for (nh=&(nicktable[nickhash(np->nick)]);*nh;nh=&((*nh)->next)) {
-    if ((*nh)==np) {
-      (*nh)=np->next;
-      break;
-    }
-  }
+  hashtable_remove(&nickhashtable, np, irc_strhashi(np->nick));
+  nickcolumnremove(np);
+  metricset(nickcountmetric, nickhashtable.count);
 }
 
 nick *getnickbynick(const char *name) {
@@ -269,34 +350,18 @@ nick *getnickbynick(const char *name) {
 }
 
 void nickstats(int hooknum, void *arg) {
-  int total,maxchain,curchain,i,buckets;
-  nick *np;
-  char buf[200];
-  
-  /* Get nick stats */
-  buckets=total=maxchain=curchain=0;
-  for (i=0;i<NICKHASHSIZE;i++,curchain=0) {
-    np=nicktable[i];
-    if (np!=NULL) {
-      buckets++;
-      for (;np;np=np->next) {
-        total++;
-        curchain++;
-      }
-    }
-    if (curchain>maxchain) {
-      maxchain=curchain;
-    }
-  }
-    
+  char buf[300];
+
   if ((long)arg>5) {
     /* Full stats */
-    sprintf(buf,"Nick    : %6d nicks    (HASH: %6d/%6d, chain %3d)",total,buckets,NICKHASHSIZE,maxchain);
+    snprintf(buf,sizeof(buf),"Nick    : nicks:     %s",hashtable_stats(&nickhashtable));
+    triggerhook(HOOK_CORE_STATSREPLY,buf);
+    snprintf(buf,sizeof(buf),"Nick    : hosts:     %s",hashtable_stats(&hosthashtable));
+    triggerhook(HOOK_CORE_STATSREPLY,buf);
+    snprintf(buf,sizeof(buf),"Nick    : realnames: %s",hashtable_stats(&realnamehashtable));
+    triggerhook(HOOK_CORE_STATSREPLY,buf);
   } else if ((long)arg>2) {
-    sprintf(buf,"Nick    : %6d users on network.",total);
-  }
-  
-  if ((long)arg>2) {
+    snprintf(buf,sizeof(buf),"Nick    : %6lu users on network.",nickhashtable.count);
     triggerhook(HOOK_CORE_STATSREPLY,buf);
   }
 }
@@ -339,7 +404,7 @@ void releasenickext(int index) {
   freesstring(nickextnames[index]);
   nickextnames[index]=NULL;
   
-  for (i=0;i<NICKHASHSIZE;i++) {
+  for (i=0;i<nicktablesize;i++) {
     for (np=nicktable[i];np;np=np->next) {
       np->exts[index]=NULL;
     }
@@ -474,7 +539,7 @@ void clearcloaktargets(nick *cloaked)
   if (cloaked->cloak_count == 0)
     return;
 
-  for(j=0;j<NICKHASHSIZE;j++)
+  for(j=0;j<nicktablesize;j++)
     for(tnp=nicktable[j];tnp;tnp=tnp->next)
       if (tnp->cloak_extra == cloaked)
         tnp->cloak_extra = NULL;
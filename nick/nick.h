@@ -7,6 +7,7 @@
 #include "../irc/irc_config.h"
 #include "../lib/flags.h"
 #include "../lib/array.h"
+#include "../lib/hashtable.h"
 #include "../server/server.h"
 #include "../lib/base64.h"
 #include "../lib/irc_ipv6.h"
@@ -166,20 +167,70 @@ typedef struct nick {
   array *channels;
   sstring *message;
   void *exts[MAXNICKEXTS];
+  unsigned int column; /* row in nickcolumns, see below */
 } nick;
 
-#define NICKHASHSIZE      60000
-#define HOSTHASHSIZE      40000
-#define REALNAMEHASHSIZE  40000
+/* Copies of the fields full network scans test, one dense row per nick so
+ * a scan walks a few flat arrays instead of chasing every struct nick.
+ * Rows are swapped about as nicks leave, so don't hold on to row numbers.
+ *
+ * Walk with NICKCOLUMN_WALK(i, np), testing nickcolumns.umodes[i] and friends
+ * before touching np.  Anything that changes one of these fields on a nick
+ * must call nickcolumnsync(). */
+typedef struct nickcolumnset {
+  unsigned int count, size;
+  struct nick **nick;
+  long *numeric;
+  patricia_node_t **ipnode;
+  host **host;
+  realname **realname;
+  authname **auth;
+  flag_t *umodes;
+  time_t *timestamp;
+} nickcolumnset;
+
+extern nickcolumnset nickcolumns;
+
+/* Visits every row, last first: removing a nick only ever moves the last
+ * row down into its place, so the current nick may be killed in the loop. */
+#define NICKCOLUMN_WALK(i, np) \
+  for ((i)=nickcolumns.count;(i)-- > 0 && ((np)=nickcolumns.nick[(i)]);)
+
+/* Initial sizes, the tables grow as needed */
+#define NICKHASHINITSIZE      65536
+#define HOSTHASHINITSIZE      32768
+#define REALNAMEHASHINITSIZE  32768
+
+/* Walk with: for (i=0;i<nicktablesize;i++) for (np=nicktable[i];np;np=np->next) */
+extern hashtable nickhashtable, hosthashtable, realnamehashtable;
+
+#define nicktable             ((nick **)nickhashtable.buckets)
+#define nicktablesize         (nickhashtable.size)
+#define hosttable             ((host **)hosthashtable.buckets)
+#define hosttablesize         (hosthashtable.size)
+#define realnametable         ((realname **)realnamehashtable.buckets)
+#define realnametablesize     (realnamehashtable.size)
 
-extern nick *nicktable[NICKHASHSIZE];
 extern nick **servernicks[MAXSERVERS];
-extern host *hosttable[HOSTHASHSIZE];
-extern realname *realnametable[REALNAMEHASHSIZE];
 extern const flag umodeflags[];
 extern const flag accountflags[];
 extern char *NULLAUTHNAME;
 
+/* Nick churn counters, see core/metrics.h */
+struct metric;
+extern struct metric *newnickmetric, *lostnickmetric, *renamenickmetric;
+
+/* Argument to HOOK_SERVER_MASSLOSTNICKS */
+typedef struct masslostnicks {
+  long servernum;
+  int count;
+  nick **nicks;
+} masslostnicks;
+
+/* Server whose nicks are being removed in bulk, or -1 */
+extern int masslostserver;
+#define NickInMassLoss(np)      (homeserver((np)->numeric)==masslostserver)
+
 #define MAXNUMERIC 0x3FFFFFFF
 
 #define homeserver(x)           (((x)>>18)&(MAXSERVERS-1))
@@ -233,6 +284,13 @@ nick *getnickbynumeric(long numeric);
 nick *getnickbynumericstr(char *numericstr);
 */
                     
+/* nickcolumns.c functions */
+void initnickcolumns(void);
+void fininickcolumns(void);
+void nickcolumnadd(nick *np);
+void nickcolumnremove(nick *np);
+void nickcolumnsync(nick *np);
+
 /* nickhelpers.c functions */
 void initnickhelpers();
 void fininickhelpers();
@@ -0,0 +1,166 @@
+/* nickbench.c: full network scan timings, hash table walk vs nick columns.
+ * Checks first that both walks see the same nicks with the same fields. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "nick.h"
+#include "../control/control.h"
+#include "../lib/version.h"
+
+MODULE_VERSION("");
+
+#define NICKBENCHDEFAULTPASSES 20
+
+int nickbench(void *sender, int cargc, char **cargv);
+
+void _init(void) {
+  registercontrolhelpcmd("nickbench", NO_DEVELOPER, 1, &nickbench, "Usage: nickbench [passes]\nChecks the nick columns against the nick hash table, then times typical full network scans over both (default 20 passes).");
+}
+
+void _fini(void) {
+  deregistercontrolcmd("nickbench", &nickbench);
+}
+
+static double elapsed(struct timeval *start) {
+  struct timeval end;
+
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void report(nick *np, char *what, unsigned long count, unsigned long hits, double secs) {
+  controlreply(np, "%-18s %10lu nicks, %8lu hits, %7.3fs, %6.1fns/nick, %6.1fM nicks/s", what, count, hits, secs,
+    count ? secs * 1000000000.0 / count : 0.0, secs > 0 ? count / secs / 1000000.0 : 0.0);
+}
+
+/* Returns the number of disagreements between the hash table and the columns */
+static unsigned long checkcolumns(nick *np) {
+  unsigned long bad = 0, hashcount = 0, columncount = 0;
+  unsigned int i, row;
+  nick *tnp;
+
+  for (i=0;i<nicktablesize;i++) {
+    for (tnp=nicktable[i];tnp;tnp=tnp->next,hashcount++) {
+      row = tnp->column;
+      if (row >= nickcolumns.count || nickcolumns.nick[row] != tnp) {
+        if (bad++ < 10)
+          controlreply(np, "%s is in the hash table but not in its column row.", tnp->nick);
+        continue;
+      }
+
+      if (nickcolumns.numeric[row] != tnp->numeric || nickcolumns.ipnode[row] != tnp->ipnode ||
+          nickcolumns.host[row] != tnp->host || nickcolumns.realname[row] != tnp->realname ||
+          nickcolumns.auth[row] != tnp->auth || nickcolumns.umodes[row] != tnp->umodes ||
+          nickcolumns.timestamp[row] != tnp->timestamp) {
+        if (bad++ < 10)
+          controlreply(np, "%s has stale column fields.", tnp->nick);
+      }
+    }
+  }
+
+  NICKCOLUMN_WALK(row, tnp) {
+    columncount++;
+    if (getnickbynumeric(tnp->numeric) != tnp) {
+      if (bad++ < 10)
+        controlreply(np, "Column row %u (%s) isn't in the hash table.", row, tnp->nick);
+    }
+  }
+
+  if (hashcount != columncount) {
+    controlreply(np, "Hash table has %lu nicks, columns have %lu.", hashcount, columncount);
+    bad++;
+  }
+
+  return bad;
+}
+
+int nickbench(void *sender, int cargc, char **cargv) {
+  nick *np = sender, *tnp;
+  unsigned long pass, passes = NICKBENCHDEFAULTPASSES, hits, total;
+  unsigned int i, server = homeserver(np->numeric);
+  struct timeval start;
+
+  if (cargc > 0)
+    passes = strtoul(cargv[0], NULL, 10);
+
+  if (passes == 0 || passes > 10000) {
+    controlreply(np, "Passes must be between 1 and 10000.");
+    return CMD_ERROR;
+  }
+
+  if ((hits = checkcolumns(np))) {
+    controlreply(np, "Columns disagree with the hash table in %lu places, not timing anything.", hits);
+    return CMD_ERROR;
+  }
+
+  controlreply(np, "%u nicks, columns agree with the hash table, %lu passes.", nickcolumns.count, passes);
+
+  /* opers */
+  gettimeofday(&start, NULL);
+  for (pass=0,hits=0,total=0;pass<passes;pass++)
+    for (i=0;i<nicktablesize;i++)
+      for (tnp=nicktable[i];tnp;tnp=tnp->next,total++)
+        if (IsOper(tnp))
+          hits++;
+  report(np, "umodes (hash):", total, hits, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  for (pass=0,hits=0,total=0;pass<passes;pass++)
+    for (i=0;i<nickcolumns.count;i++,total++)
+      if (nickcolumns.umodes[i] & UMODE_OPER)
+        hits++;
+  report(np, "umodes (columns):", total, hits, elapsed(&start));
+
+  /* authed with a user id */
+  gettimeofday(&start, NULL);
+  for (pass=0,hits=0,total=0;pass<passes;pass++)
+    for (i=0;i<nicktablesize;i++)
+      for (tnp=nicktable[i];tnp;tnp=tnp->next,total++)
+        if (tnp->auth)
+          hits++;
+  report(np, "auth (hash):", total, hits, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  for (pass=0,hits=0,total=0;pass<passes;pass++)
+    for (i=0;i<nickcolumns.count;i++,total++)
+      if (nickcolumns.auth[i])
+        hits++;
+  report(np, "auth (columns):", total, hits, elapsed(&start));
+
+  /* same server as the requester */
+  gettimeofday(&start, NULL);
+  for (pass=0,hits=0,total=0;pass<passes;pass++)
+    for (i=0;i<nicktablesize;i++)
+      for (tnp=nicktable[i];tnp;tnp=tnp->next,total++)
+        if (homeserver(tnp->numeric) == server)
+          hits++;
+  report(np, "numeric (hash):", total, hits, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  for (pass=0,hits=0,total=0;pass<passes;pass++)
+    for (i=0;i<nickcolumns.count;i++,total++)
+      if (homeserver(nickcolumns.numeric[i]) == server)
+        hits++;
+  report(np, "numeric (columns):", total, hits, elapsed(&start));
+
+  /* shares an IP with someone else */
+  gettimeofday(&start, NULL);
+  for (pass=0,hits=0,total=0;pass<passes;pass++)
+    for (i=0;i<nicktablesize;i++)
+      for (tnp=nicktable[i];tnp;tnp=tnp->next,total++)
+        if (tnp->ipnode->usercount > 1)
+          hits++;
+  report(np, "ipnode (hash):", total, hits, elapsed(&start));
+
+  gettimeofday(&start, NULL);
+  for (pass=0,hits=0,total=0;pass<passes;pass++)
+    for (i=0;i<nickcolumns.count;i++,total++)
+      if (nickcolumns.ipnode[i]->usercount > 1)
+        hits++;
+  report(np, "ipnode (columns):", total, hits, elapsed(&start));
+
+  controlreply(np, "Done.");
+  return CMD_OK;
+}
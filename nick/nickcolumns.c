@@ -0,0 +1,81 @@
+/* nickcolumns.c: dense per field copies of the nick table for scanning */
+
+#include "nick.h"
+#include "../core/error.h"
+#include "../core/nsmalloc.h"
+
+#include <string.h>
+
+#define NICKCOLUMNSINITSIZE 65536
+
+nickcolumnset nickcolumns;
+
+#define eachcolumn(x) \
+  x(nick) x(numeric) x(ipnode) x(host) x(realname) x(auth) x(umodes) x(timestamp)
+
+static void resizecolumns(unsigned int size) {
+#define resizecolumn(c) \
+  if (!(nickcolumns.c=nsrealloc(POOL_NICK, nickcolumns.c, size * sizeof(*nickcolumns.c)))) \
+    Error("nick", ERR_STOP, "Unable to grow nick columns to %u rows.", size);
+
+  eachcolumn(resizecolumn)
+#undef resizecolumn
+
+  nickcolumns.size=size;
+}
+
+void initnickcolumns(void) {
+  memset(&nickcolumns, 0, sizeof(nickcolumns));
+  resizecolumns(NICKCOLUMNSINITSIZE);
+}
+
+void fininickcolumns(void) {
+#define freecolumn(c) nsfree(POOL_NICK, nickcolumns.c);
+  eachcolumn(freecolumn)
+#undef freecolumn
+
+  memset(&nickcolumns, 0, sizeof(nickcolumns));
+}
+
+static inline void fillrow(unsigned int i, nick *np) {
+  nickcolumns.nick[i]=np;
+  nickcolumns.numeric[i]=np->numeric;
+  nickcolumns.ipnode[i]=np->ipnode;
+  nickcolumns.host[i]=np->host;
+  nickcolumns.realname[i]=np->realname;
+  nickcolumns.auth[i]=np->auth;
+  nickcolumns.umodes[i]=np->umodes;
+  nickcolumns.timestamp[i]=np->timestamp;
+}
+
+void nickcolumnadd(nick *np) {
+  if (nickcolumns.count==nickcolumns.size)
+    resizecolumns(nickcolumns.size*2);
+
+  np->column=nickcolumns.count++;
+  fillrow(np->column, np);
+}
+
+/* Move the last row into the hole so the columns stay dense */
+void nickcolumnremove(nick *np) {
+  unsigned int i=np->column, last=nickcolumns.count-1;
+
+  if (i>last || nickcolumns.nick[i]!=np) {
+    Error("nick", ERR_ERROR, "Nick %s not in its column row.", np->nick);
+    return;
+  }
+
+  if (i!=last) {
+#define moverow(c) nickcolumns.c[i]=nickcolumns.c[last];
+    eachcolumn(moverow)
+#undef moverow
+    nickcolumns.nick[i]->column=i;
+  }
+
+  nickcolumns.count--;
+}
+
+void nickcolumnsync(nick *np) {
+  if (np->column<nickcolumns.count && nickcolumns.nick[np->column]==np)
+    fillrow(np->column, np);
+}
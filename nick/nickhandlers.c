@@ -8,6 +8,7 @@
 #include "../irc/irc_config.h"
 #include "../core/error.h"
 #include "../core/hooks.h"
+#include "../core/metrics.h"
 #include "../lib/sstring.h"
 #include "../server/server.h"
 #include "../parser/parser.h"
@@ -59,10 +60,12 @@ int handlenickmsg(void *source, int cargc, char **cargv) {
         Error("nick",ERR_WARNING,"Rename to same nickname with different timestamp (%s(%jd) -> %s(%jd))",
                             np->nick,(intmax_t)np->timestamp,cargv[0], (intmax_t)timestamp);
         np->timestamp=timestamp;
+        nickcolumnsync(np);
       }
       strncpy(np->nick,cargv[0],NICKLEN);
       np->nick[NICKLEN]='\0';
       triggerhook(HOOK_NICK_RENAME,harg);
+      metricinc(renamenickmetric);
       return CMD_OK;
     }
     if (np2!=NULL) {
@@ -94,6 +97,7 @@ int handlenickmsg(void *source, int cargc, char **cargv) {
     np->nick[NICKLEN]='\0';
     addnicktohash(np);
     triggerhook(HOOK_NICK_RENAME,harg);
+    metricinc(renamenickmetric);
   } else if (cargc>=8) { /* new nick */
     /* Jupiler 2 1016645147 ~Jupiler www.iglobal.be +ir moo [FUTURE CRAP HERE] DV74O] BNBd7 :Jupiler */
     timestamp=strtol(cargv[2],NULL,10);
@@ -225,6 +229,7 @@ int handlenickmsg(void *source, int cargc, char **cargv) {
     
     /* Trigger the hook */
     triggerhook(HOOK_NICK_NEWNICK,np);
+    metricinc(newnickmetric);
   } else {
     Error("nick",ERR_WARNING,"Nick message with weird number of parameters (%d)",cargc);
   }
@@ -306,6 +311,7 @@ int handleusermodemsg(void *source, int cargc, char **cargv) {
     }
     oldflags=np->umodes;
     setflags(&(np->umodes),UMODE_ALL,cargv[1],umodeflags,REJECT_NONE);
+    nickcolumnsync(np);
 
     args[0] = np;
     args[1] = (void *)oldflags;
@@ -403,6 +409,7 @@ int handleaccountmsg(void *source, int cargc, char **cargv) {
       target->auth->flags=accountflags;
   }
 
+  nickcolumnsync(target);
   triggerhook(HOOK_NICK_ACCOUNT, (void *)target);
 
   return CMD_OK;
@@ -9,39 +9,46 @@
 
 #include <string.h>
 
-#define hosthash(x)       ((irc_crc32i(x))%HOSTHASHSIZE)
-#define realnamehash(x)   ((irc_crc32(x))%REALNAMEHASHSIZE)
+#define hosthash(x)       (hashtable_bucket(&hosthashtable, irc_strhashi(x)))
+#define realnamehash(x)   (hashtable_bucket(&realnamehashtable, irc_strhash(x)))
 
-host *hosttable[HOSTHASHSIZE];
-realname *realnametable[REALNAMEHASHSIZE];
+hashtable hosthashtable, realnamehashtable;
+
+static unsigned int hostitemhash(const void *item) {
+  return irc_strhashi(((const host *)item)->name->content);
+}
+
+static unsigned int realnameitemhash(const void *item) {
+  return irc_strhash(((const realname *)item)->name->content);
+}
 
 void initnickhelpers() {
-  memset(hosttable,0,sizeof(hosttable));
-  memset(realnametable,0,sizeof(realnametable));
+  hashtable_init(&hosthashtable, HOSTHASHINITSIZE, offsetof(host, next), hostitemhash);
+  hashtable_init(&realnamehashtable, REALNAMEHASHINITSIZE, offsetof(realname, next), realnameitemhash);
 }
 
 void fininickhelpers() {
   host *hnp, *hnpn;
   realname *rnp, *rnpn;
-  int i;
+  unsigned int i;
 
-  for(i=0;i<HOSTHASHSIZE;i++) {
+  for(i=0;i<hosttablesize;i++) {
     for(hnp=hosttable[i];hnp;hnp=hnpn) {
       hnpn=hnp->next;
       freesstring(hnp->name);
       freehost(hnp);
     }
-    hosttable[i]=NULL;
   }
+  hashtable_free(&hosthashtable);
 
-  for(i=0;i<REALNAMEHASHSIZE;i++) {
+  for(i=0;i<realnametablesize;i++) {
     for(rnp=realnametable[i];rnp;rnp=rnpn) {
       rnpn=rnp->next;
       freesstring(rnp->name);
       freerealname(rnp);
     }
-    realnametable[i]=NULL;
   }
+  hashtable_free(&realnamehashtable);
 }
 
 host *findhost(const char *hostname) {
@@ -55,9 +62,9 @@ host *findhost(const char *hostname) {
 
 host *findorcreatehost(const char *hostname) {
   host *hp;
-  unsigned long thehash=hosthash(hostname);
+  unsigned int thehash=irc_strhashi(hostname);
   
-  for (hp=hosttable[thehash];hp;hp=(host *)hp->next)
+  for (hp=hosttable[hashtable_bucket(&hosthashtable,thehash)];hp;hp=(host *)hp->next)
     if (!ircd_strcmp(hostname,hp->name->content)) {
       hp->clonecount++;
       return hp;
@@ -68,22 +75,17 @@ host *findorcreatehost(const char *hostname) {
   hp->clonecount=1;
   hp->marker=0;
   hp->nicks=NULL;
-  hp->next=(struct host *)hosttable[thehash];
-  hosttable[thehash]=hp;
+  hashtable_add(&hosthashtable,hp,thehash);
   
   return hp;
 }
 
 void releasehost(host *hp) {
-  host **mhp;
   if (--(hp->clonecount)==0) {
-    for(mhp=&(hosttable[hosthash(hp->name->content)]);*mhp;mhp=(host **)&((*mhp)->next)) {
-      if ((*mhp)==hp) {
-        (*mhp)=(host *)hp->next;
-        freesstring(hp->name);
-        freehost(hp);
-        return;
-      }
+    if (hashtable_remove(&hosthashtable,hp,irc_strhashi(hp->name->content))) {
+      freesstring(hp->name);
+      freehost(hp);
+      return;
     }
     Error("nick",ERR_ERROR,"Unable to remove host %s from hashtable",hp->name->content);
   }
@@ -101,9 +103,9 @@ realname *findrealname(const char *name) {
 
 realname *findorcreaterealname(const char *name) {
   realname *rnp;
-  unsigned int thehash=realnamehash(name);
+  unsigned int thehash=irc_strhash(name);
 
-  for (rnp=realnametable[thehash];rnp;rnp=(realname *)rnp->next)
+  for (rnp=realnametable[hashtable_bucket(&realnamehashtable,thehash)];rnp;rnp=(realname *)rnp->next)
     if (!strcmp(name,rnp->name->content)) {
       rnp->usercount++;
       return rnp;
@@ -114,36 +116,31 @@ realname *findorcreaterealname(const char *name) {
   rnp->usercount=1;
   rnp->marker=0;
   rnp->nicks=NULL;
-  rnp->next=(struct realname *)realnametable[thehash];
-  realnametable[thehash]=rnp;
+  hashtable_add(&realnamehashtable,rnp,thehash);
   
   return rnp;
 }
 
 void releaserealname(realname *rnp) {
-  realname **mrnp;
   if (--(rnp->usercount)==0) {
-    for(mrnp=&(realnametable[realnamehash(rnp->name->content)]);*mrnp;mrnp=(realname **)&((*mrnp)->next)) {
-      if ((*mrnp)==rnp) {
-        (*mrnp)=(realname *)rnp->next;
-        freesstring(rnp->name);
-        freerealname(rnp);
-        return;
-      }
+    if (hashtable_remove(&realnamehashtable,rnp,irc_strhash(rnp->name->content))) {
+      freesstring(rnp->name);
+      freerealname(rnp);
+      return;
     }
     Error("nick",ERR_ERROR,"Unable to remove realname %s from hashtable",rnp->name->content);
   }
 }
 
 unsigned int nexthostmarker() {	
-  int i;
+  unsigned int i;
   host *hp;
   static unsigned int hostmarker=0;
   
   hostmarker++;
   if (!hostmarker) {
     /* If we wrapped to zero, zap the marker on all hosts */
-    for (i=0;i<HOSTHASHSIZE;i++)
+    for (i=0;i<hosttablesize;i++)
       for (hp=hosttable[i];hp;hp=hp->next)
         hp->marker=0;
     hostmarker++;
@@ -153,14 +150,14 @@ unsigned int nexthostmarker() {
 }
 
 unsigned int nextrealnamemarker() {
-  int i;
+  unsigned int i;
   realname *rnp;
   static unsigned int realnamemarker=0;
   
   realnamemarker++;
   if (!realnamemarker) {
     /* If we wrapped to zero, zap the marker on all records */
-    for (i=0;i<REALNAMEHASHSIZE;i++)
+    for (i=0;i<realnametablesize;i++)
       for (rnp=realnametable[i];rnp;rnp=rnp->next) 
         rnp->marker=0;
     realnamemarker++;
@@ -170,7 +167,7 @@ unsigned int nextrealnamemarker() {
 }
 
 unsigned int nextnickmarker() {
-  int i;
+  unsigned int i;
   nick *np;
   static unsigned int nickmarker=0;
   
@@ -178,7 +175,7 @@ unsigned int nextnickmarker() {
   
   if (!nickmarker) {
     /* If we wrapped to zero, zap the marker on all records */
-    for (i=0;i<NICKHASHSIZE;i++)
+    for (i=0;i<nicktablesize;i++)
       for (np=nicktable[i];np;np=np->next)
         np->marker=0;
     nickmarker++;
@@ -1,10 +1,17 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <ctype.h>
 
 #include "../core/nsmalloc.h"
 #include "../core/hooks.h"
+#include "../core/schedule.h"
+#include "../core/metrics.h"
 #include "../control/control.h"
 #include "../lib/version.h"
 
@@ -12,15 +19,37 @@ MODULE_VERSION("");
 
 void nsmstats(int hookhum, void *arg);
 int nsmhistogram(void *sender, int cargc, char **cargv);
+int nsmsamplecmd(void *sender, int cargc, char **cargv);
+int nsmsites_cmd(void *sender, int cargc, char **cargv);
+static void nsmpublish(void *arg);
+
+static time_t lastsample;
+static unsigned long lastallocs[MAXPOOL], lastfrees[MAXPOOL];
+static metric *poolmetrics[MAXPOOL];
+static char poolunmetered[MAXPOOL];
 
 void _init(void) {
   registerhook(HOOK_CORE_STATSREQUEST, &nsmstats);
-  registercontrolhelpcmd("nsmhistogram", NO_DEVELOPER,1,&nsmhistogram,"Usage: nsmhistogram [pool id]\nDisplays memory information for given pool.");
+  registercontrolhelpcmd("nsmhistogram", NO_DEVELOPER,2,&nsmhistogram,"Usage: nsmhistogram <pool id> [exact]\nDisplays size class histogram for given pool, exact walks every block and lists individual sizes.");
+  registercontrolhelpcmd("nsmsample", NO_DEVELOPER,1,&nsmsamplecmd,"Usage: nsmsample [rate]\nAttributes one in every rate allocations to its call site, 0 turns it off.");
+  registercontrolhelpcmd("nsmsites", NO_DEVELOPER,1,&nsmsites_cmd,"Usage: nsmsites [count]\nLists call sites holding the most sampled memory.");
+
+  lastsample=time(NULL);
+
+  schedulerecurring(time(NULL)+1, 0, 1, &nsmpublish, NULL);
 }
 
 void _fini(void) {
+  int i;
+
+  deleteschedule(NULL, &nsmpublish, NULL);
+  for(i=0;i<MAXPOOL;i++)
+    deregistermetric(poolmetrics[i]);
+
   deregisterhook(HOOK_CORE_STATSREQUEST, &nsmstats);
   deregistercontrolcmd("nsmhistogram", &nsmhistogram);
+  deregistercontrolcmd("nsmsample", &nsmsamplecmd);
+  deregistercontrolcmd("nsmsites", &nsmsites_cmd);
 }
 
 static char *formatmbuf(unsigned long count, size_t size, size_t realsize) {
@@ -31,15 +60,8 @@ static char *formatmbuf(unsigned long count, size_t size, size_t realsize) {
 }
 
 void nsmgenstats(struct nsmpool *pool, double *mean, double *stddev) {
-  unsigned long long int sumsq = 0;
-  struct nsminfo *np;
-
   *mean = (double)pool->size / pool->count;
-
-  for (np=pool->blocks;np;np=np->next)
-    sumsq+=np->size * np->size;
-
-  *stddev = sqrtf((double)sumsq / pool->count - *mean * *mean);
+  *stddev = sqrt((double)pool->sumsq / pool->count - *mean * *mean);
 }
 
 void nsmstats(int hookhum, void *arg) {
@@ -48,13 +70,18 @@ void nsmstats(int hookhum, void *arg) {
   unsigned long totalcount = 0;
   size_t totalsize = 0, totalrealsize = 0;
   long level = (long)arg;
+  time_t now = time(NULL);
+  double interval = (now > lastsample) ? (double)(now - lastsample) : 1.0;
 
   for (i=0;i<MAXPOOL;i++) {
     struct nsmpool *pool=&nsmpools[i];
     size_t realsize;
 
-    if (!pool->count)
+    if (!pool->count) {
+      lastallocs[i]=pool->allocs;
+      lastfrees[i]=pool->frees;
       continue;
+    }
 
     realsize=pool->size + pool->count * sizeof(struct nsminfo) + sizeof(struct nsmpool);
 
@@ -68,18 +95,50 @@ void nsmstats(int hookhum, void *arg) {
         double mean, stddev;
         nsmgenstats(pool, &mean, &stddev);
 
-        snprintf(extra, sizeof(extra), ", mean: %.2fKb stddev: %.2fKb", mean / 1024, stddev / 1024);
+        snprintf(extra, sizeof(extra), ", peak %luKb, %.1f allocs/s, %.1f frees/s, mean: %.2fKb stddev: %.2fKb",
+          (unsigned long)pool->peaksize / 1024, (pool->allocs - lastallocs[i]) / interval, (pool->frees - lastfrees[i]) / interval,
+          mean / 1024, stddev / 1024);
       }
 
       snprintf(buf, sizeof(buf), "NSMalloc: pool %2d (%10s): %s%s", i, nsmpoolnames[i]?nsmpoolnames[i]:"??", formatmbuf(pool->count, pool->size, realsize), extra);
       triggerhook(HOOK_CORE_STATSREPLY, buf);
     }
+
+    lastallocs[i]=pool->allocs;
+    lastfrees[i]=pool->frees;
   }
 
+  lastsample=now;
+
   snprintf(buf, sizeof(buf), "NSMalloc: pool totals: %s", formatmbuf(totalcount, totalsize, totalrealsize));
   triggerhook(HOOK_CORE_STATSREPLY, buf);
 }
 
+/* Pool sizes as nsm_<pool>_bytes gauges, registered once a pool is first used */
+static void nsmpublish(void *arg) {
+  char name[METRICNAMELEN], *p;
+  int i;
+
+  for(i=0;i<MAXPOOL;i++) {
+    if(!poolmetrics[i]) {
+      if(!nsmpools[i].count || !nsmpoolnames[i] || poolunmetered[i])
+        continue;
+
+      snprintf(name, sizeof(name), "nsm_%s_bytes", nsmpoolnames[i]);
+      for(p=name;*p;p++)
+        *p = tolower((unsigned char)*p);
+
+      /* don't retry every second if the table is full */
+      if(!(poolmetrics[i] = registermetric(name, METRIC_GAUGE))) {
+        poolunmetered[i] = 1;
+        continue;
+      }
+    }
+
+    metricset(poolmetrics[i], nsmpools[i].size);
+  }
+}
+
 struct nsmhistogram_s {
   size_t size;
   unsigned long freq;
@@ -113,7 +172,7 @@ int nsmhistogram(void *sender, int cargc, char **cargv) {
     return CMD_USAGE;
 
   poolid = atoi(cargv[0]);
-  if(poolid > MAXPOOL) {
+  if(poolid >= MAXPOOL) {
     controlreply(sender, "Bad pool id.");
     return CMD_ERROR;
   }
@@ -124,6 +183,19 @@ int nsmhistogram(void *sender, int cargc, char **cargv) {
     return CMD_ERROR;
   }
 
+  if(cargc < 2 || strcmp(cargv[1], "exact")) {
+    controlreply(sender, "%21s %10s %10s", "size", "count", "Kb");
+    for(i=0;i<NSM_SIZECLASSES;i++) {
+      if(!pool->classcount[i])
+        continue;
+
+      controlreply(sender, "%10lu - %8lu %10lu %10lu", i ? 1UL << (i - 1) : 0UL, i ? (1UL << i) - 1 : 0UL, pool->classcount[i], (unsigned long)pool->classsize[i] / 1024);
+    }
+    controlreply(sender, "%lu allocs, %lu frees, peak %luKb.", pool->allocs, pool->frees, (unsigned long)pool->peaksize / 1024);
+
+    return CMD_OK;
+  }
+
   freqs = (struct nsmhistogram_s *)malloc(sizeof(struct nsmhistogram_s) * pool->count);
   if(!freqs) {
     controlreply(sender, "Error allocating first BIG array.");
@@ -178,3 +250,70 @@ int nsmhistogram(void *sender, int cargc, char **cargv) {
   free(freqs);
   return CMD_OK;
 }
+
+int nsmsamplecmd(void *sender, int cargc, char **cargv) {
+  if(cargc < 1) {
+    if(nsmsamplerate) {
+      controlreply(sender, "Sampling one in %u allocations, %lu samples live.", nsmsamplerate, nsmsamplecount);
+    } else {
+      controlreply(sender, "Sampling is off, %lu samples live.", nsmsamplecount);
+    }
+    return CMD_OK;
+  }
+
+  nssetsamplerate(strtoul(cargv[0], NULL, 10));
+  controlreply(sender, "Done.");
+
+  return CMD_OK;
+}
+
+static int scompare_size(const void *a, const void *b) {
+  const struct nsmsite *sa = *(const struct nsmsite **)a, *sb = *(const struct nsmsite **)b;
+
+  if(sa->size == sb->size)
+    return 0;
+
+  return (sa->size < sb->size) ? 1 : -1;
+}
+
+int nsmsites_cmd(void *sender, int cargc, char **cargv) {
+  struct nsmsite *sites[NSM_MAXSITES];
+  int i, count, max = 20;
+  Dl_info info;
+  char where[256];
+
+  if(cargc > 0)
+    max = atoi(cargv[0]);
+
+  for(i=0,count=0;i<NSM_MAXSITES;i++)
+    if(nsmsites[i].caller)
+      sites[count++] = &nsmsites[i];
+
+  if(!count) {
+    controlreply(sender, "No sampled allocations, see nsmsample.");
+    return CMD_OK;
+  }
+
+  qsort(sites, count, sizeof(struct nsmsite *), scompare_size);
+
+  controlreply(sender, "Estimates scale sampled figures by the current rate of one in %u.", nsmsamplerate ? nsmsamplerate : 1);
+  for(i=0;i<count&&i<max;i++) {
+    struct nsmsite *sp = sites[i];
+    unsigned long scale = nsmsamplerate ? nsmsamplerate : 1;
+
+    if(!dladdr(sp->caller, &info))
+      memset(&info, 0, sizeof(info));
+
+    if(info.dli_sname) {
+      snprintf(where, sizeof(where), "%s+0x%lx (%s)", info.dli_sname, (unsigned long)((char *)sp->caller - (char *)info.dli_saddr), info.dli_fname);
+    } else if(info.dli_fname) {
+      snprintf(where, sizeof(where), "%p (%s)", sp->caller, info.dli_fname);
+    } else {
+      snprintf(where, sizeof(where), "%p", sp->caller);
+    }
+
+    controlreply(sender, "%-10s %8lu live ~%8luKb, %8lu sampled: %s", nsmpoolnames[sp->poolid]?nsmpoolnames[sp->poolid]:"??", sp->count, (unsigned long)sp->size * scale / 1024, sp->allocs, where);
+  }
+
+  return CMD_OK;
+}
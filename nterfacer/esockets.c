@@ -14,6 +14,7 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 #include "../core/events.h"
 
@@ -21,15 +22,45 @@ struct esocket *socklist = NULL;
 char signal_set = 0;
 unsigned short token = 1;
 
+/* esockets indexed by fd, poll events look up through this */
+static struct esocket **fdtable = NULL;
+static int fdtablesize = 0;
+
 void sigpipe_handler(int moo) { }
 
 unsigned short esocket_token(void) {
   return token++;
 }
 
+static int esocket_setfd(int fd, struct esocket *sock) {
+  if(fd >= fdtablesize) {
+    struct esocket **newtable;
+    int newsize = fdtablesize ? fdtablesize : 64;
+
+    while(newsize <= fd)
+      newsize*=2;
+
+    newtable = ntrealloc(fdtable, newsize * sizeof(struct esocket *));
+    if(!newtable)
+      return 1;
+
+    memset(newtable + fdtablesize, 0, (newsize - fdtablesize) * sizeof(struct esocket *));
+    fdtable = newtable;
+    fdtablesize = newsize;
+  }
+
+  fdtable[fd] = sock;
+  return 0;
+}
+
 struct esocket *esocket_add(int fd, char socket_type, struct esocket_events *events, unsigned short token) {
   int flags;
-  struct esocket *newsock = (struct esocket *)ntmalloc(sizeof(struct esocket));
+  struct esocket *newsock;
+
+  if(fd < 0)
+    return NULL;
+
+  newsock = (struct esocket *)ntmalloc(sizeof(struct esocket));
   if(!newsock)
     return NULL;
 
@@ -59,25 +90,45 @@ struct esocket *esocket_add(int fd, char socket_type, struct esocket_events *eve
       newsock->socket_status = ST_CONNECTED;
       break;
     default:
+      ntfree(newsock);
       return NULL;
   }
 
+  if(esocket_setfd(fd, newsock)) {
+    ntfree(newsock);
+    return NULL;
+  }
+
   registerhandler(fd, flags | POLLERR | POLLHUP, esocket_poll_event);
   newsock->fd = fd;
   newsock->next = socklist;
+  newsock->prev = NULL;
+  if(socklist)
+    socklist->prev = newsock;
 
   newsock->in.mode = PARSE_ASCII;
   newsock->in.data = NULL;
   newsock->in.size = 0;
+  newsock->in.alloc = 0;
   newsock->in.cryptobuf = NULL;
   newsock->in.cryptobufsize = 0;
   newsock->in.mac = 0;
 
-  newsock->out.head = NULL;
-  newsock->out.end = NULL;
-  newsock->out.count = 0;
+  newsock->out.data = NULL;
+  newsock->out.alloc = 0;
+  newsock->out.head = 0;
+  newsock->out.size = 0;
+  newsock->out.peak = 0;
+  newsock->wantdrain = 0;
   newsock->token = token;
   newsock->tag = NULL;
+
+  newsock->clientcrypto = NULL;
+  newsock->servercrypto = NULL;
+
+  newsock->connected = time(NULL);
+  newsock->linesin = newsock->linesout = 0;
+  newsock->bytesin = newsock->bytesout = 0;
   
   if(!signal_set) {
     signal(SIGPIPE, sigpipe_handler);
@@ -90,27 +141,20 @@ struct esocket *esocket_add(int fd, char socket_type, struct esocket_events *eve
 }
 
 struct esocket *find_esocket_from_fd(int fd) {
-  struct esocket *p = socklist;
-
-  for(;p;p=p->next)
-    if(p->fd == fd)
-      return p;
+  if((fd < 0) || (fd >= fdtablesize))
+    return NULL;
 
-  return NULL;
+  return fdtable[fd];
 }
 
+/* only used on unload, so a single pass over everything is fine */
 void esocket_clean_by_token(unsigned short token) {
   struct esocket *cp = socklist, *np;
 
-  /* not efficient but boohoo */
-  for(;cp;) {
-    if(cp->token == token) {
-      np = cp->next;
+  for(;cp;cp=np) {
+    np = cp->next;
+    if(cp->token == token)
       esocket_disconnect(cp);
-      cp = np;
-    } else {
-      cp = cp->next;
-    }
   }
 }
 
@@ -163,59 +207,62 @@ void esocket_poll_event(int fd, short events) {
 }
 
 void esocket_disconnect(struct esocket *active) {
-  struct esocket *l = NULL, *p = socklist;
+  if(find_esocket_from_fd(active->fd) != active)
+    return;
 
   if(active->events.on_disconnect)
     active->events.on_disconnect(active);
 
-  for(;p;l=p,p=p->next)
-    if(p == active) {
-      struct esocket_packet *pkt = p->out.head, *npkt;
-      if(l) {
-        l->next = p->next;
-      } else {
-        socklist = p->next;
-      }
-     
-
-      deregisterhandler(p->fd, 1);
-
-      for(;pkt;) {
-        npkt = pkt->next;
-        ntfree(pkt->line);
-        ntfree(pkt);
-        pkt = npkt;
-      }
-
-      if(p->in.data)
-        ntfree(p->in.data);
-      if(p->in.cryptobuf)
-        ntfree(p->in.cryptobuf);
-
-      ntfree(p);
-      break;
-    }  
+  if(active->prev) {
+    active->prev->next = active->next;
+  } else {
+    socklist = active->next;
+  }
+  if(active->next)
+    active->next->prev = active->prev;
+
+  fdtable[active->fd] = NULL;
+  deregisterhandler(active->fd, 1);
+
+  if(active->out.data)
+    ntfree(active->out.data);
+  if(active->in.data)
+    ntfree(active->in.data);
+  if(active->in.cryptobuf)
+    ntfree(active->in.cryptobuf);
+  if(active->clientcrypto)
+    rijndaelcbc_free(active->clientcrypto);
+  if(active->servercrypto)
+    rijndaelcbc_free(active->servercrypto);
+
+  ntfree(active);
+
+  if(!socklist) {
+    ntfree(fdtable);
+    fdtable = NULL;
+    fdtablesize = 0;
+  }
 }
 
 void esocket_disconnect_when_complete(struct esocket *active) {
-  if(active->out.count) {
+  if(active->out.size) {
     active->socket_status = ST_BLANK;
   } else {
     esocket_disconnect(active);
   }
 }
 
-int parse_ascii(struct esocket *sock, int *bytes_to_strip) {
-  struct esocket_in_buffer *buf = &sock->in;
+int parse_ascii(struct esocket *sock, char *data, int size, int *bytes_to_strip) {
   char *p;
   int i, ret;
 
-  for(p=buf->data,i=0;i<buf->size;i++,p++) {
+  for(p=data,i=0;i<size;i++,p++) {
     if(*p == '\0' || *p == '\n') {
       *p = '\0';
 
       *bytes_to_strip = i + 1;
-      ret = sock->events.on_line(sock, buf->data);
+      sock->linesin++;
+      ret = sock->events.on_line(sock, data);
       if(ret)
         return ret;
 
@@ -249,15 +296,17 @@ int crypto_newblock(struct esocket *sock, unsigned char *block) {
     seqno_update(&sock->clienthmac, sock->clientseqno);
     sock->clientseqno++;
 
+    sock->linesin++;
     ret = sock->events.on_line(sock, (char *)buf->cryptobuf);
-    ntfree(buf->cryptobuf);
-    buf->cryptobuf = NULL;
     buf->cryptobufsize = 0;
     buf->mac = 0;
 
     return ret;
   }
 
+  if(buf->cryptobufsize + 16 > MAX_BINARY_LINE_SIZE)
+    return BUF_OVERFLOW;
+
   hmacsha256_update(&sock->clienthmac, block, 16);
   p = rijndaelcbc_decrypt(sock->clientcrypto, block);
   for(p2=p,i=0;i<16;i++,p2++) { /* locate terminator */
@@ -267,208 +316,311 @@ int crypto_newblock(struct esocket *sock, unsigned char *block) {
     }
   }
 
-  p2 = ntrealloc(buf->cryptobuf, buf->cryptobufsize + 16);
-  if(!p2)
-    Error("nterface", ERR_STOP, "ntrealloc() failed in crypto_newblock (esockets.c)");
-  buf->cryptobuf = p2;
-
-  memcpy(p2 + buf->cryptobufsize, p, 16);
+  memcpy(buf->cryptobuf + buf->cryptobufsize, p, 16);
   buf->cryptobufsize+=16;
 
   return 0;
 }
 
-int parse_crypt(struct esocket *sock, int *bytes_to_strip) {
-  struct esocket_in_buffer *buf = &sock->in;
-  int remaining = buf->size, ret;
+int parse_crypt(struct esocket *sock, char *data, int size, int *bytes_to_strip) {
+  int ret;
 
   *bytes_to_strip = 0;
-  if(remaining < 16)
+  if(size < 16)
     return 0;
 
-  ret = crypto_newblock(sock, (unsigned char *)buf->data);
+  ret = crypto_newblock(sock, (unsigned char *)data);
   *bytes_to_strip = 16;
 
   return ret;
 }
 
-int esocket_read(struct esocket *sock) {
-  struct esocket_in_buffer *buf = &sock->in;
-  char bufd[16384], *p;
-  int bytesread, ret, strip;
+static void aead_nonce(unsigned char *nonce, u_int64_t seqno) {
+  u_int64_t v = htonq(seqno);
 
-  bytesread = read(sock->fd, bufd, sizeof(bufd));
-  if(!bytesread || ((bytesread == -1) && (errno != EAGAIN)))
-    return 1;
+  memset(nonce, 0, CHACHAPOLY_NONCELEN - 8);
+  memcpy(nonce + CHACHAPOLY_NONCELEN - 8, &v, 8);
+}
 
-  if((bytesread == -1) && (errno == EAGAIN))
+/* whole frames are authenticated and decrypted in place in the read buffer */
+int parse_aead(struct esocket *sock, char *data, int size, int *bytes_to_strip) {
+  unsigned char *frame = (unsigned char *)data, *payload = frame + AEAD_HEADER_LEN, nonce[CHACHAPOLY_NONCELEN];
+  int len, i;
+
+  *bytes_to_strip = 0;
+  if(size < AEAD_HEADER_LEN)
     return 0;
 
-  p = ntrealloc(buf->data, buf->size + bytesread);
-  if(!p)
-    Error("nterface", ERR_STOP, "ntrealloc() failed in esocket_read (esockets.c)");
+  len = (frame[0] << 8) | frame[1];
+  if(!len || (len > MAX_BINARY_LINE_SIZE))
+    return BUF_OVERFLOW;
 
-  buf->data = p;
-  memcpy(buf->data + buf->size, bufd, bytesread);
-  buf->size+=bytesread;
+  if(size < AEAD_FRAME_LEN(len))
+    return 0;
 
-  do {
-    if(buf->mode == PARSE_ASCII) {
-      ret = parse_ascii(sock, &strip);
-    } else {
-      ret = parse_crypt(sock, &strip);
+  aead_nonce(nonce, sock->clientseqno);
+  if(chachapoly_open(sock->clientaeadkey, nonce, frame, AEAD_HEADER_LEN, payload, len, payload + len)) /* mac error */
+    return 1;
+
+  sock->clientseqno++;
+  *bytes_to_strip = AEAD_FRAME_LEN(len);
+
+  /* tag has been checked, so its first byte can hold the terminator */
+  payload[len] = '\0';
+  for(i=0;i<len;i++) {
+    if(payload[i] == '\n') {
+      payload[i] = '\0';
+      break;
     }
+  }
 
-    if(strip > 0) {
-      if(buf->size - strip == 0) {
-        ntfree(buf->data);
-        buf->data = NULL;
-      } else {
-        memmove(buf->data, buf->data + strip, buf->size - strip);
-        p = ntrealloc(buf->data, buf->size - strip);
-        if(!p)
-          Error("nterface", ERR_STOP, "ntrealloc() failed in esocket_read (esockets.c)");
+  sock->linesin++;
+  return sock->events.on_line(sock, (char *)payload);
+}
 
-        buf->data = p;
+/*
+ * Drain the socket: read straight into the line buffer and parse after each
+ * read, until it's empty (a short read or EAGAIN) or ESOCKET_MAX_READS.
+ * Returns BUF_ERROR if a line handler has already disconnected the socket.
+ */
+int esocket_read(struct esocket *sock) {
+  struct esocket_in_buffer *buf = &sock->in;
+  char *p;
+  int bytesread, space, ret = 0, strip, consumed, reads;
+
+  for(reads=0;reads<ESOCKET_MAX_READS;reads++) {
+    if(buf->alloc - buf->size < ESOCKET_READ_SIZE) {
+      p = ntrealloc(buf->data, buf->size + ESOCKET_READ_SIZE);
+      if(!p)
+        Error("nterface", ERR_STOP, "ntrealloc() failed in esocket_read (esockets.c)");
+
+      buf->data = p;
+      buf->alloc = buf->size + ESOCKET_READ_SIZE;
+    }
+
+    space = buf->alloc - buf->size;
+    bytesread = read(sock->fd, buf->data + buf->size, space);
+    if(!bytesread || ((bytesread == -1) && (errno != EAGAIN)))
+      return 1;
+
+    if(bytesread == -1)
+      return 0;
+
+    buf->size+=bytesread;
+    sock->bytesin+=bytesread;
+
+    /* parse everything we can, then compact the buffer once */
+    consumed = 0;
+    do {
+      p = buf->data + consumed;
+      if(buf->mode == PARSE_ASCII) {
+        ret = parse_ascii(sock, p, buf->size - consumed, &strip);
+      } else if(buf->mode == PARSE_AEAD) {
+        ret = parse_aead(sock, p, buf->size - consumed, &strip);
+      } else {
+        ret = parse_crypt(sock, p, buf->size - consumed, &strip);
       }
 
-      buf->size-=strip;
+      consumed+=strip;
+    } while(!ret && strip && (consumed < buf->size));
+
+    if(ret == BUF_ERROR) /* sock may be gone */
+      return ret;
+
+    if(consumed) {
+      buf->size-=consumed;
+      if(buf->size) {
+        memmove(buf->data, buf->data + consumed, buf->size);
+      } else if(buf->alloc > ESOCKET_READ_SIZE) { /* don't hang on to a big partial line's buffer */
+        ntfree(buf->data);
+        buf->data = NULL;
+        buf->alloc = 0;
+      }
     }
 
-    if(ret)
+    if(ret || (bytesread < space))
       return ret;
-  } while(strip && buf->data);
+  }
 
   return 0;
 }
 
-struct esocket_packet *esocket_new_packet(struct esocket_out_buffer *buf, char *buffer, int bytes) {
-  struct esocket_packet *nw;
+static void esocket_set_events(struct esocket *sock, short events) {
+  deregisterhandler(sock->fd, 0);
+  registerhandler(sock->fd, events | POLLERR | POLLHUP, esocket_poll_event);
+}
 
-  if(buf->count == MAX_OUT_QUEUE_SIZE)
-    return NULL;
+static int esocket_queue(struct esocket_out_buffer *buf, char *data, unsigned int bytes) {
+  unsigned int tail, first;
 
-  nw = ntmalloc(sizeof(struct esocket_packet));
-  if(!nw)
-    return NULL;
+  if(buf->size + bytes > MAX_OUT_QUEUE_BYTES)
+    return 1;
 
-  nw->line = ntmalloc(bytes);
-  if(!nw->line) {
-    ntfree(nw);
-    return NULL;
+  if(buf->size + bytes > buf->alloc) { /* grow, straightening out the ring */
+    unsigned int newalloc = buf->alloc ? buf->alloc : ESOCKET_OUT_INITIAL;
+    char *newdata;
+
+    while(newalloc < buf->size + bytes)
+      newalloc*=2;
+
+    newdata = ntmalloc(newalloc);
+    if(!newdata)
+      return 1;
+
+    if(buf->data) {
+      first = buf->alloc - buf->head;
+      if(first > buf->size)
+        first = buf->size;
+
+      memcpy(newdata, buf->data + buf->head, first);
+      memcpy(newdata + first, buf->data, buf->size - first);
+      ntfree(buf->data);
+    }
+
+    buf->data = newdata;
+    buf->alloc = newalloc;
+    buf->head = 0;
   }
 
-  if(!buf->head) {
-    buf->head = nw;
-  } else {
-    buf->end->next = nw;
+  tail = (buf->head + buf->size) & (buf->alloc - 1);
+  first = buf->alloc - tail;
+  if(first > bytes)
+    first = bytes;
+
+  memcpy(buf->data + tail, data, first);
+  memcpy(buf->data, data + first, bytes - first);
+
+  buf->size+=bytes;
+  if(buf->size > buf->peak)
+    buf->peak = buf->size;
+
+  return 0;
+}
+
+/* write out as much of the ring as we can, both halves at once */
+static int esocket_flush(struct esocket *sock) {
+  struct esocket_out_buffer *buf = &sock->out;
+  struct iovec iov[2];
+  unsigned int first;
+  ssize_t ret;
+  int iovcnt;
+
+  while(buf->size) {
+    first = buf->alloc - buf->head;
+
+    iov[0].iov_base = buf->data + buf->head;
+    if(first >= buf->size) {
+      iov[0].iov_len = buf->size;
+      iovcnt = 1;
+    } else {
+      iov[0].iov_len = first;
+      iov[1].iov_base = buf->data;
+      iov[1].iov_len = buf->size - first;
+      iovcnt = 2;
+    }
+
+    ret = writev(sock->fd, iov, iovcnt);
+    if(ret == -1) {
+      if(errno != EAGAIN)
+        return 1;
+      break; /* wait until we're called again */
+    }
+    if(!ret)
+      break;
+
+    sock->bytesout+=ret;
+    buf->head = (buf->head + ret) & (buf->alloc - 1);
+    buf->size-=ret;
   }
 
-  buf->end = nw;
+  if(!buf->size) { /* exhausted the buffer */
+    buf->head = 0;
 
-  nw->next = NULL;
-  nw->size = bytes;
-  nw->startpos = 0;
+    if(sock->socket_status == ST_BLANK) {
+      esocket_disconnect(sock);
+      return 0;
+    }
+    esocket_set_events(sock, POLLIN);
+  }
 
-  memcpy(nw->line, buffer, bytes);
+  if(sock->wantdrain && (buf->size <= ESOCKET_LOW_WATER)) {
+    sock->wantdrain = 0;
+    if(sock->events.on_drain)
+      sock->events.on_drain(sock);
+  }
 
-  buf->count++;
+  return 0;
+}
 
-  return nw;
+/* true if the client is behind; if so on_drain is called once it catches up */
+int esocket_congested(struct esocket *sock) {
+  if(sock->out.size < ESOCKET_HIGH_WATER)
+    return 0;
+
+  sock->wantdrain = 1;
+  return 1;
 }
 
 int esocket_raw_write(struct esocket *sock, char *buffer, int bytes) {
   struct esocket_out_buffer *buf = &sock->out;
+  int ret;
 
-  if((bytes > USHRT_MAX) || (!buffer && bytes) || (buffer && !bytes))
+  if((bytes < 0) || (!buffer && bytes) || (buffer && !bytes))
     return 1;
 
-  if(bytes) { /* if we're not flushing */
-    if(buf->count) { /* if we're currently blocked */
-      if(!esocket_new_packet(buf, buffer, bytes))
+  if(!bytes) { /* flushing */
+    if(!buf->size) /* something went wrong */
+      return 1;
+    return esocket_flush(sock);
+  }
+
+  if(buf->size) /* currently blocked, queue behind what's there */
+    return esocket_queue(buf, buffer, bytes);
+
+  for(;;) {
+    ret = write(sock->fd, buffer, bytes);
+    if(ret == bytes) {
+      sock->bytesout+=ret;
+      return 0;
+    } else if(ret == -1) {
+      if(errno != EAGAIN) /* EPIPE or some other weird code, disconnect the socket */
         return 1;
+
+      /* was going to block, store the data and ignore the socket until it's unblocked */
+      if(esocket_queue(buf, buffer, bytes))
+        return 1;
+
+      esocket_set_events(sock, POLLOUT);
       return 0;
-    } else { /* not currently blocked */
-      int ret;
-      for(;;) {
-        ret = write(sock->fd, buffer, bytes);
-        if(ret == bytes) {
-          return 0;
-        } else if(ret == -1) { /* something bad happened */
-          switch(errno) {
-            case EAGAIN: /* was going to block, store the data in the buffer */
-              if(!esocket_new_packet(buf, buffer, bytes))
-                return 1;
-
-              deregisterhandler(sock->fd, 0); /* now we need to ignore the socket until it's unblocked */
-              registerhandler(sock->fd, POLLOUT | POLLERR | POLLHUP, esocket_poll_event);
-
-              return 0;
-              break;
-            case EPIPE: /* if there's some weird code disconnect the socket */
-            default:
-              return 1;
-              break;
-          }
-        } else { /* less than total was written, try again */
-          buffer+=ret;
-          bytes-=ret;
-        }
-      }
     }
-  } else if(buf->count) { /* if we're just flushing the buffer */
-    int ret;
-    for(;;) {
-      ret = write(sock->fd, buf->head->line + buf->head->startpos, buf->head->size);
-      if(!ret) {
-        return 0;
-      } else if(ret == buf->head->size) {
-        struct esocket_packet *p = buf->head;
-        buf->head = buf->head->next;
-
-        ntfree(p->line);
-        ntfree(p);
-
-        buf->count--;
-        if(!buf->head) { /* if we've exhausted the buffer */
-          buf->end = NULL;
-
-          if(sock->socket_status == ST_BLANK) {
-            esocket_disconnect(sock);
-          } else {
-            deregisterhandler(sock->fd, 0);
-
-            registerhandler(sock->fd, POLLIN | POLLERR | POLLHUP, esocket_poll_event);
-          }
-          return 0;
-        }
-      } else if(ret == -1) {
-        switch(errno) {
-          case EAGAIN: /* was going to block, wait until we're called again */
-            return 0;
-            break;
-
-          case EPIPE: /* if there's some weird code disconnect the socket */
-          default:
-            return 1;
-            break;
-        }
-      } else {
-        buf->head->startpos+=ret;
-        buf->head->size-=ret;
-      }
-    }
-    return 0;
-  }
 
-  /* something went wrong */
-  return 1;
+    /* less than total was written, try again */
+    sock->bytesout+=ret;
+    buffer+=ret;
+    bytes-=ret;
+  }
 }
 
 int esocket_write(struct esocket *sock, char *buffer, int bytes) {
   int ret;
   if(sock->in.mode == PARSE_ASCII) {
     ret = esocket_raw_write(sock, buffer, bytes);
+  } else if(sock->in.mode == PARSE_AEAD) {
+    unsigned char frame[AEAD_FRAME_LEN(MAX_BINARY_LINE_SIZE)], nonce[CHACHAPOLY_NONCELEN];
+
+    if((bytes <= 0) || (bytes > MAX_BINARY_LINE_SIZE)) {
+      ret = 1;
+    } else {
+      frame[0] = bytes >> 8;
+      frame[1] = bytes & 0xff;
+      memcpy(frame + AEAD_HEADER_LEN, buffer, bytes);
+
+      aead_nonce(nonce, sock->serverseqno);
+      sock->serverseqno++;
+      chachapoly_seal(sock->serveraeadkey, nonce, frame, AEAD_HEADER_LEN, frame + AEAD_HEADER_LEN, bytes, frame + AEAD_HEADER_LEN + bytes);
+
+      ret = esocket_raw_write(sock, (char *)frame, AEAD_FRAME_LEN(bytes));
+    }
   } else {
     unsigned char newbuf[MAX_BUFSIZE + USED_MAC_LEN], *p = newbuf, hmacdigest[32];
     hmacsha256 hmac;
@@ -504,8 +656,11 @@ int esocket_write(struct esocket *sock, char *buffer, int bytes) {
   }
 
   /* AWOOGA!! */
-  if(ret)
+  if(ret) {
     esocket_disconnect(sock);
+  } else {
+    sock->linesout++;
+  }
 
   return ret;
 }
@@ -557,6 +712,10 @@ void switch_buffer_mode(struct esocket *sock, unsigned char *serverkey, unsigned
   memcpy(sock->clientrawkey, clientkey, 32);
 
   sock->in.mode = PARSE_CRYPTO;
+  sock->in.cryptobuf = ntmalloc(MAX_BINARY_LINE_SIZE);
+  if(!sock->in.cryptobuf)
+    Error("nterface", ERR_STOP, "ntmalloc() failed in switch_buffer_mode (esockets.c)");
+  sock->in.cryptobufsize = 0;
 
   sock->clientseqno = 0;
   sock->serverseqno = 0;
@@ -572,3 +731,18 @@ void switch_buffer_mode(struct esocket *sock, unsigned char *serverkey, unsigned
   sock->clientseqno++;
 }
 
+void switch_buffer_mode_aead(struct esocket *sock, unsigned char *serverkey, unsigned char *clientkey) {
+  memcpy(sock->serverrawkey, serverkey, 32);
+  memcpy(sock->clientrawkey, clientkey, 32);
+
+  sock->in.mode = PARSE_AEAD;
+
+  sock->clientseqno = 0;
+  sock->serverseqno = 0;
+
+  sock->clientkeyno = 0;
+  sock->serverkeyno = 0;
+
+  derive_key(sock->serveraeadkey, sock->serverrawkey, sock->serverkeyno++, (unsigned char *)":SAEAD", 6);
+  derive_key(sock->clientaeadkey, sock->clientrawkey, sock->clientkeyno++, (unsigned char *)":CAEAD", 6);
+}
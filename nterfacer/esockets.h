@@ -10,9 +10,11 @@
 #include "../lib/sha2.h"
 #include "../lib/hmac.h"
 #include "../lib/cbc.h"
+#include "../lib/chachapoly.h"
 #include "library.h"
 #include <sys/types.h>
 #include <ctype.h>
+#include <time.h>
 
 #define ESOCKET_UNIX_DOMAIN            ESOCKET_LISTENING
 #define ESOCKET_UNIX_DOMAIN_CONNECTED  ESOCKET_INCOMING
@@ -41,17 +43,30 @@
 
 #define PARSE_ASCII 0
 #define PARSE_CRYPTO 1
+#define PARSE_AEAD 2
 
 #define MAX_BUFSIZE 50000
 
 #define USED_MAC_LEN 16
 
+/* AEAD frames: 16 bit big endian payload length, payload, tag */
+#define AEAD_HEADER_LEN 2
+#define AEAD_FRAME_LEN(x) (AEAD_HEADER_LEN + (x) + CHACHAPOLY_TAGLEN)
+
 typedef unsigned short packet_t;
 
 #define MAX_BINARY_LINE_SIZE MAX_BUFSIZE
 #define MAX_ASCII_LINE_SIZE  MAX_BINARY_LINE_SIZE - 10 - USED_MAC_LEN
 
-#define MAX_OUT_QUEUE_SIZE   5000
+#define MAX_OUT_QUEUE_BYTES  (4 * 1024 * 1024)
+#define ESOCKET_OUT_INITIAL  4096 /* ring sizes are powers of two */
+
+/* esocket_congested() above the high mark, on_drain once we're back under the low one */
+#define ESOCKET_HIGH_WATER   (256 * 1024)
+#define ESOCKET_LOW_WATER    (64 * 1024)
+
+#define ESOCKET_READ_SIZE    16384
+#define ESOCKET_MAX_READS    16   /* per poll event, so one client can't starve the rest */
 
 struct buffer;
 struct esocket;
@@ -63,23 +78,20 @@ typedef int (*line_event)(struct esocket *sock, char *newline);
 typedef struct esocket_in_buffer {
   char *data;
   int size;
+  int alloc;
   short mode;
   unsigned char *cryptobuf;
   int cryptobufsize;
   short mac;
 } in_buffer;
 
-typedef struct esocket_packet {
-  char *line;
-  packet_t size;
-  packet_t startpos;
-  struct esocket_packet *next;
-} esocket_packet;
-
+/* anything that couldn't be written straight away, in a ring flushed with writev() */
 typedef struct esocket_out_buffer {
-  struct esocket_packet *head;
-  struct esocket_packet *end;
-  unsigned short count;
+  char *data;
+  unsigned int alloc;
+  unsigned int head;
+  unsigned int size;
+  unsigned int peak;
 } out_buffer;
 
 typedef void (*esocket_event)(struct esocket *socket);
@@ -89,6 +101,7 @@ typedef struct esocket_events {
   esocket_event on_accept;
   esocket_event on_disconnect;
   line_event    on_line;
+  esocket_event on_drain;
 } esocket_events;
 
 typedef struct esocket {
@@ -97,11 +110,16 @@ typedef struct esocket {
   struct esocket_out_buffer out;
   char socket_type;
   char socket_status;
+  char wantdrain;
   struct esocket_events events;
-  struct esocket *next;
+  struct esocket *next, *prev;
   unsigned short token;
   void *tag;
 
+  time_t connected;
+  unsigned long linesin, linesout;
+  unsigned long long bytesin, bytesout;
+
   unsigned char clientrawkey[32], serverrawkey[32];
   unsigned char clienthmackey[32], serverhmackey[32];
   u_int64_t clientseqno, serverseqno;
@@ -110,8 +128,12 @@ typedef struct esocket {
   hmacsha256 clienthmac;
   rijndaelcbc *clientcrypto;
   rijndaelcbc *servercrypto;
+
+  unsigned char clientaeadkey[CHACHAPOLY_KEYLEN], serveraeadkey[CHACHAPOLY_KEYLEN];
 } esocket;
 
+extern struct esocket *socklist;
+
 struct esocket *esocket_add(int fd, char socket_type, struct esocket_events *events, unsigned short token);
 struct esocket *find_esocket_from_fd(int fd);
 void esocket_poll_event(int fd, short events);
@@ -121,9 +143,10 @@ int esocket_read(struct esocket *sock);
 int esocket_write(struct esocket *sock, char *buffer, int bytes);
 int esocket_write_line(struct esocket *sock, char *format, ...) __attribute__ ((format (printf, 2, 3)));
 unsigned short esocket_token(void);
-struct esocket *find_esocket_from_fd(int fd);
+int esocket_congested(struct esocket *sock);
 void esocket_clean_by_token(unsigned short token);
 void switch_buffer_mode(struct esocket *sock, unsigned char *serverkey, unsigned char *serveriv, unsigned char *clientkey, unsigned char *clientiv);
+void switch_buffer_mode_aead(struct esocket *sock, unsigned char *serverkey, unsigned char *clientkey);
 void esocket_disconnect_when_complete(struct esocket *active);
 int esocket_raw_write(struct esocket *sock, char *buffer, int bytes);
 
@@ -202,6 +202,9 @@ char *request_error(int errn) {
     case RE_ACCESS_DENIED:
       snc(err, "Access denied");
       break;
+    case RE_SERVICE_BUSY:
+      snc(err, "Too many requests in progress for this service");
+      break;
     default:
       snc(err, "Unable to find error message");
   }
@@ -23,9 +23,11 @@
 #include "../lib/irc_string.h"
 #include "../core/config.h"
 #include "../core/events.h"
+#include "../core/hooks.h"
 #include "../lib/version.h"
 #include "../core/schedule.h"
 #include "../lib/strlfunc.h"
+#include "../core/metrics.h"
 
 #include "nterfacer.h"
 #include "logging.h"
@@ -42,12 +44,22 @@ struct nterface_auto_log *nrl;
 static struct service_node *ping;
 static struct handler *ping_hl;
 
+/* requests waiting on a reply, a slot per second */
+static struct rline *rlinewheel[NTERFACER_WHEELSIZE];
+static time_t wheelpos;
+static int requesttimeout, maxrequests;
+
 int accept_fd = -1;
 struct permitted *permits;
 int permit_count = 0;
 
 int ping_handler(struct rline *ri, int argc, char **argv);
+static void nterfacerstats(int hooknum, void *arg);
 static void nterfacer_sendcallback(struct rline *ri, int error, char *buf);
+static void nterfacer_drain_event(struct esocket *sock);
+static void nterfacer_wheeltick(void *arg);
+static void nterfacer_kick(void *arg);
+static void rline_free(struct rline *li);
 
 void _init(void) {
   int loaded;
@@ -55,6 +67,11 @@ void _init(void) {
   
   nrl = nterface_open_log("nterfacer", "logs/nterfacer.log", debug_mode);
 
+  requesttimeout = getcopyconfigitemintpositive("nterfacer", "timeout", NTERFACER_TIMEOUT);
+  maxrequests = getcopyconfigitemintpositive("nterfacer", "maxrequests", NTERFACER_MAXREQUESTS);
+
+  registerhook(HOOK_CORE_STATSREQUEST, &nterfacerstats);
+
   loaded = load_permits();
   nterface_log(nrl, NL_INFO, "Loaded %d permit%s successfully.", loaded, loaded==1?"":"s");
 
@@ -64,9 +81,13 @@ void _init(void) {
   nterfacer_events.on_accept = nterfacer_accept_event;
   nterfacer_events.on_line = nterfacer_line_event;
   nterfacer_events.on_disconnect = NULL;
+  nterfacer_events.on_drain = nterfacer_drain_event;
 
   nterfacer_token = esocket_token();
 
+  wheelpos = time(NULL);
+  schedulerecurring(time(NULL) + 1, 0, 1, &nterfacer_wheeltick, NULL);
+
   ping = register_service("nterfacer");
   if(!ping) {
     MemError();
@@ -86,29 +107,22 @@ void _init(void) {
 }
 
 void free_handler(struct handler *hp) {
-  struct rline *li, *pi = NULL;
-
-  for(li=rlines;li;) {
-    if(li->handler == hp) {
-      if(li->socket) {
-        esocket_write_line(li->socket, "%d,OE%d,%s", li->id, BF_UNLOADED, "Service was unloaded.");
-      } else if(li->callback) {
-        nterfacer_sendcallback(li, BF_UNLOADED, "Service was unloaded.");
-      }
-      if(pi) {
-        pi->next = li->next;
-        ntfree(li);
-        li = pi->next;
-      } else {
-        rlines = li->next;
-        ntfree(li);
-        li = rlines;
-      }
-    } else {
-      pi=li,li=li->next;
+  struct rline *li, *ni;
+
+  for(li=rlines;li;li=ni) {
+    ni = li->next;
+    if(li->handler != hp)
+      continue;
+
+    if(li->socket) {
+      esocket_write_line(li->socket, "%d,OE%d,%s", li->id, BF_UNLOADED, "Service was unloaded.");
+    } else if(li->callback) {
+      nterfacer_sendcallback(li, BF_UNLOADED, "Service was unloaded.");
     }
+    rline_free(li);
   }
 
+  deregistermetric(hp->latency);
   freesstring(hp->command);
   ntfree(hp);
 }
@@ -129,6 +143,10 @@ void _fini(void) {
   struct service_node *tp, *lp;
   int i;
 
+  deregisterhook(HOOK_CORE_STATSREQUEST, &nterfacerstats);
+  deleteschedule(NULL, &nterfacer_wheeltick, NULL);
+  deleteschedule(NULL, &nterfacer_kick, NULL);
+
   if(ping)
     deregister_service(ping);
 
@@ -277,6 +295,24 @@ int setup_listening_socket(void) {
   return fd;
 }
 
+/* servicelimit lines look like "R=20", anything else gets maxrequests */
+static int service_limit(char *name) {
+  array *limitsa = getconfigitems("nterfacer", "servicelimit");
+  sstring **limits;
+  size_t len = strlen(name);
+  int i;
+
+  if(!limitsa)
+    return maxrequests;
+
+  limits = (sstring **)limitsa->content;
+  for(i=0;i<limitsa->cursi;i++)
+    if(!strncmp(limits[i]->content, name, len) && (limits[i]->content[len] == '='))
+      return positive_atoi(limits[i]->content + len + 1);
+
+  return maxrequests;
+}
+
 struct service_node *register_service(char *name) {
   struct service_node *np = ntmalloc(sizeof(service_node));
   MemCheckR(np, NULL);
@@ -288,6 +324,10 @@ struct service_node *register_service(char *name) {
     return NULL;
   }
 
+  np->inflight = 0;
+  np->limit = service_limit(name);
+  np->requests = np->rejected = np->timeouts = 0;
+
   np->handlers = NULL;
   np->next = tree;
   tree = np;
@@ -297,6 +337,7 @@ struct service_node *register_service(char *name) {
 
 struct handler *register_handler(struct service_node *service, char *command, int args, handler_function fp) {
   struct handler *hp = ntmalloc(sizeof(handler));
+  char metricname[METRICNAMELEN];
   MemCheckR(hp, NULL);
 
   hp->command = getsstring(command, strlen(command));
@@ -309,6 +350,9 @@ struct handler *register_handler(struct service_node *service, char *command, in
   hp->function = fp;
   hp->args = args;
 
+  snprintf(metricname, sizeof(metricname), "nterfacer_%s_%s_us", service->name->content, command);
+  hp->latency = registermetric(metricname, METRIC_HISTOGRAM);
+
   hp->next = service->handlers;
   hp->service = service;
   service->handlers = hp;
@@ -409,6 +453,7 @@ void nterfacer_accept_event(struct esocket *socket) {
   nterface_log(nrl, NL_INFO, "New connection from %s.", item->hostname->content);
 
   temp->status = SS_IDLE;
+  temp->aead = 0;
   temp->permit = item;
 
   esocket_write_line(newsocket, "nterfacer " PROTOCOL_VERSION);
@@ -436,41 +481,40 @@ void derive_key(unsigned char *out, char *password, char *segment, unsigned char
 int nterfacer_line_event(struct esocket *sock, char *newline) {
   struct sconnect *socket = sock->tag;
   char *response, *theirnonceh = NULL, *theirivh = NULL;
-  unsigned char theirnonce[16], theiriv[16];
+  unsigned char theirnonce[16], theiriv[16], challenge[32];
+  char ivhex[16 * 2 + 1], noncehex[16 * 2 + 1];
   int number, reason;
 
   switch(socket->status) {
     case SS_IDLE:
-      if(strcasecmp(newline, ANTI_FULL_VERSION)) {
+      if(!strcasecmp(newline, AEAD_FULL_VERSION)) {
+        socket->aead = 1;
+      } else if(strcasecmp(newline, ANTI_FULL_VERSION)) {
         nterface_log(nrl, NL_INFO, "Protocol mismatch from %s: %s", socket->permit->hostname->content, newline);
         return 1;
-      } else {
-        unsigned char challenge[32];
-        char ivhex[16 * 2 + 1], noncehex[16 * 2 + 1];
-
-        if(!get_entropy(challenge, 32) || !get_entropy(socket->iv, 16)) {
-          nterface_log(nrl, NL_ERROR, "Unable to open challenge/IV entropy bin!");
-          return 1;
-        }
+      }
 
-        int_to_hex(challenge, socket->challenge, 32);
-        int_to_hex(socket->iv, ivhex, 16);
+      if(!get_entropy(challenge, 32) || !get_entropy(socket->iv, 16)) {
+        nterface_log(nrl, NL_ERROR, "Unable to open challenge/IV entropy bin!");
+        return 1;
+      }
 
-        memcpy(socket->response, challenge_response(socket->challenge, socket->permit->password->content), sizeof(socket->response));
-        socket->response[sizeof(socket->response) - 1] = '\0'; /* just in case */
+      int_to_hex(challenge, socket->challenge, 32);
+      int_to_hex(socket->iv, ivhex, 16);
 
-        socket->status = SS_VERSIONED;
-        if(!generate_nonce(socket->ournonce, 1)) {
-          nterface_log(nrl, NL_ERROR, "Unable to generate nonce!");
-          return 1;
-        }
-        int_to_hex(socket->ournonce, noncehex, 16);
+      memcpy(socket->response, challenge_response(socket->challenge, socket->permit->password->content), sizeof(socket->response));
+      socket->response[sizeof(socket->response) - 1] = '\0'; /* just in case */
 
-        if(esocket_write_line(sock, "%s %s %s", socket->challenge, ivhex, noncehex))
-           return BUF_ERROR;
-        return 0;
+      socket->status = SS_VERSIONED;
+      if(!generate_nonce(socket->ournonce, 1)) {
+        nterface_log(nrl, NL_ERROR, "Unable to generate nonce!");
+        return 1;
       }
-      break;
+      int_to_hex(socket->ournonce, noncehex, 16);
+
+      if(esocket_write_line(sock, "%s %s %s", socket->challenge, ivhex, noncehex))
+         return BUF_ERROR;
+      return 0;
     case SS_VERSIONED:
       for(response=newline;*response;response++) {
         if((*response == ' ') && (*(response + 1))) {
@@ -507,9 +551,13 @@ int nterfacer_line_event(struct esocket *sock, char *newline) {
         derive_key(ourkey, socket->permit->password->content, socket->challenge, socket->ournonce, theirnonce, (unsigned char *)"SERVER", 6);
 
         derive_key(theirkey, socket->permit->password->content, socket->response, theirnonce, socket->ournonce, (unsigned char *)"CLIENT", 6);
-        nterface_log(nrl, NL_INFO, "Authed: %s", socket->permit->hostname->content);
+        nterface_log(nrl, NL_INFO, "Authed: %s%s", socket->permit->hostname->content, socket->aead ? " (AEAD)" : "");
         socket->status = SS_AUTHENTICATED;
-        switch_buffer_mode(sock, ourkey, socket->iv, theirkey, theiriv);
+        if(socket->aead) {
+          switch_buffer_mode_aead(sock, ourkey, theirkey);
+        } else {
+          switch_buffer_mode(sock, ourkey, socket->iv, theirkey, theiriv);
+        }
 
         if(esocket_write_line(sock, "Oauth"))
           return BUF_ERROR;
@@ -539,6 +587,139 @@ int nterfacer_line_event(struct esocket *sock, char *newline) {
   return 0;
 }
 
+static void wheeladd(struct rline *li, time_t expires) {
+  struct rline **slot = &rlinewheel[expires & (NTERFACER_WHEELSIZE - 1)];
+
+  li->expires = expires;
+  li->wheelprev = NULL;
+  li->wheelnext = *slot;
+  if(*slot)
+    (*slot)->wheelprev = li;
+  *slot = li;
+}
+
+static void wheeldel(struct rline *li) {
+  if(!li->expires)
+    return;
+
+  if(li->wheelprev) {
+    li->wheelprev->wheelnext = li->wheelnext;
+  } else {
+    rlinewheel[li->expires & (NTERFACER_WHEELSIZE - 1)] = li->wheelnext;
+  }
+  if(li->wheelnext)
+    li->wheelnext->wheelprev = li->wheelprev;
+
+  li->expires = 0;
+}
+
+static void rline_link(struct rline *li, struct service_node *service, struct handler *hl) {
+  li->service = service;
+  li->handler = hl;
+  li->buf[0] = '\0';
+  li->curpos = li->buf;
+
+  li->prev = NULL;
+  li->next = rlines;
+  if(rlines)
+    rlines->prev = li;
+  rlines = li;
+
+  li->started = metricclock();
+  li->expires = 0;
+  li->streaming = 0;
+  li->resume = NULL;
+  li->resumearg = NULL;
+  li->blocked = 0;
+  li->partials = 0;
+
+  service->inflight++;
+  service->requests++;
+}
+
+static void rline_free(struct rline *li) {
+  wheeldel(li);
+
+  if(li->prev) {
+    li->prev->next = li->next;
+  } else {
+    rlines = li->next;
+  }
+  if(li->next)
+    li->next->prev = li->prev;
+
+  li->service->inflight--;
+  metricobserve(li->handler->latency, metricclock() - li->started);
+
+  if(li->resumearg)
+    ntfree(li->resumearg);
+  ntfree(li);
+}
+
+/* the client went away or gave up, the handler carries on talking to nobody */
+static void rline_detach(struct rline *li) {
+  wheeldel(li);
+  li->socket = NULL;
+}
+
+/* blocked is 1 while waiting, 2 while queued to resume so re-blocking doesn't loop */
+static void ri_resume_blocked(struct esocket *sock) {
+  struct rline *li;
+
+  for(li=rlines;li;li=li->next)
+    if(li->blocked && (li->socket == sock))
+      li->blocked = 2;
+
+  for(;;) {
+    for(li=rlines;li;li=li->next)
+      if(li->blocked == 2)
+        break;
+
+    if(!li)
+      return;
+
+    li->blocked = 0;
+    li->resume(li, li->resumearg);
+  }
+}
+
+static void nterfacer_drain_event(struct esocket *sock) {
+  ri_resume_blocked(sock);
+}
+
+static void nterfacer_kick(void *arg) {
+  ri_resume_blocked(NULL);
+}
+
+static void nterfacer_wheeltick(void *arg) {
+  time_t now = time(NULL);
+  struct rline *li, *ni;
+  struct esocket *sock;
+  int expired = 0;
+
+  /* clock went backwards, or we fell a whole revolution behind */
+  if((wheelpos > now + 1) || (wheelpos + NTERFACER_WHEELSIZE <= now))
+    wheelpos = now - NTERFACER_WHEELSIZE + 1;
+
+  for(;wheelpos<=now;wheelpos++) {
+    for(li=rlinewheel[wheelpos & (NTERFACER_WHEELSIZE - 1)];li;li=ni) {
+      ni = li->wheelnext;
+      if(!li->expires || (li->expires > now))
+        continue;
+
+      li->service->timeouts++;
+      sock = li->socket;
+      rline_detach(li);
+      if(sock)
+        esocket_write_line(sock, "%d,OE%d,%s", li->id, BF_TIMEOUT, "Request timed out.");
+      expired = 1;
+    }
+  }
+
+  if(expired)
+    ri_resume_blocked(NULL);
+}
+
 int nterfacer_new_rline(char *line, struct esocket *socket, int *number, struct permitted *permit) {
   char *sp, *p, *parsebuf = NULL, *pp, commandbuf[MAX_BUFSIZE], *args[MAX_ARGS], *newp;
   int argcount;
@@ -654,6 +835,13 @@ int nterfacer_new_rline(char *line, struct esocket *socket, int *number, struct
     return RE_ACCESS_DENIED;
   }
 
+  if(service->limit && (service->inflight >= service->limit)) {
+    service->rejected++;
+    if(argcount && parsebuf)
+      ntfree(parsebuf);
+    return RE_SERVICE_BUSY;
+  }
+
   prequest = (struct rline *)ntmalloc(sizeof(struct rline));
   if(!prequest) {
     MemError();
@@ -662,17 +850,15 @@ int nterfacer_new_rline(char *line, struct esocket *socket, int *number, struct
     return RE_MEM_ERROR;
   }
 
-  prequest->service = service;
-  prequest->handler = hl;
-  prequest->buf[0] = '\0';
-  prequest->curpos = prequest->buf;
+  rline_link(prequest, service, hl);
   prequest->tag = NULL;
   prequest->id = *number;
-  prequest->next = rlines;
   prequest->socket = socket;
   prequest->callback = NULL;
 
-  rlines = prequest;
+  if(requesttimeout)
+    wheeladd(prequest, time(NULL) + requesttimeout);
+
   re = (hl->function)(prequest, argcount, args);
   
   if(argcount && parsebuf)
@@ -684,21 +870,31 @@ int nterfacer_new_rline(char *line, struct esocket *socket, int *number, struct
 void nterfacer_disconnect_event(struct esocket *sock) {
   struct sconnect *socket = sock->tag;
   struct rline *li;
-  /* not tested */
+  int blocked = 0;
 
-  nterface_log(nrl, NL_INFO, "Disconnected from %s.", socket->permit->hostname->content);
+  nterface_log(nrl, NL_INFO, "Disconnected from %s (%lu/%lu lines in/out, peak queue %u bytes).", socket->permit->hostname->content,
+    sock->linesin, sock->linesout, sock->out.peak);
 
-  /* not tested */
-  for(li=rlines;li;li=li->next)
-    if(li->socket && (li->socket->tag == socket))
-      li->socket = NULL;
+  for(li=rlines;li;li=li->next) {
+    if(li->socket == sock) {
+      rline_detach(li);
+      if(li->blocked)
+        blocked = 1;
+    }
+  }
+
+  /* let stalled streams notice and finish, but not from in here */
+  if(blocked) {
+    deleteschedule(NULL, &nterfacer_kick, NULL);
+    scheduleoneshot(time(NULL), &nterfacer_kick, NULL);
+  }
 
   ntfree(socket);
 }
 
 int ri_append(struct rline *li, char *format, ...) {
   char buf[MAX_BUFSIZE], escapedbuf[MAX_BUFSIZE * 2 + 1], *p, *tp;
-  int sizeleft = sizeof(li->buf) - (li->curpos - li->buf);  
+  int used, len, ret = BF_OK;
   va_list ap;
 
   va_start(ap, format);
@@ -713,25 +909,77 @@ int ri_append(struct rline *li, char *format, ...) {
   for(tp=escapedbuf,p=buf;*p||(*tp='\0');*tp++=*p++)
     if((*p == ',') || (*p == '\\'))
       *tp++ = '\\';
+  len = tp - escapedbuf;
+
+  if(li->streaming && !li->socket && !li->callback)
+    return BF_CLOSED;
+
+  used = li->curpos - li->buf;
+  if(li->streaming && li->socket && used && (used + len + 1 > RI_STREAM_CHUNK)) {
+    ret = ri_flush(li);
+    if(ret == BF_CLOSED)
+      return ret;
+    if(ret == BF_OVER) /* old client, fill the buffer as usual */
+      ret = BF_OK;
+    used = li->curpos - li->buf;
+  }
 
-  if(sizeleft > 0) {
-    if(li->curpos == li->buf) { 
-      li->curpos+=snprintf(li->curpos, sizeleft, "%s", escapedbuf);
-    } else {
-      li->curpos+=snprintf(li->curpos, sizeleft, ",%s", escapedbuf);
+  if(used + len + (used ? 1 : 0) >= sizeof(li->buf))
+    return BF_OVER;
+
+  if(used)
+    *li->curpos++ = ',';
+  memcpy(li->curpos, escapedbuf, len + 1);
+  li->curpos+=len;
+
+  return ret;
+}
+
+/*
+ * Opt in to streaming.  Once the response passes RI_STREAM_CHUNK bytes
+ * ri_append sends it as a partial line (protocol 5 clients only, older
+ * ones get BF_OVER when the buffer fills as before).  With a resume
+ * function it can also return BF_BUSY when the client is behind: return
+ * and wait for resume(li, arg).  BF_CLOSED means nobody is listening, so
+ * finish with ri_final/ri_error.  arg is ntfree'd along with li.
+ */
+void ri_stream(struct rline *li, rline_resume resume, void *arg) {
+  li->streaming = 1;
+  li->resume = resume;
+  li->resumearg = arg;
+}
+
+int ri_flush(struct rline *li) {
+  if(!li->socket)
+    return li->callback ? BF_OVER : BF_CLOSED;
+
+  if(!((struct sconnect *)li->socket->tag)->aead)
+    return BF_OVER;
+
+  if(li->curpos != li->buf) {
+    if(esocket_write_line(li->socket, "%d,OP%s", li->id, li->buf))
+      return BF_CLOSED;
+
+    li->buf[0] = '\0';
+    li->curpos = li->buf;
+    li->partials++;
+
+    if(li->expires) { /* still making progress */
+      wheeldel(li);
+      wheeladd(li, time(NULL) + requesttimeout);
     }
   }
 
-  if(sizeof(li->buf) - (li->curpos - li->buf) > 0) {
-    return BF_OK;
-  } else {
-    return BF_OVER;
+  if(li->resume && esocket_congested(li->socket)) {
+    li->blocked = 1;
+    return BF_BUSY;
   }
+
+  return BF_OK;
 }
 
 int ri_error(struct rline *li, int error_code, char *format, ...) {
   char buf[MAX_BUFSIZE], escapedbuf[MAX_BUFSIZE * 2 + 1], *p, *tp;
-  struct rline *pp, *lp = NULL;
   va_list ap;
   int retval = RE_OK;
 
@@ -754,23 +1002,12 @@ int ri_error(struct rline *li, int error_code, char *format, ...) {
     }
   }
 
-  for(pp=rlines;pp;lp=pp,pp=pp->next) {
-    if(pp == li) {
-      if(lp) {
-        lp->next = li->next;
-      } else {
-        rlines = li->next;
-      }
-      ntfree(li);
-      break;
-    }
-  }
-  
+  rline_free(li);
+
   return retval;
 }
 
 int ri_final(struct rline *li) {
-  struct rline *pp, *lp = NULL;
   int retval = RE_OK;
 
   if(li->socket) {
@@ -780,17 +1017,7 @@ int ri_final(struct rline *li) {
     nterfacer_sendcallback(li, 0, li->buf);
   }
 
-  for(pp=rlines;pp;lp=pp,pp=pp->next) {
-    if(pp == li) {
-      if(lp) {
-        lp->next = li->next;
-      } else {
-        rlines = li->next;
-      }
-      ntfree(li);
-      break;
-    }
-  }
+  rline_free(li);
 
   return retval;
 }
@@ -885,19 +1112,13 @@ void *nterfacer_sendline(char *service, char *command, int argc, char **argv, rl
   }
   sr->hl = hl;
 
-  prequest->service = servicep;
-  prequest->handler = hl;
-  prequest->buf[0] = '\0';
-  prequest->curpos = prequest->buf;
+  rline_link(prequest, servicep, hl);
   prequest->tag = tag;
   prequest->id = 0;
   prequest->socket = NULL;
   prequest->callback = callback;
 
-  prequest->next = rlines;
-  rlines = prequest;
-
-  scheduleoneshot(time(NULL), execrline, sr);
+  sr->schedule = scheduleoneshot(time(NULL), execrline, sr);
 
   return (void *)sr;
 }
@@ -906,8 +1127,10 @@ void nterfacer_freeline(void *tag) {
   struct sched_rline *prequest = tag;
 
   prequest->rl.callback = NULL;
-  if(prequest->schedule)
-    deleteschedule(prequest->schedule, execrline, NULL);
+  if(prequest->schedule) { /* never ran, nothing else will free it */
+    deleteschedule(prequest->schedule, execrline, prequest);
+    rline_free(&prequest->rl);
+  }
 }
 
 #define MAX_LINES 8192
@@ -945,3 +1168,53 @@ static void nterfacer_sendcallback(struct rline *ri, int error, char *buf) {
 
   ri->callback(error, linec, lines, ri->tag);
 }
+
+static void nterfacerstats(int hooknum, void *arg) {
+  struct service_node *sp;
+  struct esocket *sock;
+  struct sconnect *sc;
+  unsigned long linesin = 0, linesout = 0;
+  unsigned int queued = 0, peak = 0;
+  int connections = 0;
+  time_t age;
+  char buf[512];
+
+  for(sock=socklist;sock;sock=sock->next) {
+    if((sock->token != nterfacer_token) || (sock == nterfacer_sock))
+      continue;
+
+    connections++;
+    linesin+=sock->linesin;
+    linesout+=sock->linesout;
+    queued+=sock->out.size;
+    if(sock->out.peak > peak)
+      peak = sock->out.peak;
+  }
+
+  snprintf(buf, sizeof(buf), "nterfacer: %d connection%s, %lu/%lu lines in/out, %u bytes queued (peak %u).",
+    connections, connections==1?"":"s", linesin, linesout, queued, peak);
+  triggerhook(HOOK_CORE_STATSREPLY, buf);
+
+  if((long)arg <= 10)
+    return;
+
+  for(sock=socklist;sock;sock=sock->next) {
+    if((sock->token != nterfacer_token) || (sock == nterfacer_sock) || !(sc = sock->tag))
+      continue;
+
+    age = time(NULL) - sock->connected;
+    if(age < 1)
+      age = 1;
+
+    snprintf(buf, sizeof(buf), "nterfacer: %-20s %lus, %lu/%lu lines in/out (%lu/%lu per sec), %llu/%llu bytes, queue %u (peak %u)",
+      sc->permit->hostname->content, (unsigned long)age, sock->linesin, sock->linesout, sock->linesin / age, sock->linesout / age,
+      sock->bytesin, sock->bytesout, sock->out.size, sock->out.peak);
+    triggerhook(HOOK_CORE_STATSREPLY, buf);
+  }
+
+  for(sp=tree;sp;sp=sp->next) {
+    snprintf(buf, sizeof(buf), "nterfacer: service %-10s %d/%d in flight, %lu requests, %lu rejected busy, %lu timed out",
+      sp->name->content, sp->inflight, sp->limit, sp->requests, sp->rejected, sp->timeouts);
+    triggerhook(HOOK_CORE_STATSREPLY, buf);
+  }
+}
@@ -18,6 +18,9 @@
 #define BF_OK      0x00
 #define BF_OVER    0xFF
 #define BF_UNLOADED 0xFE
+#define BF_BUSY    0xFD /* streaming: sent, but the client is behind -- stop until resumed */
+#define BF_CLOSED  0xFC /* streaming: nobody is listening any more, finish up */
+#define BF_TIMEOUT 0xFB
 
 #define SS_IDLE           0x00
 #define SS_VERSIONED      0x01
@@ -27,13 +30,25 @@
 
 #define MAX_ARGS 100
 
+#define RI_STREAM_CHUNK        16384 /* streamed responses go out in pieces about this big */
+#define NTERFACER_TIMEOUT      60    /* seconds a client waits for a reply before getting BF_TIMEOUT */
+#define NTERFACER_MAXREQUESTS  100   /* requests in flight per service, 0 for no limit */
+#define NTERFACER_WHEELSIZE    64    /* timeout wheel slots, a power of two */
+
 #define PROTOCOL_VERSION "4"
 #define ANTI_FULL_VERSION "service_link " PROTOCOL_VERSION
 
+/* same handshake, but ChaCha20-Poly1305 frames afterwards (see esockets.h).
+ * Protocol 5 clients may also get "id,OPfields" partial lines ahead of the
+ * final "id,OOfields"; the response is all of their fields in order. */
+#define AEAD_PROTOCOL_VERSION "5"
+#define AEAD_FULL_VERSION "service_link " AEAD_PROTOCOL_VERSION
+
 struct rline;
 
 typedef int (*handler_function)(struct rline *ri, int argc, char **argv);
 typedef void (*rline_callback)(int failed, int linec, char **linev, void *tag);
+typedef void (*rline_resume)(struct rline *ri, void *arg);
 
 typedef struct handler {
   sstring *command;
@@ -41,12 +56,15 @@ typedef struct handler {
   handler_function function;
   struct handler *next;
   void *service;
+  struct metric *latency;
 } handler;
 
 typedef struct service_node {
   sstring *name;
   struct handler *handlers;
   struct service_node *next;
+  int inflight, limit;
+  unsigned long requests, rejected, timeouts;
 } service_node;
 
 typedef struct rline {
@@ -55,10 +73,19 @@ typedef struct rline {
   struct service_node *service;
   char buf[MAX_BUFSIZE];
   char *curpos;
-  struct rline *next;
+  struct rline *next, *prev;
   void *tag;
   rline_callback callback;
   struct esocket *socket;
+
+  unsigned long long started;
+  time_t expires;
+  struct rline *wheelnext, *wheelprev;
+
+  short streaming, blocked;
+  rline_resume resume;
+  void *resumearg;
+  unsigned int partials;
 } rline;
 
 typedef struct permitted {
@@ -70,6 +97,7 @@ typedef struct permitted {
 
 typedef struct sconnect {
   int status;
+  int aead;
   char response[32 * 2 + 1], challenge[32 * 2 + 1];
   unsigned char iv[16];
   struct permitted *permit;
@@ -88,6 +116,8 @@ int error_respond(struct rline *li, int error_code, char *format, ...);
 int ri_append(struct rline *li, char *format, ...) __attribute__ ((format (printf, 2, 3)));
 int ri_error(struct rline *li, int error_code, char *format, ...) __attribute__ ((format (printf, 3, 4)));
 int ri_final(struct rline *li);
+void ri_stream(struct rline *li, rline_resume resume, void *arg);
+int ri_flush(struct rline *li);
 
 int load_permits(void);
 int setup_listening_socket(void);
@@ -0,0 +1,377 @@
+/*
+  nterfacer_bench: loopback throughput benchmark for the esockets transports.
+
+  Runs once when loaded.  A socketpair stands in for a web frontend: we play
+  the client side ourselves and time the server side of both the CBC+HMAC
+  transport (protocol 4) and the ChaCha20-Poly1305 frames (protocol 5),
+  i.e. esocket_read() for requests and esocket_write() for responses.
+  Every line is checked on the far side.
+
+  [nterfacer_bench]
+  lines=100000   lines per transport and direction
+  size=200       bytes per line, including the newline
+  results=data/nterfacer_bench.results
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../core/error.h"
+#include "../core/schedule.h"
+#include "../core/metrics.h"
+#include "../lib/version.h"
+#include "../lib/benchmark.h"
+
+#include "esockets.h"
+#include "library.h"
+
+MODULE_VERSION("")
+
+#define NB_BATCHBYTES 32768
+#define NB_MAXSTALLS  100
+
+typedef struct nbclient {
+  int aead;
+  int framelen;
+
+  /* protocol 4 */
+  rijndaelcbc *encrypt, *decrypt;
+  unsigned char sendhmackey[32], recvhmackey[32];
+
+  /* protocol 5 */
+  unsigned char sendkey[CHACHAPOLY_KEYLEN], recvkey[CHACHAPOLY_KEYLEN];
+
+  u_int64_t sendseqno, recvseqno;
+} nbclient;
+
+typedef struct nbresult {
+  unsigned long lines;
+  uint64_t us;
+} nbresult;
+
+static int nblines, nbsize;
+static char *nbline;
+static unsigned long nbreceived, nbbad;
+
+static void nb_run(void *arg);
+
+void _init(void) {
+  nblines = getcopyconfigitemintpositive("nterfacer_bench", "lines", 100000);
+  nbsize = getcopyconfigitemintpositive("nterfacer_bench", "size", 200);
+
+  if((nblines <= 0) || (nbsize < 2) || (nbsize > MAX_ASCII_LINE_SIZE)) {
+    Error("nterfacer_bench", ERR_ERROR, "Bad lines/size, not running.");
+    return;
+  }
+
+  scheduleoneshot(time(NULL), &nb_run, NULL);
+}
+
+void _fini(void) {
+  deleteschedule(NULL, &nb_run, NULL);
+}
+
+static void nb_seqno(hmacsha256 *h, u_int64_t value) {
+  u_int64_t v = htonq(value);
+  hmacsha256_update(h, (unsigned char *)&v, 8);
+}
+
+/* as derive_key() in esockets.c, for the first key */
+static void nb_derive(unsigned char *out, unsigned char *rawkey, char *label) {
+  hmacsha256 hmac;
+
+  hmacsha256_init(&hmac, rawkey, 32);
+  nb_seqno(&hmac, 0);
+  hmacsha256_update(&hmac, (unsigned char *)label, strlen(label));
+  hmacsha256_final(&hmac, out);
+}
+
+static void nb_nonce(unsigned char *nonce, u_int64_t seqno) {
+  u_int64_t v = htonq(seqno);
+
+  memset(nonce, 0, CHACHAPOLY_NONCELEN - 8);
+  memcpy(nonce + CHACHAPOLY_NONCELEN - 8, &v, 8);
+}
+
+static int nb_padded(void) {
+  return (nbsize + 15) & ~15;
+}
+
+static int nb_setup(struct esocket *sock, nbclient *c, int aead) {
+  unsigned char serverkey[32], clientkey[32], serveriv[16], clientiv[16], key[32];
+
+  if(!get_entropy(serverkey, 32) || !get_entropy(clientkey, 32) || !get_entropy(serveriv, 16) || !get_entropy(clientiv, 16))
+    return 1;
+
+  memset(c, 0, sizeof(nbclient));
+  c->aead = aead;
+
+  if(aead) {
+    switch_buffer_mode_aead(sock, serverkey, clientkey);
+    memcpy(c->sendkey, sock->clientaeadkey, CHACHAPOLY_KEYLEN);
+    memcpy(c->recvkey, sock->serveraeadkey, CHACHAPOLY_KEYLEN);
+    c->framelen = AEAD_FRAME_LEN(nbsize);
+    return 0;
+  }
+
+  switch_buffer_mode(sock, serverkey, serveriv, clientkey, clientiv);
+
+  nb_derive(key, clientkey, ":CKEY");
+  c->encrypt = rijndaelcbc_init(key, 256, clientiv, 0);
+  memcpy(c->sendhmackey, sock->clienthmackey, 32);
+
+  nb_derive(key, serverkey, ":SKEY");
+  c->decrypt = rijndaelcbc_init(key, 256, serveriv, 1);
+  memcpy(c->recvhmackey, sock->serverhmackey, 32);
+
+  c->framelen = nb_padded() + USED_MAC_LEN;
+
+  return !c->encrypt || !c->decrypt;
+}
+
+static void nb_cleanup(nbclient *c) {
+  if(c->encrypt)
+    rijndaelcbc_free(c->encrypt);
+  if(c->decrypt)
+    rijndaelcbc_free(c->decrypt);
+}
+
+/* a request, as a protocol 4 or 5 client would send it */
+static void nb_encode(nbclient *c, unsigned char *out) {
+  unsigned char nonce[CHACHAPOLY_NONCELEN], digest[32], *p;
+  hmacsha256 hmac;
+  int i, len;
+
+  if(c->aead) {
+    out[0] = nbsize >> 8;
+    out[1] = nbsize & 0xff;
+    memcpy(out + AEAD_HEADER_LEN, nbline, nbsize);
+    nb_nonce(nonce, c->sendseqno++);
+    chachapoly_seal(c->sendkey, nonce, out, AEAD_HEADER_LEN, out + AEAD_HEADER_LEN, nbsize, out + AEAD_HEADER_LEN + nbsize);
+    return;
+  }
+
+  len = nb_padded();
+  memcpy(out, nbline, nbsize);
+  for(i=nbsize;i<len;i++)
+    out[i] = i - nbsize;
+
+  hmacsha256_init(&hmac, c->sendhmackey, 32);
+  nb_seqno(&hmac, c->sendseqno++);
+  for(p=out;p<out+len;p+=16) {
+    memcpy(p, rijndaelcbc_encrypt(c->encrypt, p), 16);
+    hmacsha256_update(&hmac, p, 16);
+  }
+  hmacsha256_final(&hmac, digest);
+  memcpy(out + len, digest, USED_MAC_LEN);
+}
+
+/* a response; returns nonzero if it doesn't verify or isn't our line */
+static int nb_decode(nbclient *c, unsigned char *frame) {
+  unsigned char nonce[CHACHAPOLY_NONCELEN], digest[32], *p;
+  hmacsha256 hmac;
+  int len;
+
+  if(c->aead) {
+    if(((frame[0] << 8) | frame[1]) != nbsize)
+      return 1;
+    nb_nonce(nonce, c->recvseqno++);
+    if(chachapoly_open(c->recvkey, nonce, frame, AEAD_HEADER_LEN, frame + AEAD_HEADER_LEN, nbsize, frame + AEAD_HEADER_LEN + nbsize))
+      return 1;
+    return memcmp(frame + AEAD_HEADER_LEN, nbline, nbsize) != 0;
+  }
+
+  len = nb_padded();
+  hmacsha256_init(&hmac, c->recvhmackey, 32);
+  nb_seqno(&hmac, c->recvseqno++);
+  hmacsha256_update(&hmac, frame, len);
+  hmacsha256_final(&hmac, digest);
+  if(memcmp(digest, frame + len, USED_MAC_LEN))
+    return 1;
+
+  for(p=frame;p<frame+len;p+=16)
+    memcpy(p, rijndaelcbc_decrypt(c->decrypt, p), 16);
+
+  return memcmp(frame, nbline, nbsize) != 0;
+}
+
+static int nb_line(struct esocket *sock, char *line) {
+  nbreceived++;
+  if((strlen(line) != (size_t)(nbsize - 1)) || memcmp(line, nbline, nbsize - 1))
+    nbbad++;
+
+  return 0;
+}
+
+static int nb_requests(struct esocket *sock, nbclient *c, unsigned char *buf, int batch, nbresult *r) {
+  int peer = *(int *)sock->tag, i, n, stalls;
+  unsigned long sent = 0, last;
+  uint64_t start;
+  ssize_t ret;
+
+  nbreceived = 0;
+  while(sent < nblines) {
+    n = (nblines - sent < batch) ? nblines - sent : batch;
+    for(i=0;i<n;i++)
+      nb_encode(c, buf + i * c->framelen);
+
+    ret = write(peer, buf, n * c->framelen);
+    if(ret != n * c->framelen)
+      return 1;
+    sent+=n;
+
+    start = metricclock();
+    for(stalls=0;nbreceived<sent;) {
+      last = nbreceived;
+      if(esocket_read(sock))
+        return 1;
+      if((nbreceived == last) && (++stalls > NB_MAXSTALLS))
+        return 1;
+    }
+    r->us+=metricclock() - start;
+  }
+
+  r->lines = sent;
+  return 0;
+}
+
+static int nb_responses(struct esocket *sock, nbclient *c, unsigned char *buf, int batch, nbresult *r) {
+  int peer = *(int *)sock->tag, i, n, got, want;
+  unsigned long sent = 0;
+  uint64_t start;
+  ssize_t ret;
+
+  while(sent < nblines) {
+    n = (nblines - sent < batch) ? nblines - sent : batch;
+
+    start = metricclock();
+    for(i=0;i<n;i++)
+      if(esocket_write(sock, nbline, nbsize))
+        return 2; /* esocket_write() has disconnected it */
+    r->us+=metricclock() - start;
+    sent+=n;
+
+    want = n * c->framelen;
+    for(got=0;got<want;) {
+      if(sock->out.size && esocket_raw_write(sock, NULL, 0))
+        return 1;
+
+      ret = read(peer, buf + got, want - got);
+      if(ret <= 0)
+        return 1;
+      got+=ret;
+    }
+
+    for(i=0;i<n;i++)
+      if(nb_decode(c, buf + i * c->framelen))
+        nbbad++;
+  }
+
+  r->lines = sent;
+  return 0;
+}
+
+static int nb_transport(int aead, nbresult *in, nbresult *out) {
+  struct esocket_events events;
+  struct esocket *sock;
+  unsigned char *buf;
+  nbclient c;
+  int fds[2], batch, ret = 1;
+
+  memset(&events, 0, sizeof(events));
+  events.on_line = nb_line;
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    Error("nterfacer_bench", ERR_ERROR, "Unable to create socketpair (%d).", errno);
+    return 1;
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+  sock = esocket_add(fds[0], ESOCKET_INCOMING, &events, esocket_token());
+  if(!sock) {
+    close(fds[0]);
+    close(fds[1]);
+    return 1;
+  }
+  sock->tag = &fds[1];
+
+  if(nb_setup(sock, &c, aead)) {
+    Error("nterfacer_bench", ERR_ERROR, "Unable to set up %s transport.", aead ? "AEAD" : "CBC");
+    nb_cleanup(&c);
+    esocket_disconnect(sock);
+    close(fds[1]);
+    return 1;
+  }
+
+  batch = NB_BATCHBYTES / c.framelen;
+  if(!batch)
+    batch = 1;
+
+  buf = malloc(batch * c.framelen);
+  if(buf) {
+    ret = nb_requests(sock, &c, buf, batch, in);
+    if(!ret)
+      ret = nb_responses(sock, &c, buf, batch, out);
+    free(buf);
+  }
+
+  nb_cleanup(&c);
+  if(ret != 2)
+    esocket_disconnect(sock);
+  close(fds[1]);
+
+  return ret;
+}
+
+static void nb_report(benchresults *br, char *bench, nbresult *r) {
+  double secs = r->us / 1000000.0;
+  char extra[64];
+
+  snprintf(extra, sizeof(extra), "size=%d MB_per_s=%.2f", nbsize, secs ? (double)r->lines * nbsize / secs / 1048576.0 : 0.0);
+  benchresult(br, bench, r->lines, r->us, extra);
+}
+
+static void nb_run(void *arg) {
+  nbresult cbcin, cbcout, aeadin, aeadout;
+  benchresults results;
+  int i;
+
+  nbline = malloc(nbsize);
+  if(!nbline)
+    return;
+
+  for(i=0;i<nbsize-1;i++)
+    nbline[i] = 'a' + i % 26;
+  nbline[nbsize - 1] = '\n';
+
+  memset(&cbcin, 0, sizeof(cbcin));
+  memset(&cbcout, 0, sizeof(cbcout));
+  memset(&aeadin, 0, sizeof(aeadin));
+  memset(&aeadout, 0, sizeof(aeadout));
+  nbbad = 0;
+
+  if(nb_transport(0, &cbcin, &cbcout) || nb_transport(1, &aeadin, &aeadout)) {
+    Error("nterfacer_bench", ERR_ERROR, "Benchmark failed.");
+  } else {
+    benchopen(&results, "nterfacer_bench");
+    nb_report(&results, "cbc_requests", &cbcin);
+    nb_report(&results, "cbc_responses", &cbcout);
+    nb_report(&results, "aead_requests", &aeadin);
+    nb_report(&results, "aead_responses", &aeadout);
+    benchclose(&results);
+
+    if(aeadin.us && aeadout.us)
+      Error("nterfacer_bench", ERR_INFO, "aead/cbc speedup: requests %.2fx, responses %.2fx, %lu bad lines.",
+        (double)cbcin.us / aeadin.us, (double)cbcout.us / aeadout.us, nbbad);
+  }
+
+  free(nbline);
+  nbline = NULL;
+}
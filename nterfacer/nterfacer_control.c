@@ -31,6 +31,7 @@ int handle_onchan(struct rline *li, int argc, char **argv);
 int handle_status(struct rline *li, int argc, char **argv);
 int handle_servicesonchan(struct rline *li, int argc, char **argv);
 int handle_counthost(struct rline *li, int argc, char **argv);
+int handle_chanusers(struct rline *li, int argc, char **argv);
 
 struct rline *grli; /* used inline for status */
 struct service_node *n_node;
@@ -50,6 +51,7 @@ void _init(void) {
   register_handler(n_node, "status", 0, handle_status);
   register_handler(n_node, "servicesonchan", 1, handle_servicesonchan);
   register_handler(n_node, "counthost", 1, handle_counthost);
+  register_handler(n_node, "chanusers", 1, handle_chanusers);
 }
 
 void _fini(void) {
@@ -207,7 +209,7 @@ int handle_counthost(struct rline *li, int argc, char **argv) {
   for(j=0;j<argc;j++)
     collapse(argv[j]);
 
-  for(i=0;i<HOSTHASHSIZE;i++)
+  for(i=0;i<hosttablesize;i++)
     for(hp=hosttable[i];hp;hp=hp->next)
       for(j=0;j<argc;j++)
         if(!match(argv[j], hp->name->content))
@@ -221,4 +223,59 @@ int handle_counthost(struct rline *li, int argc, char **argv) {
   return ri_final(li);
 }
 
+/* a snapshot of the numerics, so the channel can change while we wait on the client */
+struct chanusers {
+  int pos, count;
+  unsigned long numerics[];
+};
 
+static int chanusers_send(struct rline *li, struct chanusers *cu) {
+  nick *np;
+  int ret;
+
+  for(;cu->pos<cu->count;cu->pos++) {
+    np = getnickbynumeric(cu->numerics[cu->pos]);
+    if(!np)
+      continue;
+
+    ret = ri_append(li, "%s", np->nick);
+    if(ret == BF_BUSY) {
+      cu->pos++;
+      return RE_OK; /* chanusers_resume picks up from here */
+    }
+    if(ret == BF_CLOSED) {
+      ri_final(li);
+      return RE_SOCKET_ERROR;
+    }
+    if(ret != BF_OK)
+      return ri_error(li, BF_OVER, "Buffer overflow");
+  }
+
+  return ri_final(li);
+}
+
+static void chanusers_resume(struct rline *li, void *arg) {
+  chanusers_send(li, arg);
+}
+
+int handle_chanusers(struct rline *li, int argc, char **argv) {
+  struct chanusers *cu;
+  channel *cp = findchannel(argv[0]);
+  int i;
+
+  if(!cp)
+    return ri_error(li, ERR_TARGET_NOT_FOUND, "Channel not found");
+
+  cu = ntmalloc(sizeof(struct chanusers) + cp->users->totalusers * sizeof(unsigned long));
+  if(!cu)
+    return ri_error(li, ERR_UNKNOWN_ERROR, "Memory error");
+
+  cu->pos = cu->count = 0;
+  for(i=0;i<cp->users->hashsize;i++)
+    if(cp->users->content[i] != nouser)
+      cu->numerics[cu->count++] = cp->users->content[i];
+
+  ri_stream(li, chanusers_resume, cu);
+
+  return chanusers_send(li, cu);
+}
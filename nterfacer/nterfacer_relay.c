@@ -226,6 +226,7 @@ int relay_handler(struct rline *ri, int argc, char **argv) {
   MemCheckR(np, ri_error(ri, RELAY_MEMORY_ERROR, "Memory error"));
 
   np->rline = ri;
+  ri_stream(ri, NULL, NULL); /* can't pause IRC, but needn't buffer it all either */
   if(!lines) {
      np->termination.pcre.phrase = pcre_compile(argv[1], PCRE_FLAGS, &rerror, &erroroffset, NULL);
     if(!np->termination.pcre.phrase) {
@@ -309,6 +310,7 @@ int stats_handler(struct rline *ri, int argc, char **argv) {
   MemCheckR(np, ri_error(ri, RELAY_MEMORY_ERROR, "Memory error"));
 
   np->rline = ri;
+  ri_stream(ri, NULL, NULL);
   np->mode = MODE_STATS;
   np->dest = NULL;
 
@@ -35,7 +35,7 @@ void _init() {
     return;
   }
 
-  for (i=0;i<NICKHASHSIZE;i++)
+  for (i=0;i<nicktablesize;i++)
     for (np=nicktable[i];np;np=nnp) {
       nnp=np->next;
       addnicktonode(np->ipnode, np);
@@ -20,7 +20,7 @@ nick *patrol_selectuser(void) {
   nick *np;
 
   do {
-    for (j = patrol_minmaxrand(0, NICKHASHSIZE - 1); j < NICKHASHSIZE; j++)
+    for (j = patrol_minmaxrand(0, nicktablesize - 1); j < nicktablesize; j++)
       for (np = nicktable[j]; np; np = np->next)
         if (!--target)
           return np;
@@ -34,7 +34,7 @@ host *patrol_selecthost(void) {
   host *hp;
 
   do {
-    for (j = patrol_minmaxrand(0, HOSTHASHSIZE - 1); j < HOSTHASHSIZE; j++)
+    for (j = patrol_minmaxrand(0, hosttablesize - 1); j < hosttablesize; j++)
       for (hp = hosttable[j]; hp; hp = hp->next)
         if (!--target)
           return hp;
@@ -369,7 +369,7 @@ int patrol_generatepool(void) {
   char *p, *pp;
   nick *np;
 
-  for (i = 0; i < NICKHASHSIZE; i++)
+  for (i = 0; i < nicktablesize; i++)
     for (np = nicktable[i]; np; np = np->next)
       j++;
 
@@ -382,7 +382,7 @@ int patrol_generatepool(void) {
   i = 0;
 
   do {
-    for (j = patrol_minmaxrand(0, NICKHASHSIZE - 1); j < NICKHASHSIZE; j++) {
+    for (j = patrol_minmaxrand(0, nicktablesize - 1); j < nicktablesize; j++) {
       if (nicktable[j]) {
         for (p = nicktable[j]->host->name->content, pp = p; *p;) {
           if (*++p == '.') {
@@ -10,6 +10,7 @@
 #include "../core/events.h"
 #include "../core/hooks.h"
 #include "../core/nsmalloc.h"
+#include "../core/metrics.h"
 #include "../lib/irc_string.h"
 #include "../lib/version.h"
 #include "../lib/strlfunc.h"
@@ -22,6 +23,7 @@
 #include <sys/poll.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 
 MODULE_VERSION("");
 
@@ -47,11 +49,25 @@ typedef struct pqasyncquery_s {
   struct pqasyncquery_s *next;
 } pqasyncquery_s;
 
+/* Table loads stream the table with COPY and hand it to the data
+ * callback PQ_COPYBATCH rows at a time.  The rows are split in place in
+ * the buffers libpq gives us, so values point straight into them. */
+#define PQ_COPYLOAD  0x100
+#define PQ_COPYBATCH 1000
+
 typedef struct pqtableloaderinfo_s
 {
     sstring *tablename;
     PQQueryHandler init, data, fini;
     void *tag;
+
+    int started;
+    int fields;
+    int batchrows;
+    unsigned long totalrows;
+    uint64_t starttime;
+    char *rowbufs[PQ_COPYBATCH];
+    char **values;
 } pqtableloaderinfo_s;
 
 pqasyncquery_s *queryhead = NULL, *querytail = NULL;
@@ -60,20 +76,45 @@ static int dbconnected = 0;
 static PQModuleIdentifier moduleid = 0;
 static PGconn *dbconn;
 
+static unsigned long queuedepth;
+static uint64_t headsent;
+static metric *queuedepthmetric, *querymetric, *querylatencymetric, *copyrowsmetric;
+
+static int copyload;
+static PQResult *copyresult;  /* what pqgetresult() hands out during load callbacks */
+
 void dbhandler(int fd, short revents);
 void pqstartloadtable(PGconn *dbconn, void *arg);
+static int pqcopyrows(pqtableloaderinfo_s *tli);
+static void pqfreeloader(pqtableloaderinfo_s *tli);
 void dbstatus(int hooknum, void *arg);
 void disconnectdb(void);
 void connectdb(void);
 char* pqlasterror(PGconn * pgconn);
 
 void _init(void) {
+  sstring *copy;
+
+  queuedepthmetric=registermetric("pqsql_queue_depth", METRIC_GAUGE);
+  querymetric=registermetric("pqsql_queries", METRIC_COUNTER);
+  querylatencymetric=registermetric("pqsql_query_latency_us", METRIC_HISTOGRAM);
+  copyrowsmetric=registermetric("pqsql_copy_rows", METRIC_COUNTER);
+
+  copy=getcopyconfigitem("pqsql", "copyload", "1", 5);
+  copyload=atoi(copy->content);
+  freesstring(copy);
+
   connectdb();
 }
 
 void _fini(void) {
   disconnectdb();
 
+  deregistermetric(queuedepthmetric);
+  deregistermetric(querymetric);
+  deregistermetric(querylatencymetric);
+  deregistermetric(copyrowsmetric);
+
   nscheckfreeall(POOL_PQSQL);
 }
 
@@ -100,6 +141,7 @@ void pqfreeid(PQModuleIdentifier identifier) {
     if(q->identifier == identifier) {
       (q->handler)(NULL, q->tag);
       p->next = q->next;
+      metricset(queuedepthmetric, --queuedepth);
 
       if (q->query_ss) {
         freesstring(q->query_ss);
@@ -179,6 +221,10 @@ void dbhandler(int fd, short revents) {
 
   if(revents & POLLIN) {
     PQconsumeInput(dbconn);
+
+    /* Table loads stay at the head until the whole table has arrived */
+    if((queryhead->flags & PQ_COPYLOAD) && !pqcopyrows(queryhead->tag))
+      return;
     
     if(!PQisBusy(dbconn)) { /* query is complete */
       if(queryhead->handler && queryhead->identifier != QH_ALREADYFIRED)
@@ -207,6 +253,9 @@ void dbhandler(int fd, short revents) {
         PQclear(res);
       }
 
+      metricobserve(querylatencymetric, metricclock() - headsent);
+      metricset(queuedepthmetric, --queuedepth);
+
       /* Free the query and advance */
       qqp = queryhead;
       if(queryhead == querytail)
@@ -225,6 +274,7 @@ void dbhandler(int fd, short revents) {
       nsfree(POOL_PQSQL, qqp);
 
       if(queryhead) { /* Submit the next query */	      
+        headsent = metricclock();
         PQsendQuery(dbconn, queryhead->query);
         PQflush(dbconn);
       }
@@ -267,11 +317,15 @@ void pqasyncqueryf(int identifier, PQQueryHandler handler, void *tag, int flags,
   qp->flags = flags;
   qp->identifier = identifier;
 
+  metricinc(querymetric);
+  metricset(queuedepthmetric, ++queuedepth);
+
   if(querytail) {
     querytail->next = qp;
     querytail = qp;
   } else {
     querytail = queryhead = qp;
+    headsent = metricclock();
     PQsendQuery(dbconn, qp->query);
     PQflush(dbconn);
   }
@@ -282,12 +336,199 @@ void pqloadtable(char *tablename, PQQueryHandler init, PQQueryHandler data, PQQu
   pqtableloaderinfo_s *tli;
 
   tli=(pqtableloaderinfo_s *)nsmalloc(POOL_PQSQL, sizeof(pqtableloaderinfo_s));
+  memset(tli, 0, sizeof(pqtableloaderinfo_s));
   tli->tablename=getsstring(tablename, 100);
   tli->init=init;
   tli->data=data;
   tli->fini=fini;
   tli->tag=tag;
-  pqasyncquery(pqstartloadtable, tli, "SELECT COUNT(*) FROM %s", tli->tablename->content);
+
+  if(copyload) {
+    pqasyncqueryf(DB_NULLIDENTIFIER, NULL, tli, PQ_COPYLOAD, "COPY (SELECT * FROM %s) TO STDOUT", tli->tablename->content);
+  } else {
+    pqasyncquery(pqstartloadtable, tli, "SELECT COUNT(*) FROM %s", tli->tablename->content);
+  }
+}
+
+static void pqfreeloader(pqtableloaderinfo_s *tli) {
+  int i;
+
+  for(i=0;i<tli->batchrows;i++)
+    PQfreemem(tli->rowbufs[i]);
+
+  if(tli->values)
+    nsfree(POOL_PQSQL, tli->values);
+
+  freesstring(tli->tablename);
+  nsfree(POOL_PQSQL, tli);
+}
+
+/*
+ * Splits one row of COPY text output in place.  Returns the number of
+ * fields, or -1 if there are more than maxfields.  NULLs come back as ""
+ * like PQgetvalue() gives them.
+ */
+static int pqsplitcopyrow(char *line, int len, char **values, int maxfields) {
+  char *in=line, *end=line+len, *out, *field;
+  int n=0, isnull, v, digits;
+
+  if(len > 0 && end[-1] == '\n')
+    end--;
+
+  for(;;) {
+    field=out=in;
+    isnull=0;
+
+    while(in < end && *in != '\t') {
+      if(*in != '\\' || in + 1 == end) {
+        *out++=*in++;
+        continue;
+      }
+
+      in++;
+      switch(*in) {
+        case 'N': isnull=1; in++; break;
+        case 'b': *out++='\b'; in++; break;
+        case 'f': *out++='\f'; in++; break;
+        case 'n': *out++='\n'; in++; break;
+        case 'r': *out++='\r'; in++; break;
+        case 't': *out++='\t'; in++; break;
+        case 'v': *out++='\v'; in++; break;
+        case 'x':
+          for(in++,v=0,digits=0;digits < 2 && in < end && isxdigit((unsigned char)*in);in++,digits++)
+            v=v * 16 + (isdigit((unsigned char)*in) ? *in - '0' : (tolower((unsigned char)*in) - 'a' + 10));
+          *out++=v;
+          break;
+        case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+          for(v=0,digits=0;digits < 3 && in < end && *in >= '0' && *in <= '7';in++,digits++)
+            v=v * 8 + (*in - '0');
+          *out++=v;
+          break;
+        default:
+          *out++=*in++;
+          break;
+      }
+    }
+
+    *out='\0';
+
+    if(n == maxfields)
+      return -1;
+    values[n++]=isnull ? "" : field;
+
+    if(in == end)
+      return n;
+
+    in++;
+  }
+}
+
+/* Runs a load callback with pqgetresult() returning the given rows */
+static void pqcopycallback(PQQueryHandler handler, pqtableloaderinfo_s *tli, int rows, int ok) {
+  PQResult r;
+
+  if(!handler)
+    return;
+
+  r.result=NULL;
+  r.row=-1;
+  r.rows=rows;
+  r.fields=tli->fields;
+  r.ok=ok;
+  r.values=tli->values;
+
+  copyresult=&r;
+  handler(dbconn, tli->tag);
+  copyresult=NULL;
+}
+
+static void pqcopydeliver(pqtableloaderinfo_s *tli, int ok) {
+  int i;
+
+  if(tli->batchrows || !ok)
+    pqcopycallback(tli->data, tli, tli->batchrows, ok);
+
+  for(i=0;i<tli->batchrows;i++)
+    PQfreemem(tli->rowbufs[i]);
+
+  tli->totalrows+=tli->batchrows;
+  metricadd(copyrowsmetric, tli->batchrows);
+  tli->batchrows=0;
+}
+
+/*
+ * Takes whatever rows have arrived for the load at the head of the queue.
+ * Returns 1 once the COPY is over and the query can be retired.
+ */
+static int pqcopyrows(pqtableloaderinfo_s *tli) {
+  PGresult *res;
+  char *buf;
+  int len, i, n, ok;
+
+  if(!tli->started) {
+    if(PQisBusy(dbconn))
+      return 0;
+
+    res=PQgetResult(dbconn);
+    if(PQresultStatus(res) != PGRES_COPY_OUT) {
+      Error("pqsql", ERR_ERROR, "Error loading table %s: %s", tli->tablename->content, PQresultErrorMessage(res));
+      PQclear(res);
+      pqfreeloader(tli);
+      return 1;
+    }
+    PQclear(res);
+
+    tli->started=1;
+    tli->starttime=metricclock();
+    pqcopycallback(tli->init, tli, 0, 1);
+  }
+
+  while((len=PQgetCopyData(dbconn, &buf, 1)) > 0) {
+    if(!tli->values) {
+      /* First row tells us how wide the table is */
+      for(n=1,i=0;i<len;i++)
+        if(buf[i] == '\t')
+          n++;
+
+      tli->fields=n;
+      tli->values=(char **)nsmalloc(POOL_PQSQL, sizeof(char *) * n * PQ_COPYBATCH);
+      if(!tli->values)
+        Error("pqsql",ERR_STOP,"malloc() failed in pqsql.c");
+    }
+
+    tli->rowbufs[tli->batchrows]=buf;
+    if(pqsplitcopyrow(buf, len, &tli->values[tli->batchrows * tli->fields], tli->fields) != tli->fields) {
+      Error("pqsql", ERR_WARNING, "Skipping malformed row while loading %s.", tli->tablename->content);
+      PQfreemem(buf);
+      continue;
+    }
+
+    if(++tli->batchrows == PQ_COPYBATCH)
+      pqcopydeliver(tli, 1);
+  }
+
+  if(len == 0)
+    return 0; /* more to come */
+
+  ok=0;
+  if(len == -1) {
+    res=PQgetResult(dbconn);
+    ok=(PQresultStatus(res) == PGRES_COMMAND_OK);
+    if(!ok)
+      Error("pqsql", ERR_ERROR, "Error loading table %s: %s", tli->tablename->content, PQresultErrorMessage(res));
+    PQclear(res);
+  } else {
+    Error("pqsql", ERR_ERROR, "Error loading table %s: %s", tli->tablename->content, pqlasterror(dbconn));
+  }
+
+  pqcopydeliver(tli, ok);
+  pqcopycallback(tli->fini, tli, 0, ok);
+
+  Error("pqsql", ERR_INFO, "Loaded %lu rows from %s in %.2fs.", tli->totalrows, tli->tablename->content,
+        (metricclock() - tli->starttime) / 1000000.0);
+
+  pqfreeloader(tli);
+  return 1;
 }
 
 void pqstartloadtable(PGconn *dbconn, void *arg)
@@ -341,6 +582,8 @@ void disconnectdb(void) {
   /* Throw all the queued queries away, beware of data malloc()ed inside the query item.. */
   while(qqp) {
     nqqp = qqp->next;
+    if (qqp->flags & PQ_COPYLOAD)
+      pqfreeloader(qqp->tag);
     if (qqp->query_ss) {
       freesstring(qqp->query_ss);
       qqp->query_ss=NULL;
@@ -353,6 +596,10 @@ void disconnectdb(void) {
     qqp = nqqp;
   }
 
+  queryhead = querytail = NULL;
+  queuedepth = 0;
+  metricset(queuedepthmetric, 0);
+
   deregisterhook(HOOK_CORE_STATSREQUEST, dbstatus);
   PQfinish(dbconn);
   dbconn = NULL; /* hmm? */
@@ -401,7 +648,16 @@ PQResult *pqgetresult(PGconn *c) {
     return NULL;
 
   r = (PQResult *)nsmalloc(POOL_PQSQL, sizeof(PQResult));
+
+  if(copyresult) {
+    *r = *copyresult;
+    return r;
+  }
+
   r->row = -1;
+  r->fields = 0;
+  r->ok = 0;
+  r->values = NULL;
   r->result = PQgetResult(c);
   r->rows = PQntuples(r->result);
 
@@ -418,6 +674,9 @@ int pqfetchrow(PQResult *res) {
 }
 
 char *pqgetvalue(PQResult *res, int column) {
+  if(!res->result)
+    return (column < res->fields) ? res->values[res->row * res->fields + column] : NULL;
+
   return PQgetvalue(res->result, res->row, column);
 }
 
@@ -11,6 +11,11 @@ typedef struct PQResult {
   PGresult *result;
   int row;
   int rows;
+
+  /* Rows streamed by a table load have no PGresult behind them */
+  int fields;
+  int ok;
+  char **values;
 } PQResult;
 
 typedef int PQModuleIdentifier;
@@ -29,7 +34,8 @@ int pqconnected(void);
 PQModuleIdentifier pqgetid(void);
 void pqfreeid(PQModuleIdentifier identifier);
 
-#define pqquerysuccessful(x) (x && (PQresultStatus(x->result) == PGRES_TUPLES_OK))
+#define pqquerysuccessful(x) (x && (x->result ? PQresultStatus(x->result) == PGRES_TUPLES_OK : x->ok))
+#define pqnumfields(x) ((x)->result ? PQnfields((x)->result) : (x)->fields)
 
 PQResult *pqgetresult(PGconn *c);
 int pqfetchrow(PQResult *res);
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/resource.h>
 #include "../nick/nick.h"
 #include "../core/hooks.h"
 #include "../lib/sstring.h"
@@ -27,13 +28,12 @@
 #include "../channel/channel.h"
 #include "../localuser/localuserchannel.h"
 #include "../core/nsmalloc.h"
+#include "../core/metrics.h"
 #include "../lib/irc_ipv6.h"
 #include "../glines/glines.h"
 
 MODULE_VERSION("")
 
-#define SCANTIMEOUT      60
-
 #define SCANHOSTHASHSIZE 1000
 #define SCANHASHSIZE     400
 
@@ -47,11 +47,26 @@ CommandTree *ps_commands;
 static int listenfdv4 = -1, listenfdv6 = -1;
 int activescans;
 int maxscans;
+int scanlimit;
+int prefixscans;
 int queuedhosts;
 int scansdone;
 int rescaninterval;
 int warningsent;
 int glinedhosts;
+
+static metric *activescansmetric, *scansdonemetric, *scanlimitmetric, *connectlatencymetric;
+
+/* Pending timeouts, a slot per second; scans expire at most SCANTIMEOUT out */
+static scan *scanwheel[PSCAN_WHEELSIZE];
+static time_t wheelpos;
+
+/* Time to first socket event, EWMA and a slowly rising floor (usec) */
+static uint64_t connectlatency, connectbaseline;
+static time_t lastlimitcut;
+static int fdbudget;
+
+void (*ps_benchhook)(patricia_node_t *node, int type, unsigned short port, int outcome);
 time_t ps_starttime;
 int ps_cache_ext;
 int ps_extscan_ext;
@@ -88,7 +103,7 @@ FILE *ps_logfile;
 
 /* Local functions */
 void handlescansock(int fd, short events);
-void timeoutscansock(void *arg);
+void scanwheeltick(void *arg);
 void proxyscan_newnick(int hooknum, void *arg);
 void proxyscan_lostnick(int hooknum, void *arg);
 void proxyscan_onconnect(int hooknum, void *arg);
@@ -252,10 +267,18 @@ void _init(void) {
   }
 
   memset(scantable,0,sizeof(scantable));
+  memset(scanwheel,0,sizeof(scanwheel));
+  wheelpos=time(NULL);
+  connectlatency=connectbaseline=0;
+  lastlimitcut=0;
   maxscans=200;
   activescans=0;
   queuedhosts=0;
   scansdone=0;
+  activescansmetric=registermetric("proxyscan_active_scans", METRIC_GAUGE);
+  scansdonemetric=registermetric("proxyscan_scans_done", METRIC_COUNTER);
+  scanlimitmetric=registermetric("proxyscan_scan_limit", METRIC_GAUGE);
+  connectlatencymetric=registermetric("proxyscan_connect_latency_us", METRIC_HISTOGRAM);
   warningsent=0;
   ps_starttime=time(NULL);
   glinedhosts=0;
@@ -273,6 +296,33 @@ void _init(void) {
   maxscans=strtol(cfgstr->content,NULL,10);
   freesstring(cfgstr);
 
+  /* ... of which at most this many against one /24 or /64 */
+  cfgstr=getcopyconfigitem("proxyscan","prefixscans","64",10);
+  prefixscans=strtol(cfgstr->content,NULL,10);
+  if (prefixscans<1)
+    prefixscans=1;
+  freesstring(cfgstr);
+
+  {
+    struct rlimit rl;
+
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur!=RLIM_INFINITY)
+      fdbudget=(rl.rlim_cur > PSCAN_FDRESERVE + PSCAN_MINSCANS) ? rl.rlim_cur - PSCAN_FDRESERVE : PSCAN_MINSCANS;
+    else
+      fdbudget=maxscans;
+
+    if (fdbudget < maxscans)
+      Error("proxyscan",ERR_WARNING,"Only %d descriptors available, limiting to %d concurrent scans (maxscans %d).",(int)rl.rlim_cur,fdbudget,maxscans);
+  }
+
+  /* Start low and let the latency feedback open it up */
+  scanlimit=P_MAX(PSCAN_MINSCANS, maxscans/4);
+  if (scanlimit>maxscans)
+    scanlimit=maxscans;
+  if (scanlimit>fdbudget)
+    scanlimit=fdbudget;
+  metricset(scanlimitmetric, scanlimit);
+
   /* Clean host timeout */
   cfgstr=getcopyconfigitem("proxyscan","rescaninterval","3600",7);
   rescaninterval=strtol(cfgstr->content,NULL,10);
@@ -396,6 +446,8 @@ void _init(void) {
 
   /* Schedule saves */
   schedulerecurring(time(NULL)+3600,0,3600,&dumpcachehosts,NULL);
+
+  schedulerecurring(time(NULL)+1,0,1,&scanwheeltick,NULL);
  
   ps_logfile=fopen("logs/proxyscan.log","a");
 
@@ -450,6 +502,7 @@ void _fini(void) {
   deregisterhook(HOOK_CORE_STATSREQUEST,&proxyscanstats);
 
   deleteschedule(NULL,&dumpcachehosts,NULL);
+  deleteschedule(NULL,&scanwheeltick,NULL);
  
   destroycommandtree(ps_commands);
  
@@ -458,6 +511,12 @@ void _fini(void) {
 
   /* Dump the database - AFTER killallscans() which prunes it */
   dumpcachehosts(NULL);
+  cachehostfini();
+
+  deregistermetric(activescansmetric);
+  deregistermetric(scansdonemetric);
+  deregistermetric(scanlimitmetric);
+  deregistermetric(connectlatencymetric);
 
   /* dump any cached hosts before deleting the extensions */
   releasenodeext(ps_cache_ext);
@@ -530,6 +589,7 @@ void addscantohash(scan *sp) {
   scantable[hash]=sp;
   
   activescans++;
+  metricset(activescansmetric, activescans);
 }
 
 void delscanfromhash(scan *sp) {
@@ -546,6 +606,7 @@ void delscanfromhash(scan *sp) {
   } 
   
   activescans--;
+  metricset(activescansmetric, activescans);
 }
 
 scan *findscan(int fd) {
@@ -561,6 +622,86 @@ scan *findscan(int fd) {
   return NULL;
 }
 
+static void wheeladd(scan *sp, time_t expires) {
+  scan **slot=&scanwheel[expires&(PSCAN_WHEELSIZE-1)];
+
+  sp->expires=expires;
+  sp->wheelprev=NULL;
+  sp->wheelnext=*slot;
+  if (*slot)
+    (*slot)->wheelprev=sp;
+  *slot=sp;
+}
+
+static void wheeldel(scan *sp) {
+  if (!sp->expires)
+    return;
+
+  if (sp->wheelprev)
+    sp->wheelprev->wheelnext=sp->wheelnext;
+  else
+    scanwheel[sp->expires&(PSCAN_WHEELSIZE-1)]=sp->wheelnext;
+  if (sp->wheelnext)
+    sp->wheelnext->wheelprev=sp->wheelprev;
+
+  sp->expires=0;
+}
+
+/*
+ * Additive increase while the queue is backed up and connects come back
+ * about as fast as they ever do, cut by a quarter when they slow to more
+ * than twice the floor.  Never above maxscans or the descriptor budget.
+ */
+static void adjustscanlimit(time_t now) {
+  int ceiling=(fdbudget < maxscans) ? fdbudget : maxscans;
+  int floor=(PSCAN_MINSCANS < ceiling) ? PSCAN_MINSCANS : ceiling;
+
+  if (connectlatency) {
+    if (!connectbaseline || connectlatency < connectbaseline)
+      connectbaseline=connectlatency;
+    else
+      connectbaseline+=(connectlatency-connectbaseline)/256;
+  }
+
+  if (connectlatency && connectlatency > 2*connectbaseline + 20000) {
+    if (now >= lastlimitcut + 5) {
+      scanlimit-=scanlimit/4;
+      lastlimitcut=now;
+    }
+  } else if ((normalqueuedscans || (prioqueuedscans && activescans)) && activescans + PSCAN_CONNECTBATCH >= scanlimit) {
+    scanlimit+=PSCAN_LIMITSTEP;
+  }
+
+  if (scanlimit>ceiling)
+    scanlimit=ceiling;
+  if (scanlimit<floor)
+    scanlimit=floor;
+
+  metricset(scanlimitmetric, scanlimit);
+}
+
+void scanwheeltick(void *arg) {
+  time_t now=time(NULL);
+  scan *sp, *nsp;
+
+  /* Clock went backwards, or we fell a whole revolution behind */
+  if (wheelpos > now + 1 || wheelpos + PSCAN_WHEELSIZE <= now)
+    wheelpos=now-PSCAN_WHEELSIZE+1;
+
+  for (;wheelpos<=now;wheelpos++) {
+    for (sp=scanwheel[wheelpos&(PSCAN_WHEELSIZE-1)];sp;sp=nsp) {
+      nsp=sp->wheelnext;
+      if (sp->expires<=now)
+        killsock(sp, SOUTCOME_CLOSED);
+    }
+  }
+
+  adjustscanlimit(now);
+  startqueuedscans();
+
+  expirecachehosts();
+}
+
 void startscan(patricia_node_t *node, int type, int port, int class) {
   scan *sp;
   float scantmp;
@@ -590,29 +731,37 @@ void startscan(patricia_node_t *node, int type, int port, int class) {
   sp->class=class;
   sp->bytesread=0;
   sp->totalbytesread=0;
+  sp->expires=0;
+  sp->prefix=findscanprefix(node);
   memset(sp->readbuf, '\0', PSCAN_READBUFSIZE);
 
+  sp->started=metricclock();
   sp->fd=createconnectsocket(&((patricia_node_t *)sp->node)->prefix->sin,sp->port);
   sp->state=SSTATE_CONNECTING;
   if (sp->fd<0) {
+    /* Out of descriptors: that's our budget from now on */
+    if ((errno==EMFILE || errno==ENFILE) && activescans < fdbudget) {
+      fdbudget=P_MAX(activescans, PSCAN_MINSCANS);
+      scanlimit=fdbudget;
+      metricset(scanlimitmetric, scanlimit);
+      Error("proxyscan",ERR_WARNING,"Ran out of descriptors, limiting to %d concurrent scans.",fdbudget);
+    }
     /* Couldn't set up the socket? */
+    putscanprefix(sp->prefix);
+    if (class==SCLASS_BENCH && ps_benchhook)
+      ps_benchhook(sp->node, type, port, SOUTCOME_INPROGRESS);
     derefnode(iptree,sp->node);
     freescan(sp);
     return;
   }
+  sp->prefix->active++;
   /* Wait until it is writeable */
   registerhandler(sp->fd,POLLERR|POLLHUP|POLLOUT,&handlescansock);
   /* And set a timeout */
-  sp->sch=scheduleoneshot(time(NULL)+SCANTIMEOUT,&timeoutscansock,(void *)sp);
+  wheeladd(sp, time(NULL)+SCANTIMEOUT);
   addscantohash(sp);
 }
 
-void timeoutscansock(void *arg) {
-  scan *sp=(scan *)arg;
-
-  killsock(sp, SOUTCOME_CLOSED);
-}
-
 void killsock(scan *sp, int outcome) {
   int i;
   cachehost *chp;
@@ -621,15 +770,29 @@ void killsock(scan *sp, int outcome) {
   char reason[200];
 
   scansdone++;
+  metricinc(scansdonemetric);
   scansbyclass[sp->class]++;
 
-  /* Remove the socket from the schedule/event lists */
+  /* Remove the socket from the wheel/event lists */
   deregisterhandler(sp->fd,1);  /* this will close the fd for us */
-  deleteschedule(sp->sch,&timeoutscansock,(void *)sp);
+  wheeldel(sp);
 
   sp->outcome=outcome;
   delscanfromhash(sp);
 
+  sp->prefix->active--;
+  putscanprefix(sp->prefix);
+
+  if (sp->class==SCLASS_BENCH) {
+    if (ps_benchhook)
+      ps_benchhook(sp->node, sp->type, sp->port, outcome);
+    derefnode(iptree,sp->node);
+    freescan(sp);
+    if (scanlimit - activescans >= PSCAN_CONNECTBATCH)
+      startqueuedscans();
+    return;
+  }
+
   /* See if we need to queue another scan.. */
   if (sp->outcome==SOUTCOME_CLOSED &&
       ((sp->class==SCLASS_CHECK) ||
@@ -646,11 +809,7 @@ void killsock(scan *sp, int outcome) {
     hitsbyclass[sp->class]++;
   
     /* Lets try and get the cache record.  If there isn't one, make a new one. */
-    if (!(chp=findcachehost(sp->node))) {
-      chp=addcleanhost(time(NULL));
-      patricia_ref_prefix(sp->node->prefix);
-      sp->node->exts[ps_cache_ext] = chp;
-    }
+    chp=adddirtyhost(sp->node);
     /* Stick it on the cache's list of proxies, if necessary */
     for (fpp=chp->proxies;fpp;fpp=fpp->next)
       if (fpp->type==sp->type && fpp->port==sp->port)
@@ -685,6 +844,8 @@ void killsock(scan *sp, int outcome) {
       loggline(chp, sp->node);  /* Update log only */
     }
 
+    savecachehost(sp->node);
+
     /* Update counter */
     for(i=0;i<numscans;i++) {
       if (thescans[i].type==sp->type && thescans[i].port==sp->port) {
@@ -698,8 +859,9 @@ void killsock(scan *sp, int outcome) {
   derefnode(iptree,sp->node);
   freescan(sp);
 
-  /* kick the queue.. */
-  startqueuedscans();
+  /* kick the queue once there's a batch worth of room, the wheel picks up the rest */
+  if (scanlimit - activescans >= PSCAN_CONNECTBATCH)
+    startqueuedscans();
 }
 
 void handlescansock(int fd, short events) {
@@ -716,7 +878,14 @@ void handlescansock(int fd, short events) {
   }
 
   /* It woke up, delete the alarm call.. */
-  deleteschedule(sp->sch,&timeoutscansock,(void *)sp);
+  wheeldel(sp);
+
+  if (sp->state==SSTATE_CONNECTING) {
+    uint64_t elapsed=metricclock()-sp->started;
+
+    metricobserve(connectlatencymetric, elapsed);
+    connectlatency=connectlatency ? connectlatency - connectlatency/8 + elapsed/8 : elapsed;
+  }
 
   if (events & (POLLERR|POLLHUP)) {
     /* Some kind of error; give up on this socket */
@@ -743,7 +912,7 @@ void handlescansock(int fd, short events) {
     deregisterhandler(fd,0);
     /* Set the new one */
     registerhandler(fd,POLLERR|POLLHUP|POLLIN,&handlescansock);
-    sp->sch=scheduleoneshot(time(NULL)+SCANTIMEOUT,&timeoutscansock,(void *)sp);
+    wheeladd(sp, time(NULL)+SCANTIMEOUT);
     /* Update state */
     sp->state=SSTATE_SENTREQUEST;
 
@@ -956,7 +1125,7 @@ void handlescansock(int fd, short events) {
     }
     
     /* No magic string yet, we schedule another timeout in case it comes later. */
-    sp->sch=scheduleoneshot(time(NULL)+SCANTIMEOUT,&timeoutscansock,(void *)sp);
+    wheeladd(sp, time(NULL)+SCANTIMEOUT);
     return;    
   }
 }
@@ -964,20 +1133,16 @@ void handlescansock(int fd, short events) {
 void killallscans() {
   int i;
   scan *sp;
-  cachehost *chp;
   
   for(i=0;i<SCANHASHSIZE;i++) {
     for(sp=scantable[i];sp;sp=sp->next) {
       /* If there is a pending scan, delete it's clean host record.. */
-      if ((chp=findcachehost(sp->node)) && !chp->proxies) {
-        sp->node->exts[ps_cache_ext] = NULL;
-        derefnode(iptree,sp->node); 
-        delcachehost(chp);
-      }
+      if (iscleanhost(sp->node))
+        delcachehost(sp->node);
         
       if (sp->fd!=-1) {
 	deregisterhandler(sp->fd,1);
-	deleteschedule(sp->sch,&timeoutscansock,(void *)(sp));
+	wheeldel(sp);
       }
     }
   }
@@ -989,6 +1154,11 @@ void proxyscanstats(int hooknum, void *arg) {
   sprintf(buf, "Proxyscn: %6d/%4d scans complete/in progress.  %d hosts queued.",
 	  scansdone,activescans,queuedhosts);
   triggerhook(HOOK_CORE_STATSREPLY,buf);
+  if ((long)arg > 10) {
+    sprintf(buf, "Proxyscn: %6d/%4d scan limit/max, %u prefixes tracked, connect latency %lums (floor %lums)",
+            scanlimit,maxscans,scanprefixcount(),(unsigned long)(connectlatency/1000),(unsigned long)(connectbaseline/1000));
+    triggerhook(HOOK_CORE_STATSREPLY,buf);
+  }
   sprintf(buf, "Proxyscn: %6u known clean hosts",cleancount());
   triggerhook(HOOK_CORE_STATSREPLY,buf);  
 }
@@ -1029,7 +1199,9 @@ int proxyscandostatus(void *sender, int cargc, char **cargv) {
   sendnoticetouser(proxyscannick,np,"pendingscan structures: %lu x %lu bytes = %lu bytes total",countpendingscan,
 	sizeof(pendingscan), (countpendingscan * sizeof(pendingscan)));
 
-  sendnoticetouser(proxyscannick,np,"Currently active scans: %d/%d",activescans,maxscans);
+  sendnoticetouser(proxyscannick,np,"Currently active scans: %d/%d (max %d, %d per prefix)",activescans,scanlimit,maxscans,prefixscans);
+  sendnoticetouser(proxyscannick,np,"Connect latency:        %lums (floor %lums)",(unsigned long)(connectlatency/1000),(unsigned long)(connectbaseline/1000));
+  sendnoticetouser(proxyscannick,np,"Prefixes tracked:       %u",scanprefixcount());
   sendnoticetouser(proxyscannick,np,"Processing speed:       %lu scans per minute",scanspermin);
   sendnoticetouser(proxyscannick,np,"Normal queued scans:    %d",normalqueuedscans);
   sendnoticetouser(proxyscannick,np,"Timed queued scans:     %d",prioqueuedscans);
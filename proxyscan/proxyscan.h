@@ -54,6 +54,21 @@
 #define SCLASS_PASS2        2
 #define SCLASS_PASS3        3
 #define SCLASS_PASS4        4
+#define SCLASS_BENCH        5   /* loopback harness: never cached, glined or rescanned */
+
+/* Connect/read timeout and the timer wheel that enforces it, one slot per second */
+#define SCANTIMEOUT         60
+#define PSCAN_WHEELSIZE     64  /* power of two, > SCANTIMEOUT */
+
+/* Adaptive concurrency: scanlimit moves between these and maxscans */
+#define PSCAN_MINSCANS      20
+#define PSCAN_LIMITSTEP     10
+#define PSCAN_FDRESERVE     256 /* descriptors left for everything else */
+
+/* Completions only refill the queue once this many slots are free */
+#define PSCAN_CONNECTBATCH  16
+
+#define PSCAN_PREFIXHASHSIZE 4096
 
 typedef struct scantype {
   int type;
@@ -68,6 +83,17 @@ typedef struct extrascan {
   struct extrascan *nextbynode;
 } extrascan;
 
+/* Scans in flight and queued per /24 (IPv4) or /64 (IPv6) */
+typedef struct scanprefix {
+  struct irc_in_addr addr;
+  unsigned int active;
+  unsigned int queued;
+  struct pendingscan *queue, *queueend;
+  unsigned char inrr;
+  struct scanprefix *next;
+  struct scanprefix *nextrr;
+} scanprefix;
+
 typedef struct pendingscan {
   patricia_node_t *node; 
   unsigned short port;
@@ -83,17 +109,16 @@ typedef struct foundproxy {
   struct foundproxy *next;
 } foundproxy;
 
+/* Only hosts with proxies get one of these, clean ones live in the node ext */
 typedef struct cachehost {
   time_t lastscan;
   foundproxy *proxies;
   int glineid;
   time_t lastgline;
-  unsigned char marker;
 #if defined(PROXYSCAN_MAIL)
   sstring *lasthostmask; /* Not saved to disk */
   time_t lastconnect;    /* Not saved to disk */
 #endif
-  struct cachehost *next; 
 } cachehost;
 
 typedef struct scan {
@@ -105,7 +130,10 @@ typedef struct scan {
   unsigned short outcome;
   unsigned short class;
   struct scan *next;
-  void *sch;
+  scanprefix *prefix;
+  time_t expires;                 /* 0 when not on the wheel */
+  struct scan *wheelnext, *wheelprev;
+  uint64_t started;               /* metricclock() */
   char readbuf[PSCAN_READBUFSIZE];
   int bytesread;
   int totalbytesread;
@@ -120,6 +148,8 @@ extern int psm_mailerfd;
 
 extern int activescans;
 extern int maxscans;
+extern int scanlimit;
+extern int prefixscans;
 extern int numscans;
 extern scantype thescans[];
 extern int brokendb;
@@ -141,15 +171,26 @@ extern unsigned long countpendingscan;
 
 extern unsigned long scanspermin;
 
+/*
+ * Set by the loopback harness, told about every SCLASS_BENCH completion.
+ * Scans which couldn't be started at all come back as SOUTCOME_INPROGRESS.
+ */
+extern void (*ps_benchhook)(patricia_node_t *node, int type, unsigned short port, int outcome);
+
 /* proxyscancache.c */
-cachehost *addcleanhost(time_t timestamp);
-cachehost *findcachehost(patricia_node_t *node);
-void delcachehost(cachehost *);
+void addcleanhost(patricia_node_t *node, time_t timestamp);
+cachehost *adddirtyhost(patricia_node_t *node);
+int iscleanhost(patricia_node_t *node);
+cachehost *finddirtyhost(patricia_node_t *node);
+void delcachehost(patricia_node_t *node);
+void savecachehost(patricia_node_t *node);
+void expirecachehosts(void);
 void dumpcachehosts();
 void loadcachehosts();
 unsigned int cleancount();
 unsigned int dirtycount();
 void cachehostinit(time_t ri);
+void cachehostfini();
 void scanall(int type, int port);
 
 /* proxyscanalloc.c */
@@ -163,6 +204,8 @@ pendingscan *getpendingscan();
 void freependingscan(pendingscan *psp);
 extrascan *getextrascan();
 void freeextrascan(extrascan *esp);
+scanprefix *getscanprefix();
+void freescanprefix(scanprefix *spp);
 
 /* proxyscanlisten.c */
 int openlistensocket(int portnum);
@@ -188,6 +231,9 @@ void ps_makereportmail(scanhost *shp);
 /* proxyscanqueue.c */
 void queuescan(patricia_node_t *node, short scantype, unsigned short port, char class, time_t when);
 void startqueuedscans();
+scanprefix *findscanprefix(patricia_node_t *node);
+void putscanprefix(scanprefix *spp);
+unsigned int scanprefixcount();
 
 /* proxyscan.c */
 void startscan(patricia_node_t *node, int type, int port, int class);
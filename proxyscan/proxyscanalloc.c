@@ -43,3 +43,11 @@ void freeextrascan(extrascan *esp) {
   nsfree(POOL_PROXYSCAN, esp);
 }
 
+scanprefix *getscanprefix() {
+  return nsmalloc(POOL_PROXYSCAN, sizeof(scanprefix));
+}
+
+void freescanprefix(scanprefix *spp) {
+  nsfree(POOL_PROXYSCAN, spp);
+}
+
@@ -0,0 +1,322 @@
+/*
+ * proxyscanbench: loopback harness for the proxyscan engine.
+ *
+ * Starts fake SOCKS4/5, HTTP CONNECT and wingate responders on 127.0.0.1,
+ * some of which behave like open proxies and some of which refuse, then
+ * queues scans against them through the normal proxyscan queue and reports
+ * throughput and whether each scan came back with the expected outcome.
+ *
+ * Scans are queued as SCLASS_BENCH so they are never cached, glined or
+ * rescanned.
+ */
+
+#define _GNU_SOURCE
+
+#include "proxyscan.h"
+#include "../core/error.h"
+#include "../core/events.h"
+#include "../core/metrics.h"
+#include "../control/control.h"
+#include "../lib/irc_string.h"
+#include "../lib/version.h"
+#include "../lib/benchmark.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+MODULE_VERSION("")
+
+#define PSB_MAXFD       65536
+#define PSB_DEFAULTRUNS 1000
+#define PSB_MAXRUNS     100000
+
+typedef struct psbresponder {
+  const char *name;
+  int scantype;
+  int open;             /* expected outcome */
+  const char *reply;
+  size_t replylen;
+  int fd;
+  unsigned short port;
+  unsigned int runs, wrong, failed;
+} psbresponder;
+
+#define R(x) x, sizeof(x)-1
+
+static psbresponder responders[] = {
+  { "socks4",        STYPE_SOCKS4,    1, R("\x00\x5a\x00\x00\x00\x00\x00\x00" MAGICSTRING) },
+  { "socks4-reject", STYPE_SOCKS4,    0, R("\x00\x5b\x00\x00\x00\x00\x00\x00") },
+  { "socks5",        STYPE_SOCKS5_V4, 1, R("\x05\x00" "\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00" MAGICSTRING) },
+  { "socks5-reject", STYPE_SOCKS5_V4, 0, R("\x05\xff") },
+  { "http",          STYPE_HTTP_V4,   1, R("HTTP/1.0 200 Connection established\r\n\r\n" MAGICSTRING) },
+  { "http-forbid",   STYPE_HTTP_V4,   0, R("HTTP/1.0 403 Forbidden\r\n\r\n") },
+  { "wingate",       STYPE_WINGATE,   1, R("WinGate>Connecting to host...Connected\r\n" MAGICSTRING) },
+  { "wingate-fail",  STYPE_WINGATE,   0, R("WinGate>Host unreachable\r\n") },
+};
+
+#undef R
+
+#define PSB_RESPONDERS (sizeof(responders)/sizeof(psbresponder))
+
+/* responder index + 1 for each accepted connection, 0 if not ours */
+static unsigned char connkind[PSB_MAXFD];
+
+static patricia_node_t *benchnode;
+static long benchsender;
+static unsigned int benchtotal, benchdone;
+static uint64_t benchstart;
+
+static int psb_bench(void *sender, int cargc, char **cargv);
+static void psb_handleconn(int fd, short events);
+static void psb_drain(int fd, short events);
+static void psb_handlelisten(int fd, short events);
+static void psb_complete(patricia_node_t *node, int type, unsigned short port, int outcome);
+
+void _init(void) {
+  registercontrolhelpcmd("proxyscanbench", NO_DEVELOPER, 1, &psb_bench,
+    "Usage: proxyscanbench [count]\nScans fake proxies on 127.0.0.1 through the proxyscan queue and reports scans/s and detection errors.");
+}
+
+static void psb_stop(void) {
+  unsigned int i;
+  int fd;
+
+  for (fd=0;fd<PSB_MAXFD;fd++) {
+    if (connkind[fd]) {
+      deregisterhandler(fd, 1);
+      connkind[fd]=0;
+    }
+  }
+
+  for (i=0;i<PSB_RESPONDERS;i++) {
+    if (responders[i].fd!=-1) {
+      deregisterhandler(responders[i].fd, 1);
+      responders[i].fd=-1;
+    }
+  }
+
+  if (benchnode) {
+    derefnode(iptree, benchnode);
+    benchnode=NULL;
+  }
+
+  ps_benchhook=NULL;
+}
+
+void _fini(void) {
+  if (benchnode)
+    psb_stop();
+
+  deregistercontrolcmd("proxyscanbench", &psb_bench);
+}
+
+static int psb_listen(psbresponder *rp) {
+  struct sockaddr_in sin;
+  socklen_t len=sizeof(sin);
+  int fd;
+
+  if ((fd=socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0))<0)
+    return -1;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family=AF_INET;
+  sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+
+  if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(fd, 500) ||
+      getsockname(fd, (struct sockaddr *)&sin, &len)) {
+    close(fd);
+    return -1;
+  }
+
+  rp->fd=fd;
+  rp->port=ntohs(sin.sin_port);
+  registerhandler(fd, POLLIN, &psb_handlelisten);
+
+  return 0;
+}
+
+static int psb_bench(void *sender, int cargc, char **cargv) {
+  nick *np=(nick *)sender;
+  struct irc_in_addr sin;
+  unsigned char bits;
+  unsigned int i, runs=PSB_DEFAULTRUNS;
+
+  if (cargc>0)
+    runs=strtoul(cargv[0], NULL, 10);
+
+  if (!runs || runs>PSB_MAXRUNS) {
+    controlreply(np, "Count must be between 1 and %d.", PSB_MAXRUNS);
+    return CMD_ERROR;
+  }
+
+  if (benchnode) {
+    controlreply(np, "A benchmark is already running (%u/%u scans done).", benchdone, benchtotal);
+    return CMD_ERROR;
+  }
+
+  if (!ps_ready) {
+    controlreply(np, "Proxyscan isn't ready to scan yet.");
+    return CMD_ERROR;
+  }
+
+  if (!ipmask_parse("127.0.0.1", &sin, &bits)) {
+    controlreply(np, "Unable to parse loopback address.");
+    return CMD_ERROR;
+  }
+
+  for (i=0;i<PSB_RESPONDERS;i++) {
+    responders[i].fd=-1;
+    responders[i].runs=responders[i].wrong=responders[i].failed=0;
+  }
+
+  for (i=0;i<PSB_RESPONDERS;i++) {
+    if (psb_listen(&responders[i])) {
+      controlreply(np, "Unable to start %s responder (%d).", responders[i].name, errno);
+      psb_stop();
+      return CMD_ERROR;
+    }
+  }
+
+  benchnode=refnode(iptree, &sin, bits);
+  benchsender=np->numeric;
+  benchtotal=runs;
+  benchdone=0;
+  benchstart=metricclock();
+  ps_benchhook=&psb_complete;
+
+  controlreply(np, "Queueing %u scans against %u responders, scan limit %d (%d per prefix).",
+    runs, (unsigned int)PSB_RESPONDERS, scanlimit, prefixscans);
+
+  for (i=0;i<runs;i++) {
+    psbresponder *rp=&responders[i%PSB_RESPONDERS];
+
+    queuescan(benchnode, rp->scantype, rp->port, SCLASS_BENCH, 0);
+  }
+
+  return CMD_OK;
+}
+
+static void psb_handlelisten(int fd, short events) {
+  unsigned int i;
+  int newfd;
+
+  if ((newfd=accept4(fd, NULL, NULL, SOCK_NONBLOCK))<0)
+    return;
+
+  for (i=0;i<PSB_RESPONDERS;i++)
+    if (responders[i].fd==fd)
+      break;
+
+  if (i==PSB_RESPONDERS || newfd>=PSB_MAXFD) {
+    close(newfd);
+    return;
+  }
+
+  connkind[newfd]=i+1;
+  registerhandler(newfd, POLLIN, &psb_handleconn);
+}
+
+static void psb_closeconn(int fd) {
+  connkind[fd]=0;
+  deregisterhandler(fd, 1);
+}
+
+/* Open proxies keep the line up until the scanner hangs up */
+static void psb_drain(int fd, short events) {
+  char buf[512];
+  ssize_t res;
+
+  res=read(fd, buf, sizeof(buf));
+  if (res<0 && (errno==EAGAIN || errno==EINTR))
+    return;
+
+  if (res<=0 || (events & (POLLERR|POLLHUP)))
+    psb_closeconn(fd);
+}
+
+/*
+ * Answer the first request, then either hang up (refusing proxies) or wait
+ * for the scanner to close, so it never sees our EOF before the magic string.
+ */
+static void psb_handleconn(int fd, short events) {
+  psbresponder *rp;
+  char buf[512];
+  ssize_t res;
+
+  if (fd<0 || fd>=PSB_MAXFD || !connkind[fd]) {
+    deregisterhandler(fd, 1);
+    return;
+  }
+
+  rp=&responders[connkind[fd]-1];
+
+  res=read(fd, buf, sizeof(buf));
+  if (res<0 && (errno==EAGAIN || errno==EINTR))
+    return;
+
+  if (res<=0 || (events & (POLLERR|POLLHUP))) {
+    psb_closeconn(fd);
+    return;
+  }
+
+  if (write(fd, rp->reply, rp->replylen)!=(ssize_t)rp->replylen || !rp->open) {
+    psb_closeconn(fd);
+    return;
+  }
+
+  deregisterhandler(fd, 0);
+  registerhandler(fd, POLLIN, &psb_drain);
+}
+
+static void psb_complete(patricia_node_t *node, int type, unsigned short port, int outcome) {
+  unsigned int i, wrong=0, failed=0;
+  benchresults results;
+  char extra[64];
+  uint64_t elapsed;
+  nick *np;
+
+  for (i=0;i<PSB_RESPONDERS;i++) {
+    if (responders[i].port==port && responders[i].scantype==type) {
+      responders[i].runs++;
+      /* Never got as far as connecting, still counts towards the total */
+      if (outcome==SOUTCOME_INPROGRESS)
+        responders[i].failed++;
+      else if ((outcome==SOUTCOME_OPEN) != responders[i].open)
+        responders[i].wrong++;
+      break;
+    }
+  }
+
+  if (++benchdone < benchtotal)
+    return;
+
+  elapsed=metricclock()-benchstart;
+  np=getnickbynumeric(benchsender);
+
+  for (i=0;i<PSB_RESPONDERS;i++) {
+    wrong+=responders[i].wrong;
+    failed+=responders[i].failed;
+    if (responders[i].wrong || responders[i].failed) {
+      Error("proxyscanbench", ERR_WARNING, "%s: %u/%u scans had the wrong outcome, %u failed to start.", responders[i].name, responders[i].wrong, responders[i].runs, responders[i].failed);
+      if (np)
+        controlreply(np, "%-14s %u/%u wrong, %u failed", responders[i].name, responders[i].wrong, responders[i].runs, responders[i].failed);
+    }
+  }
+
+  snprintf(extra, sizeof(extra), "wrong=%u failed=%u", wrong, failed);
+  benchopen(&results, "proxyscanbench");
+  benchresult(&results, "scans", benchtotal, elapsed, extra);
+  benchclose(&results);
+  if (np)
+    controlreply(np, "%u scans in %.3fs (%.1f scans/s), %u wrong, %u failed.", benchtotal,
+      elapsed/1000000.0, elapsed ? benchtotal*1000000.0/elapsed : 0.0, wrong, failed);
+
+  psb_stop();
+}
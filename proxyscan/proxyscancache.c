@@ -1,35 +1,138 @@
 /*
  * proxyscancache.c:
  *  This file deals with the cache of known hosts, clean or otherwise.
+ *
+ *  Clean hosts, by far the majority, don't get a structure at all: the scan
+ *  time is packed into the node extension with the low bit set.  Hosts we
+ *  found proxies on get a cachehost.  Every entry also sits in a FIFO, one
+ *  for clean and one for dirty hosts as each has a fixed lifetime, so expiry
+ *  is a walk off the front a batch at a time from the scan tick.  A FIFO slot
+ *  holds its own reference on the node; slots whose entry has since been
+ *  replaced are skipped when they come up.
+ *
+ *  data/cleanhosts.bin is a header followed by records, later ones winning
+ *  for the same IP.  New entries are appended as they're made and the hourly
+ *  dump rewrites it from the FIFOs.  It's native endian and only meant to be
+ *  read back by the same build.
  */
 
 #include "proxyscan.h"
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include "../core/error.h"
+#include "../core/nsmalloc.h"
+#include "../core/nslog.h"
 #include <string.h>
+#include <unistd.h>
+
+#define PSCACHE_FILE        "data/cleanhosts.bin"
+#define PSCACHE_OLDFILE     "data/cleanhosts"
+#define PSCACHE_MAGIC       0x31435350U  /* "PSC1" */
+#define PSCACHE_VERSION     1
+#define PSCACHE_MAXPROXIES  1024
+#define PSCACHE_EXPIREBATCH 2000         /* slots looked at per FIFO per tick */
+
+struct pscacheheader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t written;
+};
+
+struct pscacherec {
+  uint32_t lastscan;
+  uint16_t nproxies;                     /* 0 for a clean host */
+  uint16_t spare;
+  struct irc_in_addr ip;
+};
+
+/* dirty records carry this and then nproxies of the pairs */
+struct pscachedirty {
+  uint32_t glineid;
+  uint32_t lastgline;
+};
+
+struct pscacheproxy {
+  uint16_t type;
+  uint16_t port;
+};
+
+typedef struct cacheslot {
+  patricia_node_t *node;
+  time_t when;
+} cacheslot;
+
+typedef struct cachefifo {
+  cacheslot *slots;
+  size_t head, count, size;
+} cachefifo;
+
+#define CLEANTAG(t)    ((void *)((((uintptr_t)(t)) << 1) | 1))
+#define ISCLEAN(x)     (((uintptr_t)(x)) & 1)
+#define CLEANTIME(x)   ((time_t)(((uintptr_t)(x)) >> 1))
 
 time_t cleanscaninterval;
 time_t dirtyscaninterval;
 
+static cachefifo cleanfifo, dirtyfifo;
+static unsigned int cleanhosts, dirtyhosts;
+static nslog *cachelog;
+
 void cachehostinit(time_t ri) {
   cleanscaninterval=ri;
   dirtyscaninterval=ri*7;
 }
 
-cachehost *addcleanhost(time_t timestamp) {
-  cachehost *chp;
+static void fifopush(cachefifo *f, patricia_node_t *node, time_t when) {
+  cacheslot *sp;
 
-  chp=getcachehost();
-  chp->lastscan=timestamp;
-  chp->proxies=NULL;
-  chp->glineid=0;
-  chp->lastgline=0;  
-  
-  return chp;
+  if (f->count==f->size) {
+    size_t newsize=f->size ? f->size*2 : 4096, tail=f->size - f->head;
+
+    if (!(f->slots=nsrealloc(POOL_PROXYSCAN, f->slots, newsize*sizeof(cacheslot))))
+      Error("proxyscan",ERR_STOP,"Unable to allocate memory");
+
+    /* unwrap: the part before head moves up behind the old end */
+    if (f->head && f->count) {
+      memmove(f->slots + newsize - tail, f->slots + f->head, tail*sizeof(cacheslot));
+      f->head=newsize - tail;
+    }
+    f->size=newsize;
+  }
+
+  sp=&f->slots[(f->head + f->count) % f->size];
+  patricia_ref_prefix(node->prefix);
+  sp->node=node;
+  sp->when=when;
+  f->count++;
+}
+
+static void fifoclear(cachefifo *f) {
+  while (f->count) {
+    derefnode(iptree, f->slots[f->head].node);
+    f->head=(f->head + 1) % f->size;
+    f->count--;
+  }
+
+  nsfree(POOL_PROXYSCAN, f->slots);
+  f->slots=NULL;
+  f->head=f->size=0;
+}
+
+static int slotcmp(const void *a, const void *b) {
+  time_t ta=((const cacheslot *)a)->when, tb=((const cacheslot *)b)->when;
+
+  return (ta > tb) - (ta < tb);
 }
 
-void delcachehost(cachehost *chp) {
+/* Anything loaded from disk may be out of order, only done when head is 0 */
+static void fifosort(cachefifo *f) {
+  if (f->count)
+    qsort(f->slots, f->count, sizeof(cacheslot), slotcmp);
+}
+
+static void freedirty(cachehost *chp) {
   foundproxy *fpp, *nfpp;
 
   for (fpp=chp->proxies;fpp;fpp=nfpp) {
@@ -39,89 +142,248 @@ void delcachehost(cachehost *chp) {
   freecachehost(chp);
 }
 
-/*
- * Returns a cachehost * for the named IP
- */
+static int expired(void *ext, time_t now) {
+  if (ISCLEAN(ext))
+    return CLEANTIME(ext) < now - cleanscaninterval;
 
-cachehost *findcachehost(patricia_node_t *node) {
-  cachehost *chp;
+  return ((cachehost *)ext)->lastscan < now - dirtyscaninterval;
+}
 
-  if( (cachehost *)node->exts[ps_cache_ext] ) {
-    chp = (cachehost *)node->exts[ps_cache_ext];
-    if(chp->lastscan < (time(NULL)-(chp->proxies ? dirtyscaninterval : cleanscaninterval))) {
-      /* Needs rescan; delete and return 1 */
-      delcachehost(chp);
-      derefnode(iptree,node);
-      node->exts[ps_cache_ext] = NULL;
-      return NULL;
-    } else {
-      /* valid: return it */
-      return chp;
+static void writerecord(nslog *lp, FILE *fp, patricia_node_t *node) {
+  char buf[sizeof(struct pscacherec) + sizeof(struct pscachedirty) + PSCACHE_MAXPROXIES*sizeof(struct pscacheproxy)];
+  struct pscacherec *rp=(struct pscacherec *)buf;
+  void *ext=node->exts[ps_cache_ext];
+  size_t len=sizeof(struct pscacherec);
+
+  memset(rp, 0, sizeof(struct pscacherec));
+  rp->ip=node->prefix->sin;
+
+  if (ISCLEAN(ext)) {
+    rp->lastscan=CLEANTIME(ext);
+  } else {
+    cachehost *chp=(cachehost *)ext;
+    struct pscachedirty *dp=(struct pscachedirty *)(buf + len);
+    struct pscacheproxy *pp=(struct pscacheproxy *)(dp + 1);
+    foundproxy *fpp;
+
+    rp->lastscan=chp->lastscan;
+    dp->glineid=chp->glineid;
+    dp->lastgline=chp->lastgline;
+    for (fpp=chp->proxies;fpp && rp->nproxies<PSCACHE_MAXPROXIES;fpp=fpp->next,pp++) {
+      pp->type=fpp->type;
+      pp->port=fpp->port;
+      rp->nproxies++;
     }
+    len+=sizeof(struct pscachedirty) + rp->nproxies*sizeof(struct pscacheproxy);
   }
 
-  /* Not found: return NULL */
-  return NULL;
+  if (lp)
+    nslogwrite(lp, buf, len);
+  else
+    fwrite(buf, len, 1, fp);
 }
 
-/* 
- * dumpcleanhosts:
- *  Dumps all cached hosts to a savefile.  Expires hosts as it goes along
- */
+/* Drops whatever is cached for the node, the node may go with it */
+void delcachehost(patricia_node_t *node) {
+  void *ext=node->exts[ps_cache_ext];
 
-void dumpcachehosts(void *arg) {
-  FILE *fp;
+  if (!ext)
+    return;
+
+  node->exts[ps_cache_ext]=NULL;
+  if (ISCLEAN(ext)) {
+    cleanhosts--;
+  } else {
+    freedirty((cachehost *)ext);
+    dirtyhosts--;
+  }
+  derefnode(iptree,node);
+}
+
+void addcleanhost(patricia_node_t *node, time_t timestamp) {
+  void *ext=node->exts[ps_cache_ext];
+
+  if (!ext) {
+    patricia_ref_prefix(node->prefix);
+  } else if (ISCLEAN(ext)) {
+    cleanhosts--;
+  } else {
+    freedirty((cachehost *)ext);
+    dirtyhosts--;
+  }
+
+  node->exts[ps_cache_ext]=CLEANTAG(timestamp);
+  cleanhosts++;
+
+  fifopush(&cleanfifo, node, timestamp);
+  if (cachelog)
+    writerecord(cachelog, NULL, node);
+}
+
+static cachehost *setdirtyhost(patricia_node_t *node, time_t lastscan) {
+  void *ext=node->exts[ps_cache_ext];
   cachehost *chp;
+
+  if (!ext) {
+    patricia_ref_prefix(node->prefix);
+  } else if (ISCLEAN(ext)) {
+    cleanhosts--;
+  } else {
+    freedirty((cachehost *)ext);
+    dirtyhosts--;
+  }
+
+  if (!(chp=getcachehost()))
+    Error("proxyscan",ERR_STOP,"Unable to allocate memory");
+
+  chp->lastscan=lastscan;
+  chp->proxies=NULL;
+  chp->glineid=0;
+  chp->lastgline=0;
+
+  node->exts[ps_cache_ext]=chp;
+  dirtyhosts++;
+
+  fifopush(&dirtyfifo, node, lastscan);
+
+  return chp;
+}
+
+/* Valid dirty entry for the node, promoting a clean one or making a new one */
+cachehost *adddirtyhost(patricia_node_t *node) {
+  void *ext=node->exts[ps_cache_ext];
   time_t now=time(NULL);
-  foundproxy *fpp;
+  cachehost *chp;
+
+  if ((chp=finddirtyhost(node)))
+    return chp;
+
+  return setdirtyhost(node, (ext && ISCLEAN(ext) && !expired(ext, now)) ? CLEANTIME(ext) : now);
+}
+
+/* Appends the node's current entry to the on-disk cache */
+void savecachehost(patricia_node_t *node) {
+  if (cachelog && node->exts[ps_cache_ext])
+    writerecord(cachelog, NULL, node);
+}
+
+int iscleanhost(patricia_node_t *node) {
+  void *ext=node->exts[ps_cache_ext];
+
+  return ext && ISCLEAN(ext) && !expired(ext, time(NULL));
+}
+
+cachehost *finddirtyhost(patricia_node_t *node) {
+  void *ext=node->exts[ps_cache_ext];
+
+  if (!ext || ISCLEAN(ext) || expired(ext, time(NULL)))
+    return NULL;
+
+  return (cachehost *)ext;
+}
+
+static int slotcurrent(cacheslot *sp) {
+  void *ext=sp->node->exts[ps_cache_ext];
+
+  if (!ext)
+    return 0;
+
+  if (ISCLEAN(ext))
+    return CLEANTIME(ext)==sp->when;
+
+  return ((cachehost *)ext)->lastscan==sp->when;
+}
+
+static void fifoexpire(cachefifo *f, time_t lifetime, time_t now) {
+  unsigned int budget=PSCACHE_EXPIREBATCH;
   patricia_node_t *node;
+  cacheslot *sp;
 
-  if ((fp=fopen("data/cleanhosts","w"))==NULL) {
-    Error("proxyscan",ERR_ERROR,"Unable to open cleanhosts file for writing!");
-    return;
+  while (f->count && budget--) {
+    sp=&f->slots[f->head];
+
+    /* everything behind this one is newer */
+    if (sp->when >= now - lifetime)
+      break;
+
+    node=sp->node;
+    if (slotcurrent(sp))
+      delcachehost(node);
+    derefnode(iptree,node);
+
+    f->head=(f->head + 1) % f->size;
+    f->count--;
   }
+}
 
-  PATRICIA_WALK_CLEAR (iptree->head, node) {
-    if (node->exts[ps_cache_ext] ) {
-      chp = (cachehost *) node->exts[ps_cache_ext];
-      if (chp) { 
-        if (chp->proxies) {
-          if (chp->lastscan < (now-dirtyscaninterval)) {
-            derefnode(iptree,node); 
-	    delcachehost(chp);
-  	    node->exts[ps_cache_ext] = NULL;
-          } else
-        
-          for (fpp=chp->proxies;fpp;fpp=fpp->next) 
-            fprintf(fp, "%s %lu %u %i %u %lu\n",IPtostr(node->prefix->sin),chp->lastscan,chp->glineid,fpp->type,fpp->port,chp->lastgline);
-        } else {
-          if (chp->lastscan < (now-cleanscaninterval)) {
-            /* Needs rescan anyway, so delete it */
-	    derefnode(iptree,node); 
-	    delcachehost(chp);
-            node->exts[ps_cache_ext] = NULL;          
-          } else
-          fprintf(fp,"%s %lu\n",IPtostr(node->prefix->sin),chp->lastscan);
-        }
-      }
-    }
-  } PATRICIA_WALK_CLEAR_END;
+/*
+ * expirecachehosts:
+ *  Called every tick, drops up to a batch of expired entries from each FIFO
+ */
 
-//  patricia_tidy_tree(iptree); 
+void expirecachehosts(void) {
+  time_t now=time(NULL);
 
-  fclose(fp);
+  fifoexpire(&cleanfifo, cleanscaninterval, now);
+  fifoexpire(&dirtyfifo, dirtyscaninterval, now);
+}
+
+static void dumpfifo(FILE *fp, cachefifo *f, time_t now) {
+  size_t i;
+  cacheslot *sp;
+
+  for (i=0;i<f->count;i++) {
+    sp=&f->slots[(f->head + i) % f->size];
+    if (slotcurrent(sp) && !expired(sp->node->exts[ps_cache_ext], now))
+      writerecord(NULL, fp, sp->node);
+  }
 }
 
 /*
- * loadcleanhosts:
- *  Loads clean hosts in from database. 
+ * dumpcachehosts:
+ *  Rewrites the cache file from scratch, dropping replaced and expired entries
  */
 
-void loadcachehosts() {
+void dumpcachehosts(void *arg) {
+  struct pscacheheader hdr;
+  FILE *fp;
+  time_t now=time(NULL);
+  int res;
+
+  /* anything still queued belongs to the file we're replacing */
+  nslogclose(cachelog);
+  cachelog=NULL;
+
+  if ((fp=fopen(PSCACHE_FILE ".tmp","w"))==NULL) {
+    Error("proxyscan",ERR_ERROR,"Unable to open cleanhosts file for writing!");
+    cachelog=nslogopen(PSCACHE_FILE, 0600);
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic=PSCACHE_MAGIC;
+  hdr.version=PSCACHE_VERSION;
+  hdr.written=now;
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+
+  dumpfifo(fp, &cleanfifo, now);
+  dumpfifo(fp, &dirtyfifo, now);
+
+  res=ferror(fp);
+  if (fclose(fp) || res || rename(PSCACHE_FILE ".tmp", PSCACHE_FILE)) {
+    Error("proxyscan",ERR_ERROR,"Error writing cleanhosts file!");
+    unlink(PSCACHE_FILE ".tmp");
+  }
+
+  cachelog=nslogopen(PSCACHE_FILE, 0600);
+}
+
+/* The old text format, only read if there's no binary file yet */
+static int loadoldcachehosts(time_t now) {
   FILE *fp;
   unsigned long timestamp,glineid,ptype,pport,lastgline;
   char buf[512];
-  cachehost *chp=NULL;
+  cachehost *chp;
   foundproxy *fpp;
   char ip[512];
   int res;
@@ -130,11 +392,8 @@ void loadcachehosts() {
   patricia_node_t *node;
   int i=0;
 
-  if ((fp=fopen("data/cleanhosts","r"))==NULL) {
-    Error("proxyscan",ERR_ERROR,"Unable to open cleanhosts file for reading!");
-    return;
-  }
-
+  if ((fp=fopen(PSCACHE_OLDFILE,"r"))==NULL)
+    return -1;
 
   while (!feof(fp)) {
     fgets(buf,512,fp);
@@ -153,10 +412,9 @@ void loadcachehosts() {
       node = refnode(iptree, &sin, bits);
       if( node ) {
         i++;
-        chp=addcleanhost(timestamp);
-        node->exts[ps_cache_ext] = chp;
-      
         if (res==6) {
+          if (!(chp=finddirtyhost(node)))
+            chp=setdirtyhost(node, timestamp);
           chp->glineid=glineid;
           chp->lastgline=lastgline;
           fpp=getfoundproxy();
@@ -164,86 +422,124 @@ void loadcachehosts() {
           fpp->port=pport;
           fpp->next=chp->proxies;
           chp->proxies=fpp;
-	}
+        } else if ((time_t)timestamp >= now - cleanscaninterval) {
+          addcleanhost(node, timestamp);
+        }
+        derefnode(iptree, node);
       }
     }
   }
 
   fclose(fp);
- 
-  Error("proxyscan",ERR_INFO, "Loaded %d entries from cache", i); 
+
+  return i;
 }
 
 /*
- * cleancount:
- *  Returns the number of "clean" host entries present 
+ * loadcachehosts:
+ *  Loads the cache from disk and starts a fresh file.
  */
 
-unsigned int cleancount() {
-  unsigned int total=0;
+void loadcachehosts() {
+  struct pscacheheader hdr;
+  struct pscacherec rec;
+  struct pscachedirty dirty;
+  struct pscacheproxy proxy;
+  time_t now=time(NULL);
+  patricia_node_t *node;
   cachehost *chp;
-  patricia_node_t *head, *node;
-  head = iptree->head;
-  PATRICIA_WALK (head, node) {
-    if ( node->exts[ps_cache_ext] ) {
-      chp = (cachehost *) node->exts[ps_cache_ext];
-
-      if (!chp->proxies)
-        total++;
+  foundproxy *fpp;
+  unsigned int i, n=0;
+  FILE *fp;
+  int res;
+
+  if ((fp=fopen(PSCACHE_FILE,"r"))==NULL) {
+    if ((res=loadoldcachehosts(now))<0)
+      Error("proxyscan",ERR_ERROR,"Unable to open cleanhosts file for reading!");
+    else
+      Error("proxyscan",ERR_INFO,"Loaded %d entries from old format cache", res);
+  } else if (fread(&hdr, sizeof(hdr), 1, fp)!=1 || hdr.magic!=PSCACHE_MAGIC || hdr.version!=PSCACHE_VERSION) {
+    Error("proxyscan",ERR_ERROR,"Ignoring cleanhosts file with bad header.");
+    fclose(fp);
+  } else {
+    /* a torn record at the end is just where the last append stopped */
+    while (fread(&rec, sizeof(rec), 1, fp)==1) {
+      if (rec.nproxies > PSCACHE_MAXPROXIES || (rec.nproxies && fread(&dirty, sizeof(dirty), 1, fp)!=1))
+        break;
+
+      node=refnode(iptree, &rec.ip, 128);
+      n++;
+
+      if (!rec.nproxies) {
+        if ((time_t)rec.lastscan >= now - cleanscaninterval)
+          addcleanhost(node, rec.lastscan);
+        else
+          delcachehost(node);
+      } else {
+        chp=setdirtyhost(node, rec.lastscan);
+        chp->glineid=dirty.glineid;
+        chp->lastgline=dirty.lastgline;
+        for (i=0;i<rec.nproxies && fread(&proxy, sizeof(proxy), 1, fp)==1;i++) {
+          fpp=getfoundproxy();
+          fpp->type=proxy.type;
+          fpp->port=proxy.port;
+          fpp->next=chp->proxies;
+          chp->proxies=fpp;
+        }
+        if ((time_t)rec.lastscan < now - dirtyscaninterval)
+          delcachehost(node);
+      }
+
+      derefnode(iptree, node);
     }
-  } PATRICIA_WALK_END;
 
-  return total;
+    fclose(fp);
+    Error("proxyscan",ERR_INFO, "Loaded %u entries from cache", n);
+  }
+
+  fifosort(&cleanfifo);
+  fifosort(&dirtyfifo);
+
+  /* compact what we read, and pick up the old format if that's what it was */
+  dumpcachehosts(NULL);
 }
 
-unsigned int dirtycount() {
-  unsigned int total=0;
-  cachehost *chp;
-  patricia_node_t *node;
+void cachehostfini() {
+  nslogclose(cachelog);
+  cachelog=NULL;
 
-  PATRICIA_WALK (iptree->head, node) {
-    if ( node->exts[ps_cache_ext] ) {
-      chp = (cachehost *) node->exts[ps_cache_ext];
-      if (chp->proxies)
-        total++;
-    }
-  } PATRICIA_WALK_END;
+  fifoclear(&cleanfifo);
+  fifoclear(&dirtyfifo);
+}
 
-  return total;
+/*
+ * cleancount:
+ *  Returns the number of "clean" host entries present
+ */
+
+unsigned int cleancount() {
+  return cleanhosts;
 }
 
-/* 
+unsigned int dirtycount() {
+  return dirtyhosts;
+}
+
+/*
  * scanall:
  *  Scans all hosts on the network for a given proxy, and updates the cache accordingly
  */
 
 void scanall(int type, int port) {
-  int i;
-  cachehost *chp;
-  nick *np;
-  unsigned int hostmarker;
   patricia_node_t *node;
 
-  hostmarker=nexthostmarker();
-
+  /*
+   * One pass over the IP tree, once per address with users on it.  usercount
+   * is carried up to the CIDR nodes trusts and newsearch create too, so only
+   * the host nodes users hang off are scanned.
+   */
   PATRICIA_WALK (iptree->head, node) {
-    if ( node->exts[ps_cache_ext] ) {
-      chp = (cachehost *) node->exts[ps_cache_ext];
-      chp->marker=0;
-    }
-  } PATRICIA_WALK_END; 
-
-  for (i=0;i<NICKHASHSIZE;i++) {
-    for (np=nicktable[i];np;np=np->next) {
-      if (np->host->marker==hostmarker)
-	continue;
-
-      np->host->marker=hostmarker;
-
-      if ((chp=findcachehost(np->ipnode)))
-	chp->marker=1;
-
-      queuescan(np->ipnode, type, port, SCLASS_NORMAL, 0);
-    }
-  }
+    if (node->prefix->bitlen == PATRICIA_MAXBITS && node->usercount > 0)
+      queuescan(node, type, port, SCLASS_NORMAL, 0);
+  } PATRICIA_WALK_END;
 }
@@ -50,7 +50,11 @@ int createconnectsocket(struct irc_in_addr *ip, int socknum) {
   }
 
   if ((fd=socket(proto,SOCK_STREAM|SOCK_NONBLOCK,0))<0) {
-    Error("proxyscan",ERR_ERROR,"Unable to create socket (%d)",errno);
+    int err=errno;
+
+    /* the caller looks at errno to spot descriptor exhaustion */
+    Error("proxyscan",ERR_ERROR,"Unable to create socket (%d)",err);
+    errno=err;
     return -1;
   }
 #ifdef __FreeBSD__
@@ -8,7 +8,7 @@
 void proxyscan_newnick(int hooknum, void *arg) {
   nick *np=(nick *)arg;
   cachehost *chp;
-  foundproxy *fpp, *nfpp;
+  foundproxy *fpp;
   extrascan *esp, *espp;
   char reason[200];
 
@@ -52,10 +52,10 @@ void proxyscan_newnick(int hooknum, void *arg) {
    *
    * If they're not in the cache, we queue up their scans
    */
-  if ((chp=findcachehost(np->ipnode))) {
-    if (!chp->proxies)
-      return;
+  if (iscleanhost(np->ipnode))
+    return;
 
+  if ((chp=finddirtyhost(np->ipnode))) {
     if (time(NULL) < (chp->lastscan + 1800))
       return;
 
@@ -72,23 +72,17 @@ void proxyscan_newnick(int hooknum, void *arg) {
     }
 
     /* We want these scans to start around now, so we put them at the front of the priority queue */
-    for (fpp=chp->proxies;fpp;fpp=nfpp) {
-      nfpp=fpp->next;
+    for (fpp=chp->proxies;fpp;fpp=fpp->next)
       queuescan(np->ipnode, fpp->type, fpp->port, SCLASS_CHECK, time(NULL));
-      freefoundproxy(fpp);
-    }
 
     /* set a SHORT gline - if they really have an open proxy the gline will be re-set, with a new ID */
     snprintf(reason, sizeof(reason), "Open Proxy, see http://www.quakenet.org/openproxies.html - ID: %d", chp->glineid);
     glinebynick(np, 600, reason, GLINE_IGNORE_TRUST, "proxyscan");
 
-    chp->lastscan=time(NULL);
-    chp->proxies=NULL;
-    chp->glineid=0;
+    /* back to clean until the check scans say otherwise */
+    addcleanhost(np->ipnode, time(NULL));
   } else {
-    chp=addcleanhost(time(NULL));
-    np->ipnode->exts[ps_cache_ext] = chp;
-    patricia_ref_prefix(np->ipnode->prefix);
+    addcleanhost(np->ipnode, time(NULL));
 
     /* Queue up all the normal scans - on the normal queue */
     for (i=0;i<numscans;i++)
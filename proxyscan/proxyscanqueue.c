@@ -7,18 +7,148 @@
 #include "../irc/irc.h"
 #include "../core/error.h"
 #include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
 
-pendingscan *ps_normalqueue=NULL;
 pendingscan *ps_prioqueue=NULL;
-pendingscan *ps_normalqueueend=NULL;
 
 unsigned int normalqueuedscans=0;
 unsigned int prioqueuedscans=0;
 
 unsigned long countpendingscan=0;
 
+/* The normal queue is kept per prefix and served round robin, so one busy
+ * /24 or /64 can't starve everything queued behind it. */
+static scanprefix *prefixtable[PSCAN_PREFIXHASHSIZE];
+static scanprefix *ps_rrqueue=NULL, *ps_rrqueueend=NULL;
+static unsigned int rrcount=0, prefixcount=0;
+
+static void maskprefix(struct irc_in_addr *dst, struct irc_in_addr *ip) {
+  *dst=*ip;
+
+  if (irc_in_addr_is_ipv4(ip)) {
+    dst->in6_16[0]=dst->in6_16[1]=dst->in6_16[2]=dst->in6_16[3]=dst->in6_16[4]=0;
+    dst->in6_16[5]=65535;
+    dst->in6_16[7]&=htons(0xff00);
+  } else {
+    dst->in6_16[4]=dst->in6_16[5]=dst->in6_16[6]=dst->in6_16[7]=0;
+  }
+}
+
+static unsigned int prefixhash(struct irc_in_addr *ip) {
+  unsigned int i, hash=0;
+
+  for (i=0;i<8;i++)
+    hash=hash*31+ip->in6_16[i];
+
+  return hash%PSCAN_PREFIXHASHSIZE;
+}
+
+scanprefix *findscanprefix(patricia_node_t *node) {
+  struct irc_in_addr addr;
+  scanprefix *spp;
+  unsigned int hash;
+
+  maskprefix(&addr, &node->prefix->sin);
+  hash=prefixhash(&addr);
+
+  for (spp=prefixtable[hash];spp;spp=spp->next)
+    if (!memcmp(&spp->addr, &addr, sizeof(addr)))
+      return spp;
+
+  if (!(spp=getscanprefix()))
+    Error("proxyscan",ERR_STOP,"Unable to allocate memory");
+
+  memset(spp, 0, sizeof(scanprefix));
+  spp->addr=addr;
+  spp->next=prefixtable[hash];
+  prefixtable[hash]=spp;
+  prefixcount++;
+
+  return spp;
+}
+
+/* Drops the prefix once nothing is running or waiting on it */
+void putscanprefix(scanprefix *spp) {
+  scanprefix **sh;
+
+  if (spp->active || spp->queued || spp->inrr)
+    return;
+
+  for (sh=&prefixtable[prefixhash(&spp->addr)];*sh;sh=&((*sh)->next)) {
+    if (*sh==spp) {
+      *sh=spp->next;
+      break;
+    }
+  }
+
+  prefixcount--;
+  freescanprefix(spp);
+}
+
+unsigned int scanprefixcount() {
+  return prefixcount;
+}
+
+static void rrappend(scanprefix *spp) {
+  spp->inrr=1;
+  spp->nextrr=NULL;
+  if (ps_rrqueueend)
+    ps_rrqueueend->nextrr=spp;
+  else
+    ps_rrqueue=spp;
+  ps_rrqueueend=spp;
+  rrcount++;
+}
+
+static scanprefix *rrpop(void) {
+  scanprefix *spp=ps_rrqueue;
+
+  if (!spp)
+    return NULL;
+
+  ps_rrqueue=spp->nextrr;
+  if (!ps_rrqueue)
+    ps_rrqueueend=NULL;
+  spp->inrr=0;
+  rrcount--;
+
+  return spp;
+}
+
+/* Next scan from the first prefix that's under its in-flight cap */
+static pendingscan *dequeuenormal(void) {
+  scanprefix *spp;
+  pendingscan *psp;
+  unsigned int tries;
+
+  for (tries=rrcount;tries;tries--) {
+    spp=rrpop();
+
+    if (spp->active >= prefixscans) {
+      rrappend(spp);
+      continue;
+    }
+
+    psp=spp->queue;
+    spp->queue=psp->next;
+    if (!spp->queue)
+      spp->queueend=NULL;
+    spp->queued--;
+
+    if (spp->queued)
+      rrappend(spp);
+
+    normalqueuedscans--;
+    return psp;
+  }
+
+  return NULL;
+}
+
 void queuescan(patricia_node_t *node, short scantype, unsigned short port, char class, time_t when) {
   pendingscan *psp, *psp2;
+  scanprefix *spp;
 
   /* we can just blindly queue the scans as node extension cleanhost cache blocks duplicate scans normally.
    * Scans may come from:
@@ -31,10 +161,12 @@ void queuescan(patricia_node_t *node, short scantype, unsigned short port, char
   assert(node->prefix);
   /* reference the node - we either start a or queue a single scan */
   patricia_ref_prefix(node->prefix);
-  
+
+  spp=findscanprefix(node);
+
   /* If there are scans spare, just start it immediately.. 
    * provided we're not supposed to wait */
-  if (activescans < maxscans && when<=time(NULL) && ps_ready) {
+  if (activescans < scanlimit && spp->active < prefixscans && when<=time(NULL) && ps_ready) {
     startscan(node, scantype, port, class);
     return;
   }
@@ -55,13 +187,17 @@ void queuescan(patricia_node_t *node, short scantype, unsigned short port, char
   if (!when) {
     /* normal queue */
     normalqueuedscans++;
-    if (ps_normalqueueend) {
-      ps_normalqueueend->next=psp;
-      ps_normalqueueend=psp;
+    spp->queued++;
+    if (spp->queueend) {
+      spp->queueend->next=psp;
+      spp->queueend=psp;
     } else {
-      ps_normalqueueend=ps_normalqueue=psp;
+      spp->queueend=spp->queue=psp;
     }
+    if (!spp->inrr)
+      rrappend(spp);
   } else {
+    /* timed rescans are sparse, they skip the per-prefix cap */
     prioqueuedscans++;
     if (!ps_prioqueue || ps_prioqueue->when > when) {
       psp->next=ps_prioqueue;
@@ -75,34 +211,28 @@ void queuescan(patricia_node_t *node, short scantype, unsigned short port, char
 	}
       }
     }
+    putscanprefix(spp);
   }
 }
 
 void startqueuedscans() {
-  pendingscan *psp=NULL;
+  pendingscan *psp;
+  time_t now=time(NULL);
+
+  if (!ps_ready)
+    return;
 
-  while (activescans < maxscans) {
-    if (ps_prioqueue && (ps_prioqueue->when <= time(NULL))) {
+  while (activescans < scanlimit) {
+    if (ps_prioqueue && (ps_prioqueue->when <= now)) {
       psp=ps_prioqueue;
       ps_prioqueue=psp->next;
       prioqueuedscans--;
-    } else if (ps_normalqueue) {
-      psp=ps_normalqueue;
-      ps_normalqueue=psp->next;
-      if (!ps_normalqueue)
-	ps_normalqueueend=NULL;
-      normalqueuedscans--;
-    }
-    
-    if (psp) {
-      startscan(psp->node, psp->type, psp->port, psp->class);
-      freependingscan(psp);
-      countpendingscan--;
-      psp=NULL;
-    } else {
+    } else if (!(psp=dequeuenormal())) {
       break;
     }
+
+    startscan(psp->node, psp->type, psp->port, psp->class);
+    freependingscan(psp);
+    countpendingscan--;
   }
 }
-    
-    
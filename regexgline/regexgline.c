@@ -157,7 +157,7 @@ int rg_rescan(void *source, int cargc, char **cargv) {
 
   controlreply(np, "Beginning scan, this may take a while...");
 
-  for(j=0;j<NICKHASHSIZE;j++)
+  for(j=0;j<nicktablesize;j++)
     for(tnp=nicktable[j];tnp;tnp=tnp->next)
       rg_scannick(tnp, fn, arg);
 
@@ -579,7 +579,7 @@ int rg_gline(void *source, int cargc, char **cargv) {
   
   rg_initglinelist(&gll);
 
-  for(j=0;j<NICKHASHSIZE;j++) {
+  for(j=0;j<nicktablesize;j++) {
     for(tnp=nicktable[j];tnp;tnp=tnp->next) {
       if(ignorable_nick(tnp))
         continue;
@@ -626,7 +626,7 @@ int rg_sanitycheck(char *mask, int *count) {
   }
 
   *count = 0;
-  for(j=0;j<NICKHASHSIZE;j++) {
+  for(j=0;j<nicktablesize;j++) {
     for(np=nicktable[j];np;np=np->next) {
      hostlen = RGBuildHostname(hostname, np);
       if(pcre_exec(regex, hint, hostname, hostlen, 0, 0, NULL, 0) >= 0) {
@@ -898,7 +898,7 @@ int rg_spew(void *source, int cargc, char **cargv) {
   
   rg_logevent(np, "regexspew", "%s", cargv[0]);
   
-  for(j=0;j<NICKHASHSIZE;j++) {
+  for(j=0;j<nicktablesize;j++) {
     for(tnp=nicktable[j];tnp;tnp=tnp->next) {
       hostlen = RGBuildHostname(hostname, tnp);
       pcreret = pcre_exec(regex, hint, hostname, hostlen, 0, 0, ovector, sizeof(ovector) / sizeof(int));
@@ -955,7 +955,7 @@ void rg_startup(void) {
 
   rg_initglinelist(&gll);
 
-  for(j=0;j<NICKHASHSIZE;j++)
+  for(j=0;j<nicktablesize;j++)
     for(np=nicktable[j];np;np=np->next)
       rg_scannick(np, rg_gline_match, &gll);
   
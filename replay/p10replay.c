@@ -0,0 +1,915 @@
+/*
+ * p10replay: plays the hub for a newserv and replays P10 traffic at it.
+ *
+ * Listens on a local port (newserv's irc.hubhost/hubport should point at
+ * it), optionally starts newserv itself, accepts the link and then feeds it
+ * either a recorded stream (-r) or one generated from a seed: a burst of N
+ * servers, M users and K channels, join/part/mode/topic/nick/quit churn and
+ * a number of netsplits with relinks.  The same options and seed always
+ * produce the same stream, -w writes it out instead of sending it.
+ *
+ * Streams are plain P10 as the hub would send it, one line per line.  Lines
+ * starting with '#' are comments, except "#phase <name>" which ends the
+ * previous phase: before moving on we ping newserv and wait for the reply,
+ * so each phase is timed from its first line until newserv has processed
+ * its last.
+ *
+ * At the end we report lines/s per phase and, from newserv's metrics file
+ * (core.metricsfile, see core/metrics.h), the time spent in each hook
+ * (needs core.hookprofile=1), the peak RSS and the nsmalloc pool sizes
+ * (needs the nsmstats module).  Which modules are exercised is down to the
+ * config newserv is started with.
+ *
+ *   p10replay [options] [-- newserv-command [args...]]
+ */
+
+#define _GNU_SOURCE
+
+#include "../core/metrics.h"
+#include "../lib/base64.h"
+#include "../lib/splitmix.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define HUBNAME          "hub.replay.test"
+#define MAXPHASES        64
+#define WRITEAHEAD       65536
+#define MAXSERVERS       4096
+#define MAXLINE          510
+
+typedef struct rbuf {
+  char *buf;
+  size_t len, size;
+} rbuf;
+
+typedef struct ruser {
+  int server;
+  long slot;
+  unsigned int gen;           /* bumped on every reconnect or nick change */
+  int online;
+  int nchans, maxchans;
+  int *chans;
+} ruser;
+
+typedef struct rserver {
+  int numeric;
+} rserver;
+
+typedef struct rphase {
+  char name[32];
+  unsigned long lines;
+  uint64_t start, end;
+} rphase;
+
+typedef struct rmember {
+  int chan, user;
+} rmember;
+
+static struct {
+  int port, servers, users, channels, joins, churn, splits;
+  unsigned long seed;
+  int timeout;
+  char hub[3], avoid[3], *pass, *recorded, *writeto, *metricsfile;
+} opts = { 4400, 10, 10000, 2000, 4, 50000, 2, 1, 300, "AA", "A]", "replay", NULL, NULL, "data/metrics" };
+
+static rserver *servers;
+static ruser *users;
+static long basets;
+static uint64_t rndstate;
+
+static rphase phases[MAXPHASES];
+static int nphases;
+
+static int sfd=-1;
+static pid_t child;
+
+static void die(const char *format, ...) __attribute__ ((format (printf, 1, 2), noreturn));
+static void die(const char *format, ...) {
+  va_list va;
+
+  va_start(va, format);
+  vfprintf(stderr, format, va);
+  va_end(va);
+  fputc('\n', stderr);
+
+  if (child > 0) {
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+  }
+
+  exit(1);
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void rbprintf(rbuf *rb, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static void rbprintf(rbuf *rb, const char *format, ...) {
+  va_list va;
+  int len;
+
+  for (;;) {
+    va_start(va, format);
+    len=vsnprintf(rb->buf + rb->len, rb->size - rb->len, format, va);
+    va_end(va);
+
+    if (len < 0)
+      die("vsnprintf failed");
+
+    if (rb->len + len < rb->size) {
+      rb->len+=len;
+      return;
+    }
+
+    rb->size=(rb->size + len) * 2 + 4096;
+    if (!(rb->buf=realloc(rb->buf, rb->size)))
+      die("out of memory");
+  }
+}
+
+/* streams are the same everywhere for a given seed */
+static uint64_t rnd(void) {
+  return splitmix64(&rndstate);
+}
+
+static int rndint(int n) {
+  return (int)(rnd() % (uint64_t)n);
+}
+
+/* Most joins go to a few big channels, as on a real network */
+static int rndchan(void) {
+  double r=splitmix64_01(&rndstate);
+
+  return (int)(r * r * opts.channels);
+}
+
+/*
+ * Stream generation
+ */
+
+static char *servnum(int server) {
+  static char buf[4][3];
+  static int i;
+
+  i=(i+1)%4;
+  return longtonumeric2(servers[server].numeric, 2, buf[i]);
+}
+
+static char *usernum(int user) {
+  static char buf[4][6];
+  static int i;
+
+  i=(i+1)%4;
+  longtonumeric2(servers[users[user].server].numeric, 2, buf[i]);
+  longtonumeric2(users[user].slot, 3, buf[i]+2);
+  return buf[i];
+}
+
+static void gen_server(rbuf *rb, int server) {
+  rbprintf(rb, "%s S leaf%d.replay.test 2 %ld %ld J10 %s]]] +h6 :replay leaf %d\n",
+    opts.hub, server, basets, basets, servnum(server), server);
+}
+
+static void gen_nick(rbuf *rb, int user) {
+  ruser *up=&users[user];
+  char ipbuf[7], acct[64]="";
+  uint32_t ip=0x0A000000U | (uint32_t)((user * 2654435761U) & 0x00FFFFFF);
+
+  /* a third of users are authed */
+  if (user % 3 == 0)
+    snprintf(acct, sizeof(acct), "+ir acct%d:%ld:%d ", user, basets, user + 1);
+
+  rbprintf(rb, "%s N r%dg%u 2 %ld replay u%d.replay.test %s%s %s :replay user %d\n",
+    servnum(up->server), user, up->gen, basets, user % 5000, acct, longtonumeric2(ip, 6, ipbuf), usernum(user), user);
+
+  up->online=1;
+}
+
+static int memcompare(const void *a, const void *b) {
+  const rmember *ma=a, *mb=b;
+
+  if (ma->chan != mb->chan)
+    return ma->chan - mb->chan;
+  return ma->user - mb->user;
+}
+
+/* Channel membership for one server's users, one chanop per channel */
+static void gen_bursts(rbuf *rb, int server) {
+  rmember *members;
+  size_t count=0, i, j, k;
+  char line[MAXLINE + 2];
+  int u, c, pos, n, first;
+
+  for (u=0;u<opts.users;u++)
+    if (users[u].server == server && users[u].online)
+      count+=users[u].nchans;
+
+  if (!count)
+    return;
+
+  if (!(members=malloc(count * sizeof(rmember))))
+    die("out of memory");
+
+  for (count=0,u=0;u<opts.users;u++) {
+    if (users[u].server != server || !users[u].online)
+      continue;
+    for (c=0;c<users[u].nchans;c++) {
+      members[count].chan=users[u].chans[c];
+      members[count++].user=u;
+    }
+  }
+
+  qsort(members, count, sizeof(rmember), memcompare);
+
+  for (i=0;i<count;i=j) {
+    for (j=i;j<count && members[j].chan == members[i].chan;j++)
+      ;
+
+    /* the first member is opped and goes last, as ircu sorts them */
+    for (k=i+1,pos=n=0,first=1;k<=j;k++) {
+      if (!pos)
+        pos=snprintf(line, sizeof(line), "%s B #chan%d %ld%s ", servnum(server), members[i].chan, basets - 1000, first ? " +nt" : "");
+
+      pos+=snprintf(line + pos, sizeof(line) - pos, "%s%s%s", n++ ? "," : "",
+        usernum(k == j ? members[i].user : members[k].user), k == j ? ":o" : "");
+
+      if (k == j || pos > MAXLINE - 20) {
+        rbprintf(rb, "%s\n", line);
+        pos=n=first=0;
+      }
+    }
+  }
+
+  free(members);
+}
+
+static int onchan(ruser *up, int chan) {
+  int i;
+
+  for (i=0;i<up->nchans;i++)
+    if (up->chans[i] == chan)
+      return i;
+
+  return -1;
+}
+
+static void addchan(ruser *up, int chan) {
+  if (up->nchans == up->maxchans) {
+    up->maxchans=up->maxchans ? up->maxchans * 2 : 4;
+    if (!(up->chans=realloc(up->chans, up->maxchans * sizeof(int))))
+      die("out of memory");
+  }
+
+  up->chans[up->nchans++]=chan;
+}
+
+static void gen_churn(rbuf *rb, int events) {
+  int i, u, c, k, event;
+  ruser *up;
+
+  for (i=0;i<events;i++) {
+    u=rndint(opts.users);
+    up=&users[u];
+    if (!up->online)
+      continue;
+
+    event=rndint(100);
+    if (event < 30 || !up->nchans) {
+      c=rndchan();
+      if (onchan(up, c) >= 0)
+        continue;
+      addchan(up, c);
+      rbprintf(rb, "%s J #chan%d %ld\n", usernum(u), c, basets);
+    } else if (event < 55) {
+      k=rndint(up->nchans);
+      rbprintf(rb, "%s L #chan%d\n", usernum(u), up->chans[k]);
+      up->chans[k]=up->chans[--up->nchans];
+    } else if (event < 70) {
+      static const char *modes[] = { "+o", "-o", "+v", "-v" };
+      rbprintf(rb, "%s M #chan%d %s %s\n", servnum(up->server), up->chans[rndint(up->nchans)], modes[rndint(4)], usernum(u));
+    } else if (event < 80) {
+      rbprintf(rb, "%s T #chan%d %ld %ld :topic %d\n", usernum(u), up->chans[rndint(up->nchans)], basets - 1000, basets + i, i);
+    } else if (event < 90) {
+      up->gen++;
+      rbprintf(rb, "%s N r%dg%u %ld\n", usernum(u), u, up->gen, basets + i);
+    } else {
+      rbprintf(rb, "%s Q :Quit: replay %d\n", usernum(u), i);
+      up->nchans=0;
+      up->gen++;
+      gen_nick(rb, u);
+    }
+  }
+}
+
+static void gen_stream(rbuf *rb) {
+  int s, u, i, avoid=numerictolong(opts.avoid, 2), next=numerictolong(opts.hub, 2);
+
+  if (opts.servers < 1 || opts.servers > MAXSERVERS - 2 || opts.users < 1 || opts.channels < 1)
+    die("need at least one server, user and channel (and fewer than %d servers)", MAXSERVERS - 2);
+
+  if (!(servers=calloc(opts.servers, sizeof(rserver))) || !(users=calloc(opts.users, sizeof(ruser))))
+    die("out of memory");
+
+  rndstate=opts.seed;
+  basets=1000000000;
+
+  for (s=0;s<opts.servers;s++) {
+    do {
+      next=(next + 1) % MAXSERVERS;
+    } while (next == avoid || next == numerictolong(opts.hub, 2));
+    servers[s].numeric=next;
+  }
+
+  for (u=0;u<opts.users;u++) {
+    users[u].server=u % opts.servers;
+    users[u].slot=u / opts.servers;
+
+    for (i=0;i<opts.joins;i++) {
+      int c=rndchan();
+      if (onchan(&users[u], c) < 0)
+        addchan(&users[u], c);
+    }
+  }
+
+  rbprintf(rb, "#phase burst\n");
+  for (s=0;s<opts.servers;s++)
+    gen_server(rb, s);
+  for (u=0;u<opts.users;u++)
+    gen_nick(rb, u);
+  for (s=0;s<opts.servers;s++)
+    gen_bursts(rb, s);
+  for (s=0;s<opts.servers;s++)
+    rbprintf(rb, "%s EB\n", servnum(s));
+  rbprintf(rb, "%s EB\n", opts.hub);
+
+  rbprintf(rb, "#phase churn\n");
+  gen_churn(rb, opts.churn);
+
+  for (i=0;i<opts.splits;i++) {
+    s=rndint(opts.servers);
+
+    rbprintf(rb, "#phase split%d\n", i);
+    rbprintf(rb, "%s SQ leaf%d.replay.test 0 :replay split %d\n", opts.hub, s, i);
+    for (u=0;u<opts.users;u++)
+      if (users[u].server == s)
+        users[u].online=0;
+
+    rbprintf(rb, "#phase relink%d\n", i);
+    gen_server(rb, s);
+    for (u=0;u<opts.users;u++)
+      if (users[u].server == s)
+        gen_nick(rb, u);
+    gen_bursts(rb, s);
+    rbprintf(rb, "%s EB\n", servnum(s));
+  }
+}
+
+static void load_stream(rbuf *rb, const char *file) {
+  FILE *fp;
+  size_t res;
+
+  if (!(fp=fopen(file, "r")))
+    die("unable to open %s: %s", file, strerror(errno));
+
+  for (;;) {
+    if (rb->size - rb->len < 65536) {
+      rb->size=rb->size * 2 + 65536;
+      if (!(rb->buf=realloc(rb->buf, rb->size)))
+        die("out of memory");
+    }
+
+    if (!(res=fread(rb->buf + rb->len, 1, rb->size - rb->len, fp)))
+      break;
+    rb->len+=res;
+  }
+
+  fclose(fp);
+}
+
+/*
+ * Metrics file
+ */
+
+typedef struct msnapshot {
+  struct metricshdr hdr;
+  metric table[MAXMETRICS];
+} msnapshot;
+
+static int readmetrics(msnapshot *ms) {
+  struct metricshdr *hdr;
+  struct stat st;
+  uint64_t generation;
+  void *map;
+  int fd, tries;
+
+  memset(ms, 0, sizeof(msnapshot));
+
+  if ((fd=open(opts.metricsfile, O_RDONLY)) < 0)
+    return -1;
+
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct metricshdr) + MAXMETRICS * sizeof(metric)) {
+    close(fd);
+    return -1;
+  }
+
+  map=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  hdr=map;
+  if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC || hdr->version != METRICS_VERSION ||
+      hdr->slotsize != sizeof(metric) || hdr->maxmetrics != MAXMETRICS) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  for (tries=0;tries<100;tries++) {
+    generation=__atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE);
+    if (generation & 1)
+      continue;
+
+    memcpy(ms, map, sizeof(msnapshot));
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE) == generation)
+      break;
+  }
+
+  munmap(map, st.st_size);
+
+  return tries == 100 ? -1 : 0;
+}
+
+static metric *findsnapshot(msnapshot *ms, const char *name) {
+  int i;
+
+  for (i=0;i<MAXMETRICS;i++)
+    if (ms->table[i].type != METRIC_FREE && !strcmp(ms->table[i].name, name))
+      return &ms->table[i];
+
+  return NULL;
+}
+
+typedef struct hookline {
+  const char *name;
+  uint64_t calls, us;
+} hookline;
+
+static int hookcompare(const void *a, const void *b) {
+  const hookline *ha=a, *hb=b;
+
+  return ha->us < hb->us ? 1 : ha->us > hb->us ? -1 : 0;
+}
+
+static void peakrss(pid_t pid) {
+  char path[64], line[256];
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  if (!(fp=fopen(path, "r"))) {
+    printf("peak RSS: unavailable (pid %d)\n", (int)pid);
+    return;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    if (!strncmp(line, "VmHWM:", 6)) {
+      printf("peak RSS: %s", line + 6 + strspn(line + 6, " \t"));
+      break;
+    }
+  }
+
+  fclose(fp);
+}
+
+static void report(msnapshot *before) {
+  static msnapshot after;
+  hookline hl[MAXMETRICS];
+  unsigned long totallines=0;
+  uint64_t totalus=0;
+  metric *mp, *bp;
+  int i, count;
+
+  printf("\n%-16s %12s %10s %12s\n", "phase", "lines", "seconds", "lines/s");
+  for (i=0;i<nphases;i++) {
+    uint64_t us=phases[i].end - phases[i].start;
+
+    printf("%-16s %12lu %10.3f %12.0f\n", phases[i].name, phases[i].lines, us / 1000000.0, us ? phases[i].lines * 1000000.0 / us : 0.0);
+    totallines+=phases[i].lines;
+    totalus+=us;
+  }
+  printf("%-16s %12lu %10.3f %12.0f\n", "total", totallines, totalus / 1000000.0, totalus ? totallines * 1000000.0 / totalus : 0.0);
+
+  /* nsmstats refreshes its gauges once a second */
+  usleep(1200000);
+
+  if (readmetrics(&after)) {
+    printf("\nno metrics available from %s\n", opts.metricsfile);
+    return;
+  }
+
+  printf("\n");
+  peakrss((pid_t)after.hdr.pid);
+
+  for (i=0,count=0;i<MAXMETRICS;i++) {
+    mp=&after.table[i];
+    if (mp->type != METRIC_HISTOGRAM || strncmp(mp->name, "core_hook_", 10) || !strcmp(mp->name, "core_hook_latency_us"))
+      continue;
+
+    hl[count].name=mp->name;
+    hl[count].calls=mp->value;
+    hl[count].us=mp->sum;
+    if ((bp=findsnapshot(before, mp->name))) {
+      hl[count].calls-=bp->value;
+      hl[count].us-=bp->sum;
+    }
+    if (hl[count].calls)
+      count++;
+  }
+
+  if (!count) {
+    printf("\nno per-hook times, set core.hookprofile=1\n");
+  } else {
+    qsort(hl, count, sizeof(hookline), hookcompare);
+    printf("\n%-28s %12s %12s %10s\n", "hook", "calls", "total ms", "mean us");
+    for (i=0;i<count;i++)
+      printf("%-28s %12llu %12.1f %10.2f\n", hl[i].name, (unsigned long long)hl[i].calls, hl[i].us / 1000.0, (double)hl[i].us / hl[i].calls);
+  }
+
+  for (i=0,count=0;i<MAXMETRICS;i++) {
+    mp=&after.table[i];
+    if (mp->type != METRIC_GAUGE || strncmp(mp->name, "nsm_", 4))
+      continue;
+    if (!count++)
+      printf("\n%-28s %12s\n", "nsmalloc pool", "kB");
+    printf("%-28s %12llu\n", mp->name, (unsigned long long)mp->value / 1024);
+  }
+
+  if (!count)
+    printf("\nno nsmalloc pool sizes, load the nsmstats module\n");
+}
+
+/*
+ * The link
+ */
+
+static rbuf out;
+static size_t outpos;
+static char inbuf[65536];
+static size_t inlen;
+static char barrier[32];
+static int barrierseen;
+
+static void sendline(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
+static void sendline(const char *format, ...) {
+  char line[MAXLINE + 3];
+  va_list va;
+  int len;
+
+  va_start(va, format);
+  len=vsnprintf(line, sizeof(line) - 2, format, va);
+  va_end(va);
+
+  if (len > (int)sizeof(line) - 3)
+    len=sizeof(line) - 3;
+
+  rbprintf(&out, "%.*s\r\n", len, line);
+}
+
+static void flushout(void) {
+  ssize_t res;
+
+  if (outpos == out.len)
+    return;
+
+  res=write(sfd, out.buf + outpos, out.len - outpos);
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return;
+    die("write to newserv failed: %s", strerror(errno));
+  }
+
+  if ((outpos+=res) == out.len) {
+    outpos=out.len=0;
+  } else if (outpos > 1048576) {
+    memmove(out.buf, out.buf + outpos, out.len - outpos);
+    out.len-=outpos;
+    outpos=0;
+  }
+}
+
+static void handleline(char *line, char *peernumeric) {
+  char *argv[16], *p;
+  int argc=0;
+
+  for (p=line;*p && argc<16;) {
+    if (*p == ':' && argc) {
+      argv[argc++]=p+1;
+      break;
+    }
+    argv[argc++]=p;
+    if (!(p=strchr(p, ' ')))
+      break;
+    *p++='\0';
+  }
+
+  if (argc >= 7 && !strcmp(argv[0], "SERVER")) {
+    if (peernumeric)
+      snprintf(peernumeric, 3, "%s", argv[6]);
+    return;
+  }
+
+  if (argc < 2)
+    return;
+
+  if (!strcmp(argv[1], "G")) {
+    sendline("%s Z %s :%s", opts.hub, opts.hub, argv[argc-1]);
+  } else if (!strcmp(argv[1], "Z")) {
+    if (*barrier && !strcmp(argv[argc-1], barrier))
+      barrierseen=1;
+  } else if (!strcmp(argv[1], "SQ")) {
+    die("newserv squit: %s", argv[argc-1]);
+  }
+}
+
+static void readin(char *peernumeric) {
+  char *start, *end;
+  ssize_t res;
+
+  res=read(sfd, inbuf + inlen, sizeof(inbuf) - inlen - 1);
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return;
+    die("read from newserv failed: %s", strerror(errno));
+  }
+
+  if (!res)
+    die("newserv closed the link");
+
+  inlen+=res;
+  inbuf[inlen]='\0';
+
+  for (start=inbuf;(end=strchr(start, '\n'));start=end+1) {
+    *end='\0';
+    if (end > start && end[-1] == '\r')
+      end[-1]='\0';
+    handleline(start, peernumeric);
+  }
+
+  inlen-=start - inbuf;
+  memmove(inbuf, start, inlen);
+
+  /* long garbage, drop it */
+  if (inlen == sizeof(inbuf) - 1)
+    inlen=0;
+}
+
+static void pump(char *peernumeric) {
+  struct pollfd pfd;
+
+  pfd.fd=sfd;
+  pfd.events=POLLIN | (outpos < out.len ? POLLOUT : 0);
+
+  if (poll(&pfd, 1, 1000) < 0) {
+    if (errno == EINTR)
+      return;
+    die("poll failed: %s", strerror(errno));
+  }
+
+  if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+    readin(peernumeric);
+
+  if (pfd.revents & POLLOUT)
+    flushout();
+}
+
+static void waitbarrier(int number) {
+  time_t deadline=time(NULL) + opts.timeout;
+
+  snprintf(barrier, sizeof(barrier), "replay%d", number);
+  barrierseen=0;
+  sendline("%s G :%s", opts.hub, barrier);
+
+  while (!barrierseen) {
+    if (time(NULL) > deadline)
+      die("timed out waiting for newserv to catch up");
+    pump(NULL);
+  }
+
+  *barrier='\0';
+}
+
+static void replay(rbuf *stream) {
+  char *p=stream->buf, *end=stream->buf + stream->len, *eol;
+  rphase *ph=NULL;
+  size_t len;
+
+  while (p < end) {
+    if (!(eol=memchr(p, '\n', end - p)))
+      eol=end;
+    len=eol - p;
+    if (len && p[len-1] == '\r')
+      len--;
+
+    if (len > 7 && !strncmp(p, "#phase ", 7)) {
+      if (ph && ph->lines) {
+        waitbarrier((int)(ph - phases));
+        ph->end=now_us();
+        ph=NULL;
+      }
+      if (nphases == MAXPHASES)
+        die("too many phases");
+      if (!ph)
+        ph=&phases[nphases++];
+      snprintf(ph->name, sizeof(ph->name), "%.*s", (int)(len - 7), p + 7);
+    } else if (len && *p != '#') {
+      if (!ph) {
+        ph=&phases[nphases++];
+        snprintf(ph->name, sizeof(ph->name), "replay");
+      }
+      if (!ph->lines)
+        ph->start=now_us();
+      ph->lines++;
+
+      rbprintf(&out, "%.*s\r\n", (int)(len > MAXLINE ? MAXLINE : len), p);
+      while (out.len - outpos > WRITEAHEAD)
+        pump(NULL);
+    }
+
+    p=eol + 1;
+  }
+
+  if (ph && ph->lines) {
+    waitbarrier((int)(ph - phases));
+    ph->end=now_us();
+  }
+}
+
+static int listenon(int port) {
+  struct sockaddr_in sin;
+  int fd, opt=1;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family=AF_INET;
+  sin.sin_port=htons(port);
+  sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+
+  if ((fd=socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+      bind(fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(fd, 1))
+    die("unable to listen on 127.0.0.1:%d: %s", port, strerror(errno));
+
+  return fd;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "Usage: %s [options] [-- newserv-command [args...]]\n"
+    "  -p port       port to listen on for newserv (default %d)\n"
+    "  -P pass       link password to send (default %s)\n"
+    "  -H numeric    hub server numeric (default %s)\n"
+    "  -N numeric    newserv's numeric, never generated (default %s)\n"
+    "  -s servers    leaf servers (default %d)\n"
+    "  -u users      users (default %d)\n"
+    "  -c channels   channels (default %d)\n"
+    "  -j joins      channels joined per user in the burst (default %d)\n"
+    "  -e events     churn events (default %d)\n"
+    "  -x splits     netsplits and relinks (default %d)\n"
+    "  -S seed       generator seed (default %lu)\n"
+    "  -r file       replay a recorded stream instead of generating one\n"
+    "  -w file       write the generated stream to file and exit\n"
+    "  -m file       newserv's metrics file (default %s)\n"
+    "  -t seconds    how long to wait for newserv to catch up (default %d)\n",
+    name, opts.port, opts.pass, opts.hub, opts.avoid, opts.servers, opts.users, opts.channels, opts.joins,
+    opts.churn, opts.splits, opts.seed, opts.metricsfile, opts.timeout);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  static msnapshot before;
+  rbuf stream={ NULL, 0, 0 };
+  char peernumeric[3]="";
+  int lfd, c, flags, i;
+  time_t deadline;
+
+  while ((c=getopt(argc, argv, "p:P:H:N:s:u:c:j:e:x:S:r:w:m:t:")) != -1) {
+    switch (c) {
+      case 'p': opts.port=atoi(optarg); break;
+      case 'P': opts.pass=optarg; break;
+      case 'H': snprintf(opts.hub, sizeof(opts.hub), "%s", optarg); break;
+      case 'N': snprintf(opts.avoid, sizeof(opts.avoid), "%s", optarg); break;
+      case 's': opts.servers=atoi(optarg); break;
+      case 'u': opts.users=atoi(optarg); break;
+      case 'c': opts.channels=atoi(optarg); break;
+      case 'j': opts.joins=atoi(optarg); break;
+      case 'e': opts.churn=atoi(optarg); break;
+      case 'x': opts.splits=atoi(optarg); break;
+      case 'S': opts.seed=strtoul(optarg, NULL, 10); break;
+      case 'r': opts.recorded=optarg; break;
+      case 'w': opts.writeto=optarg; break;
+      case 'm': opts.metricsfile=optarg; break;
+      case 't': opts.timeout=atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (strlen(opts.hub) != 2 || strlen(opts.avoid) != 2)
+    usage(argv[0]);
+
+  if (opts.recorded) {
+    load_stream(&stream, opts.recorded);
+  } else {
+    gen_stream(&stream);
+  }
+
+  if (opts.writeto) {
+    FILE *fp=fopen(opts.writeto, "w");
+
+    if (!fp || fwrite(stream.buf, 1, stream.len, fp) != stream.len || fclose(fp))
+      die("unable to write %s: %s", opts.writeto, strerror(errno));
+    return 0;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  lfd=listenon(opts.port);
+
+  if (optind < argc) {
+    if ((child=fork()) < 0)
+      die("fork failed: %s", strerror(errno));
+
+    if (!child) {
+      close(lfd);
+      execvp(argv[optind], argv + optind);
+      fprintf(stderr, "unable to run %s: %s\n", argv[optind], strerror(errno));
+      _exit(127);
+    }
+  }
+
+  printf("waiting for newserv on 127.0.0.1:%d...\n", opts.port);
+  fflush(stdout);
+
+  if ((sfd=accept(lfd, NULL, NULL)) < 0)
+    die("accept failed: %s", strerror(errno));
+  close(lfd);
+
+  flags=fcntl(sfd, F_GETFL);
+  fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
+
+  deadline=time(NULL) + opts.timeout;
+  while (!*peernumeric) {
+    if (time(NULL) > deadline)
+      die("newserv never sent SERVER");
+    pump(peernumeric);
+  }
+
+  if (!strcmp(peernumeric, opts.hub))
+    die("newserv is using the hub numeric %s, pick another with -H", opts.hub);
+
+  if (!opts.recorded) {
+    for (i=0;i<opts.servers;i++)
+      if (servers[i].numeric == numerictolong(peernumeric, 2))
+        die("newserv's numeric %s clashes with a generated server, rerun with -N %s", peernumeric, peernumeric);
+  }
+
+  sendline("PASS :%s", opts.pass);
+  sendline("SERVER %s 1 %ld %ld J10 %s]]] +h6 :replay hub", HUBNAME, (long)time(NULL), (long)time(NULL), opts.hub);
+
+  /* let newserv finish its own burst before we start the clock */
+  waitbarrier(-1);
+
+  if (readmetrics(&before))
+    fprintf(stderr, "warning: unable to read metrics from %s\n", opts.metricsfile);
+
+  replay(&stream);
+  report(&before);
+
+  close(sfd);
+
+  if (child > 0) {
+    kill(child, SIGINT);
+    waitpid(child, NULL, 0);
+  }
+
+  return 0;
+}
@@ -43,7 +43,7 @@ int rq_success = 0;
 int rq_blocked = 0;
 
 /* log fd */
-FILE *rq_logfd;
+nslog *rq_log;
 
 /* config */
 sstring *rq_qserver, *rq_qnick, *rq_sserver, *rq_snick;
@@ -93,7 +93,7 @@ void _init(void) {
   
   qr_initrequest();
 
-  rq_logfd = fopen("logs/request.log", "a");
+  rq_log = nslogopen("logs/request.log", 0666);
   
   scheduleoneshot(time(NULL) + 1, (ScheduleCallback)&rq_registeruser, NULL);
 }
@@ -126,8 +126,8 @@ void _fini(void) {
   freesstring(rq_real);
   freesstring(rq_auth);
 
-  if (rq_logfd != NULL)
-    fclose(rq_logfd);
+  nslogclose(rq_log);
+  rq_log = NULL;
 
   deleteallschedules((ScheduleCallback)&rq_registeruser);
 }
@@ -356,16 +356,15 @@ int rqcmd_request(void *user, int cargc, char **cargv) {
 
   retval = lr_requestl(rqnick, np, cp, qnick);
 
-  if (rq_logfd != NULL) {
+  if (rq_log != NULL) {
     now[0] = '\0';
     now_ts = time(NULL);
     strftime(now, sizeof(now), "%c", localtime(&now_ts));
 
-    fprintf(rq_logfd, "%s: request (%s) for %s from %s!%s@%s%s%s: Request was %s.\n",
+    nslogprintf(rq_log, "%s: request (%s) for %s from %s!%s@%s%s%s: Request was %s.\n",
       now, rq_qnick->content, cp->index->name->content,
       np->nick, np->ident, np->host->name->content, IsAccount(np)?"/":"", IsAccount(np)?np->authname:"",
       (retval == RQ_OK) ? "accepted" : "denied");
-    fflush(rq_logfd);
   }
 
   if (retval == RQ_ERROR)
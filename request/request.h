@@ -1,4 +1,5 @@
 #include "../lib/sstring.h"
+#include "../core/nslog.h"
 
 #define RQU_ANY 0
 #define RQU_OPER 1
@@ -10,7 +11,7 @@
 extern int rq_failed;
 extern int rq_success;
 
-extern FILE *rq_logfd;
+extern nslog *rq_log;
 
 /* config */
 extern sstring *rq_qserver, *rq_qnick, *rq_sserver, *rq_snick;
@@ -82,7 +82,7 @@ static void rq_cleanup_fasttrack(void *arg) {
 
     ft = *pft;
 
-    for(j=0;j<NICKHASHSIZE && !foundnick;j++) {
+    for(j=0;j<nicktablesize && !foundnick;j++) {
       for(tnp=nicktable[j];tnp;tnp=tnp->next) {
         if(tnp->exts[rqnext]==ft) {
           foundnick = 1;
@@ -156,7 +156,7 @@ static void qr_result(requestrec *req, int outcome, char failcode, char *message
     return;
   }
 
-  if (rq_logfd != NULL) {
+  if (rq_log != NULL) {
     now[0] = '\0';
     now_ts = time(NULL);
 
@@ -169,13 +169,12 @@ static void qr_result(requestrec *req, int outcome, char failcode, char *message
     }
 
     strftime(now, sizeof(now), "%c", localtime(&now_ts));
-    fprintf(rq_logfd, "%s: request (%s) for %s (%d unique users, "
+    nslogprintf(rq_log, "%s: request (%s) for %s (%d unique users, "
             "%d total users) from %s!%s@%s%s%s: Request was %s (%c).\n", now,
             (req->what == QR_CSERVE) ? rq_qnick->content : rq_snick->content,
             req->cip->name->content, unique, total,
             tnp->nick, tnp->ident, tnp->host->name->content, IsAccount(tnp)?"/":"", IsAccount(tnp)?tnp->authname:"",
             (outcome == QR_OK) ? "accepted" : "denied", failcode);
-    fflush(rq_logfd);
   }
   
   if (outcome==QR_OK) {
@@ -52,7 +52,7 @@ void _init(void) {
   registerhook(HOOK_NICK_RENAME, &hook_rename);
   registernumerichandler(317, whois_reply_handler, 7);
 
-  for(i=0;i<NICKHASHSIZE;i++)
+  for(i=0;i<nicktablesize;i++)
     for(np=nicktable[i];np;np=np->next)
       queue_scan_nick(np);
 
@@ -169,7 +169,7 @@ static int cmd_listnosignonusers(void *source, int cargc, char **cargv) {
   int i, found = 0, displayed = 0;
   nick *np;
 
-  for(i=0;i<NICKHASHSIZE;i++) {
+  for(i=0;i<nicktablesize;i++) {
     for(np=nicktable[i];np;np=np->next) {
       if(!NickOnServiceServer(np) && !getnicksignon(np)) {
         if(found++ < 100) {
@@ -0,0 +1,570 @@
+/*
+ * synthnet: builds a synthetic network straight into the nick, host,
+ * realname, authname, channel and patricia structures and times the
+ * common lookups and full walks over it.
+ *
+ * Runs once when loaded, while not linked to a network: it adds servers
+ * under our own numeric, creates users through handlenickmsg() and joins
+ * them with addnicktochannel(), runs the benchmarks, then squits the
+ * servers again.  Results go to the log and, one key=value line per
+ * benchmark, to synthnet.results.
+ *
+ * [synthnet]
+ * users=100000        users to create
+ * clones=2.5          clone count power law exponent (users per host)
+ * maxclones=500       largest clone count
+ * ipv6=10             percentage of hosts on IPv6
+ * accounts=40         percentage of hosts whose users are authed
+ * channels=20000      channels
+ * joins=3             mean channels joined per user
+ * chanexponent=0.9    channel popularity follows a Zipf law with this exponent
+ *                     (joins past SYNTHMAXCHAN users are counted as full)
+ * banchans=100        this many of the biggest channels get bans...
+ * bans=20             ...this many each
+ * ops=1000000         iterations of each lookup benchmark
+ * walks=10            repeats of each full walk
+ * seed=1
+ * keep=0            leave the network up until unload, for other benchmarks
+ *                     (lua/lib/iterbench.lua, say)
+ * results=data/synthnet.results
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../core/error.h"
+#include "../core/config.h"
+#include "../core/schedule.h"
+#include "../core/metrics.h"
+#include "../lib/sstring.h"
+#include "../lib/base64.h"
+#include "../lib/irc_ipv6.h"
+#include "../lib/version.h"
+#include "../lib/splitmix.h"
+#include "../lib/benchmark.h"
+#include "../irc/irc.h"
+#include "../server/server.h"
+#include "../nick/nick.h"
+#include "../channel/channel.h"
+#include "../authext/authext.h"
+#include "../patricia/patricia.h"
+
+MODULE_VERSION("");
+
+#define SYNTHMAXUSERS 262144  /* per server, numerics are 3 characters */
+#define SYNTHMAXCHAN  20000   /* chanuserhash sizes are unsigned short and grow by 1.5x */
+
+static struct {
+  long users, maxclones, channels, banchans, bans, ops, walks;
+  double clones, chanexponent, joins;
+  int ipv6, accounts, keep;
+  unsigned long seed;
+} sp;
+
+static long synthservers[MAXSERVERS];
+static int nsynthservers;
+static nick **synthnicks;
+static long nsynthnicks;
+static channel **synthchans;
+static benchresults results;
+static uint64_t rndstate;
+
+static void synthrun(void *arg);
+
+void _init(void) {
+  sp.users=benchconfiglong("synthnet", "users", "100000");
+  sp.clones=benchconfigdouble("synthnet", "clones", "2.5");
+  sp.maxclones=benchconfiglong("synthnet", "maxclones", "500");
+  sp.ipv6=benchconfiglong("synthnet", "ipv6", "10");
+  sp.accounts=benchconfiglong("synthnet", "accounts", "40");
+  sp.channels=benchconfiglong("synthnet", "channels", "20000");
+  sp.joins=benchconfigdouble("synthnet", "joins", "3");
+  sp.chanexponent=benchconfigdouble("synthnet", "chanexponent", "0.9");
+  sp.banchans=benchconfiglong("synthnet", "banchans", "100");
+  sp.bans=benchconfiglong("synthnet", "bans", "20");
+  sp.ops=benchconfiglong("synthnet", "ops", "1000000");
+  sp.walks=benchconfiglong("synthnet", "walks", "10");
+  sp.seed=benchconfiglong("synthnet", "seed", "1");
+  sp.keep=benchconfiglong("synthnet", "keep", "0");
+
+  if (sp.users < 1 || sp.channels < 1 || sp.ops < 1 || sp.walks < 1 || sp.maxclones < 1 || sp.clones <= 1.0) {
+    Error("synthnet", ERR_ERROR, "Bad parameters, not running.");
+    return;
+  }
+
+  if (sp.banchans > sp.channels)
+    sp.banchans=sp.channels;
+
+  benchopen(&results, "synthnet");
+
+  /* let the rest of the modules finish loading first */
+  scheduleoneshot(time(NULL), &synthrun, NULL);
+}
+
+void _fini(void) {
+  int i;
+
+  deleteschedule(NULL, &synthrun, NULL);
+
+  for (i=0;i<nsynthservers;i++)
+    deleteserver(synthservers[i]);
+  nsynthservers=0;
+
+  benchclose(&results);
+}
+
+/* runs with the same seed build the same network */
+static uint64_t synthrnd(void) {
+  return splitmix64(&rndstate);
+}
+
+static double synthrnd01(void) {
+  return splitmix64_01(&rndstate);
+}
+
+/* Discrete power law on [1, max] by inverting the continuous one */
+static long synthpowerlaw(double exponent, long max) {
+  double k=pow(1.0 - synthrnd01(), -1.0 / (exponent - 1.0));
+
+  return (k >= (double)max) ? max : (long)k;
+}
+
+static double *synthzipf(long n, double exponent) {
+  double *cdf=malloc(n * sizeof(double)), total=0;
+  long i;
+
+  if (!cdf)
+    return NULL;
+
+  for (i=0;i<n;i++)
+    cdf[i]=(total+=pow(i + 1, -exponent));
+  for (i=0;i<n;i++)
+    cdf[i]/=total;
+
+  return cdf;
+}
+
+static long synthzipfpick(double *cdf, long n) {
+  double r=synthrnd01();
+  long lo=0, hi=n-1, mid;
+
+  while (lo < hi) {
+    mid=(lo + hi) / 2;
+    if (cdf[mid] < r)
+      lo=mid + 1;
+    else
+      hi=mid;
+  }
+
+  return lo;
+}
+
+static long synthrss(void) {
+  long size, resident=0;
+  FILE *fp;
+
+  if ((fp=fopen("/proc/self/statm", "r"))) {
+    if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+      resident=0;
+    fclose(fp);
+  }
+
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void synthhashstats(const char *name, hashtable *ht) {
+  unsigned long i, used=0, entries=0, chain, maxchain=0;
+  char extra[128];
+  void *item;
+
+  for (i=0;i<ht->size;i++) {
+    for (chain=0,item=ht->buckets[i];item;item=*(void **)((char *)item + ht->nextoffset))
+      chain++;
+    if (chain) {
+      used++;
+      entries+=chain;
+      if (chain > maxchain)
+        maxchain=chain;
+    }
+  }
+
+  snprintf(extra, sizeof(extra), "size=%lu entries=%lu used=%lu maxchain=%lu meanchain=%.2f",
+    (unsigned long)ht->size, entries, used, maxchain, used ? (double)entries / used : 0.0);
+  benchresult(&results, name, 0, 0, extra);
+}
+
+static int synthaddservers(void) {
+  char name[HOSTLEN], numeric[6], ts[20], *cargv[8];
+  long need=(sp.users + SYNTHMAXUSERS - 1) / SYNTHMAXUSERS, i;
+  long mine=numerictolong(getmynumeric(), 2);
+
+  snprintf(ts, sizeof(ts), "%ld", (long)getnettime());
+
+  for (i=MAXSERVERS-1;i>=0 && nsynthservers<need;i--) {
+    if (i == mine || serverlist[i].name)
+      continue;
+
+    snprintf(name, sizeof(name), "synth%d.synthnet.test", nsynthservers);
+    longtonumeric2(i, 2, numeric);
+    strcpy(numeric + 2, "]]]");
+
+    cargv[0]=name;
+    cargv[1]="1";
+    cargv[2]=ts;
+    cargv[3]=ts;
+    cargv[4]="J10";
+    cargv[5]=numeric;
+    cargv[6]="+h6";
+    cargv[7]="synthetic server";
+
+    if (handleservermsg(getmynumeric(), 8, cargv) != CMD_OK)
+      return -1;
+
+    synthservers[nsynthservers++]=i;
+  }
+
+  return (nsynthservers == need) ? 0 : -1;
+}
+
+static void synthaddusers(void) {
+  char nickname[32], ts[20], ident[32], hostname[HOSTLEN+1], modes[8], account[ACCOUNTLEN+64];
+  char ipbuf[32], numeric[6], realname[REALLEN+1], servernum[3], *cargv[11];
+  long u=0, host=0, clones, i, s;
+  struct irc_in_addr ip;
+  int cargc, v6, authed;
+  uint64_t start;
+
+  snprintf(ts, sizeof(ts), "%ld", (long)getnettime());
+  start=metricclock();
+
+  while (u < sp.users) {
+    clones=synthpowerlaw(sp.clones, sp.maxclones);
+    v6=(synthrnd() % 100) < sp.ipv6;
+    authed=(synthrnd() % 100) < sp.accounts;
+    host++;
+
+    snprintf(hostname, sizeof(hostname), "h%ld.isp%ld.synthnet.test", host, host % 97);
+    if (v6) {
+      memset(&ip, 0, sizeof(ip));
+      ip.in6_16[0]=htons(0x2001);
+      ip.in6_16[1]=htons(0x0db8);
+      ip.in6_16[2]=htons((host >> 16) & 0xffff);
+      ip.in6_16[3]=htons(host & 0xffff);
+      ip.in6_16[7]=htons(1);
+      iptobase64(ipbuf, &ip, 128, 1);
+    } else {
+      longtonumeric2(0x0A000000L | (host & 0xFFFFFF), 6, ipbuf);
+    }
+
+    for (i=0;i<clones && u<sp.users;i++,u++) {
+      s=u % nsynthservers;
+      longtonumeric2(synthservers[s], 2, servernum);
+      longtonumeric2(synthservers[s], 2, numeric);
+      longtonumeric2(u / nsynthservers, 3, numeric + 2);
+
+      snprintf(nickname, sizeof(nickname), "syn%ld", u);
+      snprintf(ident, sizeof(ident), "id%ld", u % 1000);
+      snprintf(realname, sizeof(realname), "synthetic user %ld", u % (sp.users / 4 + 1));
+      strcpy(modes, authed ? "+ir" : "+i");
+
+      cargc=0;
+      cargv[cargc++]=nickname;
+      cargv[cargc++]="1";
+      cargv[cargc++]=ts;
+      cargv[cargc++]=ident;
+      cargv[cargc++]=hostname;
+      cargv[cargc++]=modes;
+      if (authed) {
+        /* clones share the account */
+        snprintf(account, sizeof(account), "acct%ld:%s:%ld", host, ts, host);
+        cargv[cargc++]=account;
+      }
+      cargv[cargc++]=ipbuf;
+      cargv[cargc++]=numeric;
+      cargv[cargc++]=realname;
+
+      handlenickmsg(servernum, cargc, cargv);
+
+      if ((synthnicks[nsynthnicks]=getnickbynumeric(numerictolong(numeric, 5))))
+        nsynthnicks++;
+    }
+  }
+
+  {
+    char extra[64];
+
+    snprintf(extra, sizeof(extra), "hosts=%ld users=%ld", host, nsynthnicks);
+    benchresult(&results, "populate_nicks", nsynthnicks, metricclock()-start, extra);
+  }
+}
+
+static void synthjoin(void) {
+  double *cdf=synthzipf(sp.channels, sp.chanexponent);
+  char name[CHANNELLEN+1], extra[64];
+  unsigned long ops=0, joins=0, full=0;
+  long u, c, j, count;
+  uint64_t start;
+
+  if (!cdf) {
+    Error("synthnet", ERR_ERROR, "Unable to allocate channel distribution.");
+    return;
+  }
+
+  start=metricclock();
+
+  for (u=0;u<nsynthnicks;u++) {
+    count=(long)(synthrnd01() * 2 * sp.joins + 0.5);
+
+    for (j=0;j<count;j++) {
+      c=synthzipfpick(cdf, sp.channels);
+
+      if (!synthchans[c]) {
+        snprintf(name, sizeof(name), "#synth%ld", c);
+        if (!(synthchans[c]=findchannel(name)))
+          synthchans[c]=createchannel(name);
+        synthchans[c]->timestamp=getnettime();
+      }
+
+      /* the channel would complain, duplicates just mean one join fewer */
+      if (getnumerichandlefromchanhash(synthchans[c]->users, synthnicks[u]->numeric))
+        continue;
+
+      if (synthchans[c]->users->totalusers >= SYNTHMAXCHAN) {
+        full++;
+        continue;
+      }
+
+      ops++;
+      if (!addnicktochannel(synthchans[c], synthnicks[u]->numeric))
+        joins++;
+    }
+  }
+
+  snprintf(extra, sizeof(extra), "joins=%lu full=%lu biggest=%u", joins, full, synthchans[0] ? synthchans[0]->users->totalusers : 0);
+  benchresult(&results, "populate_joins", ops, metricclock()-start, extra);
+
+  free(cdf);
+}
+
+static void synthsetbans(void) {
+  char mask[NICKLEN+HOSTLEN+10];
+  long c, b;
+
+  for (c=0;c<sp.banchans;c++) {
+    if (!synthchans[c])
+      continue;
+
+    for (b=0;b<sp.bans;b++) {
+      switch (b % 3) {
+        case 0:
+          snprintf(mask, sizeof(mask), "*!*@h%ld.isp%ld.synthnet.test", (long)(synthrnd() % (sp.users + 1)), (long)(synthrnd() % 97));
+          break;
+        case 1:
+          snprintf(mask, sizeof(mask), "syn%ld*!*@*", (long)(synthrnd() % (sp.users + 1)));
+          break;
+        default:
+          snprintf(mask, sizeof(mask), "*!id%ld@*.isp%ld.synthnet.test", (long)(synthrnd() % 1000), (long)(synthrnd() % 97));
+          break;
+      }
+      setban(synthchans[c], mask);
+    }
+  }
+}
+
+static void synthlookups(void) {
+  char misses[1024][NICKLEN+1], extra[64];
+  unsigned long i, hits;
+  struct irc_in_addr ip;
+  patricia_node_t *node;
+  uint64_t start;
+  nick *np;
+
+  for (i=0;i<1024;i++)
+    snprintf(misses[i], sizeof(misses[i]), "nosuch%lu", i);
+
+  start=metricclock();
+  for (i=0,hits=0;i<sp.ops;i++)
+    if (getnickbynick(synthnicks[synthrnd() % nsynthnicks]->nick))
+      hits++;
+  snprintf(extra, sizeof(extra), "hits=%lu", hits);
+  benchresult(&results, "getnickbynick", sp.ops, metricclock()-start, extra);
+
+  start=metricclock();
+  for (i=0,hits=0;i<sp.ops;i++)
+    if (getnickbynick(misses[i & 1023]))
+      hits++;
+  snprintf(extra, sizeof(extra), "hits=%lu", hits);
+  benchresult(&results, "getnickbynick_miss", sp.ops, metricclock()-start, extra);
+
+  start=metricclock();
+  for (i=0,hits=0;i<sp.ops;i++)
+    if (findhost(synthnicks[synthrnd() % nsynthnicks]->host->name->content))
+      hits++;
+  snprintf(extra, sizeof(extra), "hits=%lu", hits);
+  benchresult(&results, "findhost", sp.ops, metricclock()-start, extra);
+
+  start=metricclock();
+  for (i=0,hits=0;i<sp.ops;i++) {
+    np=synthnicks[synthrnd() % nsynthnicks];
+    if (np->auth && findauthname(np->auth->userid))
+      hits++;
+  }
+  snprintf(extra, sizeof(extra), "hits=%lu", hits);
+  benchresult(&results, "findauthname", sp.ops, metricclock()-start, extra);
+
+  if (sp.banchans && synthchans[0]) {
+    start=metricclock();
+    for (i=0,hits=0;i<sp.ops;i++) {
+      channel *cp=synthchans[synthrnd() % sp.banchans];
+
+      if (cp && nickbanned(synthnicks[synthrnd() % nsynthnicks], cp, 0))
+        hits++;
+    }
+    snprintf(extra, sizeof(extra), "banned=%lu bans=%ld", hits, sp.bans);
+    benchresult(&results, "nickbanned", sp.ops, metricclock()-start, extra);
+  }
+
+  /* existing addresses only bump a refcount */
+  start=metricclock();
+  for (i=0;i<sp.ops;i++) {
+    np=synthnicks[synthrnd() % nsynthnicks];
+    node=refnode(iptree, &np->ipaddress, PATRICIA_MAXBITS);
+    derefnode(iptree, node);
+  }
+  benchresult(&results, "refnode_existing", sp.ops, metricclock()-start, "");
+
+  /* new ones are inserted into the tree and removed again */
+  start=metricclock();
+  for (i=0;i<sp.ops;i++) {
+    np=synthnicks[synthrnd() % nsynthnicks];
+    ip=np->ipaddress;
+    ip.in6_16[6]^=htons(0x8000 | (synthrnd() & 0x7fff));
+    node=refnode(iptree, &ip, PATRICIA_MAXBITS);
+    derefnode(iptree, node);
+  }
+  benchresult(&results, "refnode_new", sp.ops, metricclock()-start, "");
+}
+
+static void synthwalks(void) {
+  unsigned long visited, total;
+  patricia_node_t *node;
+  chanindex *cip;
+  char extra[64];
+  uint64_t start;
+  long w, i;
+  nick *np;
+
+  start=metricclock();
+  for (w=0,visited=0,total=0;w<sp.walks;w++) {
+    for (i=0;i<nicktablesize;i++) {
+      for (np=nicktable[i];np;np=np->next) {
+        visited++;
+        if (IsInvisible(np))
+          total++;
+      }
+    }
+  }
+  snprintf(extra, sizeof(extra), "matched=%lu", total / sp.walks);
+  benchresult(&results, "walk_nicktable", visited, metricclock()-start, extra);
+
+  start=metricclock();
+  for (w=0,visited=0,total=0;w<sp.walks;w++) {
+    for (i=0;i<nickcolumns.count;i++) {
+      visited++;
+      if (nickcolumns.umodes[i] & UMODE_INV)
+        total++;
+    }
+  }
+  snprintf(extra, sizeof(extra), "matched=%lu", total / sp.walks);
+  benchresult(&results, "walk_nickcolumns", visited, metricclock()-start, extra);
+
+  start=metricclock();
+  for (w=0,visited=0,total=0;w<sp.walks;w++) {
+    for (i=0;i<chantablesize;i++) {
+      for (cip=chantable[i];cip;cip=cip->next) {
+        visited++;
+        if (cip->channel)
+          total+=cip->channel->users->totalusers;
+      }
+    }
+  }
+  snprintf(extra, sizeof(extra), "members=%lu", total / sp.walks);
+  benchresult(&results, "walk_chantable", visited, metricclock()-start, extra);
+
+  start=metricclock();
+  for (w=0,visited=0,total=0;w<sp.walks;w++) {
+    PATRICIA_WALK(iptree->head, node) {
+      visited++;
+      total+=node->usercount;
+    } PATRICIA_WALK_END;
+  }
+  snprintf(extra, sizeof(extra), "users=%lu", total / sp.walks);
+  benchresult(&results, "walk_iptree", visited, metricclock()-start, extra);
+}
+
+static void synthrun(void *arg) {
+  long rssbefore, rssafter;
+  char extra[128];
+  uint64_t start;
+  int i;
+
+  if (connected) {
+    Error("synthnet", ERR_WARNING, "Linked to a network, not building a synthetic one on top of it.");
+    return;
+  }
+
+  rndstate=sp.seed;
+  nsynthservers=0;
+  nsynthnicks=0;
+  synthnicks=calloc(sp.users, sizeof(nick *));
+  synthchans=calloc(sp.channels, sizeof(channel *));
+
+  if (!synthnicks || !synthchans) {
+    Error("synthnet", ERR_ERROR, "Unable to allocate %ld users and %ld channels.", sp.users, sp.channels);
+    goto out;
+  }
+
+  rssbefore=synthrss();
+
+  if (synthaddservers()) {
+    Error("synthnet", ERR_ERROR, "Unable to find enough free server numerics.");
+  } else {
+    synthaddusers();
+    synthjoin();
+    synthsetbans();
+
+    rssafter=synthrss();
+    snprintf(extra, sizeof(extra), "rss_kb=%ld bytes_per_user=%.0f", (rssafter - rssbefore) / 1024,
+      nsynthnicks ? (double)(rssafter - rssbefore) / nsynthnicks : 0.0);
+    benchresult(&results, "memory", 0, 0, extra);
+
+    synthhashstats("hash_nick", &nickhashtable);
+    synthhashstats("hash_host", &hosthashtable);
+    synthhashstats("hash_realname", &realnamehashtable);
+    synthhashstats("hash_channel", &chanhashtable);
+
+    if (nsynthnicks) {
+      synthlookups();
+      synthwalks();
+    }
+  }
+
+  if (!sp.keep) {
+    start=metricclock();
+    for (i=0;i<nsynthservers;i++)
+      deleteserver(synthservers[i]);
+    snprintf(extra, sizeof(extra), "servers=%d", nsynthservers);
+    benchresult(&results, "teardown", nsynthnicks, metricclock()-start, extra);
+    nsynthservers=0;
+  }
+
+out:
+  free(synthnicks);
+  free(synthchans);
+  synthnicks=NULL;
+  synthchans=NULL;
+}
@@ -1450,7 +1450,7 @@ void trojanscan_fill_channels(void *arg) {
       count++;
   }
   
-  for (i=0;i<CHANNELHASHSIZE;i++) {
+  for (i=0;i<chantablesize;i++) {
     for(chn=chantable[i];chn;chn=chn->next) {
       if (chn->channel && !IsKey(chn->channel) && !IsInviteOnly(chn->channel) && !IsRegOnly(chn->channel) && (chn->channel->users->totalusers >= trojanscan_minchansize)) {
         lp = (trojanscan_prechannels *)tmalloc(sizeof(trojanscan_prechannels));
@@ -2090,7 +2090,7 @@ nick *trojanscan_selectuser(void) {
   int target = trojanscan_minmaxrand(0, 500), loops = 150, j;
   nick *np;
   do {
-    for (j=trojanscan_minmaxrand(0, NICKHASHSIZE-1);j<NICKHASHSIZE;j++)
+    for (j=trojanscan_minmaxrand(0, nicktablesize-1);j<nicktablesize;j++)
       for(np=nicktable[j];np;np=np->next)
         if (!--target)
           return np;
@@ -11,6 +11,7 @@
 #include "trusts.h"
 
 trustgroup *tglist;
+unsigned int trusts_generation;
 
 void th_dbupdatecounts(trusthost *);
 void tg_dbupdatecounts(trustgroup *);
@@ -33,6 +34,7 @@ void trusts_freeall(void) {
   }
 
   tglist = NULL;
+  trusts_generation++;
 }
 
 trustgroup *tg_getbyid(unsigned int id) {
@@ -46,6 +48,7 @@ trustgroup *tg_getbyid(unsigned int id) {
 }
 
 void th_free(trusthost *th) {
+  trusts_generation++;
   triggerhook(HOOK_TRUSTS_LOSTHOST, th);
 
   nsfree(POOL_TRUSTS, th);
@@ -66,19 +69,214 @@ static void th_updatechildren(trusthost *th) {
   }
 }
 
-void th_linktree(void) {
+typedef struct thsortentry {
+  struct irc_in_addr ip; /* masked */
+  trusthost *th;
+} thsortentry;
+
+static void th_maskip(struct irc_in_addr *out, const struct irc_in_addr *ip, unsigned char bits) {
+  int i;
+
+  for(i=0;i<8;i++) {
+    if(bits >= 16) {
+      out->in6_16[i] = ip->in6_16[i];
+      bits -= 16;
+    } else {
+      out->in6_16[i] = htons(ntohs(ip->in6_16[i]) & (unsigned short)(0xffff << (16 - bits)));
+      bits = 0;
+    }
+  }
+}
+
+static int th_ipcmp(const struct irc_in_addr *a, const struct irc_in_addr *b) {
+  int i;
+
+  for(i=0;i<8;i++)
+    if(a->in6_16[i] != b->in6_16[i])
+      return (ntohs(a->in6_16[i]) < ntohs(b->in6_16[i])) ? -1 : 1;
+
+  return 0;
+}
+
+/* address order, less specific first for the same address */
+static int th_sortcmp(const void *a, const void *b) {
+  const thsortentry *ea = a, *eb = b;
+  int r = th_ipcmp(&ea->ip, &eb->ip);
+
+  if(r)
+    return r;
+
+  return (int)ea->th->bits - (int)eb->th->bits;
+}
+
+static thsortentry *th_sortedhosts(int *count) {
   trustgroup *tg;
   trusthost *th;
+  thsortentry *hosts;
+  int i = 0;
 
-  /* ugh */
   for(tg=tglist;tg;tg=tg->next)
     for(th=tg->hosts;th;th=th->next)
-      th->parent = th_getsmallestsupersetbyhost(&th->ip, th->bits);
+      i++;
 
-  for(tg=tglist;tg;tg=tg->next)
-    for(th=tg->hosts;th;th=th->next)
-      if(th->parent)
-        th_updatechildren(th->parent);
+  *count = i;
+  if(!i)
+    return NULL;
+
+  hosts = nsmalloc(POOL_TRUSTS, sizeof(thsortentry) * i);
+  if(!hosts)
+    return NULL;
+
+  i = 0;
+  for(tg=tglist;tg;tg=tg->next) {
+    for(th=tg->hosts;th;th=th->next) {
+      th_maskip(&hosts[i].ip, &th->ip, th->bits);
+      hosts[i++].th = th;
+    }
+  }
+
+  qsort(hosts, i, sizeof(thsortentry), th_sortcmp);
+
+  return hosts;
+}
+
+/*
+ * CIDR ranges either nest or don't overlap, so in address order the parent
+ * of each host is the nearest enclosing one still on the stack.
+ */
+void th_linktree(void) {
+  trustgroup *tg;
+  trusthost *th, *stack[129];
+  thsortentry *hosts;
+  int i, count, sp = 0;
+
+  trusts_generation++;
+
+  hosts = th_sortedhosts(&count);
+  if(!hosts) {
+    if(!count)
+      return;
+
+    /* ugh */
+    for(tg=tglist;tg;tg=tg->next)
+      for(th=tg->hosts;th;th=th->next)
+        th->parent = th_getsmallestsupersetbyhost(&th->ip, th->bits);
+
+    for(tg=tglist;tg;tg=tg->next)
+      for(th=tg->hosts;th;th=th->next)
+        if(th->parent)
+          th_updatechildren(th->parent);
+
+    return;
+  }
+
+  for(i=0;i<count;i++) {
+    th = hosts[i].th;
+
+    while(sp && !(stack[sp-1]->bits < th->bits && ipmask_check(&th->ip, &stack[sp-1]->ip, stack[sp-1]->bits)))
+      sp--;
+
+    th->parent = sp ? stack[sp-1] : NULL;
+    th->children = NULL;
+    stack[sp++] = th;
+  }
+
+  for(i=count-1;i>=0;i--) {
+    th = hosts[i].th;
+    if(th->parent) {
+      th->nextbychild = th->parent->children;
+      th->parent->children = th;
+    }
+  }
+
+  nsfree(POOL_TRUSTS, hosts);
+}
+
+static int th_bitscmp(const void *a, const void *b) {
+  return (int)(*(trusthost **)a)->bits - (int)(*(trusthost **)b)->bits;
+}
+
+static int th_rootcmp(const void *a, const void *b) {
+  struct irc_in_addr ia, ib;
+  trusthost *tha = *(trusthost **)a, *thb = *(trusthost **)b;
+
+  th_maskip(&ia, &tha->ip, tha->bits);
+  th_maskip(&ib, &thb->ip, thb->bits);
+
+  return th_ipcmp(&ia, &ib);
+}
+
+/*
+ * Moves users into a batch of hosts added without th_adjusthosts, after
+ * th_linktree has run.  Hosts with a parent take matching users from it,
+ * least specific first, the others are top level and can only have picked
+ * up users with no trust at all, which one pass over the nick table finds.
+ */
+void th_adjustbatch(trusthost **hosts, int count) {
+  struct irc_in_addr ipaddress_canonical;
+  trusthost *th, **roots;
+  int i, rootcount = 0;
+  nick *np, *nnp;
+
+  if(!count)
+    return;
+
+  qsort(hosts, count, sizeof(trusthost *), th_bitscmp);
+
+  roots = nsmalloc(POOL_TRUSTS, sizeof(trusthost *) * count);
+  if(!roots) {
+    for(i=0;i<count;i++)
+      th_adjusthosts(hosts[i], hosts[i]->parent, NULL);
+    return;
+  }
+
+  for(i=0;i<count;i++) {
+    th = hosts[i];
+
+    if(!th->parent) {
+      roots[rootcount++] = th;
+      continue;
+    }
+
+    for(np=th->parent->users;np;np=nnp) {
+      nnp = nextbytrust(np);
+      ip_canonicalize_tunnel(&ipaddress_canonical, &np->ipaddress);
+      if(ipmask_check(&ipaddress_canonical, &th->ip, th->bits)) {
+        trusts_lostnick(np, 1);
+        trusts_newnick(np, 1);
+      }
+    }
+  }
+
+  if(rootcount) {
+    qsort(roots, rootcount, sizeof(trusthost *), th_rootcmp);
+
+    /* the ipnode column already holds the canonical address */
+    NICKCOLUMN_WALK(i, np) {
+      struct irc_in_addr masked, *ip = &nickcolumns.ipnode[i]->prefix->sin;
+      int lo = 0, hi = rootcount - 1, mid, found = -1;
+
+      if(gettrusthost(np))
+        continue;
+
+      /* last root starting at or before this address */
+      while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        th_maskip(&masked, &roots[mid]->ip, roots[mid]->bits);
+        if(th_ipcmp(&masked, ip) <= 0) {
+          found = mid;
+          lo = mid + 1;
+        } else {
+          hi = mid - 1;
+        }
+      }
+
+      if(found != -1 && ipmask_check(ip, &roots[found]->ip, roots[found]->bits))
+        trusts_newnick(np, 1);
+    }
+  }
+
+  nsfree(POOL_TRUSTS, roots);
 }
 
 trusthost *th_add(trusthost *ith) {
@@ -97,14 +295,19 @@ trusthost *th_add(trusthost *ith) {
   th->children = NULL;
 
   th->marker = 0;
+  th->generation = 0;
 
   th->next = th->group->hosts;
   th->group->hosts = th;
 
+  trusts_generation++;
+
   return th;
 }
 
 void tg_free(trustgroup *tg, int created) {
+  trusts_generation++;
+
   if(created)
     triggerhook(HOOK_TRUSTS_LOSTGROUP, tg);
 
@@ -134,6 +337,7 @@ trustgroup *tg_add(trustgroup *itg) {
   tg->hosts = NULL;
   tg->marker = 0;
   tg->count = 0;
+  tg->generation = 0;
 
   memset(tg->exts, 0, sizeof(tg->exts));
 
@@ -376,12 +580,10 @@ void th_adjusthosts(trusthost *th, trusthost *superset, trusthost *subset) {
     nick *np;
     int i;
 
-    for(i=0;i<NICKHASHSIZE;i++) {
-      for(np=nicktable[i];np;np=np->next) {
-        ip_canonicalize_tunnel(&ipaddress_canonical, &np->ipaddress);
-        if(!gettrusthost(np) && ipmask_check(&ipaddress_canonical, &th->ip, th->bits))
-          trusts_newnick(np, 1);
-      }
+    /* test the canonical address in the ipnode column before touching the nick */
+    NICKCOLUMN_WALK(i, np) {
+      if(ipmask_check(&nickcolumns.ipnode[i]->prefix->sin, &th->ip, th->bits) && !gettrusthost(np))
+        trusts_newnick(np, 1);
     }
   }
 }
@@ -461,6 +663,7 @@ int tg_modify(trustgroup *oldtg, trustgroup *newtg) {
   vnewtg.lastmaxusereset = newtg->lastmaxusereset;
 
   memcpy(oldtg, &vnewtg, sizeof(trustgroup));
+  trusts_generation++;
 
   return 1;
 }
@@ -468,6 +671,7 @@ int tg_modify(trustgroup *oldtg, trustgroup *newtg) {
 int th_modify(trusthost *oldth, trusthost *newth) {
   oldth->maxpernode = newth->maxpernode;
   oldth->nodebits = newth->nodebits;
+  trusts_generation++;
 
   return 1;
 }
@@ -68,13 +68,61 @@ void trusts_lostnick(nick *sender, int moving) {
 }
 
 static void __lostnick(int hooknum, void *arg) {
+  /* already dealt with in __masslostnicks */
+  if(NickInMassLoss((nick *)arg))
+    return;
+
   trusts_lostnick(arg, 0);
 }
 
+/*
+ * Split: run the counts and hooks for each nick as usual, but rebuild each
+ * affected host's user list once instead of unlinking nick by nick.
+ */
+static void __masslostnicks(int hooknum, void *arg) {
+  masslostnicks *ml = arg;
+  unsigned int marker = nextthmarker();
+  trusthost *th;
+  nick *np, *lp, *next;
+  void *args[2];
+  int i;
+
+  args[1] = (void *)0L;
+
+  for(i=0;i<ml->count;i++) {
+    args[0] = ml->nicks[i];
+    __counthandler(HOOK_TRUSTS_LOSTNICK, args);
+    triggerhook(HOOK_TRUSTS_LOSTNICK, args);
+  }
+
+  for(i=0;i<ml->count;i++) {
+    th = gettrusthost(ml->nicks[i]);
+    if(!th || th->marker == marker)
+      continue;
+
+    th->marker = marker;
+
+    for(np=th->users,lp=NULL;np;np=next) {
+      next = nextbytrust(np);
+
+      if(!NickInMassLoss(np)) {
+        lp = np;
+        continue;
+      }
+
+      if(lp) {
+        setnextbytrust(lp, next);
+      } else {
+        th->users = next;
+      }
+    }
+  }
+}
+
 static void __counthandler(int hooknum, void *arg) {
   time_t t = getnettime();
   void **args = arg;
-  trusthost *th = gettrusthost((nick *)args[0]);
+  trusthost *th = gettrusthost((nick *)args[0]), *pth;
   trustgroup *tg;
 
   if(!th)
@@ -82,6 +130,12 @@ static void __counthandler(int hooknum, void *arg) {
 
   tg = th->group;
   tg->lastseen = th->lastseen = t;
+
+  /* node counts for every enclosing host change too */
+  tg->generation++;
+  for(pth=th;pth;pth=pth->parent)
+    pth->generation++;
+
   if(hooknum == HOOK_TRUSTS_NEWNICK) {
     th->count++;
     if(th->count > th->maxusage)
@@ -108,15 +162,15 @@ static void __dbloaded(int hooknum, void *arg) {
 
   registerhook(HOOK_NICK_NEWNICK, __newnick);
   registerhook(HOOK_NICK_LOSTNICK, __lostnick);
+  registerhook(HOOK_SERVER_MASSLOSTNICKS, __masslostnicks);
 
 /*  registerhook(HOOK_TRUSTS_NEWNICK, __counthandler);
   registerhook(HOOK_TRUSTS_LOSTNICK, __counthandler);
 */
 
   /* we could do it by host, but hosts and ips are not bijective :( */
-  for(i=0;i<NICKHASHSIZE;i++)
-    for(np=nicktable[i];np;np=np->next)
-      __newnick(0, np);
+  NICKCOLUMN_WALK(i, np)
+    __newnick(0, np);
 }
 
 static void __dbclosed(int hooknum, void *arg) {
@@ -126,6 +180,7 @@ static void __dbclosed(int hooknum, void *arg) {
 
   deregisterhook(HOOK_NICK_NEWNICK, __newnick);
   deregisterhook(HOOK_NICK_LOSTNICK, __lostnick);
+  deregisterhook(HOOK_SERVER_MASSLOSTNICKS, __masslostnicks);
 
 /*
   deregisterhook(HOOK_TRUSTS_NEWNICK, __counthandler);
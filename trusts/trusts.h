@@ -74,6 +74,7 @@ typedef struct trusthost {
 
   struct trusthost *parent, *children;
   unsigned int marker;
+  unsigned int generation; /* bumped when users in this host or its children change */
 
   struct trusthost *nextbychild;
   struct trusthost *next;
@@ -96,6 +97,7 @@ typedef struct trustgroup {
   unsigned int count;
 
   unsigned int marker;
+  unsigned int generation; /* bumped when users in this group change */
 
   struct trustgroup *next;
 
@@ -124,6 +126,7 @@ char *rtrim(char *);
 
 /* data.c */
 extern trustgroup *tglist;
+extern unsigned int trusts_generation; /* bumped when any group or host is added, removed or changed */
 trustgroup *tg_getbyid(unsigned int);
 void th_free(trusthost *);
 trusthost *th_add(trusthost *);
@@ -138,6 +141,7 @@ void th_getsuperandsubsets(struct irc_in_addr *, uint32_t, trusthost **, trustho
 trusthost *th_getsubsetbyhost(struct irc_in_addr *ip, uint32_t mask);
 trusthost *th_getnextsubsetbyhost(trusthost *th, struct irc_in_addr *ip, uint32_t mask);
 void th_linktree(void);
+void th_adjustbatch(trusthost **, int);
 unsigned int nexttgmarker(void);
 unsigned int nextthmarker(void);
 trusthost *th_getbyid(unsigned int);
@@ -159,10 +163,12 @@ void trustsdb_insertth(char *, trusthost *, unsigned int);
 void trustsdb_inserttg(char *, trustgroup *);
 trustgroup *tg_copy(trustgroup *);
 trusthost *th_copy(trusthost *);
+trusthost *th_insert(trusthost *);
 void tg_update(trustgroup *);
 void tg_delete(trustgroup *);
 void th_update(trusthost *);
 void th_delete(trusthost *);
+void th_unlink(trusthost *);
 void trustlog(trustgroup *tg, const char *user, const char *format, ...);
 void trustlogspewid(nick *np, unsigned int groupid, unsigned int limit);
 void trustlogspewname(nick *np, const char *groupname, unsigned int limit);
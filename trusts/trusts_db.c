@@ -253,8 +253,9 @@ static void tg_dbupdatecounts(trustgroup *tg) {
   trustsdb->squery(trustsdb, "UPDATE ? SET lastseen = ?, maxusage = ? WHERE id = ?", "Ttuu", "groups", tg->lastseen, tg->maxusage, tg->id);
 }
 
-trusthost *th_copy(trusthost *ith) {
-  trusthost *th, *superset, *subset;
+/* Adds a host without moving users into it, see th_adjustbatch */
+trusthost *th_insert(trusthost *ith) {
+  trusthost *th;
 
   th = th_add(ith);
   if(!th)
@@ -262,6 +263,16 @@ trusthost *th_copy(trusthost *ith) {
 
   trustsdb_insertth("hosts", th, th->group->id);
 
+  return th;
+}
+
+trusthost *th_copy(trusthost *ith) {
+  trusthost *th, *superset, *subset;
+
+  th = th_insert(ith);
+  if(!th)
+    return NULL;
+
   th_getsuperandsubsets(&ith->ip, ith->bits, &superset, &subset);
   th_adjusthosts(th, superset, subset);
   th_linktree();
@@ -376,8 +387,9 @@ void trustsdb_deleteth(char *table, trusthost *th) {
     "Tu", "hosts", th->id); 
 }
 
-void th_delete(trusthost *th) {
-  trusthost **pnext;
+/* Removes a host, children move up to its parent until the next th_linktree */
+void th_unlink(trusthost *th) {
+  trusthost **pnext, *child, *nchild;
   nick *np;
 
   for(pnext=&(th->group->hosts);*pnext;pnext=&((*pnext)->next)) {
@@ -396,6 +408,15 @@ void th_delete(trusthost *th) {
     }
   }
 
+  for(child=th->children;child;child=nchild) {
+    nchild = child->nextbychild;
+    child->parent = th->parent;
+    if(th->parent) {
+      child->nextbychild = th->parent->children;
+      th->parent->children = child;
+    }
+  }
+
   for(np=th->users;np;np=nextbytrust(np))
     settrusthost(np, NULL);
 
@@ -410,7 +431,10 @@ void th_delete(trusthost *th) {
 
   trustsdb_deleteth("hosts", th);
   th_free(th);
+}
 
+void th_delete(trusthost *th) {
+  th_unlink(th);
   th_linktree();
 }
 
@@ -5,6 +5,10 @@
 #include "../core/hooks.h"
 #include "../core/config.h"
 #include "../core/error.h"
+#include "../core/nsmalloc.h"
+#include "../core/metrics.h"
+#include "../core/schedule.h"
+#include "../server/server.h"
 #include "../lib/version.h"
 #include "../lib/sha1.h"
 #include "../lib/hmac.h"
@@ -14,6 +18,38 @@
 
 MODULE_VERSION("");
 
+/*
+ * Every change gets a sequence number and is kept in a ring, so a slave
+ * which missed some can ask for everything after the last one it applied
+ * instead of a full snapshot.  The epoch changes whenever we (re)load the
+ * database, sequence numbers from different epochs aren't comparable.
+ */
+#define REPLLOGSIZE 131072 /* power of two */
+
+static char *repllog[REPLLOGSIZE];
+static unsigned int replepoch, replseq;
+static metric *seqmetric, *replayedmetric, *snapshotmetric;
+static int bulkreplication;
+
+static void clearlog(void) {
+  int i;
+
+  for(i=0;i<REPLLOGSIZE;i++) {
+    nsfree(POOL_TRUSTS, repllog[i]);
+    repllog[i] = NULL;
+  }
+
+  replseq = 0;
+
+  /* never reuse an epoch, even if we reload twice in a second */
+  if((unsigned int)time(NULL) > replepoch)
+    replepoch = time(NULL);
+  else
+    replepoch++;
+
+  metricset(seqmetric, 0);
+}
+
 static void broadcast(SHA1_CTX *c, unsigned int replicationid, unsigned int lineno, char *command, char *format, ...) {
   char buf[512], buf2[600];
   va_list va;
@@ -36,6 +72,64 @@ static void broadcast(SHA1_CTX *c, unsigned int replicationid, unsigned int line
   SHA1Update(c, (unsigned char *)buf2, len + 1);
 }
 
+/*
+ * The same snapshot as one deflated xsb bulk transfer, a few hundred lines
+ * on the wire rather than one per group and host.  Slaves which don't know
+ * about trsnap need bulkreplication=0 to get it line by line.
+ */
+static int snapshotappend(char **buf, size_t *len, size_t *size, const char *format, ...) {
+  va_list va;
+  char line[512], *nbuf;
+  int linelen;
+
+  va_start(va, format);
+  linelen = vsnprintf(line, sizeof(line), format, va);
+  va_end(va);
+
+  if(linelen < 0)
+    return 0;
+  if(linelen > sizeof(line) - 1)
+    linelen = sizeof(line) - 1;
+
+  if(*len + linelen + 2 > *size) {
+    *size = (*size + linelen + 2) * 2;
+    nbuf = nsrealloc(POOL_TRUSTS, *buf, *size);
+    if(!nbuf)
+      return 0;
+    *buf = nbuf;
+  }
+
+  memcpy(*buf + *len, line, linelen);
+  *len+=linelen;
+  (*buf)[(*len)++] = '\n';
+
+  return 1;
+}
+
+static int replicatebulk(int forced, unsigned int lines) {
+  char *buf = NULL;
+  size_t len = 0, size = 0;
+  trustgroup *tg;
+  trusthost *th;
+  int ok;
+
+  ok = snapshotappend(&buf, &len, &size, "%d %u %u %u", forced, lines, replepoch, replseq);
+
+  for(tg=tglist;ok&&tg;tg=tg->next) {
+    ok = snapshotappend(&buf, &len, &size, "G %s", dumptg(tg, 0));
+
+    for(th=tg->hosts;ok&&th;th=th->next)
+      ok = snapshotappend(&buf, &len, &size, "H %s", dumpth(th, 0));
+  }
+
+  if(ok)
+    ok = xsb_broadcastbulk("trsnap", NULL, buf, len);
+
+  nsfree(POOL_TRUSTS, buf);
+
+  return ok;
+}
+
 static void replicate(int forced) {
   SHA1_CTX s;
   unsigned int lineno, lines;
@@ -54,9 +148,19 @@ static void replicate(int forced) {
       lines++;
   }
 
+  if(bulkreplication) {
+    if(replicatebulk(forced, lines)) {
+      metricinc(snapshotmetric);
+      return;
+    }
+
+    Error("trusts_master", ERR_WARNING, "Unable to send bulk snapshot, falling back to line by line.");
+  }
+
   SHA1Init(&s);
   lineno = 1;
-  broadcast(&s, replicationid, lineno++, "trinit", "%d %u", forced, lines);
+  broadcast(&s, replicationid, lineno++, "trinit", "%d %u %u %u", forced, lines, replepoch, replseq);
+  metricinc(snapshotmetric);
 
   for(tg=tglist;tg;tg=tg->next) {
     broadcast(&s, replicationid, lineno++, "trdata", "G %s", dumptg(tg, 0));
@@ -69,6 +173,46 @@ static void replicate(int forced) {
   xsb_broadcast("trfini", NULL, "%u %u %s", replicationid, lineno, hmac_printhex(digest, digestbuf, SHA1_DIGESTSIZE));
 }
 
+/* entries are "<timestamp> <op> <data>" */
+static int appendlog(const char *op, const char *data) {
+  char buf[512];
+  unsigned int slot;
+
+  snprintf(buf, sizeof(buf), "%u %s %s", (unsigned int)time(NULL), op, data);
+
+  slot = (replseq + 1) & (REPLLOGSIZE - 1);
+  nsfree(POOL_TRUSTS, repllog[slot]);
+  repllog[slot] = nsmalloc(POOL_TRUSTS, strlen(buf) + 1);
+  if(!repllog[slot])
+    return 0;
+
+  strcpy(repllog[slot], buf);
+  replseq++;
+  metricset(seqmetric, replseq);
+
+  return 1;
+}
+
+static void logchange(const char *op, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static void logchange(const char *op, const char *format, ...) {
+  char buf[512];
+  va_list va;
+
+  va_start(va, format);
+  vsnprintf(buf, sizeof(buf), format, va);
+  va_end(va);
+
+  /* a hole in the log would stall every slave, start a new one instead */
+  if(!appendlog(op, buf)) {
+    Error("trusts_master", ERR_WARNING, "Unable to log trust change, forcing resync.");
+    clearlog();
+    replicate(1);
+    return;
+  }
+
+  xsb_broadcast("trlog", NULL, "%u %u %s", replepoch, replseq, repllog[replseq & (REPLLOGSIZE - 1)]);
+}
+
 static int xsb_tr_requeststart(void *source, int argc, char **argv) {
   static time_t last = 0;
   time_t t = time(NULL);
@@ -82,40 +226,119 @@ static int xsb_tr_requeststart(void *source, int argc, char **argv) {
   return CMD_OK;
 }
 
+/* trrequestlog epoch fromseq */
+static int xsb_tr_requestlog(void *source, int argc, char **argv) {
+  nick *np = source;
+  unsigned int epoch, from, seq;
+  int home = homeserver(np->numeric);
+
+  if(home < 0 || argc < 2)
+    return CMD_ERROR;
+
+  epoch = strtoul(argv[0], NULL, 10);
+  from = strtoul(argv[1], NULL, 10);
+
+  /* from another epoch or already gone from the ring, needs a snapshot */
+  if(epoch != replepoch || !from || from > replseq + 1 || replseq + 1 - from > REPLLOGSIZE)
+    return xsb_tr_requeststart(source, argc, argv);
+
+  for(seq=from;seq<=replseq;seq++)
+    if(!repllog[seq & (REPLLOGSIZE - 1)])
+      return xsb_tr_requeststart(source, argc, argv);
+
+  for(seq=from;seq<=replseq;seq++)
+    xsb_broadcast("trlog", &serverlist[home], "%u %u %s", replepoch, seq, repllog[seq & (REPLLOGSIZE - 1)]);
+
+  metricadd(replayedmetric, replseq + 1 - from);
+
+  xsb_broadcast("trloghead", &serverlist[home], "%u %u", replepoch, replseq);
+
+  return CMD_OK;
+}
+
+/* lets slaves notice they missed the tail of the log */
+static void loghead(void *arg) {
+  xsb_broadcast("trloghead", NULL, "%u %u", replepoch, replseq);
+}
+
 static void groupadded(int hooknum, void *arg) {
   trustgroup *tg = arg;
 
-  xsb_broadcast("traddgroup", NULL, "%s", dumptg(tg, 0));
+  logchange("addgroup", "%s", dumptg(tg, 0));
 }
 
 static void groupremoved(int hooknum, void *arg) {
   trustgroup *tg = arg;
 
-  xsb_broadcast("trdelgroup", NULL, "%u", tg->id);
+  logchange("delgroup", "%u", tg->id);
 }
 
 static void hostadded(int hooknum, void *arg) {
   trusthost *th = arg;
 
-  xsb_broadcast("traddhost", NULL, "%s", dumpth(th, 0));
+  logchange("addhost", "%s", dumpth(th, 0));
 }
 
 static void hostremoved(int hooknum, void *arg) {
   trusthost *th = arg;
 
-  xsb_broadcast("trdelhost", NULL, "%u", th->id);
+  logchange("delhost", "%u", th->id);
 }
 
 static void groupmodified(int hooknum, void *arg) {
   trustgroup *tg = arg;
 
-  xsb_broadcast("trmodifygroup", NULL, "%s", dumptg(tg, 0));
+  logchange("modifygroup", "%s", dumptg(tg, 0));
 }
 
 static void hostmodified(int hooknum, void *arg) {
   trusthost *th = arg;
 
-  xsb_broadcast("trmodifyhost", NULL, "%s", dumpth(th, 0));
+  logchange("modifyhost", "%s", dumpth(th, 0));
+}
+
+/*
+ * Logs no-op changes without sending them, then advertises the new head so
+ * slaves fetch the lot through trrequestlog.  Slaves report how long they
+ * took to catch up.
+ */
+static int trusts_cmdtrustreplbench(void *source, int argc, char **argv) {
+  nick *np = source;
+  unsigned int count = 100000, i;
+  uint64_t start;
+  trustgroup *tg = tglist;
+
+  if(argc > 0)
+    count = strtoul(argv[0], NULL, 10);
+
+  if(!count || count > REPLLOGSIZE) {
+    controlreply(np, "Count must be between 1 and %d.", REPLLOGSIZE);
+    return CMD_ERROR;
+  }
+
+  if(!tglist) {
+    controlreply(np, "No trust groups to modify.");
+    return CMD_ERROR;
+  }
+
+  start = metricclock();
+
+  for(i=0;i<count;i++) {
+    if(!appendlog("modifygroup", dumptg(tg, 0))) {
+      controlreply(np, "Unable to log change, forcing resync.");
+      clearlog();
+      replicate(1);
+      return CMD_ERROR;
+    }
+
+    tg = tg->next ? tg->next : tglist;
+  }
+
+  loghead(NULL);
+
+  controlreply(np, "Logged %u changes in %.3fs, now at %u:%u.", count, (metricclock() - start) / 1000000.0, replepoch, replseq);
+
+  return CMD_OK;
 }
 
 static int trusts_cmdtrustforceresync(void *source, int argc, char **argv) {
@@ -135,7 +358,10 @@ static void __dbloaded(int hooknum, void *arg) {
 
   commandsregistered = 1;
 
+  clearlog();
+
   xsb_addcommand("trrequeststart", 0, xsb_tr_requeststart);
+  xsb_addcommand("trrequestlog", 2, xsb_tr_requestlog);
 
   registerhook(HOOK_TRUSTS_ADDGROUP, groupadded);
   registerhook(HOOK_TRUSTS_DELGROUP, groupremoved);
@@ -150,6 +376,9 @@ static void __dbloaded(int hooknum, void *arg) {
     replicate(1);
 
   registercontrolhelpcmd("trustforceresync", NO_DEVELOPER, 0, trusts_cmdtrustforceresync, "Usage: trustforceresync");
+  registercontrolhelpcmd("trustreplbench", NO_DEVELOPER, 1, trusts_cmdtrustreplbench, "Usage: trustreplbench ?count?\nLogs count no-op trust changes and has the slaves catch up on them.");
+
+  schedulerecurring(time(NULL) + 60, 0, 60, loghead, NULL);
 }
 
 static void __dbclosed(int hooknum, void *arg) {
@@ -158,15 +387,20 @@ static void __dbclosed(int hooknum, void *arg) {
   commandsregistered = 0;
 
   xsb_delcommand("trrequeststart", xsb_tr_requeststart);
+  xsb_delcommand("trrequestlog", xsb_tr_requestlog);
 
-  registerhook(HOOK_TRUSTS_ADDGROUP, groupadded);
-  registerhook(HOOK_TRUSTS_DELGROUP, groupremoved);
-  registerhook(HOOK_TRUSTS_ADDHOST, hostadded);
-  registerhook(HOOK_TRUSTS_DELGROUP, hostremoved);
-  registerhook(HOOK_TRUSTS_MODIFYGROUP, groupmodified);
-  registerhook(HOOK_TRUSTS_MODIFYHOST, hostmodified);
+  deregisterhook(HOOK_TRUSTS_ADDGROUP, groupadded);
+  deregisterhook(HOOK_TRUSTS_DELGROUP, groupremoved);
+  deregisterhook(HOOK_TRUSTS_ADDHOST, hostadded);
+  deregisterhook(HOOK_TRUSTS_DELHOST, hostremoved);
+  deregisterhook(HOOK_TRUSTS_MODIFYGROUP, groupmodified);
+  deregisterhook(HOOK_TRUSTS_MODIFYHOST, hostmodified);
 
   deregistercontrolcmd("trustforceresync", trusts_cmdtrustforceresync);
+  deregistercontrolcmd("trustreplbench", trusts_cmdtrustreplbench);
+
+  deleteallschedules(loghead);
+  clearlog();
 }
 
 void _init(void) {
@@ -180,6 +414,13 @@ void _init(void) {
 
   loaded = 1;
 
+  m = getconfigitem("trusts", "bulkreplication");
+  bulkreplication = !m || atoi(m->content);
+
+  seqmetric = registermetric("trusts_master_seq", METRIC_GAUGE);
+  replayedmetric = registermetric("trusts_master_replayed", METRIC_COUNTER);
+  snapshotmetric = registermetric("trusts_master_snapshots", METRIC_COUNTER);
+
   registerhook(HOOK_TRUSTS_DB_LOADED, __dbloaded);
   registerhook(HOOK_TRUSTS_DB_CLOSED, __dbclosed);
 
@@ -206,4 +447,8 @@ void _fini(void) {
   trusts_closedb(0);
 
   __dbclosed(0, NULL);
+
+  deregistermetric(seqmetric);
+  deregistermetric(replayedmetric);
+  deregistermetric(snapshotmetric);
 }
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -22,10 +23,13 @@
 #include "../core/events.h"
 #include "../core/schedule.h"
 #include "../core/nsmalloc.h"
+#include "../core/metrics.h"
 #include "../core/hooks.h"
 #include "../core/config.h"
 #include "../control/control.h"
 #include "../lib/irc_string.h"
+#include "../lib/splitmix.h"
+#include "../lib/benchmark.h"
 #include "../irc/irc.h"
 #include "../glines/glines.h"
 #include "../patricianick/patricianick.h"
@@ -36,16 +40,23 @@ MODULE_VERSION("");
 static int countext, enforcepolicy_irc, enforcepolicy_auth;
 
 #define TRUSTBUFSIZE 8192
+#define TRUSTOUTBUFSIZE 16384
 #define TRUSTPASSLEN 128
 #define NONCELEN 16
 
+/* Direct mapped, must be powers of two */
+#define POLICYHOSTCACHESIZE 16384
+#define POLICYIDENTCACHESIZE 16384
+
 typedef struct trustsocket {
   int fd;
   int authed;
   char authuser[SERVERLEN+1];
   char buf[TRUSTBUFSIZE];
+  char outbuf[TRUSTOUTBUFSIZE];
   unsigned char nonce[NONCELEN];
   int size;
+  int outsize;
   time_t connected;
   time_t timeout;
   int accepted;
@@ -67,22 +78,158 @@ typedef struct trustaccount {
 
 trustaccount trustaccounts[MAXSERVERS];
 
-static int checkconnection(const char *username, struct irc_in_addr *ipaddress, int hooknum, int usercountadjustment, char *message, size_t messagelen, int *unthrottle) {
+/*
+ * Decision cache: the trusthost for an address stays valid until
+ * trusts_generation moves, the node count until th->generation does and
+ * ident counts until tg->generation does.  The trusts module bumps those
+ * whenever hosts/groups change or users come and go.
+ */
+typedef struct policyhost {
+  struct irc_in_addr ip;
+  int valid, counted;
+  unsigned int trustsgen, thgen;
+  trusthost *th;
+  int nodecount, servicecount;
+} policyhost;
+
+typedef struct policyident {
+  int valid;
+  unsigned int trustsgen, tggen;
+  trustgroup *tg;
+  char username[USERLEN+1];
+  int identcount;
+} policyident;
+
+static policyhost hostcache[POLICYHOSTCACHESIZE];
+static policyident identcache[POLICYIDENTCACHESIZE];
+static int policycache = 1;
+
+static metric *checkmetric, *hitsmetric, *missesmetric;
+
+static unsigned int policyiphash(struct irc_in_addr *ip) {
+  unsigned int h = 0;
+  int i;
+
+  for(i=0;i<8;i++)
+    h = h * 31 + ip->in6_16[i];
+
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+
+  return h & (POLICYHOSTCACHESIZE - 1);
+}
+
+static policyhost *policygethost(struct irc_in_addr *ip) {
+  policyhost *ph = &hostcache[policyiphash(ip)];
+
+  if(policycache && ph->valid && ph->trustsgen == trusts_generation && !memcmp(&ph->ip, ip, sizeof(struct irc_in_addr))) {
+    metricinc(hitsmetric);
+    return ph;
+  }
+
+  metricinc(missesmetric);
+
+  memcpy(&ph->ip, ip, sizeof(struct irc_in_addr));
+  ph->th = th_getbyhost(ip);
+  ph->trustsgen = trusts_generation;
+  ph->valid = 1;
+  ph->counted = 0;
+
+  return ph;
+}
+
+/* Users on the node, and how many of those are on service servers */
+static void policycountnode(policyhost *ph) {
+  patricia_node_t *head, *node;
+  int i;
+  patricianick_t *pnp;
+  nick *npp;
+
+  if(policycache && ph->counted && ph->thgen == ph->th->generation) {
+    metricinc(hitsmetric);
+    return;
+  }
+
+  metricinc(missesmetric);
+
+  head = refnode(iptree, &ph->ip, ph->th->nodebits);
+  ph->nodecount = head->usercount;
+  ph->servicecount = 0;
+
+  /* Account for borrowed IP addresses. */
+  PATRICIA_WALK(head, node) {
+    pnp = node->exts[pnode_ext];
+
+    if (pnp)
+      for (i = 0; i < PATRICIANICK_HASHSIZE; i++)
+        for (npp = pnp->identhash[i]; npp; npp=npp->exts[pnick_ext])
+          if (NickOnServiceServer(npp))
+            ph->servicecount++;
+  }
+  PATRICIA_WALK_END;
+
+  derefnode(iptree, head);
+
+  ph->thgen = ph->th->generation;
+  ph->counted = 1;
+}
+
+static int policycountident(trustgroup *tg, const char *username) {
+  policyident *pi = &identcache[(irc_crc32i(username) ^ ((unsigned long)tg >> 4)) & (POLICYIDENTCACHESIZE - 1)];
+  int identcount = 0;
+  trusthost *th2;
+  nick *tnp;
+
+  if(policycache && pi->valid && pi->tg == tg && pi->trustsgen == trusts_generation && pi->tggen == tg->generation && !ircd_strcmp(pi->username, username)) {
+    metricinc(hitsmetric);
+    return pi->identcount;
+  }
+
+  metricinc(missesmetric);
+
+  for(th2=tg->hosts;th2;th2=th2->next) {
+    for(tnp=th2->users;tnp;tnp=nextbytrust(tnp)) {
+      if(!ircd_strcmp(tnp->ident, username))
+        identcount++;
+    }
+  }
+
+  /* anything longer can't match a real ident, don't let it alias one */
+  if(strlen(username) <= USERLEN) {
+    strcpy(pi->username, username);
+    pi->tg = tg;
+    pi->trustsgen = trusts_generation;
+    pi->tggen = tg->generation;
+    pi->identcount = identcount;
+    pi->valid = 1;
+  }
+
+  return identcount;
+}
+
+/* walls is 0 for the benchmark, whose synthetic trusts are over their limits all the time */
+static int checkconnection(const char *username, struct irc_in_addr *ipaddress, int hooknum, int usercountadjustment, char *message, size_t messagelen, int *unthrottle, int walls) {
   trusthost *th;
   trustgroup *tg;
+  policyhost *ph;
   struct irc_in_addr ipaddress_canonical;
 
   ip_canonicalize_tunnel(&ipaddress_canonical, ipaddress);
 
-  th = th_getbyhost(&ipaddress_canonical);
-
   if (unthrottle)
     *unthrottle = 0;
 
   if(messagelen>0)
     message[0] = '\0';
   
-  if(!th || !trustsdbloaded || irc_in_addr_is_loopback(ipaddress))
+  if(!trustsdbloaded || irc_in_addr_is_loopback(ipaddress))
+    return POLICY_SUCCESS;
+
+  ph = policygethost(&ipaddress_canonical);
+  th = ph->th;
+
+  if(!th)
     return POLICY_SUCCESS;
 
   tg = th->group;
@@ -95,30 +242,15 @@ static int checkconnection(const char *username, struct irc_in_addr *ipaddress,
    */
 
   if(hooknum == HOOK_TRUSTS_NEWNICK) {
-    patricia_node_t *head, *node;
-    int i, nodecount = 0;
-    patricianick_t *pnp;
-    nick *npp;
-
-    head = refnode(iptree, &ipaddress_canonical, th->nodebits);
-    nodecount = head->usercount;
-
-    /* Account for borrowed IP addresses. */
-    PATRICIA_WALK(head, node) {
-      pnp = node->exts[pnode_ext];
-
-      if (pnp)
-        for (i = 0; i < PATRICIANICK_HASHSIZE; i++)
-          for (npp = pnp->identhash[i]; npp; npp=npp->exts[pnick_ext])
-            if (NickOnServiceServer(npp))
-              usercountadjustment--;
-    }
-    PATRICIA_WALK_END;
+    int nodecount;
 
-    derefnode(iptree, head);
+    policycountnode(ph);
+    nodecount = ph->nodecount;
+    usercountadjustment -= ph->servicecount;
 
     if(th->maxpernode && nodecount + usercountadjustment > th->maxpernode) {
-      controlwall(NO_OPER, NL_CLONING, "Hard connection limit exceeded on subnet: %s (group: %s): %d connected, %d max.", CIDRtostr(*ipaddress, th->nodebits), tg->name->content, nodecount + usercountadjustment, th->maxpernode);
+      if(walls)
+        controlwall(NO_OPER, NL_CLONING, "Hard connection limit exceeded on subnet: %s (group: %s): %d connected, %d max.", CIDRtostr(*ipaddress, th->nodebits), tg->name->content, nodecount + usercountadjustment, th->maxpernode);
       snprintf(message, messagelen, "Too many connections from your host (%s) - see https://www.quakenet.org/help/trusts/connection-limit for details.", IPtostr(*ipaddress));
       return POLICY_FAILURE_NODECOUNT;
     }
@@ -127,7 +259,8 @@ static int checkconnection(const char *username, struct irc_in_addr *ipaddress,
       if(tg->count > (long)tg->exts[countext]) {
         tg->exts[countext] = (void *)(long)tg->count;
 
-        controlwall(NO_OPER, NL_CLONING, "Hard connection limit exceeded (group %s): %d connected, %d max.", tg->name->content, tg->count + usercountadjustment, tg->trustedfor);
+        if(walls)
+          controlwall(NO_OPER, NL_CLONING, "Hard connection limit exceeded (group %s): %d connected, %d max.", tg->name->content, tg->count + usercountadjustment, tg->trustedfor);
         snprintf(message, messagelen, "Too many connections from your trust (%s) - see https://www.quakenet.org/help/trusts/connection-limit for details.", IPtostr(*ipaddress));
       }
 
@@ -136,25 +269,18 @@ static int checkconnection(const char *username, struct irc_in_addr *ipaddress,
     }
 
     if((tg->flags & TRUST_ENFORCE_IDENT) && (username[0] == '~')) {
-      controlwall(NO_OPER, NL_CLONING, "Ident required: %s@%s (group: %s).", username, IPtostr(*ipaddress), tg->name->content);
+      if(walls)
+        controlwall(NO_OPER, NL_CLONING, "Ident required: %s@%s (group: %s).", username, IPtostr(*ipaddress), tg->name->content);
       snprintf(message, messagelen, "IDENTD required from your host (%s) - see https://www.quakenet.org/help/trusts/connection-limit for details.", IPtostr(*ipaddress));
       return POLICY_FAILURE_IDENTD;
     }
 
     if(tg->maxperident > 0) {
-      int identcount = 0;
-      trusthost *th2;
-      nick *tnp;
-
-      for(th2=tg->hosts;th2;th2=th2->next) {
-        for(tnp=th2->users;tnp;tnp=nextbytrust(tnp)) {
-          if(!ircd_strcmp(tnp->ident, username))
-            identcount++;
-        }
-      }
+      int identcount = policycountident(tg, username);
 
       if(identcount + usercountadjustment > tg->maxperident) {
-        controlwall(NO_OPER, NL_CLONING, "Hard ident limit exceeded: %s@%s (group: %s): %d connected, %d max.", username, IPtostr(*ipaddress), tg->name->content, identcount + usercountadjustment, tg->maxperident);
+        if(walls)
+          controlwall(NO_OPER, NL_CLONING, "Hard ident limit exceeded: %s@%s (group: %s): %d connected, %d max.", username, IPtostr(*ipaddress), tg->name->content, identcount + usercountadjustment, tg->maxperident);
         snprintf(message, messagelen, "Too many connections from your username (%s@%s) - see https://www.quakenet.org/help/trusts/connection-limit for details.", username, IPtostr(*ipaddress));
         return POLICY_FAILURE_IDENTCOUNT;
       }
@@ -173,6 +299,17 @@ static int checkconnection(const char *username, struct irc_in_addr *ipaddress,
   return POLICY_SUCCESS;
 }
 
+static int trustflush(trustsocket *sock) {
+  int size = sock->outsize;
+
+  sock->outsize = 0;
+
+  if(size && write(sock->fd, sock->outbuf, size) != size)
+    return 0;
+  return 1;
+}
+
+/* Replies are queued and go out in one write per socket read, see handletrustclient */
 static int trustdowrite(trustsocket *sock, char *format, ...) {
   char buf[1024];
   va_list va;
@@ -187,8 +324,11 @@ static int trustdowrite(trustsocket *sock, char *format, ...) {
 
   buf[r] = '\n';
 
-  if(write(sock->fd, buf, r + 1) != r + 1)
+  if(sock->outsize + r + 1 > TRUSTOUTBUFSIZE && !trustflush(sock))
     return 0;
+
+  memcpy(sock->outbuf + sock->outsize, buf, r + 1);
+  sock->outsize += r + 1;
   return 1;
 }
 
@@ -197,13 +337,16 @@ static int policycheck_auth(trustsocket *sock, const char *sequence_id, const ch
   int verdict, unthrottle;
   struct irc_in_addr ipaddress;
   unsigned char bits;
+  uint64_t start;
 
   if(!ipmask_parse(host, &ipaddress, &bits)) {
     sock->accepted++;
     return trustdowrite(sock, "PASS %s", sequence_id);
   }
 
-  verdict = checkconnection(username, &ipaddress, HOOK_TRUSTS_NEWNICK, 1, message, sizeof(message), &unthrottle);
+  start = metricclock();
+  verdict = checkconnection(username, &ipaddress, HOOK_TRUSTS_NEWNICK, 1, message, sizeof(message), &unthrottle, 1);
+  metricobserve(checkmetric, metricclock() - start);
 
   if(!enforcepolicy_auth)
     verdict = POLICY_SUCCESS;
@@ -230,6 +373,7 @@ static int policycheck_auth(trustsocket *sock, const char *sequence_id, const ch
 
 static int trustkillconnection(trustsocket *sock, char *reason) {
   trustdowrite(sock, "QUIT %s", reason);
+  trustflush(sock);
   return 0;
 }
 
@@ -374,15 +518,17 @@ static int handletrustclient(trustsocket *sock) {
     if(*c != '\n')
       continue;
     *c = '\0';
-    if(!handletrustline(sock, lastpos))
+    if(!handletrustline(sock, lastpos)) {
+      trustflush(sock);
       return 0;
+    }
 
     lastpos = c + 1; /* is this ok? */
   }
   sock->size-=lastpos - sock->buf;
   memmove(sock->buf, lastpos, sock->size);
   
-  return 1;
+  return trustflush(sock);
 }
 
 static void processtrustclient(int fd, short events) {
@@ -467,12 +613,13 @@ static void processtrustlistener(int fd, short events) {
     } else {
       sock->authed = 0;
       sock->size = 0;
+      sock->outsize = 0;
       sock->connected = time(NULL);
       sock->timeout = time(NULL) + 30;
       sock->accepted = 0;
       sock->rejected = 0;
       sock->unthrottled = 0;
-      if(!trustdowrite(sock, "AUTH %s", hmac_printhex(sock->nonce, buf, NONCELEN))) {
+      if(!trustdowrite(sock, "AUTH %s", hmac_printhex(sock->nonce, buf, NONCELEN)) || !trustflush(sock)) {
         Error("trusts_policy", ERR_WARNING, "Error writing auth to fd %d.", newfd);
         deregisterhandler(newfd, 1);
         tslist = sock->next;
@@ -529,7 +676,7 @@ static void policycheck_irc(int hooknum, void *arg) {
   if(moving)
     return;
 
-  verdict = checkconnection(np->ident, &np->ipaddress, hooknum, 0, message, sizeof(message), &unthrottle);
+  verdict = checkconnection(np->ident, &np->ipaddress, hooknum, 0, message, sizeof(message), &unthrottle, 1);
     
   if(!enforcepolicy_irc)
     verdict = POLICY_SUCCESS;
@@ -592,6 +739,167 @@ static int trusts_cmdtrustsockets(void *source, int cargc, char **cargv) {
     controlreply(sender, "%-35s %-20s %-15d %-15d %-15d", sock->authed?sock->authuser:"<unauthenticated connection>", longtoduration(now - sock->connected, 0), sock->accepted, sock->rejected, sock->unthrottled);
 
   controlreply(sender, "-- End of list.");
+
+  if(hitsmetric && missesmetric)
+    controlreply(sender, "Decision cache: %llu hits, %llu misses.", (unsigned long long)hitsmetric->value, (unsigned long long)missesmetric->value);
+
+  return CMD_OK;
+}
+
+#define BENCHMAXGROUPS 32768 /* /30s in 198.18.0.0/15 */
+#define BENCHMAXCHECKS 1000000
+
+/*
+ * One reconnect storm: clients pick a random benchmark trust, an address
+ * in it and one of a handful of usernames.  Accepted clients are counted
+ * against their group the way the trusts module would count them.
+ */
+static uint64_t benchstorm(trusthost **hosts, int groups, int checks) {
+  char message[512], username[USERLEN+1];
+  struct irc_in_addr ip;
+  uint64_t state = 1, start;
+  trusthost *th;
+  int i;
+
+  start = metricclock();
+
+  for(i=0;i<checks;i++) {
+    uint64_t r = splitmix64(&state);
+
+    th = hosts[r % groups];
+    memcpy(&ip, &th->ip, sizeof(ip));
+    ip.in6_16[7] = htons(ntohs(ip.in6_16[7]) + ((r >> 16) & 3));
+    snprintf(username, sizeof(username), "%sbench%u", (r & 0x100) ? "~" : "", (unsigned int)(r >> 20) & 7);
+
+    if(checkconnection(username, &ip, HOOK_TRUSTS_NEWNICK, 1, message, sizeof(message), NULL, 0) != POLICY_SUCCESS)
+      continue;
+
+    th->count++;
+    th->generation++;
+    th->group->count++;
+    th->group->generation++;
+  }
+
+  return metricclock() - start;
+}
+
+static int trusts_cmdtrustpolicybench(void *source, int cargc, char **cargv) {
+  nick *sender = source;
+  trustgroup *savedlist = tglist, *tg, *ntg;
+  trusthost **hosts;
+  int groups = 20000, checks = 20000, savedcache = policycache, i;
+  uint64_t hits = 0, misses = 0, uncached = 0, cached = 0;
+  benchresults results;
+  char extra[64];
+
+  if(cargc > 0)
+    groups = atoi(cargv[0]);
+  if(cargc > 1)
+    checks = atoi(cargv[1]);
+
+  if(groups < 1 || groups > BENCHMAXGROUPS || checks < 1 || checks > BENCHMAXCHECKS) {
+    controlreply(sender, "Groups must be between 1 and %d, checks between 1 and %d.", BENCHMAXGROUPS, BENCHMAXCHECKS);
+    return CMD_ERROR;
+  }
+
+  if(!trustsdbloaded) {
+    controlreply(sender, "Trusts database isn't loaded.");
+    return CMD_ERROR;
+  }
+
+  hosts = nsmalloc(POOL_TRUSTS, sizeof(trusthost *) * groups);
+  if(!hosts) {
+    controlreply(sender, "Out of memory.");
+    return CMD_ERROR;
+  }
+
+  /* Swap in a synthetic trust list, nothing else runs until we put it back */
+  tglist = NULL;
+
+  for(i=0;i<groups;i++) {
+    trusthost *th;
+
+    tg = nsmalloc(POOL_TRUSTS, sizeof(trustgroup));
+    th = nsmalloc(POOL_TRUSTS, sizeof(trusthost));
+    if(!tg || !th) {
+      nsfree(POOL_TRUSTS, tg);
+      nsfree(POOL_TRUSTS, th);
+      groups = i;
+      break;
+    }
+
+    memset(tg, 0, sizeof(trustgroup));
+    memset(th, 0, sizeof(trusthost));
+
+    tg->name = getsstring("policybench", TRUSTNAMELEN);
+    tg->trustedfor = MAXTRUSTEDFOR;
+    tg->maxperident = MAXPERIDENT;
+    tg->hosts = th;
+    tg->next = tglist;
+    tglist = tg;
+
+    th->ip.in6_16[5] = htons(65535);
+    th->ip.in6_16[6] = htons(0xc612 + (i >> 14));
+    th->ip.in6_16[7] = htons((i << 2) & 0xffff);
+    th->bits = 96 + 30;
+    th->nodebits = 128;
+    th->maxpernode = MAXPERNODE;
+    th->group = tg;
+    hosts[i] = th;
+  }
+
+  trusts_generation++;
+
+  if(groups) {
+    policycache = 0;
+    uncached = benchstorm(hosts, groups, checks);
+
+    for(tg=tglist;tg;tg=tg->next)
+      tg->count = tg->hosts->count = 0;
+
+    hits = hitsmetric ? hitsmetric->value : 0;
+    misses = missesmetric ? missesmetric->value : 0;
+
+    policycache = 1;
+    trusts_generation++;
+    cached = benchstorm(hosts, groups, checks);
+
+    if(hitsmetric && missesmetric) {
+      hits = hitsmetric->value - hits;
+      misses = missesmetric->value - misses;
+    }
+  }
+
+  for(tg=tglist;tg;tg=ntg) {
+    ntg = tg->next;
+    freesstring(tg->name);
+    nsfree(POOL_TRUSTS, tg->hosts);
+    nsfree(POOL_TRUSTS, tg);
+  }
+
+  nsfree(POOL_TRUSTS, hosts);
+  tglist = savedlist;
+  policycache = savedcache;
+  trusts_generation++;
+
+  if(!groups) {
+    controlreply(sender, "Out of memory.");
+    return CMD_ERROR;
+  }
+
+  benchopen(&results, "trustpolicybench");
+  snprintf(extra, sizeof(extra), "trusts=%d", groups);
+  benchresult(&results, "uncached", checks, uncached, extra);
+  snprintf(extra, sizeof(extra), "trusts=%d hits=%llu misses=%llu", groups, (unsigned long long)hits, (unsigned long long)misses);
+  benchresult(&results, "cached", checks, cached, extra);
+  benchclose(&results);
+
+  controlreply(sender, "%d checks against %d trusts:", checks, groups);
+  controlreply(sender, "Uncached: %.3fs (%.0f checks/s)", uncached / 1000000.0, uncached ? checks * 1000000.0 / uncached : 0.0);
+  controlreply(sender, "Cached:   %.3fs (%.0f checks/s)", cached / 1000000.0, cached ? checks * 1000000.0 / cached : 0.0);
+  if(hitsmetric && missesmetric)
+    controlreply(sender, "Cache lookups: %llu hits, %llu misses.", (unsigned long long)hits, (unsigned long long)misses);
+
   return CMD_OK;
 }
 
@@ -671,6 +979,11 @@ void _init(void) {
   registercontrolhelpcmd("trustpolicyirc", NO_DEVELOPER, 1, trusts_cmdtrustpolicyirc, "Usage: trustpolicyirc ?1|0?\nEnables or disables policy enforcement (IRC). Shows current status when no parameter is specified.");
   registercontrolhelpcmd("trustpolicyauth", NO_DEVELOPER, 1, trusts_cmdtrustpolicyauth, "Usage: trustpolicyauth ?1|0?\nEnables or disables policy enforcement (IAuth). Shows current status when no parameter is specified.");
   registercontrolhelpcmd("trustsockets", NO_DEVELOPER, 0, trusts_cmdtrustsockets, "Usage: trustsockets\nLists all currently active TRUST sockets.");
+  registercontrolhelpcmd("trustpolicybench", NO_DEVELOPER, 2, trusts_cmdtrustpolicybench, "Usage: trustpolicybench ?groups? ?checks?\nRuns a simulated reconnect storm against synthetic trusts with and without the decision cache.");
+
+  checkmetric = registermetric("trusts_policy_check_us", METRIC_HISTOGRAM);
+  hitsmetric = registermetric("trusts_policy_cache_hits", METRIC_COUNTER);
+  missesmetric = registermetric("trusts_policy_cache_misses", METRIC_COUNTER);
 
   schedulerecurring(time(NULL)+1, 0, 5, trustdotimeout, NULL);
   
@@ -694,6 +1007,11 @@ void _fini(void) {
   deregistercontrolcmd("trustpolicyirc", trusts_cmdtrustpolicyirc);
   deregistercontrolcmd("trustpolicyauth", trusts_cmdtrustpolicyauth);
   deregistercontrolcmd("trustsockets", trusts_cmdtrustsockets);
+  deregistercontrolcmd("trustpolicybench", trusts_cmdtrustpolicybench);
+
+  deregistermetric(checkmetric);
+  deregistermetric(hitsmetric);
+  deregistermetric(missesmetric);
   
   deleteallschedules(trustdotimeout); 
  
@@ -6,11 +6,14 @@
 #include "../core/hooks.h"
 #include "../core/config.h"
 #include "../core/error.h"
+#include "../core/nsmalloc.h"
+#include "../core/metrics.h"
 #include "../control/control.h"
 #include "../lib/version.h"
 #include "../lib/sha1.h"
 #include "../lib/hmac.h"
 #include "../lib/irc_string.h"
+#include "../lib/strlfunc.h"
 #include "../core/schedule.h"
 #include "../server/server.h"
 #include "../xsb/xsb.h"
@@ -24,6 +27,33 @@ static sstring *smasterserver;
 static unsigned int curlineno, totallines;
 static SHA1_CTX s;
 
+/*
+ * Position in the master's change log.  Changes are queued as they arrive
+ * and applied together at the end of the tick, so a burst of host changes
+ * costs one th_linktree().  A gap in the sequence makes us ask the master
+ * for everything we missed (catching up), if it doesn't have that any more
+ * it sends a snapshot instead.
+ */
+typedef struct trustchange {
+  struct trustchange *next;
+  time_t ts;
+  char op[16];
+  char data[];
+} trustchange;
+
+static unsigned int logepoch, logseq, snapepoch, snapseq;
+static int catchingup, reportcatchup;
+static unsigned int catchupfrom;
+static uint64_t catchupstart, lastcatchup;
+static unsigned int lastcatchupchanges;
+static time_t catchuprequested;
+static trustchange *changehead, *changetail;
+static void *applysched;
+static metric *lagmetric, *seqmetric, *appliedmetric, *batchmetric, *catchupmetric;
+
+static void clearchanges(void);
+static void requestlog(void);
+
 void trusts_replication_createtables(void);
 void trusts_replication_swap(void);
 void trusts_replication_complete(int);
@@ -42,7 +72,8 @@ static void __abandonreplication(const char *fn, int line, char *error, ...) {
 
   Error("trusts_slave", ERR_ERROR, "%s", buf2);
 
-  syncing = synced = 0;
+  syncing = synced = catchingup = 0;
+  clearchanges();
 
   controlwall(NO_DEVELOPER, NL_TRUSTS, "Warning: %s", buf2);
 }
@@ -62,6 +93,9 @@ void trusts_replication_complete(int error) {
   }
 
   synced = 1;
+
+  /* pick up whatever changed while the snapshot was being copied */
+  requestlog();
 }
 
 static char *extractline(char *buf, int reset, int update, int final) {
@@ -134,7 +168,7 @@ static int xsb_trinit(void *source, int argc, char **argv) {
   if(!buf)
     return CMD_ERROR;
 
-  if((sscanf(buf, "%u %u", &forced, &totallines) != 2)) {
+  if((sscanf(buf, "%u %u %u %u", &forced, &totallines, &snapepoch, &snapseq) != 4)) {
     abandonreplication("bad number for sscanf result");
     return CMD_ERROR;
   }
@@ -150,6 +184,9 @@ static int xsb_trinit(void *source, int argc, char **argv) {
   if(!extractline(argv[0], 1, 1, 0))
     return CMD_ERROR;
 
+  catchingup = 0;
+  clearchanges();
+
   trusts_replication_createtables();
 
   syncing = 1;
@@ -158,31 +195,13 @@ static int xsb_trinit(void *source, int argc, char **argv) {
   return CMD_OK;
 }
 
-/* trdata id lines type data */
-static int xsb_trdata(void *source, int argc, char **argv) {
-  char *buf;
-
-  if(!syncing)
-    return CMD_OK;
-
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of args");
-    return CMD_ERROR;
-  }
-
-  buf = extractline(argv[0], 0, 1, 0);
-  if(!buf)
-    return CMD_ERROR;
-
+static int applysnapshotline(char *buf) {
   if(buf[0] && (buf[1] == ' ')) {
     if(buf[0] == 'G') {
       trustgroup tg;
       if(!parsetg(&buf[2], &tg, 0)) {
         abandonreplication("bad trustgroup line: %s", buf);
-        return CMD_ERROR;
+        return 0;
       }
       trustsdb_inserttg("replication_groups", &tg);
 
@@ -197,21 +216,58 @@ static int xsb_trdata(void *source, int argc, char **argv) {
 
       if(!parseth(&buf[2], &th, &tgid, 0)) {
         abandonreplication("bad trusthost line: %s", buf);
-        return CMD_ERROR;
+        return 0;
       }
       trustsdb_insertth("replication_hosts", &th, tgid);
     } else {
       abandonreplication("bad trust type: %c", buf[0]);
 
-      return CMD_ERROR;
+      return 0;
     }
   } else {
     abandonreplication("malformed line: %s", buf);
+    return 0;
   }
 
+  return 1;
+}
+
+/* trdata id lines type data */
+static int xsb_trdata(void *source, int argc, char **argv) {
+  char *buf;
+
+  if(!syncing)
+    return CMD_OK;
+
+  if(!masterserver(source))
+    return CMD_ERROR;
+
+  if(argc < 1) {
+    abandonreplication("bad number of args");
+    return CMD_ERROR;
+  }
+
+  buf = extractline(argv[0], 0, 1, 0);
+  if(!buf)
+    return CMD_ERROR;
+
+  if(!applysnapshotline(buf))
+    return CMD_ERROR;
+
   return CMD_OK;
 }
 
+static void snapshotcomplete(void) {
+  logepoch = snapepoch;
+  logseq = snapseq;
+  metricset(seqmetric, logseq);
+
+  trusts_replication_swap();
+
+  synced = 1;
+  syncing = 0;
+}
+
 /* trfini id lines sha */
 static int xsb_trfini(void *source, int argc, char **argv) {
   char *buf, digestbuf[SHA1_DIGESTSIZE * 2 + 1];
@@ -245,31 +301,71 @@ static int xsb_trfini(void *source, int argc, char **argv) {
 
   Error("trusts_slave", ERR_INFO, "Data verification successful.");
 
-  trusts_replication_swap();
-
-  synced = 1;
-  syncing = 0;
+  snapshotcomplete();
 
   return CMD_OK;
 }
 
-static int xsb_traddgroup(void *source, int argc, char **argv) {
-  trustgroup tg, *otg;
-
-  if(!synced)
-    return CMD_OK;
+/*
+ * trsnap is the whole snapshot in one xsb bulk transfer, which has already
+ * checked its digest: "force totallines epoch seq" then a G or H per line.
+ */
+static void xsb_trsnap(nick *source, char *data, size_t len) {
+  char *line, *next;
+  unsigned int forced, lines;
 
   if(!masterserver(source))
-    return CMD_ERROR;
+    return;
 
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
+  next = strchr(data, '\n');
+  if(!next || (sscanf(data, "%u %u %u %u", &forced, &totallines, &snapepoch, &snapseq) != 4)) {
+    abandonreplication("bad snapshot header");
+    return;
   }
 
-  if(!parsetg(argv[0], &tg, 0)) {
-    abandonreplication("bad trustgroup line: %s", argv[0]);
-    return CMD_ERROR;
+  if(totallines < 2) {
+    abandonreplication("bad number of lines");
+    return;
+  }
+
+  if(!forced && synced)
+    return;
+
+  catchingup = 0;
+  clearchanges();
+
+  trusts_replication_createtables();
+
+  syncing = 1;
+
+  for(lines=2,line=next+1;*line;line=next+1,lines++) {
+    next = strchr(line, '\n');
+    if(!next) {
+      abandonreplication("truncated snapshot");
+      return;
+    }
+    *next = '\0';
+
+    if(!applysnapshotline(line))
+      return;
+  }
+
+  if(lines != totallines) {
+    abandonreplication("wrong number of lines received: %u vs. %u", totallines, lines);
+    return;
+  }
+
+  Error("trusts_slave", ERR_INFO, "Received snapshot of %u lines (%lu bytes).", lines, (unsigned long)len);
+
+  snapshotcomplete();
+}
+
+static int applyaddgroup(char *data) {
+  trustgroup tg, *otg;
+
+  if(!parsetg(data, &tg, 0)) {
+    abandonreplication("bad trustgroup line: %s", data);
+    return 0;
   }
 
   otg = tg_copy(&tg);
@@ -281,134 +377,90 @@ static int xsb_traddgroup(void *source, int argc, char **argv) {
 
   if(!otg) {
     abandonreplication("unable to add trustgroup");
-    return CMD_ERROR;
+    return 0;
   }
 
-  return CMD_OK;
+  return 1;
 }
 
-static int xsb_traddhost(void *source, int argc, char **argv) {
+static trusthost *applyaddhost(char *data) {
   unsigned int tgid;
-  trusthost th;
-
-  if(!synced)
-    return CMD_OK;
-
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
+  trusthost th, *nth;
 
-  if(!parseth(argv[0], &th, &tgid, 0)) {
-    abandonreplication("bad trusthost line: %s", argv[0]);
-    return CMD_ERROR;
+  if(!parseth(data, &th, &tgid, 0)) {
+    abandonreplication("bad trusthost line: %s", data);
+    return NULL;
   }
 
   th.group = tg_getbyid(tgid);
   if(!th.group) {
     abandonreplication("unable to lookup trustgroup");
-    return CMD_ERROR;
+    return NULL;
   }
 
-  if(!th_copy(&th)) {
+  /* users are moved in once the whole batch is in, see applychanges */
+  nth = th_insert(&th);
+  if(!nth) {
     abandonreplication("unable to add trusthost");
-    return CMD_ERROR;
+    return NULL;
   }
 
-  return CMD_OK;
+  return nth;
 }
 
-static int xsb_trdelhost(void *source, int argc, char **argv) {
+static trusthost *applydelhost(char *data) {
   unsigned int id;
   trusthost *th;
 
-  if(!synced)
-    return CMD_OK;
-
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
-
-  id = strtoul(argv[0], NULL, 10);
+  id = strtoul(data, NULL, 10);
   if(!id) {
     abandonreplication("unable to convert id to integer");
-    return CMD_ERROR;
+    return NULL;
   }
 
   th = th_getbyid(id);
   if(!th) {
     abandonreplication("unable to lookup id");
-    return CMD_ERROR;
+    return NULL;
   }
 
-  th_delete(th);
-
-  return CMD_OK;
+  return th;
 }
 
-static int xsb_trdelgroup(void *source, int argc, char **argv) {
+static int applydelgroup(char *data) {
   unsigned int id;
   trustgroup *tg;
 
-  if(!synced)
-    return CMD_OK;
-
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
-
-  id = strtoul(argv[0], NULL, 10);
+  id = strtoul(data, NULL, 10);
   if(!id) {
     abandonreplication("unable to convert id to integer");
-    return CMD_ERROR;
+    return 0;
   }
 
   tg = tg_getbyid(id);
   if(!tg) {
     abandonreplication("unable to lookup id");
-    return CMD_ERROR;
+    return 0;
   }
 
   tg_delete(tg);
 
-  return CMD_OK;
+  return 1;
 }
 
-static int xsb_trmodifygroup(void *source, int argc, char **argv) {
+static int applymodifygroup(char *data) {
   trustgroup tg, *otg;
 
-  if(!synced)
-    return CMD_OK;
-
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
-
-  if(!parsetg(argv[0], &tg, 0)) {
-    abandonreplication("bad trustgroup line: %s", argv[0]);
-    return CMD_ERROR;
+  if(!parsetg(data, &tg, 0)) {
+    abandonreplication("bad trustgroup line: %s", data);
+    return 0;
   }
 
   otg = tg_getbyid(tg.id);
 
   if(otg && !tg_modify(otg, &tg)) {
     abandonreplication("unable to modify database");
-    return CMD_ERROR;
+    return 0;
   }
 
   freesstring(tg.name);
@@ -418,20 +470,212 @@ static int xsb_trmodifygroup(void *source, int argc, char **argv) {
 
   if(!otg) {
     abandonreplication("unable to lookup id");
-    return CMD_ERROR;
+    return 0;
   }
 
   tg_update(otg);
 
-  return CMD_OK;
+  return 1;
 }
 
-static int xsb_trmodifyhost(void *source, int argc, char **argv) {
+static int applymodifyhost(char *data) {
   trustgroup *tg;
-  trusthost th, *oth;
+  trusthost th, *oth = NULL;
   unsigned int groupid;
 
-  if(!synced)
+  if(!parseth(data, &th, &groupid, 0)) {
+    abandonreplication("bad trusthost line: %s", data);
+    return 0;
+  }
+
+  tg = tg_getbyid(groupid);
+
+  if(tg) {
+    for(oth=tg->hosts;oth;oth=oth->next) {
+      if(ipmask_check(&oth->ip, &th.ip, th.bits) && th.bits == oth->bits)
+        break;
+    }
+  }
+
+  if(oth && !th_modify(oth, &th)) {
+    abandonreplication("unable to modify database");
+    return 0;
+  }
+
+  if(!oth) {
+    abandonreplication("unable to lookup host");
+    return 0;
+  }
+
+  th_update(oth);
+
+  return 1;
+}
+
+static void clearchanges(void) {
+  trustchange *tc, *ntc;
+
+  for(tc=changehead;tc;tc=ntc) {
+    ntc = tc->next;
+    nsfree(POOL_TRUSTS, tc);
+  }
+
+  changehead = changetail = NULL;
+}
+
+static void catchupcomplete(void) {
+  lastcatchup = metricclock() - catchupstart;
+  lastcatchupchanges = logseq - catchupfrom;
+  reportcatchup = 0;
+
+  metricobserve(catchupmetric, lastcatchup);
+
+  if(lastcatchupchanges)
+    Error("trusts_slave", ERR_INFO, "Caught up with %u trust changes in %.3fs.", lastcatchupchanges, lastcatchup / 1000000.0);
+}
+
+static void applychanges(void *arg) {
+  trustchange *tc;
+  trusthost **added = NULL, *th;
+  int addedcount = 0, addedsize = 0, relink = 0, i, ok = 1;
+  time_t newest = 0;
+  uint64_t start;
+
+  applysched = NULL;
+
+  /* still loading the snapshot we were sent */
+  if(!trustsdbloaded) {
+    applysched = scheduleoneshot(time(NULL) + 1, applychanges, NULL);
+    return;
+  }
+
+  start = metricclock();
+
+  for(tc=changehead;tc;tc=tc->next)
+    if(!strcmp(tc->op, "addhost"))
+      addedsize++;
+
+  if(addedsize) {
+    added = nsmalloc(POOL_TRUSTS, sizeof(trusthost *) * addedsize);
+    if(!added) {
+      abandonreplication("unable to allocate host batch");
+      return;
+    }
+  }
+
+  while(ok && (tc=changehead)) {
+    changehead = tc->next;
+    if(!changehead)
+      changetail = NULL;
+
+    newest = tc->ts;
+
+    if(!strcmp(tc->op, "addgroup")) {
+      ok = applyaddgroup(tc->data);
+    } else if(!strcmp(tc->op, "delgroup")) {
+      ok = applydelgroup(tc->data);
+    } else if(!strcmp(tc->op, "addhost")) {
+      th = applyaddhost(tc->data);
+      if(th)
+        added[addedcount++] = th;
+      ok = th != NULL;
+    } else if(!strcmp(tc->op, "delhost")) {
+      th = applydelhost(tc->data);
+      if(th) {
+        for(i=0;i<addedcount;i++) {
+          if(added[i] == th) {
+            added[i] = added[--addedcount];
+            break;
+          }
+        }
+
+        th_unlink(th);
+        relink = 1;
+      }
+      ok = th != NULL;
+    } else if(!strcmp(tc->op, "modifygroup")) {
+      ok = applymodifygroup(tc->data);
+    } else if(!strcmp(tc->op, "modifyhost")) {
+      ok = applymodifyhost(tc->data);
+    } else {
+      abandonreplication("bad change type: %s", tc->op);
+      ok = 0;
+    }
+
+    nsfree(POOL_TRUSTS, tc);
+    if(ok)
+      metricinc(appliedmetric);
+  }
+
+  if(addedcount || relink) {
+    th_linktree();
+    th_adjustbatch(added, addedcount);
+  }
+
+  nsfree(POOL_TRUSTS, added);
+
+  metricobserve(batchmetric, metricclock() - start);
+  if(newest)
+    metricset(lagmetric, time(NULL) > newest ? time(NULL) - newest : 0);
+
+  if(reportcatchup && !catchingup)
+    catchupcomplete();
+}
+
+static void queuechange(time_t ts, const char *op, const char *data) {
+  trustchange *tc = nsmalloc(POOL_TRUSTS, sizeof(trustchange) + strlen(data) + 1);
+
+  if(!tc) {
+    abandonreplication("unable to queue change");
+    return;
+  }
+
+  tc->next = NULL;
+  tc->ts = ts;
+  strlcpy(tc->op, op, sizeof(tc->op));
+  strcpy(tc->data, data);
+
+  if(changetail) {
+    changetail->next = tc;
+  } else {
+    changehead = tc;
+  }
+  changetail = tc;
+
+  if(!applysched)
+    applysched = scheduleoneshot(time(NULL), applychanges, NULL);
+}
+
+static void requestsnapshot(void) {
+  syncing = synced = catchingup = 0;
+  clearchanges();
+
+  xsb_broadcast("trrequeststart", NULL, "%s", "");
+}
+
+/* live changes are ignored until the master has replayed what we missed */
+static void requestlog(void) {
+  if(catchingup)
+    return;
+
+  catchingup = 1;
+  reportcatchup = 1;
+  synced = 0;
+  catchupfrom = logseq;
+  catchupstart = metricclock();
+  catchuprequested = time(NULL);
+
+  xsb_broadcast("trrequestlog", NULL, "%u %u", logepoch, logseq + 1);
+}
+
+/* trlog epoch seq ts op data */
+static int xsb_trlog(void *source, int argc, char **argv) {
+  unsigned int epoch, seq;
+  unsigned long ts;
+  char op[16];
+  int chars = 0;
+
+  if(!synced && !catchingup)
     return CMD_OK;
 
   if(!masterserver(source))
@@ -442,29 +686,81 @@ static int xsb_trmodifyhost(void *source, int argc, char **argv) {
     return CMD_ERROR;
   }
 
-  if(!parseth(argv[0], &th, &groupid, 0)) {
-    abandonreplication("bad trusthost line: %s", argv[0]);
+  if(sscanf(argv[0], "%u %u %lu %15s %n", &epoch, &seq, &ts, op, &chars) != 4 || chars <= 0) {
+    abandonreplication("bad log line: %s", argv[0]);
     return CMD_ERROR;
   }
 
-  tg = tg_getbyid(groupid);
+  if(epoch != logepoch) {
+    Error("trusts_slave", ERR_INFO, "Master started a new log, requesting snapshot.");
+    requestsnapshot();
+    return CMD_OK;
+  }
+
+  /* already have it, replayed for someone else */
+  if(seq <= logseq)
+    return CMD_OK;
 
-  for(oth=tg->hosts;oth;oth=oth->next) {
-    if(ipmask_check(&oth->ip, &th.ip, th.bits) && th.bits == oth->bits)
-      break;
+  if(seq != logseq + 1) {
+    if(!catchingup)
+      requestlog();
+    return CMD_OK;
   }
 
-  if(oth && !th_modify(oth, &th)) {
-    abandonreplication("unable to modify database");
+  logseq = seq;
+  metricset(seqmetric, logseq);
+
+  queuechange(ts, op, &argv[0][chars]);
+
+  return CMD_OK;
+}
+
+/* trloghead epoch seq, after a replay and every so often */
+static int xsb_trloghead(void *source, int argc, char **argv) {
+  unsigned int epoch, seq;
+
+  if(!synced && !catchingup)
+    return CMD_OK;
+
+  if(!masterserver(source))
     return CMD_ERROR;
-  }
 
-  if(!oth) {
-    abandonreplication("unable to lookup host");
+  if(argc < 2) {
+    abandonreplication("bad number of arguments");
     return CMD_ERROR;
   }
 
-  th_update(oth);
+  epoch = strtoul(argv[0], NULL, 10);
+  seq = strtoul(argv[1], NULL, 10);
+
+  if(epoch != logepoch) {
+    requestsnapshot();
+  } else if(seq > logseq) {
+    /* while catching up, a head sent before our request was seen */
+    if(!catchingup)
+      requestlog();
+  } else if(catchingup) {
+    catchingup = 0;
+    synced = 1;
+
+    if(!changehead && !applysched)
+      catchupcomplete();
+  }
+
+  return CMD_OK;
+}
+
+static int trusts_cmdtrustreplstatus(void *source, int argc, char **argv) {
+  nick *np = source;
+  unsigned int queued = 0;
+  trustchange *tc;
+
+  for(tc=changehead;tc;tc=tc->next)
+    queued++;
+
+  controlreply(np, "State         : %s", syncing ? "receiving snapshot" : catchingup ? "catching up" : synced ? "synced" : "not synced");
+  controlreply(np, "Log position  : %u:%u (%u queued)", logepoch, logseq, queued);
+  controlreply(np, "Last catch-up : %u changes in %.3fs", lastcatchupchanges, lastcatchup / 1000000.0);
 
   return CMD_OK;
 }
@@ -488,7 +784,11 @@ static int masterserver(void *source) {
 }
 
 static void checksynced(void *arg) {
-  if(!synced && !syncing)
+  /* master never answered, fall back to a snapshot */
+  if(catchingup && time(NULL) - catchuprequested > 60)
+    catchingup = 0;
+
+  if(!synced && !syncing && !catchingup)
     xsb_broadcast("trrequeststart", NULL, "%s", "");
 }
 
@@ -508,7 +808,14 @@ static void __serverlinked(int hooknum, void *arg) {
 
   if(!ircd_strcmp(serverlist[servernum].name->content, smasterserver->content)) {
     masternumeric = servernum;
-    syncing = synced = 0;
+
+    /* if we were in sync before the split only the difference is needed */
+    if(synced && logepoch) {
+      requestlog();
+      return;
+    }
+
+    syncing = synced = catchingup = 0;
     checksynced(NULL);
   }
 }
@@ -538,12 +845,17 @@ void _init(void) {
   xsb_addcommand("trinit", 1, xsb_trinit);
   xsb_addcommand("trdata", 1, xsb_trdata);
   xsb_addcommand("trfini", 1, xsb_trfini);
-  xsb_addcommand("traddhost", 1, xsb_traddhost);
-  xsb_addcommand("traddgroup", 1, xsb_traddgroup);
-  xsb_addcommand("trdelhost", 1, xsb_trdelhost);
-  xsb_addcommand("trdelgroup", 1, xsb_trdelgroup);
-  xsb_addcommand("trmodifygroup", 1, xsb_trmodifygroup);
-  xsb_addcommand("trmodifyhost", 1, xsb_trmodifyhost);
+  xsb_addbulk("trsnap", xsb_trsnap);
+  xsb_addcommand("trlog", 1, xsb_trlog);
+  xsb_addcommand("trloghead", 2, xsb_trloghead);
+
+  registercontrolhelpcmd("trustreplstatus", NO_DEVELOPER, 0, trusts_cmdtrustreplstatus, "Usage: trustreplstatus\nShows the position in the master's trust change log.");
+
+  lagmetric = registermetric("trusts_slave_lag_seconds", METRIC_GAUGE);
+  seqmetric = registermetric("trusts_slave_seq", METRIC_GAUGE);
+  appliedmetric = registermetric("trusts_slave_applied", METRIC_COUNTER);
+  batchmetric = registermetric("trusts_slave_batch_us", METRIC_HISTOGRAM);
+  catchupmetric = registermetric("trusts_slave_catchup_us", METRIC_HISTOGRAM);
 
   registerhook(HOOK_SERVER_LINKED, __serverlinked);
   syncsched = schedulerecurring(time(NULL)+5, 0, 60, checksynced, NULL);
@@ -563,12 +875,21 @@ void _fini(void) {
   xsb_delcommand("trinit", xsb_trinit);
   xsb_delcommand("trdata", xsb_trdata);
   xsb_delcommand("trfini", xsb_trfini);  
-  xsb_delcommand("traddhost", xsb_traddhost);
-  xsb_delcommand("traddgroup", xsb_traddgroup);
-  xsb_delcommand("trdelhost", xsb_trdelhost);
-  xsb_delcommand("trdelgroup", xsb_trdelgroup);
-  xsb_delcommand("trmodifygroup", xsb_trmodifygroup);
-  xsb_delcommand("trmodifyhost", xsb_trmodifyhost);
+  xsb_delbulk("trsnap", xsb_trsnap);
+  xsb_delcommand("trlog", xsb_trlog);
+  xsb_delcommand("trloghead", xsb_trloghead);
+
+  deregistercontrolcmd("trustreplstatus", trusts_cmdtrustreplstatus);
+
+  if(applysched)
+    deleteschedule(applysched, applychanges, NULL);
+  clearchanges();
+
+  deregistermetric(lagmetric);
+  deregistermetric(seqmetric);
+  deregistermetric(appliedmetric);
+  deregistermetric(batchmetric);
+  deregistermetric(catchupmetric);
 
   deregisterhook(HOOK_SERVER_LINKED, __serverlinked);
 
@@ -14,14 +14,12 @@ static void uc_newnick(int hook, void *arg);
 static void uc_lostnick(int hook, void *arg);
 
 void _init(void) {
-  nick *np;
-  int i;
+  unsigned int i;
 
   memset(servercount, 0, sizeof(servercount));
 
-  for(i=0;i<NICKHASHSIZE;i++)
-    for(np=nicktable[i];np;np=np->next)
-      servercount[homeserver(np->numeric)]++;
+  for(i=0;i<nickcolumns.count;i++)
+    servercount[homeserver(nickcolumns.numeric[i])]++;
 
   registerhook(HOOK_SERVER_NEWSERVER, uc_newserver);
   registerhook(HOOK_NICK_NEWNICK, uc_newnick);
@@ -45,6 +45,8 @@ void _init(void) {
   cmds = newcommandtree();
   if(!cmds)
     return;
+
+  xsb_bulkinit();
   
   registerhook(HOOK_NICK_MASKPRIVMSG, &handlemaskprivmsg);
   registerhook(HOOK_CONTROL_REGISTERED, &handlecontrolregistered);
@@ -70,6 +72,7 @@ void _fini(void) {
   if(!cmds)
     return;
 
+  xsb_bulkfini();
   destroycommandtree(cmds);
 
   deregisterhook(HOOK_NICK_MASKPRIVMSG, &handlemaskprivmsg);
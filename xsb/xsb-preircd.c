@@ -76,6 +76,8 @@ void _init(void) {
   if(!cmds)
     return;
 
+  xsb_bulkinit();
+
   xsbnicksched = scheduleoneshot(time(NULL)+1, setuplocaluser, NULL);
   
   registerhook(HOOK_NICK_MASKPRIVMSG, &handlemaskprivmsg);
@@ -107,6 +109,7 @@ void _fini(void) {
   if(!cmds)
     return;
 
+  xsb_bulkfini();
   destroycommandtree(cmds);
 
   deregisterhook(HOOK_NICK_MASKPRIVMSG, &handlemaskprivmsg);
@@ -0,0 +1,355 @@
+/*
+ * Bulk transfers on top of whichever engine we're built with.
+ *
+ *   xsbbulk <command> <id> 0 <fragments> <length> <sha1>
+ *   xsbbulk <command> <id> <n> <base64 of the deflated payload, part n>
+ *
+ * Fragments from one sender arrive in order, so anything out of sequence
+ * means we lost some and the transfer is dropped.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "../core/error.h"
+#include "../lib/sha1.h"
+#include "../lib/hmac.h"
+#include "xsb.h"
+
+#define XSB_BULKCHUNK    400                 /* base64 characters per line */
+#define XSB_BULKMAXLEN   (64 * 1024 * 1024)
+#define XSB_BULKTIMEOUT  300
+#define XSB_BULKCMDLEN   32
+
+struct bulkhandler {
+  struct bulkhandler *next;
+  XSBBulkHandler handler;
+  char name[XSB_BULKCMDLEN];
+};
+
+struct bulktransfer {
+  struct bulktransfer *next;
+  long numeric;
+  char command[XSB_BULKCMDLEN];
+  unsigned int id, fragments, nextfragment;
+  size_t length, b64len;
+  char digest[SHA1_DIGESTSIZE * 2 + 1];
+  char *b64;
+  time_t last;
+};
+
+static struct bulkhandler *bulkhandlers;
+static struct bulktransfer *transfers;
+
+static const char b64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int xsb_bulkfragment(void *source, int cargc, char **cargv);
+
+static size_t b64encode(const unsigned char *in, size_t len, char *out) {
+  char *p = out;
+  unsigned long v;
+  size_t i;
+
+  for(i=0;i+2<len;i+=3) {
+    v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+    *p++ = b64chars[(v >> 18) & 63];
+    *p++ = b64chars[(v >> 12) & 63];
+    *p++ = b64chars[(v >> 6) & 63];
+    *p++ = b64chars[v & 63];
+  }
+
+  if(i < len) {
+    v = in[i] << 16;
+    if(i + 1 < len)
+      v|=in[i + 1] << 8;
+
+    *p++ = b64chars[(v >> 18) & 63];
+    *p++ = b64chars[(v >> 12) & 63];
+    *p++ = (i + 1 < len) ? b64chars[(v >> 6) & 63] : '=';
+    *p++ = '=';
+  }
+
+  *p = '\0';
+  return p - out;
+}
+
+/* returns the decoded length, or -1 if it isn't base64 */
+static long b64decode(const char *in, size_t len, unsigned char *out) {
+  static signed char lookup[256];
+  static int lookupready;
+  unsigned char *p = out;
+  unsigned long v = 0;
+  int bits = 0, c;
+  size_t i;
+
+  if(!lookupready) {
+    memset(lookup, -1, sizeof(lookup));
+    for(i=0;i<64;i++)
+      lookup[(unsigned char)b64chars[i]] = i;
+    lookupready = 1;
+  }
+
+  for(i=0;i<len;i++) {
+    if(in[i] == '=')
+      break;
+
+    c = lookup[(unsigned char)in[i]];
+    if(c < 0)
+      return -1;
+
+    v = (v << 6) | c;
+    bits+=6;
+    if(bits >= 8) {
+      bits-=8;
+      *p++ = (v >> bits) & 0xff;
+    }
+  }
+
+  return p - out;
+}
+
+static void sha1hex(const char *data, size_t len, char *out) {
+  unsigned char digest[SHA1_DIGESTSIZE];
+  SHA1_CTX s;
+
+  SHA1Init(&s);
+  SHA1Update(&s, (unsigned char *)data, len);
+  SHA1Final(digest, &s);
+
+  hmac_printhex(digest, out, SHA1_DIGESTSIZE);
+}
+
+void xsb_bulkinit(void) {
+  xsb_addcommand("xsbbulk", 6, xsb_bulkfragment);
+}
+
+static void freetransfer(struct bulktransfer *t) {
+  free(t->b64);
+  free(t);
+}
+
+void xsb_bulkfini(void) {
+  struct bulkhandler *h, *nh;
+  struct bulktransfer *t, *nt;
+
+  xsb_delcommand("xsbbulk", xsb_bulkfragment);
+
+  for(t=transfers;t;t=nt) {
+    nt = t->next;
+    freetransfer(t);
+  }
+  transfers = NULL;
+
+  for(h=bulkhandlers;h;h=nh) {
+    nh = h->next;
+    free(h);
+  }
+  bulkhandlers = NULL;
+}
+
+void xsb_addbulk(const char *name, XSBBulkHandler handler) {
+  struct bulkhandler *h = malloc(sizeof(struct bulkhandler));
+  if(!h)
+    return;
+
+  strncpy(h->name, name, sizeof(h->name) - 1);
+  h->name[sizeof(h->name) - 1] = '\0';
+  h->handler = handler;
+  h->next = bulkhandlers;
+  bulkhandlers = h;
+}
+
+void xsb_delbulk(const char *name, XSBBulkHandler handler) {
+  struct bulkhandler **hp, *h;
+
+  for(hp=&bulkhandlers;*hp;hp=&(*hp)->next) {
+    h = *hp;
+    if((h->handler == handler) && !strcmp(h->name, name)) {
+      *hp = h->next;
+      free(h);
+      return;
+    }
+  }
+}
+
+int xsb_broadcastbulk(const char *command, server *service, const char *data, size_t len) {
+  static unsigned int lastid;
+  unsigned char *compressed;
+  uLongf clen;
+  char *b64, digest[SHA1_DIGESTSIZE * 2 + 1];
+  size_t b64len, pos;
+  unsigned int id, fragments, i;
+
+  if(len > XSB_BULKMAXLEN || strlen(command) >= XSB_BULKCMDLEN)
+    return 0;
+
+  clen = compressBound(len);
+  compressed = malloc(clen);
+  if(!compressed)
+    return 0;
+
+  if(compress2(compressed, &clen, (const Bytef *)data, len, Z_BEST_COMPRESSION) != Z_OK) {
+    free(compressed);
+    return 0;
+  }
+
+  b64 = malloc((clen + 2) / 3 * 4 + 1);
+  if(!b64) {
+    free(compressed);
+    return 0;
+  }
+
+  b64len = b64encode(compressed, clen, b64);
+  free(compressed);
+
+  sha1hex(data, len, digest);
+
+  id = lastid = (lastid % 65535) + 1;
+  fragments = (b64len + XSB_BULKCHUNK - 1) / XSB_BULKCHUNK;
+
+  xsb_broadcast("xsbbulk", service, "%s %u 0 %u %lu %s", command, id, fragments, (unsigned long)len, digest);
+  for(i=1,pos=0;i<=fragments;i++,pos+=XSB_BULKCHUNK)
+    xsb_broadcast("xsbbulk", service, "%s %u %u %.*s", command, id, i, XSB_BULKCHUNK, b64 + pos);
+
+  free(b64);
+
+  Error("xsb", ERR_DEBUG, "Sent %s: %lu bytes as %u lines (%lu deflated).", command, (unsigned long)len, fragments + 1, (unsigned long)clen);
+
+  return 1;
+}
+
+static void completetransfer(nick *source, struct bulktransfer *t) {
+  struct bulkhandler *h;
+  unsigned char *compressed;
+  char *data, digest[SHA1_DIGESTSIZE * 2 + 1];
+  uLongf dlen;
+  long clen;
+
+  compressed = malloc(t->b64len / 4 * 3 + 3);
+  data = malloc(t->length + 1);
+  if(!compressed || !data) {
+    Error("xsb", ERR_WARNING, "Unable to allocate memory for bulk %s.", t->command);
+    free(compressed);
+    free(data);
+    return;
+  }
+
+  clen = b64decode(t->b64, t->b64len, compressed);
+  dlen = t->length;
+  if((clen < 0) || (uncompress((Bytef *)data, &dlen, compressed, clen) != Z_OK) || (dlen != t->length)) {
+    Error("xsb", ERR_WARNING, "Bad bulk %s from %s: corrupt payload.", t->command, source->nick);
+    free(compressed);
+    free(data);
+    return;
+  }
+  free(compressed);
+
+  data[dlen] = '\0';
+
+  sha1hex(data, dlen, digest);
+  if(hmac_strcmp(digest, t->digest)) {
+    Error("xsb", ERR_WARNING, "Bad bulk %s from %s: digest mismatch.", t->command, source->nick);
+    free(data);
+    return;
+  }
+
+  for(h=bulkhandlers;h;h=h->next)
+    if(!strcmp(h->name, t->command))
+      h->handler(source, data, dlen);
+
+  free(data);
+}
+
+static int xsb_bulkfragment(void *source, int cargc, char **cargv) {
+  nick *np = source;
+  struct bulktransfer **tp, *t;
+  unsigned int id, seq, fragments;
+  unsigned long length;
+  time_t now = time(NULL);
+  size_t len;
+
+  if(cargc < 4)
+    return CMD_ERROR;
+
+  id = strtoul(cargv[1], NULL, 10);
+  seq = strtoul(cargv[2], NULL, 10);
+
+  /* also gets rid of anything abandoned half way */
+  for(tp=&transfers;*tp;) {
+    t = *tp;
+    if(((t->numeric == np->numeric) && !strcmp(t->command, cargv[0]) && ((t->id != id) || !seq)) || (t->last + XSB_BULKTIMEOUT < now)) {
+      if(t->last + XSB_BULKTIMEOUT >= now)
+        Error("xsb", ERR_WARNING, "Bulk %s from %s abandoned after %u/%u fragments.", t->command, np->nick, t->nextfragment - 1, t->fragments);
+      *tp = t->next;
+      freetransfer(t);
+    } else {
+      tp = &t->next;
+    }
+  }
+
+  if(!seq) {
+    if(cargc < 6)
+      return CMD_ERROR;
+
+    fragments = strtoul(cargv[3], NULL, 10);
+    length = strtoul(cargv[4], NULL, 10);
+    if(!fragments || (length > XSB_BULKMAXLEN) || (fragments > (XSB_BULKMAXLEN / XSB_BULKCHUNK) * 2) ||
+       (strlen(cargv[0]) >= XSB_BULKCMDLEN) || (strlen(cargv[5]) != SHA1_DIGESTSIZE * 2)) {
+      Error("xsb", ERR_WARNING, "Bad bulk header from %s: %s", np->nick, cargv[0]);
+      return CMD_ERROR;
+    }
+
+    t = malloc(sizeof(struct bulktransfer));
+    if(t)
+      t->b64 = malloc((size_t)fragments * XSB_BULKCHUNK + 1);
+    if(!t || !t->b64) {
+      free(t);
+      return CMD_ERROR;
+    }
+
+    t->numeric = np->numeric;
+    strcpy(t->command, cargv[0]);
+    strcpy(t->digest, cargv[5]);
+    t->id = id;
+    t->fragments = fragments;
+    t->nextfragment = 1;
+    t->length = length;
+    t->b64len = 0;
+    t->last = now;
+
+    t->next = transfers;
+    transfers = t;
+
+    return CMD_OK;
+  }
+
+  for(t=transfers;t;t=t->next)
+    if((t->numeric == np->numeric) && (t->id == id) && !strcmp(t->command, cargv[0]))
+      break;
+
+  if(!t) /* started before we were listening */
+    return CMD_OK;
+
+  len = strlen(cargv[3]);
+  if((seq != t->nextfragment) || (len > XSB_BULKCHUNK)) {
+    Error("xsb", ERR_WARNING, "Bulk %s from %s out of sequence (%u, expected %u), dropped.", t->command, np->nick, seq, t->nextfragment);
+    t->last = 0; /* swept next time round */
+    return CMD_ERROR;
+  }
+
+  memcpy(t->b64 + t->b64len, cargv[3], len);
+  t->b64len+=len;
+  t->last = now;
+
+  if(++t->nextfragment <= t->fragments)
+    return CMD_OK;
+
+  for(tp=&transfers;*tp!=t;tp=&(*tp)->next)
+    ;
+  *tp = t->next;
+
+  completetransfer(np, t);
+  freetransfer(t);
+
+  return CMD_OK;
+}
@@ -11,4 +11,20 @@ void xsb_broadcast(const char *command, server *service, const char *format, ...
 void xsb_unicast(const char *command, nick *np, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
 int xsb_isservice(server *service);
 
+/*
+ * Bulk transfers: the payload is deflated, base64'd and sent as numbered
+ * fragments with a SHA1 over the whole thing, and handed to the handler
+ * registered for that command once it's all arrived and checks out.
+ * data is NUL terminated for the handler's convenience.
+ */
+typedef void (*XSBBulkHandler)(nick *source, char *data, size_t len);
+
+void xsb_addbulk(const char *name, XSBBulkHandler handler);
+void xsb_delbulk(const char *name, XSBBulkHandler handler);
+int xsb_broadcastbulk(const char *command, server *service, const char *data, size_t len);
+
+/* engine glue, see xsb.c */
+void xsb_bulkinit(void);
+void xsb_bulkfini(void);
+
 #endif